@@ -0,0 +1,418 @@
+#include <coroutine>
+#include <exception>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "hmp221.hpp"
+#include "shmring.h"
+
+#ifndef HMP221_COCLIENT_HPP
+#define HMP221_COCLIENT_HPP
+
+// C++20 coroutine interface to an HMP221 server. A single Scheduler drives
+// every coroutine of the process from one epoll loop, so a simulation can keep
+// a very large number of devices in flight on one thread:
+//
+//     hmp221::co::Scheduler sched;
+//     hmp221::co::Client client(sched, "localhost", 8081);
+//     sched.spawn(device(client));   // device() co_awaits client.publish/next
+//     sched.run();
+
+namespace hmp221
+{
+    namespace co
+    {
+        class Scheduler;
+
+        namespace detail
+        {
+            // Coroutine frames are recycled through size-class free lists so
+            // that a request does not cost a trip to the general allocator.
+            void *allocateFrame(size_t size);
+            void releaseFrame(void *frame, size_t size);
+
+            struct PromiseBase
+            {
+                std::coroutine_handle<> continuation;
+                std::exception_ptr exception;
+
+                static void *operator new(size_t size) { return allocateFrame(size); }
+                static void operator delete(void *frame, size_t size) { releaseFrame(frame, size); }
+
+                // Tasks are lazy: nothing runs until the task is awaited or spawned
+                std::suspend_always initial_suspend() noexcept { return {}; }
+
+                struct FinalAwaiter
+                {
+                    bool await_ready() noexcept { return false; }
+                    template <typename Promise>
+                    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+                    {
+                        std::coroutine_handle<> next = handle.promise().continuation;
+                        return next ? next : std::noop_coroutine();
+                    }
+                    void await_resume() noexcept {}
+                };
+                FinalAwaiter final_suspend() noexcept { return {}; }
+
+                void unhandled_exception() { exception = std::current_exception(); }
+            };
+        }
+
+        // A lazily started coroutine producing a T. Awaiting a task starts it
+        // and resumes the awaiting coroutine once the task has finished.
+        template <typename T>
+        class Task
+        {
+        public:
+            struct promise_type : detail::PromiseBase
+            {
+                T value;
+                Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+                void return_value(T result) { value = std::move(result); }
+            };
+
+            Task(Task &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+            Task(const Task &) = delete;
+            ~Task()
+            {
+                if (handle)
+                {
+                    handle.destroy();
+                }
+            }
+
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume()
+            {
+                if (handle.promise().exception)
+                {
+                    std::rethrow_exception(handle.promise().exception);
+                }
+                return std::move(handle.promise().value);
+            }
+
+        private:
+            explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+            std::coroutine_handle<promise_type> handle;
+        };
+
+        template <>
+        class Task<void>
+        {
+        public:
+            struct promise_type : detail::PromiseBase
+            {
+                Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+                void return_void() {}
+            };
+
+            Task(Task &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+            Task(const Task &) = delete;
+            ~Task()
+            {
+                if (handle)
+                {
+                    handle.destroy();
+                }
+            }
+
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            void await_resume()
+            {
+                if (handle.promise().exception)
+                {
+                    std::rethrow_exception(handle.promise().exception);
+                }
+            }
+
+        private:
+            explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+            std::coroutine_handle<promise_type> handle;
+        };
+
+        // Readiness state of one file descriptor registered with the scheduler.
+        // It lives in the frame of the coroutine that owns the descriptor.
+        struct IoWaiter
+        {
+            std::coroutine_handle<> reader;
+            std::coroutine_handle<> writer;
+            bool canRead = false;
+            bool canWrite = false;
+        };
+
+        class Scheduler
+        {
+        public:
+            Scheduler();
+            ~Scheduler();
+
+            // Start a task in the background. run() returns once every spawned task has finished.
+            void spawn(Task<void> task);
+
+            // Resume coroutines as their descriptors and timers become ready
+            void run();
+
+            // Register a non-blocking descriptor. Closing the descriptor unregisters it.
+            void watch(int fd, IoWaiter *waiter);
+
+            struct IoAwaiter
+            {
+                IoWaiter *waiter;
+                bool forWrite;
+                bool await_ready() noexcept;
+                void await_suspend(std::coroutine_handle<> handle) noexcept;
+                void await_resume() noexcept {}
+            };
+            // Suspend until a watched descriptor can be read from / written to
+            IoAwaiter readable(IoWaiter *waiter) { return IoAwaiter{waiter, false}; }
+            IoAwaiter writable(IoWaiter *waiter) { return IoAwaiter{waiter, true}; }
+
+            struct SleepAwaiter
+            {
+                Scheduler *scheduler;
+                u64 deadline;
+                bool await_ready() noexcept { return deadline <= Scheduler::now(); }
+                void await_suspend(std::coroutine_handle<> handle);
+                void await_resume() noexcept {}
+            };
+            // Suspend for the given number of microseconds
+            SleepAwaiter sleep(u64 micros) { return SleepAwaiter{this, now() + micros}; }
+            // Suspend until the given point on the now() clock
+            SleepAwaiter sleepUntil(u64 deadline) { return SleepAwaiter{this, deadline}; }
+
+            struct YieldAwaiter
+            {
+                Scheduler *scheduler;
+                bool await_ready() noexcept { return false; }
+                void await_suspend(std::coroutine_handle<> handle) { scheduler->ready.push_back(handle); }
+                void await_resume() noexcept {}
+            };
+            // Let every other ready coroutine run before resuming
+            YieldAwaiter yield() { return YieldAwaiter{this}; }
+
+            // Monotonic clock in microseconds
+            static u64 now();
+
+        private:
+            struct Timer
+            {
+                u64 deadline;
+                u64 sequence;
+                std::coroutine_handle<> handle;
+                bool operator>(const Timer &other) const
+                {
+                    return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+                }
+            };
+
+            // Owner of a spawned task; its frame frees itself when the task is done
+            struct Detached
+            {
+                struct promise_type
+                {
+                    static void *operator new(size_t size) { return detail::allocateFrame(size); }
+                    static void operator delete(void *frame, size_t size) { detail::releaseFrame(frame, size); }
+                    Detached get_return_object() { return Detached{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+                    std::suspend_always initial_suspend() noexcept { return {}; }
+                    std::suspend_never final_suspend() noexcept { return {}; }
+                    void return_void() {}
+                    void unhandled_exception() { std::terminate(); }
+                };
+                std::coroutine_handle<promise_type> handle;
+            };
+            Detached runDetached(Task<void> task);
+
+            int epfd;
+            size_t live;
+            u64 timerSequence;
+            std::deque<std::coroutine_handle<>> ready;
+            std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+        };
+
+        // Awaitable publish/subscribe operations against one server, or against
+        // any node of a cluster: the client then follows the cluster's redirects
+        // to the node owning a channel.
+        class Client
+        {
+        public:
+            Client(Scheduler &scheduler, string hostName, int portNo);
+            // Connect through the Unix domain socket of a server on the same host, started with --unix
+            Client(Scheduler &scheduler, string unixPath);
+
+            // Store bytes as the latest message of a channel. Returns false if the server could not be reached.
+            // With ttlMillis, the server drops the message once it is that old.
+            Task<bool> publish(string channel, vec bytes, u32 ttlMillis = 0);
+
+            // Fetch the latest message of a channel. contentBytes is empty when nothing was published yet.
+            // The client remembers the last message seen on every channel and only asks the server
+            // for a newer version, so an unchanged channel costs a short NotModified reply.
+            // With waitMillis, the server holds the request until the channel moves past the
+            // remembered version or the time is up, so next() returns as soon as there is news.
+            Task<struct Message> next(string channel, u32 waitMillis = 0);
+
+            // Store many messages with a single frame. Returns false if the server could not be reached.
+            Task<bool> publishBatch(std::vector<struct Message> messages);
+
+            // Fetch the latest message of many channels with a single round trip, in the order asked.
+            Task<std::vector<struct Message>> nextBatch(std::vector<string> channels);
+
+            // Receive every message published on a channel from now on, until onMessage returns
+            // false or the connection ends. If the server holds a newer message than the one
+            // remembered for the channel, that message comes first. Returns false if the
+            // connection failed or was closed by the server.
+            // With conflate, a subscriber that falls behind skips to the latest message of the
+            // channel instead of receiving every one in between.
+            Task<bool> watch(string channel, std::function<bool(const struct Message &)> onMessage, bool conflate = false);
+
+            // Fetch the server's counters and latency percentiles. Empty if the server could not be reached.
+            Task<struct Stats> stats();
+
+            // Store size bytes of a file, read from its start, as the latest message of a channel. They
+            // go in Chunk frames, so the message may be larger than a frame and than memory, up to 4 GiB.
+            // Returns once the server has the whole message, false if it could not store it.
+            Task<bool> publishStream(string channel, int fd, u64 size);
+
+            // Write the latest message of a channel to a file as it arrives, however large. Returns the
+            // number of bytes written, 0 when nothing was published yet, -1 if the fetch failed.
+            Task<i64> fetchStream(string channel, int fd);
+
+        private:
+            friend class Publisher;
+            friend class LocalSession;
+
+            Task<int> connectToServer(IoWaiter *waiter, string channel = "");
+            Task<bool> writeAll(int fd, IoWaiter *waiter, vec bytes);
+            Task<bool> answerPing(int fd, IoWaiter *waiter, vec &pingBytes);
+            Task<vec> roundTrip(vec requestBytes, string channel = "", u64 capabilities = 0);
+            Task<vec> readFrame(int fd, IoWaiter *waiter, vec &buffered);
+            bool learnOwner(vec &redirectBytes);
+
+            Scheduler &scheduler;
+            struct sockaddr_in serverAddr;
+            // Empty unless the server is reached through its Unix domain socket
+            string unixPath;
+            // Cluster node owning a channel, learned from a Redirect. Requests for
+            // the channel go straight to it from then on instead of being
+            // forwarded by the node the client was given.
+            std::unordered_map<string, struct sockaddr_in> owners;
+            // Last message received on each channel, keyed by channel name
+            std::unordered_map<string, struct Message> lastSeen;
+        };
+
+        // At-least-once publishing over one long-lived connection. Every message
+        // carries a packet id and stays in flight until the server acknowledges
+        // it; up to window messages are outstanding at once, so the publisher
+        // does not wait a round trip per message. The server acknowledges
+        // cumulatively, one Ack for all the publishes of a read. When the
+        // connection fails, the publisher reconnects and sends every message in
+        // flight again, so a subscriber may see a message twice.
+        // One coroutine at a time may use a publisher.
+        class Publisher
+        {
+        public:
+            Publisher(Client &client, size_t window = 64);
+            ~Publisher();
+            Publisher(const Publisher &) = delete;
+            Publisher &operator=(const Publisher &) = delete;
+
+            // Send a message, compressed when it is long enough and the server takes compressed payloads.
+            // Suspends only while window messages are in flight. Returns false if the server could not be
+            // reached again.
+            Task<bool> publish(string channel, vec bytes);
+
+            // Wait until every message sent so far is acknowledged.
+            // Returns false if the server could not be reached again.
+            Task<bool> flush();
+
+            // Number of messages sent but not yet acknowledged
+            size_t inFlight() const { return this->unacked.size(); }
+
+            // Capabilities the server granted the current connection, 0 until its Welcome arrives
+            u64 capabilities() const { return this->granted; }
+
+        private:
+            Task<bool> receiveAcks();
+            Task<bool> reconnect();
+
+            Client &client;
+            size_t window;
+            int sockfd;
+            IoWaiter waiter;
+            u32 nextId;
+            u64 granted;
+            // Encrypted frames not acknowledged yet, in the order they were sent
+            std::deque<std::pair<u32, vec>> unacked;
+            // Decrypted bytes of a reply that has not fully arrived yet
+            vec inbound;
+        };
+
+        // Requests and replies through memory shared with a server on the same
+        // host. The session connects to the server's Unix domain socket and
+        // hands over a memory file holding two rings, one per direction, and
+        // an eventfd for each side. From then on a request is copied into one
+        // ring and its reply out of the other, and a side only makes a system
+        // call to wake the other when it is asleep. Requests are pipelined on
+        // the one connection; one coroutine at a time may use a session.
+        class LocalSession
+        {
+        public:
+            // capacity is the size of each ring, a power of two
+            LocalSession(Client &client, size_t capacity = 1 << 20);
+            ~LocalSession();
+            LocalSession(const LocalSession &) = delete;
+            LocalSession &operator=(const LocalSession &) = delete;
+
+            // Connect and attach the rings. Returns false if the server could not be reached or refused them.
+            Task<bool> open();
+
+            // Store bytes as the latest message of a channel, compressed when they are long enough and
+            // the server takes compressed payloads. Returns once the request is in the ring, false if the
+            // session is closed.
+            Task<bool> publish(string channel, vec bytes);
+
+            // Fetch the latest message of a channel. contentBytes is empty when nothing was published yet.
+            // A compressed message comes as it was stored; hmp221::decompress restores its payload.
+            Task<struct Message> next(string channel);
+
+            // Capabilities the server granted the session when it opened
+            u64 capabilities() const { return this->granted; }
+
+        private:
+            Task<bool> send(vec bytes);
+            Task<vec> receive();
+            Task<bool> wait();
+
+            Client &client;
+            size_t capacity;
+            int sockfd;
+            IoWaiter waiter;
+            void *memory;
+            ShmRing requests;
+            ShmRing replies;
+            // eventfd the server waits on, and the one this side waits on
+            int serverDoorbell;
+            int doorbell;
+            u64 granted;
+            // Decrypted bytes of replies that have not fully arrived yet
+            vec inbound;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include "hmp221.hpp"
+
+#ifndef HMP221_HDRHISTOGRAM_HPP
+#define HMP221_HDRHISTOGRAM_HPP
+
+// High dynamic range histogram with 3 significant decimal digits.
+// Values are kept in log-linear buckets: every power of two is split into
+// 1024 equal sub-buckets, so recording is a few shifts and one increment and
+// any recorded value is reported back within 0.1% of its true value.
+class HdrHistogram
+{
+private:
+    static const int SUB_BUCKET_HALF_MAGNITUDE = 10;
+    static const u64 SUB_BUCKET_COUNT = 1 << (SUB_BUCKET_HALF_MAGNITUDE + 1);
+    static const u64 SUB_BUCKET_HALF_COUNT = SUB_BUCKET_COUNT / 2;
+    static const u64 SUB_BUCKET_MASK = SUB_BUCKET_COUNT - 1;
+
+    std::vector<u64> counts;
+    u64 highestTrackable;
+    u64 total;
+    u64 minValue;
+    u64 maxValue;
+    double sum;
+
+    static int bucketIndex(u64 value)
+    {
+        return 64 - __builtin_clzl(value | SUB_BUCKET_MASK) - (SUB_BUCKET_HALF_MAGNITUDE + 1);
+    }
+
+    static size_t countsIndex(u64 value)
+    {
+        int bucket = bucketIndex(value);
+        u64 subBucket = value >> bucket;
+        return ((size_t)(bucket + 1) << SUB_BUCKET_HALF_MAGNITUDE) + (subBucket - SUB_BUCKET_HALF_COUNT);
+    }
+
+    // Largest value that lands in the same slot as the value at the given index
+    static u64 highestEquivalent(size_t index)
+    {
+        int bucket = (int)(index >> SUB_BUCKET_HALF_MAGNITUDE) - 1;
+        u64 subBucket = (index & (SUB_BUCKET_HALF_COUNT - 1)) + SUB_BUCKET_HALF_COUNT;
+        if (bucket < 0)
+        {
+            bucket = 0;
+            subBucket -= SUB_BUCKET_HALF_COUNT;
+        }
+        return (subBucket << bucket) + ((u64)1 << bucket) - 1;
+    }
+
+public:
+    // Track values from 0 up to highestTrackable; larger values are clamped
+    HdrHistogram(u64 highestTrackable = 3600ULL * 1000000)
+    {
+        this->highestTrackable = highestTrackable;
+        this->counts.resize(countsIndex(highestTrackable) + 1);
+        this->reset();
+    }
+
+    void reset()
+    {
+        std::fill(this->counts.begin(), this->counts.end(), 0);
+        this->total = 0;
+        this->minValue = ~(u64)0;
+        this->maxValue = 0;
+        this->sum = 0;
+    }
+
+    void record(u64 value)
+    {
+        if (value > this->highestTrackable)
+        {
+            value = this->highestTrackable;
+        }
+        this->counts[countsIndex(value)]++;
+        this->total++;
+        this->sum += value;
+        if (value < this->minValue)
+        {
+            this->minValue = value;
+        }
+        if (value > this->maxValue)
+        {
+            this->maxValue = value;
+        }
+    }
+
+    // Add every value recorded by another histogram of the same range
+    void merge(const HdrHistogram &other)
+    {
+        for (size_t i = 0; i < this->counts.size() && i < other.counts.size(); i++)
+        {
+            this->counts[i] += other.counts[i];
+        }
+        this->total += other.total;
+        this->sum += other.sum;
+        if (other.total > 0 && other.minValue < this->minValue)
+        {
+            this->minValue = other.minValue;
+        }
+        if (other.maxValue > this->maxValue)
+        {
+            this->maxValue = other.maxValue;
+        }
+    }
+
+    // Value at or below which the given percentage (0-100) of recorded values fall
+    u64 percentile(double percent) const
+    {
+        if (this->total == 0)
+        {
+            return 0;
+        }
+        u64 target = (u64)((percent / 100.0) * this->total + 0.5);
+        if (target < 1)
+        {
+            target = 1;
+        }
+        u64 seen = 0;
+        for (size_t i = 0; i < this->counts.size(); i++)
+        {
+            seen += this->counts[i];
+            if (seen >= target)
+            {
+                u64 value = highestEquivalent(i);
+                return value < this->maxValue ? value : this->maxValue;
+            }
+        }
+        return this->maxValue;
+    }
+
+    u64 count() const { return this->total; }
+    u64 min() const { return this->total == 0 ? 0 : this->minValue; }
+    u64 max() const { return this->maxValue; }
+    double mean() const { return this->total == 0 ? 0 : this->sum / this->total; }
+};
+
+#endif
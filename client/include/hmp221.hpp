@@ -1,13 +1,17 @@
 #include <vector>
 #include <string>
+#include <utility>
+#include <stdexcept>
 
 #ifndef HMP221_HPP
 #define HMP221_HPP
 
 typedef unsigned char u8;
+typedef unsigned short u16;
 typedef unsigned int u32;
 typedef unsigned long u64;
 typedef signed char i8;
+typedef signed short i16;
 typedef signed int i32;
 typedef signed long i64;
 typedef float f32;
@@ -15,18 +19,61 @@ typedef double f64;
 typedef std::vector<u8> vec;
 typedef std::string string;
 
-
 #define HMP221_U8 0xa2
+#define HMP221_U32 0xa3
+#define HMP221_U64 0xa4
 #define HMP221_S8 0xaa
 #define HMP221_S16 0xab
 #define HMP221_A8 0xac
 #define HMP221_A16 0xad
 #define HMP221_M8 0xae
+#define HMP221_S32 0xaf
+#define HMP221_A32 0xb0
+#define HMP221_PACKED 0xb1
+
+// Element types of a packed array, ORed with HMP221_PACK_DELTA when every
+// element is stored as its zigzag-encoded difference from the one before
+#define HMP221_PACK_I16 0x1
+#define HMP221_PACK_I32 0x2
+#define HMP221_PACK_F32 0x3
+#define HMP221_PACK_F64 0x4
+#define HMP221_PACK_DELTA 0x80
+
+// First byte of a compact frame, ORed with the frame's type code
+#define HMP221_COMPACT 0xc0
+
+// Payloads at least this long are compressed when the connection granted
+// HMP221_CAP_COMPRESS, if that makes them shorter
+#define HMP221_COMPRESS_THRESHOLD 512
+
+// Largest payload a compressed one may claim to expand to, and the largest
+// message a server assembles in memory
+#define HMP221_MAX_INFLATED (16 << 20)
+
+// Payload bytes per Chunk frame of a message streamed in pieces
+#define HMP221_CHUNK_SIZE 65536
+
+// Protocol a connection speaks. Version 0 is the original encoding, used by
+// every connection that does not start with a Hello.
+#define HMP221_PROTOCOL_VERSION 1
+
+// Capabilities a Hello offers and a Welcome grants
+#define HMP221_CAP_COMPACT 0x1  // compact encoding of frames
+#define HMP221_CAP_COMPRESS 0x2 // compressed payloads
+#define HMP221_CAP_BATCH 0x4    // MultiRequest and MultiMessage
+#define HMP221_CAP_PUSH 0x8     // Watch
+#define HMP221_CAP_STREAM 0x10  // Chunk, for messages of any size
+#define HMP221_CAP_DELTA 0x20   // payloads sent as a delta from the version the client holds
 
 struct Message
 {
     string channelName;
     vec contentBytes;
+    u64 version; // Version of the channel this message is, 0 when unknown
+    u32 id;      // Packet id of a publish the server must acknowledge, 0 for fire-and-forget
+    u32 ttl;     // Milliseconds the server keeps a published message, 0 for the server's default
+    bool compressed; // contentBytes hold the payload compressed by hmp221::compress
+    u64 base;        // contentBytes are a delta (hmp221::diff) from the payload of this version, 0 when whole
 };
 
 struct Request
@@ -34,20 +81,180 @@ struct Request
     string name; // The name of the channel
 };
 
+// Subscribe request for clients that cache channel values
+struct Subscribe
+{
+    string name;  // The name of the channel
+    u64 version;  // Version the client already holds, 0 for none
+    u32 timeout;  // Milliseconds the server may wait for a newer version, 0 to answer at once
+};
+
+// Reply to a Subscribe when the client's version is still the latest
+struct NotModified
+{
+    string channelName;
+    u64 version;
+};
+
+// Latest messages of many channels in one round trip
+struct MultiRequest
+{
+    std::vector<string> names;
+};
+
+// Many messages in one frame: published by a client in one go, or the reply to a MultiRequest
+struct MultiMessage
+{
+    std::vector<struct Message> messages;
+};
+
+// Acknowledges every acknowledged publish of the connection up to and including packet id
+struct Ack
+{
+    u32 id;
+};
+
+// Keepalive sent on a connection that has been quiet; answered with a Pong carrying the same id
+struct Ping
+{
+    u32 id;
+};
+
+struct Pong
+{
+    u32 id;
+};
+
+// Subscription that stays on the connection: every later message of the channel is pushed to it
+struct Watch
+{
+    string name; // The name of the channel
+    u64 version; // Version the client already holds; a newer message is sent at once
+    bool conflate; // Only the latest message matters: a pending one is replaced by a newer one, never queued behind it
+};
+
+// Reply of a cluster node to a request for a channel another node owns, when
+// the request cannot be forwarded: the client should ask that node instead
+struct Redirect
+{
+    string name; // The name of the channel
+    string node; // "host:port" of the node that owns the channel
+};
+
+// Optional first frame of a connection: the newest protocol version the
+// client speaks and the capabilities it would like to use. The server answers
+// with a Welcome holding the version both speak and the capabilities it
+// grants, which hold for the rest of the connection.
+struct Hello
+{
+    u64 version;
+    u64 capabilities;
+};
+
+struct Welcome
+{
+    u64 version;
+    u64 capabilities;
+};
+
+// Sent by a client on the server's Unix domain socket, together with a
+// shared memory file and two eventfds, to move the connection onto a pair of
+// rings of capacity bytes each in that memory. The server answers with the
+// same frame once it uses them; every frame after that goes through the rings.
+struct Attach
+{
+    u64 capacity;
+};
+
+// Sent by a replica to its primary to start the change feed after sequence.
+// A primary that cannot resume from there sends a snapshot first.
+struct Replicate
+{
+    u64 epoch;    // Run of the primary the sequence belongs to, 0 for none
+    u64 sequence; // Last change the replica has applied
+};
+
+// A message stored on the primary, streamed to its replicas in sequence order
+struct Change
+{
+    u64 sequence;
+    u64 stamp;              // Wall clock milliseconds of the primary when it stored the message
+    struct Message message; // With the version the primary gave it and the ttl it has left
+};
+
+// Part of the primary's store as of sequence. The parts of one snapshot
+// replace the replica's store; changes after sequence follow the last part.
+struct Snapshot
+{
+    u64 epoch;
+    u64 sequence;
+    bool last;
+    std::vector<struct Message> messages;
+};
+
+// Piece of a message too large for one frame. A publisher sends the pieces
+// of a message in order, and the message is stored once offset plus the
+// length of bytes reaches total. A server streams a large stored message to
+// a connection that negotiated HMP221_CAP_STREAM the same way. Chunk frames
+// only exist in the compact encoding, with the bytes last and unencoded.
+struct Chunk
+{
+    string name;  // The name of the channel
+    u64 version;  // Version of the channel the message is, 0 from a publisher
+    u64 total;    // Length of the whole message
+    u64 offset;   // Where bytes go in it
+    vec bytes;
+};
+
+// Server metrics as named counters, e.g. "put_p99_ns". Sent with no values to ask the server for them.
+struct Stats
+{
+    std::vector<std::pair<string, u64>> values;
+};
+
 namespace hmp221
 {
 
+    // Thrown by the deserializers when the bytes are not the value or frame
+    // they read, e.g. one cut short or of another type
+    class DecodeError : public std::runtime_error
+    {
+    public:
+        explicit DecodeError(const string &what) : std::runtime_error(what) {}
+    };
+
     void printVec(vec &bytes);
 
     vec serialize(u8 item);
     u8 deserialize_u8(vec bytes);
 
+    vec serialize(u32 item);
+    u32 deserialize_u32(vec bytes);
+
+    vec serialize(u64 item);
+    u64 deserialize_u64(vec bytes);
+
     vec serialize(string item);
     string deserialize_string(vec bytes);
 
     vec serialize(std::vector<u8> item);
     std::vector<u8> deserialize_vec_u8(vec bytes);
 
+    // Packed arrays of fixed-width numbers: one tag and count, then the
+    // elements little-endian with no tag each. delta stores the differences
+    // between successive elements instead, for series that move slowly.
+    vec serialize(const std::vector<i16> &item, bool delta = false);
+    std::vector<i16> deserialize_vec_i16(vec bytes);
+
+    vec serialize(const std::vector<i32> &item, bool delta = false);
+    std::vector<i32> deserialize_vec_i32(vec bytes);
+
+    vec serialize(const std::vector<f32> &item, bool delta = false);
+    std::vector<f32> deserialize_vec_f32(vec bytes);
+
+    vec serialize(const std::vector<f64> &item, bool delta = false);
+    std::vector<f64> deserialize_vec_f64(vec bytes);
+
     // Maps
     vec serialize(struct Message item);
     struct Message deserialize_message(vec bytes);
@@ -55,6 +262,104 @@ namespace hmp221
     vec serialize(struct Request item);
     struct Request deserialize_request(vec bytes);
 
+    vec serialize(struct Subscribe item);
+    struct Subscribe deserialize_subscribe(vec bytes);
+
+    vec serialize(struct NotModified item);
+    struct NotModified deserialize_not_modified(vec bytes);
+
+    vec serialize(struct MultiRequest item);
+    struct MultiRequest deserialize_multi_request(vec bytes);
+
+    vec serialize(struct MultiMessage item);
+    struct MultiMessage deserialize_multi_message(vec bytes);
+
+    vec serialize(struct Ack item);
+    struct Ack deserialize_ack(vec bytes);
+
+    vec serialize(struct Ping item);
+    struct Ping deserialize_ping(vec bytes);
+
+    vec serialize(struct Pong item);
+    struct Pong deserialize_pong(vec bytes);
+
+    vec serialize(struct Watch item);
+    struct Watch deserialize_watch(vec bytes);
+
+    vec serialize(struct Redirect item);
+    struct Redirect deserialize_redirect(vec bytes);
+
+    vec serialize(struct Hello item);
+    struct Hello deserialize_hello(vec bytes);
+
+    vec serialize(struct Welcome item);
+    struct Welcome deserialize_welcome(vec bytes);
+
+    vec serialize(struct Attach item);
+    struct Attach deserialize_attach(vec bytes);
+
+    vec serialize(struct Replicate item);
+    struct Replicate deserialize_replicate(vec bytes);
+
+    vec serialize(struct Change item);
+    struct Change deserialize_change(vec bytes);
+
+    vec serialize(struct Snapshot item);
+    struct Snapshot deserialize_snapshot(vec bytes);
+
+    vec serialize(struct Stats item);
+    struct Stats deserialize_stats(vec bytes);
+
+    // Compact encoding of the frames a connection that negotiated
+    // HMP221_CAP_COMPACT exchanges most. The deserializers above read both
+    // encodings.
+    vec serialize_compact(struct Message item);
+    vec serialize_compact(struct Request item);
+    vec serialize_compact(struct Subscribe item);
+    vec serialize_compact(struct NotModified item);
+    vec serialize_compact(struct MultiRequest item);
+    vec serialize_compact(struct MultiMessage item);
+    vec serialize_compact(struct Ack item);
+    vec serialize_compact(struct Watch item);
+    vec serialize_compact(struct Chunk item);
+    struct Chunk deserialize_chunk(vec bytes);
+
+    // The start of a Chunk frame, to be followed by length bytes of payload
+    // written from elsewhere, e.g. a file
+    vec chunk_header(const string &name, u64 version, u64 total, u64 offset, u64 length);
+
+    // Whether a frame uses the compact encoding
+    bool is_compact(const vec &bytes);
+
+    // LZ4 block compression of payloads, prefixed with the varint length of
+    // the original bytes. decompress returns false when bytes are malformed.
+    vec compress(const vec &bytes);
+    bool decompress(const vec &bytes, vec &out);
+
+    // Compress the payload of a message in place when it is long enough and
+    // shrinks, and restore a compressed one. Both return false when they leave
+    // the message as it was; decompress also when the payload is malformed.
+    bool compress(struct Message &item);
+    bool decompress(struct Message &item);
+
+    // Binary delta that turns base into target, and the target it rebuilds
+    // from base; patch returns false when delta is malformed or not from base.
+    // The delta is never much longer than target, but may not be shorter.
+    vec diff(const vec &base, const vec &target);
+    bool patch(const vec &base, const vec &delta, vec &out);
+
+    // Rebuild the payload of a message that came as a delta from previous,
+    // the message of the channel the client holds. Returns false, leaving the
+    // message as it was, when it is not a delta from previous' version.
+    bool patch(const struct Message &previous, struct Message &item);
+
+    // Returns the type of a frame ("Message", "Request", ...), or "" if it is not a frame
+    string frame_type(vec &bytes);
+
+    // Returns the length of the frame at the start of bytes once all of it has
+    // arrived, 0 when more bytes are needed and -1 when the bytes are malformed
+    long frame_length(const u8 *bytes, size_t size);
+
     // helper method for getting sub vector
     vec slice(vec &bytes, int vbegin, int vend);
 }
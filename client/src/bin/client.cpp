@@ -9,15 +9,27 @@
 #include "hmp221.hpp"
 #include <fstream>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/socket.h>
 #define KEY 42
 
 using namespace std;
 
+// Unix domain socket of a server on the same host, given with --unix; NULL to connect over TCP
+static char *unixPath = NULL;
+
 // Declared methods used to avoid compiler error
 void printFlagError();
 int connectToServer(int portno, char *hostName);
-void publish(int portNo, char *hostName, char *channel, char *message);
+void sendDatagram(int portno, char *hostName, vec &bytes);
+void publish(int portNo, char *hostName, char *channel, char *message, bool udp);
 void subscribe(int portNo, char *hostName, char *channel);
+void publishMany(int portNo, char *hostName, char **pairs, int pairCount, bool udp);
+void publishAcked(int portNo, char *hostName, char **pairs, int pairCount, int window);
+void subscribeMany(int portNo, char *hostName, char **channels, int channelCount);
+void printStats(int portNo, char *hostName);
+void watch(int portNo, char *hostName, char *channel, bool conflate);
+vec readFrame(int sockfd);
 void pushToBuffer(char *bufferP, vec *bytesP);
 
 int main(int argv, char **argc)
@@ -26,9 +38,17 @@ int main(int argv, char **argc)
     char *mode;
     char *channel;
     char *message;
+    // Remaining arguments of the batch modes
+    char **batchArgs;
+    int batchCount = 0;
     char *serverInfo;
     char *hostName;
     int portNo;
+    // --qos 1 publishes every message with a packet id and waits for the server's Ack
+    int qos = 0;
+    int window = 64;
+    // --udp sends a publish as a single datagram instead of over a connection
+    bool udp = false;
     for (int i = 1; i < argv; i++)
     {
         char *currentString = *(argc + i);
@@ -49,10 +69,54 @@ int main(int argv, char **argc)
                 message = *(argc + i + 2);
                 break;
             }
+            else if (strcmp(currentString, "--subscribe-many") == 0)
+            {
+                mode = (char*)"subscribe-many";
+                hasValidModeFlag = i + 1 < argv;
+                batchArgs = argc + i + 1;
+                batchCount = argv - i - 1;
+                break;
+            }
+            else if (strcmp(currentString, "--publish-many") == 0)
+            {
+                mode = (char*)"publish-many";
+                hasValidModeFlag = i + 2 < argv && (argv - i - 1) % 2 == 0;
+                batchArgs = argc + i + 1;
+                batchCount = (argv - i - 1) / 2;
+                break;
+            }
+            else if (strcmp(currentString, "--watch") == 0 || strcmp(currentString, "--watch-latest") == 0)
+            {
+                mode = currentString + 2;
+                hasValidModeFlag = i + 1 < argv;
+                channel = *(argc + i + 1);
+                break;
+            }
+            else if (strcmp(currentString, "--stats") == 0)
+            {
+                mode = (char*)"stats";
+                hasValidModeFlag = true;
+            }
             else if (strcmp(currentString, "--hostname") == 0)
             {
                 serverInfo = *(argc + i + 1);
             }
+            else if (strcmp(currentString, "--qos") == 0 && i + 1 < argv)
+            {
+                qos = atoi(*(argc + i + 1));
+            }
+            else if (strcmp(currentString, "--window") == 0 && i + 1 < argv)
+            {
+                window = atoi(*(argc + i + 1));
+            }
+            else if (strcmp(currentString, "--udp") == 0)
+            {
+                udp = true;
+            }
+            else if (strcmp(currentString, "--unix") == 0 && i + 1 < argv)
+            {
+                unixPath = *(argc + i + 1);
+            }
         }
     }
 
@@ -65,9 +129,34 @@ int main(int argv, char **argc)
     // extract hostname and port number
     hostName = strtok(serverInfo, ":");
     portNo = atoi(strtok(NULL, ":"));
-    if (strcmp(mode, "publish") == 0)
+    if (strcmp(mode, "publish") == 0 && qos > 0)
+    {
+        char *pair[] = {channel, message};
+        publishAcked(portNo, hostName, pair, 1, window);
+    }
+    else if (strcmp(mode, "publish-many") == 0 && qos > 0)
+    {
+        publishAcked(portNo, hostName, batchArgs, batchCount, window);
+    }
+    else if (strcmp(mode, "publish") == 0)
+    {
+        publish(portNo, hostName, channel, message, udp);
+    }
+    else if (strcmp(mode, "publish-many") == 0)
+    {
+        publishMany(portNo, hostName, batchArgs, batchCount, udp);
+    }
+    else if (strcmp(mode, "subscribe-many") == 0)
+    {
+        subscribeMany(portNo, hostName, batchArgs, batchCount);
+    }
+    else if (strcmp(mode, "stats") == 0)
     {
-        publish(portNo, hostName, channel, message);
+        printStats(portNo, hostName);
+    }
+    else if (strcmp(mode, "watch") == 0 || strcmp(mode, "watch-latest") == 0)
+    {
+        watch(portNo, hostName, channel, strcmp(mode, "watch-latest") == 0);
     }
     else
     {
@@ -81,6 +170,14 @@ void printFlagError()
     cout << "ERROR: Expected mode" << endl;
     cout << "usage: client --subscribe [channel]" << endl;
     cout << "usage: client --publish [channel] [message]" << endl;
+    cout << "usage: client --subscribe-many [channel]..." << endl;
+    cout << "usage: client --publish-many [channel] [message] [[channel] [message]]..." << endl;
+    cout << "usage: client --watch [channel]" << endl;
+    cout << "usage: client --watch-latest [channel]" << endl;
+    cout << "usage: client --stats" << endl;
+    cout << "options: --qos 1 [--window n] before --publish or --publish-many waits for the server to acknowledge every message" << endl;
+    cout << "options: --udp before --publish or --publish-many sends a datagram to a server started with --udp, unacknowledged" << endl;
+    cout << "options: --unix [path] before the mode connects through the unix socket of a server on the same host" << endl;
 }
 
 /**
@@ -94,8 +191,7 @@ void subscribe(int portno, char *hostName, char *channel)
     // Connect to server and get the socket descriptor
     int sockfd = connectToServer(portno, hostName);
     printf("Reading from channel \"%s\"\n", channel);
-    struct Request requestStruct = {name : channel};
-    bool hasMsg = false;
+    struct Request requestStruct = {channel};
     vec serializedRequest = hmp221::serialize(requestStruct);
     // Encrypt the bytes
     for (int i = 0; i < serializedRequest.size(); i++)
@@ -118,32 +214,22 @@ void subscribe(int portno, char *hostName, char *channel)
         exit(1);
     }
 
-    bzero(buffer, 65536);
-
-    n = read(sockfd, buffer, 65536);
-
-    // When n < 0, there was an error reading from the socket
+    // This is the case where the topic does not exist: the server closes the
+    // connection without a reply
+    n = recv(sockfd, buffer, 1, MSG_PEEK);
     if (n < 0)
     {
         perror("ERROR reading from socket");
         exit(1);
     }
-
-    vec responseBytes;
-    for (int i = 0; i < 65536; i++)
+    if (n == 0)
     {
-        responseBytes.push_back(buffer[i] ^ KEY);
-        if (responseBytes[i] != 0x2a) {
-            hasMsg = true;
-        }
-    }
-    if (!hasMsg) {
         std::cout << "" << std::endl;
         return;
     }
 
-    // This is the case where the topic does not exist
-
+    // A message may be larger than the buffer, so the reply is read until its frame is whole
+    vec responseBytes = readFrame(sockfd);
     struct Message messageStruct = hmp221::deserialize_message(responseBytes);
 
     std::cout << hmp221::deserialize_string(messageStruct.contentBytes) << std::endl;
@@ -157,17 +243,17 @@ void subscribe(int portno, char *hostName, char *channel)
  * @param hostName server's name
  * @param channel channel's name
  * @param message message to be published
+ * @param udp send the message as a datagram
  */
-void publish(int portno, char *hostName, char *channel, char *message)
+void publish(int portno, char *hostName, char *channel, char *message, bool udp)
 {
-    // Connect to server and get the socket descriptor
-    int sockfd = connectToServer(portno, hostName);
-
     // Construct a channelString from a char pointer
     string channelString(channel);
 
     printf("Sending message to channel \"%s\"\n", channel);
-    struct Message messageStruct = {channelName : channel, contentBytes : hmp221::serialize(string(message))};
+    struct Message messageStruct = {};
+    messageStruct.channelName = channel;
+    messageStruct.contentBytes = hmp221::serialize(string(message));
     vec serializedMessageStruct = hmp221::serialize(messageStruct);
 
     // Encrypt the bytes
@@ -175,6 +261,15 @@ void publish(int portno, char *hostName, char *channel, char *message)
     {
         serializedMessageStruct[i] ^= KEY;
     }
+    if (udp)
+    {
+        sendDatagram(portno, hostName, serializedMessageStruct);
+        std::cout << "Message sent.\nDone." << std::endl;
+        return;
+    }
+
+    // Connect to server and get the socket descriptor
+    int sockfd = connectToServer(portno, hostName);
     char buffer[serializedMessageStruct.size()];
 
     // Push the encrypted bytes to buffer
@@ -191,6 +286,329 @@ void publish(int portno, char *hostName, char *channel, char *message)
     std::cout << "Message sent.\nDone." << std::endl;
 }
 
+/**
+ * @brief Send many messages to the server in a single frame
+ * @param portNo server's port number
+ * @param hostName server's name
+ * @param pairs channel and message arguments, alternating
+ * @param pairCount number of channel/message pairs
+ * @param udp send the batch as a datagram
+ */
+void publishMany(int portno, char *hostName, char **pairs, int pairCount, bool udp)
+{
+    struct MultiMessage batchStruct;
+    for (int i = 0; i < pairCount; i++)
+    {
+        struct Message messageStruct = {};
+        messageStruct.channelName = pairs[2 * i];
+        messageStruct.contentBytes = hmp221::serialize(string(pairs[2 * i + 1]));
+        batchStruct.messages.push_back(messageStruct);
+    }
+    printf("Sending %d messages\n", pairCount);
+    vec serializedBatch = hmp221::serialize(batchStruct);
+
+    // Encrypt the bytes
+    for (int i = 0; i < serializedBatch.size(); i++)
+    {
+        serializedBatch[i] ^= KEY;
+    }
+    if (udp)
+    {
+        sendDatagram(portno, hostName, serializedBatch);
+        std::cout << "Messages sent.\nDone." << std::endl;
+        return;
+    }
+
+    // Connect to server and get the socket descriptor
+    int sockfd = connectToServer(portno, hostName);
+
+    /* Send the batch to the server */
+    int n = write(sockfd, serializedBatch.data(), serializedBatch.size());
+    if (n < 0)
+    {
+        perror("ERROR writing to socket");
+        exit(1);
+    }
+
+    std::cout << "Messages sent.\nDone." << std::endl;
+}
+
+/**
+ * @brief Publish messages one frame each and wait until the server acknowledged all of them
+ *
+ * Up to window messages are sent ahead of their Ack. The server acknowledges
+ * cumulatively, so one Ack may release many messages.
+ *
+ * @param portNo server's port number
+ * @param hostName server's name
+ * @param pairs channel and message arguments, alternating
+ * @param pairCount number of channel/message pairs
+ * @param window most messages sent but not acknowledged at once
+ */
+void publishAcked(int portno, char *hostName, char **pairs, int pairCount, int window)
+{
+    // Connect to server and get the socket descriptor
+    int sockfd = connectToServer(portno, hostName);
+    if (window < 1)
+    {
+        window = 1;
+    }
+
+    printf("Sending %d messages, at most %d unacknowledged\n", pairCount, window);
+    char buffer[65536];
+    vec responseBytes;
+    u32 acked = 0;
+    for (int i = 0; i < pairCount || acked < (u32)pairCount;)
+    {
+        // Send while the window has room, then wait for an Ack to make more
+        if (i < pairCount && i - (int)acked < window)
+        {
+            struct Message messageStruct = {};
+            messageStruct.channelName = pairs[2 * i];
+            messageStruct.contentBytes = hmp221::serialize(string(pairs[2 * i + 1]));
+            messageStruct.id = (u32)(i + 1);
+            vec serializedMessageStruct = hmp221::serialize(messageStruct);
+
+            // Encrypt the bytes
+            for (int j = 0; j < serializedMessageStruct.size(); j++)
+            {
+                serializedMessageStruct[j] ^= KEY;
+            }
+            int n = write(sockfd, serializedMessageStruct.data(), serializedMessageStruct.size());
+            if (n < 0)
+            {
+                perror("ERROR writing to socket");
+                exit(1);
+            }
+            i++;
+            continue;
+        }
+        // Several Acks may arrive in one read; the last one covers the others
+        int n = read(sockfd, buffer, sizeof(buffer));
+        if (n <= 0)
+        {
+            fprintf(stderr, "ERROR connection lost with %u messages unacknowledged\n", pairCount - acked);
+            exit(1);
+        }
+        for (int j = 0; j < n; j++)
+        {
+            responseBytes.push_back(buffer[j] ^ KEY);
+        }
+        long length;
+        while ((length = hmp221::frame_length(responseBytes.data(), responseBytes.size())) > 0)
+        {
+            vec frameBytes(responseBytes.begin(), responseBytes.begin() + length);
+            responseBytes.erase(responseBytes.begin(), responseBytes.begin() + length);
+            if (hmp221::frame_type(frameBytes) == "Ack")
+            {
+                acked = hmp221::deserialize_ack(frameBytes).id;
+            }
+        }
+    }
+
+    std::cout << "Messages acknowledged.\nDone." << std::endl;
+}
+
+/**
+ * @brief Read the latest message of many channels with a single request
+ * @param portNo server's port number
+ * @param hostName server's name
+ * @param channels channel names
+ * @param channelCount number of channels
+ */
+void subscribeMany(int portno, char *hostName, char **channels, int channelCount)
+{
+    // Connect to server and get the socket descriptor
+    int sockfd = connectToServer(portno, hostName);
+
+    struct MultiRequest requestStruct;
+    for (int i = 0; i < channelCount; i++)
+    {
+        requestStruct.names.push_back(channels[i]);
+    }
+    printf("Reading from %d channels\n", channelCount);
+    vec serializedRequest = hmp221::serialize(requestStruct);
+
+    // Encrypt the bytes
+    for (int i = 0; i < serializedRequest.size(); i++)
+    {
+        serializedRequest[i] ^= KEY;
+    }
+
+    /* Send the request to the server */
+    int n = write(sockfd, serializedRequest.data(), serializedRequest.size());
+    if (n < 0)
+    {
+        perror("ERROR sending request");
+        exit(1);
+    }
+
+    vec responseBytes = readFrame(sockfd);
+    struct MultiMessage replyStruct = hmp221::deserialize_multi_message(responseBytes);
+    for (int i = 0; i < replyStruct.messages.size(); i++)
+    {
+        struct Message &messageStruct = replyStruct.messages[i];
+        string content = messageStruct.contentBytes.empty() ? "" : hmp221::deserialize_string(messageStruct.contentBytes);
+        std::cout << messageStruct.channelName << ": " << content << std::endl;
+    }
+
+    printf("Terminating connection with %s:%d.\n", hostName, portno);
+}
+
+/**
+ * @brief Print the server's metrics
+ * @param portNo server's port number
+ * @param hostName server's name
+ */
+void printStats(int portno, char *hostName)
+{
+    // Connect to server and get the socket descriptor
+    int sockfd = connectToServer(portno, hostName);
+
+    // An empty Stats frame asks the server for its metrics
+    struct Stats requestStruct;
+    vec serializedRequest = hmp221::serialize(requestStruct);
+
+    // Encrypt the bytes
+    for (int i = 0; i < serializedRequest.size(); i++)
+    {
+        serializedRequest[i] ^= KEY;
+    }
+
+    /* Send the request to the server */
+    int n = write(sockfd, serializedRequest.data(), serializedRequest.size());
+    if (n < 0)
+    {
+        perror("ERROR sending request");
+        exit(1);
+    }
+
+    vec responseBytes = readFrame(sockfd);
+    struct Stats statsStruct = hmp221::deserialize_stats(responseBytes);
+    for (int i = 0; i < statsStruct.values.size(); i++)
+    {
+        printf("%-24s %lu\n", statsStruct.values[i].first.c_str(), statsStruct.values[i].second);
+    }
+}
+
+/**
+ * @brief Print every message published on a channel until the server closes the connection
+ * @param portNo server's port number
+ * @param hostName server's name
+ * @param channel channel's name
+ * @param conflate skip to the latest message when the client falls behind
+ */
+void watch(int portno, char *hostName, char *channel, bool conflate)
+{
+    // Connect to server and get the socket descriptor
+    int sockfd = connectToServer(portno, hostName);
+    printf("Watching channel \"%s\"\n", channel);
+    struct Watch watchStruct = {channel, 0, conflate};
+    vec serializedRequest = hmp221::serialize(watchStruct);
+
+    // Encrypt the bytes
+    for (int i = 0; i < serializedRequest.size(); i++)
+    {
+        serializedRequest[i] ^= KEY;
+    }
+
+    /* Send the request to the server */
+    int n = write(sockfd, serializedRequest.data(), serializedRequest.size());
+    if (n < 0)
+    {
+        perror("ERROR sending request");
+        exit(1);
+    }
+
+    // Several messages may arrive in one read, and one message over several
+    char buffer[65536];
+    vec responseBytes;
+    while ((n = read(sockfd, buffer, 65536)) > 0)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            responseBytes.push_back(buffer[i] ^ KEY);
+        }
+        size_t offset = 0;
+        long length;
+        while ((length = hmp221::frame_length(responseBytes.data() + offset, responseBytes.size() - offset)) > 0)
+        {
+            vec frameBytes(responseBytes.begin() + offset, responseBytes.begin() + offset + length);
+            offset += length;
+            // A quiet watch is pinged by servers with keepalives; answering keeps it open
+            if (hmp221::frame_type(frameBytes) == "Ping")
+            {
+                struct Pong pongStruct = {hmp221::deserialize_ping(frameBytes).id};
+                vec serializedPong = hmp221::serialize(pongStruct);
+                for (int i = 0; i < serializedPong.size(); i++)
+                {
+                    serializedPong[i] ^= KEY;
+                }
+                write(sockfd, serializedPong.data(), serializedPong.size());
+                continue;
+            }
+            // In a cluster, watches are served by the node that owns the channel
+            if (hmp221::frame_type(frameBytes) == "Redirect")
+            {
+                struct Redirect redirectStruct = hmp221::deserialize_redirect(frameBytes);
+                close(sockfd);
+                printf("Channel \"%s\" is on %s\n", channel, redirectStruct.node.c_str());
+                size_t colon = redirectStruct.node.rfind(':');
+                string ownerHost = redirectStruct.node.substr(0, colon);
+                watch(atoi(redirectStruct.node.c_str() + colon + 1), (char *)ownerHost.c_str(), channel, conflate);
+                return;
+            }
+            struct Message messageStruct = hmp221::deserialize_message(frameBytes);
+            std::cout << hmp221::deserialize_string(messageStruct.contentBytes) << std::endl;
+        }
+        if (length < 0)
+        {
+            fprintf(stderr, "ERROR reading message\n");
+            exit(1);
+        }
+        responseBytes.erase(responseBytes.begin(), responseBytes.begin() + offset);
+    }
+
+    printf("Terminating connection with %s:%d.\n", hostName, portno);
+}
+
+/**
+ * @brief Read one reply frame, which may arrive in several pieces
+ * @param sockfd the socket to read from
+ * @return the decrypted frame
+ */
+vec readFrame(int sockfd)
+{
+    char buffer[65536];
+    vec responseBytes;
+    long length = 0;
+    while (length == 0)
+    {
+        int n = read(sockfd, buffer, 65536);
+        if (n < 0)
+        {
+            perror("ERROR reading from socket");
+            exit(1);
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            responseBytes.push_back(buffer[i] ^ KEY);
+        }
+        length = hmp221::frame_length(responseBytes.data(), responseBytes.size());
+    }
+    if (length <= 0)
+    {
+        fprintf(stderr, "ERROR reading reply\n");
+        exit(1);
+    }
+    responseBytes.resize(length);
+    return responseBytes;
+}
+
 /**
  * @brief Connect to the server using the given hostname and port number
  * @param portno server's port number
@@ -202,6 +620,27 @@ int connectToServer(int portno, char *hostName)
     struct sockaddr_in serv_addr;
     struct hostent *server;
 
+    if (unixPath != NULL)
+    {
+        struct sockaddr_un local_addr;
+        bzero((char *)&local_addr, sizeof(local_addr));
+        local_addr.sun_family = AF_UNIX;
+        strncpy(local_addr.sun_path, unixPath, sizeof(local_addr.sun_path) - 1);
+        sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd < 0)
+        {
+            perror("ERROR opening socket");
+            exit(1);
+        }
+        printf("Connecting to %s.\n", unixPath);
+        if (connect(sockfd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0)
+        {
+            perror("ERROR connecting");
+            exit(1);
+        }
+        return sockfd;
+    }
+
     /* Create a socket point */
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -234,6 +673,45 @@ int connectToServer(int portno, char *hostName)
     return sockfd;
 }
 
+/**
+ * @brief Send encrypted frames to the server as one datagram
+ *
+ * There is no connection to set up or tear down, and no reply: a datagram
+ * that is lost is not sent again.
+ *
+ * @param portno server's port number
+ * @param hostName server's name
+ * @param bytes the encrypted frames, at most the size of one datagram
+ */
+void sendDatagram(int portno, char *hostName, vec &bytes)
+{
+    struct sockaddr_in serv_addr;
+    struct hostent *server = gethostbyname(hostName);
+    if (server == NULL)
+    {
+        fprintf(stderr, "ERROR, no such host\n");
+        exit(0);
+    }
+    bzero((char *)&serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
+    serv_addr.sin_port = htons(portno);
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0)
+    {
+        perror("ERROR opening socket");
+        exit(1);
+    }
+    printf("Sending a datagram to %s:%d.\n", hostName, portno);
+    if (sendto(sockfd, bytes.data(), bytes.size(), 0, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+        perror("ERROR sending datagram");
+        exit(1);
+    }
+    close(sockfd);
+}
+
 void pushToBuffer(char buffer[], vec *bytesP)
 {
     int i = 0;
@@ -0,0 +1,390 @@
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <random>
+#include <algorithm>
+#include <memory>
+#include "hmp221.hpp"
+#include "coclient.hpp"
+#include "hdrhistogram.hpp"
+
+using namespace std;
+using hmp221::co::Client;
+using hmp221::co::LocalSession;
+using hmp221::co::Scheduler;
+using hmp221::co::Task;
+
+// Workload shared by every simulated publisher and subscriber
+struct Workload
+{
+    int publishers = 1;
+    int subscribers = 1;
+    int channels = 100;
+    int payloadSize = 64;
+    double rate = 0; // operations per second per client, 0 = as fast as possible
+    double duration = 10;
+    bool zipfian = false;
+    double zipfExponent = 0.99;
+    const char *output = NULL;
+    const char *unixPath = NULL; // connect through the server's unix socket instead of TCP
+    bool rings = false;          // every client attaches shared-memory rings, needs unixPath
+};
+
+// Results of one kind of operation
+struct OpStats
+{
+    u64 ops = 0;
+    u64 errors = 0;
+    u64 hits = 0; // subscribes that returned a message
+    u64 bytes = 0;
+    HdrHistogram latency;
+};
+
+void printUsage();
+int pickChannel(const Workload &workload, const vector<double> &cdf, mt19937_64 &rng);
+Task<void> runPublisher(Scheduler &sched, Client &client, const Workload &workload, const vector<double> &cdf, mt19937_64 &rng, u64 endTime, OpStats &stats);
+Task<void> runSubscriber(Scheduler &sched, Client &client, const Workload &workload, const vector<double> &cdf, mt19937_64 &rng, u64 endTime, OpStats &stats);
+Task<void> runRingClient(Scheduler &sched, Client &client, const Workload &workload, const vector<double> &cdf, mt19937_64 &rng, u64 endTime, OpStats &stats, bool publisher);
+void writeReport(FILE *out, const Workload &workload, double elapsed, const OpStats &publish, const OpStats &subscribe);
+
+int main(int argv, char **argc)
+{
+    Workload workload;
+    char *serverInfo = NULL;
+    for (int i = 1; i < argv; i++)
+    {
+        char *currentString = *(argc + i);
+        if (i + 1 >= argv)
+        {
+            break;
+        }
+        char *value = *(argc + i + 1);
+        if (strcmp(currentString, "--hostname") == 0)
+        {
+            serverInfo = value;
+        }
+        else if (strcmp(currentString, "--publishers") == 0)
+        {
+            workload.publishers = atoi(value);
+        }
+        else if (strcmp(currentString, "--subscribers") == 0)
+        {
+            workload.subscribers = atoi(value);
+        }
+        else if (strcmp(currentString, "--channels") == 0)
+        {
+            workload.channels = atoi(value);
+        }
+        else if (strcmp(currentString, "--payload") == 0)
+        {
+            workload.payloadSize = atoi(value);
+        }
+        else if (strcmp(currentString, "--rate") == 0)
+        {
+            workload.rate = atof(value);
+        }
+        else if (strcmp(currentString, "--duration") == 0)
+        {
+            workload.duration = atof(value);
+        }
+        else if (strcmp(currentString, "--distribution") == 0)
+        {
+            workload.zipfian = strcmp(value, "zipfian") == 0;
+        }
+        else if (strcmp(currentString, "--zipf-exponent") == 0)
+        {
+            workload.zipfExponent = atof(value);
+        }
+        else if (strcmp(currentString, "--output") == 0)
+        {
+            workload.output = value;
+        }
+        else if (strcmp(currentString, "--unix") == 0)
+        {
+            workload.unixPath = value;
+        }
+        else
+        {
+            continue;
+        }
+        i++;
+    }
+    for (int i = 1; i < argv; i++)
+    {
+        workload.rings = workload.rings || strcmp(*(argc + i), "--rings") == 0;
+    }
+
+    // Each payload byte is encoded as a tagged u8, so the frame must stay
+    // within the server's 65536-byte request buffer
+    if ((serverInfo == NULL && workload.unixPath == NULL) || (workload.rings && workload.unixPath == NULL) || workload.channels < 1 || workload.payloadSize < 0 || workload.payloadSize > 32000)
+    {
+        printUsage();
+        return 1;
+    }
+
+
+    // Cumulative distribution over channel ranks; uniform keys use it too so
+    // both distributions cost the same per pick
+    vector<double> cdf(workload.channels);
+    double norm = 0;
+    for (int i = 0; i < workload.channels; i++)
+    {
+        norm += workload.zipfian ? 1.0 / pow(i + 1, workload.zipfExponent) : 1.0;
+        cdf[i] = norm;
+    }
+    for (int i = 0; i < workload.channels; i++)
+    {
+        cdf[i] /= norm;
+    }
+
+    Scheduler sched;
+    unique_ptr<Client> clientP;
+    if (workload.unixPath != NULL)
+    {
+        clientP.reset(new Client(sched, string(workload.unixPath)));
+    }
+    else
+    {
+        // extract hostname and port number
+        char *hostName = strtok(serverInfo, ":");
+        int portNo = atoi(strtok(NULL, ":"));
+        clientP.reset(new Client(sched, hostName, portNo));
+    }
+    Client &client = *clientP;
+    mt19937_64 rng(221);
+    OpStats publish;
+    OpStats subscribe;
+    u64 startTime = Scheduler::now();
+    u64 endTime = startTime + (u64)(workload.duration * 1000000);
+    for (int i = 0; i < workload.publishers; i++)
+    {
+        sched.spawn(workload.rings ? runRingClient(sched, client, workload, cdf, rng, endTime, publish, true)
+                                   : runPublisher(sched, client, workload, cdf, rng, endTime, publish));
+    }
+    for (int i = 0; i < workload.subscribers; i++)
+    {
+        sched.spawn(workload.rings ? runRingClient(sched, client, workload, cdf, rng, endTime, subscribe, false)
+                                   : runSubscriber(sched, client, workload, cdf, rng, endTime, subscribe));
+    }
+    sched.run();
+    double elapsed = (Scheduler::now() - startTime) / 1000000.0;
+
+    FILE *out = stdout;
+    if (workload.output != NULL)
+    {
+        out = fopen(workload.output, "w");
+        if (out == NULL)
+        {
+            perror("ERROR opening output file");
+            return 1;
+        }
+    }
+    writeReport(out, workload, elapsed, publish, subscribe);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
+
+/* Printing usage when the arguments are invalid */
+void printUsage()
+{
+    fprintf(stderr, "usage: loadgen --hostname [host]:[portNo] [--publishers N] [--subscribers M]\n");
+    fprintf(stderr, "               [--channels C] [--payload bytes (<= 32000)] [--rate ops/s per client]\n");
+    fprintf(stderr, "               [--duration seconds] [--distribution uniform|zipfian]\n");
+    fprintf(stderr, "               [--zipf-exponent s] [--output report.json]\n");
+    fprintf(stderr, "       loadgen --unix [path] [--rings] [options as above]\n");
+}
+
+/**
+ * @brief Pick a channel index following the workload's key distribution
+ *
+ * @param cdf cumulative probability of each channel rank
+ * @return the channel index
+ */
+int pickChannel(const Workload &workload, const vector<double> &cdf, mt19937_64 &rng)
+{
+    double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+    int index = (int)(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+    return index < workload.channels ? index : workload.channels - 1;
+}
+
+string channelName(int index)
+{
+    return "loadgen-" + to_string(index);
+}
+
+/**
+ * @brief Wait for the next scheduled operation of a rate-limited client
+ *
+ * Latency is measured from the time an operation was due rather than from
+ * when it actually started, so a stalled server shows up in the percentiles
+ * instead of silently lowering the request rate (coordinated omission).
+ *
+ * @param due time the operation is due; advanced to the following slot
+ * @return the time latency should be measured from
+ */
+Task<u64> waitForSlot(Scheduler &sched, const Workload &workload, u64 &due)
+{
+    if (workload.rate <= 0)
+    {
+        co_return Scheduler::now();
+    }
+    u64 slot = due;
+    due += (u64)(1000000 / workload.rate);
+    co_await sched.sleepUntil(slot);
+    co_return slot;
+}
+
+Task<void> runPublisher(Scheduler &sched, Client &client, const Workload &workload, const vector<double> &cdf, mt19937_64 &rng, u64 endTime, OpStats &stats)
+{
+    vec payload(workload.payloadSize);
+    for (size_t i = 0; i < payload.size(); i++)
+    {
+        payload[i] = (u8)rng();
+    }
+    u64 due = Scheduler::now();
+    while (true)
+    {
+        u64 start = co_await waitForSlot(sched, workload, due);
+        if (start >= endTime)
+        {
+            break;
+        }
+        if (workload.rate <= 0)
+        {
+            // A publish need not wait for anything, like one over a Unix domain
+            // socket, and would otherwise keep the other clients from running
+            co_await sched.yield();
+        }
+        bool sent = co_await client.publish(channelName(pickChannel(workload, cdf, rng)), payload);
+        stats.latency.record(Scheduler::now() - start);
+        stats.ops++;
+        if (sent)
+        {
+            stats.bytes += payload.size();
+        }
+        else
+        {
+            stats.errors++;
+        }
+    }
+}
+
+Task<void> runSubscriber(Scheduler &sched, Client &client, const Workload &workload, const vector<double> &cdf, mt19937_64 &rng, u64 endTime, OpStats &stats)
+{
+    u64 due = Scheduler::now();
+    while (true)
+    {
+        u64 start = co_await waitForSlot(sched, workload, due);
+        if (start >= endTime)
+        {
+            break;
+        }
+        struct Message messageStruct = co_await client.next(channelName(pickChannel(workload, cdf, rng)));
+        stats.latency.record(Scheduler::now() - start);
+        stats.ops++;
+        if (!messageStruct.contentBytes.empty())
+        {
+            stats.hits++;
+            stats.bytes += messageStruct.contentBytes.size();
+        }
+    }
+}
+
+/**
+ * @brief Publish or subscribe like runPublisher and runSubscriber, through shared-memory rings
+ *
+ * Every client keeps one session for the whole run. A publish completes once
+ * it is in the ring, a subscribe once its reply is out of the other one.
+ *
+ * @param publisher whether the client publishes or subscribes
+ */
+Task<void> runRingClient(Scheduler &sched, Client &client, const Workload &workload, const vector<double> &cdf, mt19937_64 &rng, u64 endTime, OpStats &stats, bool publisher)
+{
+    LocalSession session(client);
+    bool opened = co_await session.open();
+    if (!opened)
+    {
+        stats.errors++;
+        co_return;
+    }
+    vec payload(publisher ? workload.payloadSize : 0);
+    for (size_t i = 0; i < payload.size(); i++)
+    {
+        payload[i] = (u8)rng();
+    }
+    u64 due = Scheduler::now();
+    while (true)
+    {
+        u64 start = co_await waitForSlot(sched, workload, due);
+        if (start >= endTime)
+        {
+            break;
+        }
+        string channel = channelName(pickChannel(workload, cdf, rng));
+        if (publisher)
+        {
+            if (workload.rate <= 0)
+            {
+                // A publish into a ring with room does not suspend
+                co_await sched.yield();
+            }
+            bool sent = co_await session.publish(channel, payload);
+            stats.latency.record(Scheduler::now() - start);
+            stats.ops++;
+            if (!sent)
+            {
+                stats.errors++;
+                break;
+            }
+            stats.bytes += payload.size();
+            continue;
+        }
+        struct Message messageStruct = co_await session.next(channel);
+        hmp221::decompress(messageStruct);
+        stats.latency.record(Scheduler::now() - start);
+        stats.ops++;
+        if (!messageStruct.contentBytes.empty())
+        {
+            stats.hits++;
+            stats.bytes += messageStruct.contentBytes.size();
+        }
+    }
+}
+
+void writeOpStats(FILE *out, const char *name, const OpStats &stats, double elapsed, bool last)
+{
+    fprintf(out, "  \"%s\": {\n", name);
+    fprintf(out, "    \"ops\": %lu,\n", stats.ops);
+    fprintf(out, "    \"errors\": %lu,\n", stats.errors);
+    fprintf(out, "    \"hits\": %lu,\n", stats.hits);
+    fprintf(out, "    \"payload_bytes\": %lu,\n", stats.bytes);
+    fprintf(out, "    \"throughput_ops_per_sec\": %.1f,\n", elapsed > 0 ? stats.ops / elapsed : 0.0);
+    fprintf(out, "    \"latency_us\": {\"min\": %lu, \"mean\": %.1f, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}\n",
+            stats.latency.min(), stats.latency.mean(), stats.latency.percentile(50),
+            stats.latency.percentile(99), stats.latency.percentile(99.9), stats.latency.max());
+    fprintf(out, "  }%s\n", last ? "" : ",");
+}
+
+/**
+ * @brief Write the run configuration and results as JSON
+ */
+void writeReport(FILE *out, const Workload &workload, double elapsed, const OpStats &publish, const OpStats &subscribe)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"publishers\": %d, \"subscribers\": %d, \"channels\": %d, \"payload_bytes\": %d, "
+                 "\"rate_per_client\": %.1f, \"duration_s\": %.1f, \"distribution\": \"%s\", \"zipf_exponent\": %.2f, "
+                 "\"transport\": \"%s\"},\n",
+            workload.publishers, workload.subscribers, workload.channels, workload.payloadSize,
+            workload.rate, workload.duration, workload.zipfian ? "zipfian" : "uniform", workload.zipfExponent,
+            workload.rings ? "rings" : workload.unixPath != NULL ? "unix" : "tcp");
+    fprintf(out, "  \"elapsed_s\": %.3f,\n", elapsed);
+    fprintf(out, "  \"throughput_ops_per_sec\": %.1f,\n", elapsed > 0 ? (publish.ops + subscribe.ops) / elapsed : 0.0);
+    writeOpStats(out, "publish", publish, elapsed, false);
+    writeOpStats(out, "subscribe", subscribe, elapsed, true);
+    fprintf(out, "}\n");
+}
@@ -0,0 +1,1461 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "coclient.hpp"
+#define KEY 42
+#define FRAME_CLASS 64
+#define FRAME_CLASSES 64
+#define MAX_EVENTS 1024
+#define PUBLISH_RETRIES 5       // connection attempts before a publisher gives up
+#define PUBLISH_BACKOFF 100000  // microseconds before the first retry, doubled after each
+#define CLIENT_CAPABILITIES (HMP221_CAP_COMPACT | HMP221_CAP_COMPRESS | HMP221_CAP_BATCH | HMP221_CAP_PUSH) // asked for by long-lived connections
+#define STREAM_CAPABILITIES (CLIENT_CAPABILITIES | HMP221_CAP_STREAM) // asked for by connections that stream a message
+#define UNIX_CONNECT_RETRY 1000 // microseconds before connecting again while the server's accept queue is full
+
+using namespace hmp221::co;
+
+// ----------------------------------------
+// Coroutine frame pool
+// ----------------------------------------
+
+// Frames are rounded up to a multiple of FRAME_CLASS bytes and freed frames
+// are kept on a list per size class. A device simulation keeps allocating the
+// same few frame sizes, so after warm-up no request touches malloc.
+static thread_local std::vector<void *> freeFrames[FRAME_CLASSES];
+
+void *detail::allocateFrame(size_t size)
+{
+    size_t sizeClass = (size + FRAME_CLASS - 1) / FRAME_CLASS;
+    if (sizeClass < FRAME_CLASSES && !freeFrames[sizeClass].empty())
+    {
+        void *frame = freeFrames[sizeClass].back();
+        freeFrames[sizeClass].pop_back();
+        return frame;
+    }
+    return ::operator new(sizeClass * FRAME_CLASS);
+}
+
+void detail::releaseFrame(void *frame, size_t size)
+{
+    size_t sizeClass = (size + FRAME_CLASS - 1) / FRAME_CLASS;
+    if (sizeClass < FRAME_CLASSES)
+    {
+        freeFrames[sizeClass].push_back(frame);
+        return;
+    }
+    ::operator delete(frame);
+}
+
+// Every read completes before its coroutine suspends again, so all
+// connections of a thread can share one receive buffer instead of carrying
+// 64 KiB each.
+static thread_local u8 readBuffer[65536];
+
+/**
+ * @brief Encrypted Hello that starts a long-lived connection
+ *
+ * It is sent ahead of the first request without waiting for the Welcome: the
+ * server answers frames in order, so the Welcome comes first. Connections
+ * opened for a single request skip it and keep the original encoding.
+ */
+static vec helloFrame(u64 capabilities = CLIENT_CAPABILITIES)
+{
+    struct Hello helloStruct = {HMP221_PROTOCOL_VERSION, capabilities};
+    vec serializedHello = hmp221::serialize(helloStruct);
+    for (size_t i = 0; i < serializedHello.size(); i++)
+    {
+        serializedHello[i] ^= KEY;
+    }
+    return serializedHello;
+}
+
+// ----------------------------------------
+// Scheduler
+// ----------------------------------------
+
+Scheduler::Scheduler()
+{
+    this->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epfd < 0)
+    {
+        perror("ERROR creating epoll instance");
+        exit(1);
+    }
+    this->live = 0;
+    this->timerSequence = 0;
+}
+
+Scheduler::~Scheduler()
+{
+    close(this->epfd);
+}
+
+u64 Scheduler::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+Scheduler::Detached Scheduler::runDetached(Task<void> task)
+{
+    try
+    {
+        co_await task;
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "ERROR in spawned task: %s\n", e.what());
+    }
+    this->live--;
+}
+
+void Scheduler::spawn(Task<void> task)
+{
+    this->live++;
+    this->ready.push_back(runDetached(std::move(task)).handle);
+}
+
+void Scheduler::watch(int fd, IoWaiter *waiter)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = waiter;
+    if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        perror("ERROR watching socket");
+        exit(1);
+    }
+}
+
+bool Scheduler::IoAwaiter::await_ready() noexcept
+{
+    bool &flag = this->forWrite ? this->waiter->canWrite : this->waiter->canRead;
+    if (flag)
+    {
+        flag = false;
+        return true;
+    }
+    return false;
+}
+
+void Scheduler::IoAwaiter::await_suspend(std::coroutine_handle<> handle) noexcept
+{
+    if (this->forWrite)
+    {
+        this->waiter->writer = handle;
+    }
+    else
+    {
+        this->waiter->reader = handle;
+    }
+}
+
+void Scheduler::SleepAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    this->scheduler->timers.push({this->deadline, this->scheduler->timerSequence++, handle});
+}
+
+/**
+ * @brief Subroutine to run coroutines until every spawned task has finished
+ */
+void Scheduler::run()
+{
+    struct epoll_event events[MAX_EVENTS];
+    while (this->live > 0)
+    {
+        // Coroutines made ready meanwhile, like one that yields, wait for the
+        // next pass, so that descriptors are polled in between
+        for (size_t pending = this->ready.size(); pending > 0; pending--)
+        {
+            std::coroutine_handle<> handle = this->ready.front();
+            this->ready.pop_front();
+            handle.resume();
+        }
+        if (this->live == 0)
+        {
+            break;
+        }
+
+        int timeout = this->ready.empty() ? -1 : 0;
+        if (timeout != 0 && !this->timers.empty())
+        {
+            u64 current = now();
+            u64 deadline = this->timers.top().deadline;
+            timeout = deadline <= current ? 0 : (int)((deadline - current + 999) / 1000);
+        }
+        int n = epoll_wait(this->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("ERROR waiting for socket events");
+            exit(1);
+        }
+        // Only collect handles here: resuming a coroutine may close a socket
+        // whose waiter is referenced by a later event of the same batch.
+        for (int i = 0; i < n; i++)
+        {
+            IoWaiter *waiter = (IoWaiter *)events[i].data.ptr;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                if (waiter->reader)
+                {
+                    this->ready.push_back(waiter->reader);
+                    waiter->reader = nullptr;
+                }
+                else
+                {
+                    waiter->canRead = true;
+                }
+            }
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            {
+                if (waiter->writer)
+                {
+                    this->ready.push_back(waiter->writer);
+                    waiter->writer = nullptr;
+                }
+                else
+                {
+                    waiter->canWrite = true;
+                }
+            }
+        }
+
+        u64 current = now();
+        while (!this->timers.empty() && this->timers.top().deadline <= current)
+        {
+            this->ready.push_back(this->timers.top().handle);
+            this->timers.pop();
+        }
+    }
+}
+
+// ----------------------------------------
+// Client
+// ----------------------------------------
+
+Client::Client(Scheduler &scheduler, string hostName, int portNo) : scheduler(scheduler)
+{
+    // Resolve the server once instead of on every request
+    struct hostent *server = gethostbyname(hostName.c_str());
+    if (server == NULL)
+    {
+        fprintf(stderr, "ERROR, no such host\n");
+        exit(0);
+    }
+    bzero((char *)&this->serverAddr, sizeof(this->serverAddr));
+    this->serverAddr.sin_family = AF_INET;
+    bcopy((char *)server->h_addr, (char *)&this->serverAddr.sin_addr.s_addr, server->h_length);
+    this->serverAddr.sin_port = htons(portNo);
+}
+
+Client::Client(Scheduler &scheduler, string unixPath) : scheduler(scheduler), unixPath(unixPath)
+{
+    bzero((char *)&this->serverAddr, sizeof(this->serverAddr));
+}
+
+/**
+ * @brief Open a non-blocking connection to the server
+ *
+ * @param waiter readiness state for the new socket, owned by the caller
+ * @param channel channel the connection is for; its owner is connected to if it is known
+ * @return the socket descriptor, or -1 if the connection failed
+ */
+Task<int> Client::connectToServer(IoWaiter *waiter, string channel)
+{
+    struct sockaddr_in *address = &this->serverAddr;
+    auto owner = channel.empty() ? this->owners.end() : this->owners.find(channel);
+    if (owner != this->owners.end())
+    {
+        address = &owner->second;
+    }
+    // A redirect to another node leaves the host, and the Unix domain socket with it
+    bool local = !this->unixPath.empty() && owner == this->owners.end();
+    struct sockaddr_un localAddress;
+    bzero((char *)&localAddress, sizeof(localAddress));
+    localAddress.sun_family = AF_UNIX;
+    strncpy(localAddress.sun_path, this->unixPath.c_str(), sizeof(localAddress.sun_path) - 1);
+    int sockfd = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0)
+    {
+        perror("ERROR opening socket");
+        co_return -1;
+    }
+    this->scheduler.watch(sockfd, waiter);
+    int connected = local ? connect(sockfd, (struct sockaddr *)&localAddress, sizeof(localAddress))
+                          : connect(sockfd, (struct sockaddr *)address, sizeof(*address));
+    // A Unix domain socket refuses to wait for a full accept queue, so the connect is tried again
+    while (local && connected < 0 && errno == EAGAIN)
+    {
+        co_await this->scheduler.sleep(UNIX_CONNECT_RETRY);
+        connected = connect(sockfd, (struct sockaddr *)&localAddress, sizeof(localAddress));
+    }
+    if (connected < 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            perror("ERROR connecting");
+            close(sockfd);
+            co_return -1;
+        }
+        co_await this->scheduler.writable(waiter);
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0)
+        {
+            errno = error;
+            perror("ERROR connecting");
+            close(sockfd);
+            co_return -1;
+        }
+    }
+    co_return sockfd;
+}
+
+/**
+ * @brief Write every byte to the socket, suspending whenever the socket is full
+ *
+ * @return true if all bytes were written
+ */
+Task<bool> Client::writeAll(int fd, IoWaiter *waiter, vec bytes)
+{
+    size_t written = 0;
+    while (written < bytes.size())
+    {
+        // A peer that went away shows up as EPIPE rather than a signal
+        ssize_t n = send(fd, bytes.data() + written, bytes.size() - written, MSG_NOSIGNAL);
+        if (n >= 0)
+        {
+            written += n;
+        }
+        else if (errno == EAGAIN)
+        {
+            co_await this->scheduler.writable(waiter);
+        }
+        else if (errno != EINTR)
+        {
+            perror("ERROR writing to socket");
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+/**
+ * @brief Answer a keepalive Ping of the server, so that it keeps the connection open
+ *
+ * @param pingBytes the decrypted Ping frame
+ */
+Task<bool> Client::answerPing(int fd, IoWaiter *waiter, vec &pingBytes)
+{
+    struct Pong pongStruct = {hmp221::deserialize_ping(pingBytes).id};
+    vec serializedPong = hmp221::serialize(pongStruct);
+    // Encrypt the bytes
+    for (size_t i = 0; i < serializedPong.size(); i++)
+    {
+        serializedPong[i] ^= KEY;
+    }
+    bool sent = co_await writeAll(fd, waiter, std::move(serializedPong));
+    co_return sent;
+}
+
+/**
+ * @brief Remember the cluster node a Redirect names as the owner of its channel
+ *
+ * @param redirectBytes the decrypted Redirect frame
+ * @return false if the node cannot be resolved
+ */
+bool Client::learnOwner(vec &redirectBytes)
+{
+    struct Redirect redirectStruct = hmp221::deserialize_redirect(redirectBytes);
+    size_t colon = redirectStruct.node.rfind(':');
+    struct hostent *host = colon == string::npos ? NULL : gethostbyname(redirectStruct.node.substr(0, colon).c_str());
+    if (host == NULL)
+    {
+        return false;
+    }
+    struct sockaddr_in address;
+    bzero((char *)&address, sizeof(address));
+    address.sin_family = AF_INET;
+    bcopy((char *)host->h_addr, (char *)&address.sin_addr.s_addr, host->h_length);
+    address.sin_port = htons(atoi(redirectStruct.node.c_str() + colon + 1));
+    this->owners[redirectStruct.name] = address;
+    return true;
+}
+
+Task<bool> Client::publish(string channel, vec bytes, u32 ttlMillis)
+{
+    IoWaiter waiter;
+    int sockfd = co_await connectToServer(&waiter, channel);
+    if (sockfd < 0)
+    {
+        co_return false;
+    }
+    struct Message messageStruct = {};
+    messageStruct.channelName = channel;
+    messageStruct.contentBytes = bytes;
+    messageStruct.ttl = ttlMillis;
+    vec serializedMessageStruct = hmp221::serialize(messageStruct);
+    // Encrypt the bytes
+    for (size_t i = 0; i < serializedMessageStruct.size(); i++)
+    {
+        serializedMessageStruct[i] ^= KEY;
+    }
+    bool sent = co_await writeAll(sockfd, &waiter, std::move(serializedMessageStruct));
+    close(sockfd);
+    co_return sent;
+}
+
+/**
+ * @brief Send one request frame on a fresh connection and read back one reply frame
+ *
+ * @param requestBytes the serialized request, not yet encrypted
+ * @param channel channel the request is about, to send it to the channel's owner if it is known
+ * @param capabilities sent in a Hello ahead of the request when not 0
+ * @return the decrypted reply, or an empty vector if the exchange failed
+ */
+Task<vec> Client::roundTrip(vec requestBytes, string channel, u64 capabilities)
+{
+    IoWaiter waiter;
+    int sockfd = co_await connectToServer(&waiter, channel);
+    if (sockfd < 0)
+    {
+        co_return vec();
+    }
+    // Encrypt the bytes
+    for (size_t i = 0; i < requestBytes.size(); i++)
+    {
+        requestBytes[i] ^= KEY;
+    }
+    if (capabilities != 0)
+    {
+        vec serializedHello = helloFrame(capabilities);
+        requestBytes.insert(requestBytes.begin(), serializedHello.begin(), serializedHello.end());
+    }
+    if (!co_await writeAll(sockfd, &waiter, std::move(requestBytes)))
+    {
+        close(sockfd);
+        co_return vec();
+    }
+
+    // Read until a whole frame has arrived
+    vec responseBytes;
+    while (true)
+    {
+        ssize_t n = read(sockfd, readBuffer, sizeof(readBuffer));
+        if (n > 0)
+        {
+            for (ssize_t i = 0; i < n; i++)
+            {
+                responseBytes.push_back(readBuffer[i] ^ KEY);
+            }
+            long length = hmp221::frame_length(responseBytes.data(), responseBytes.size());
+            // A long-poll may be pinged while it waits, and a Hello is
+            // answered first
+            while (length > 0 && (hmp221::frame_type(responseBytes) == "Ping" || hmp221::frame_type(responseBytes) == "Welcome"))
+            {
+                vec pingBytes(responseBytes.begin(), responseBytes.begin() + length);
+                responseBytes.erase(responseBytes.begin(), responseBytes.begin() + length);
+                if (hmp221::frame_type(pingBytes) == "Ping")
+                {
+                    co_await answerPing(sockfd, &waiter, pingBytes);
+                }
+                length = hmp221::frame_length(responseBytes.data(), responseBytes.size());
+            }
+            if (length > 0)
+            {
+                responseBytes.resize(length);
+                break;
+            }
+            if (length < 0)
+            {
+                responseBytes.clear();
+                break;
+            }
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            co_await this->scheduler.readable(&waiter);
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            responseBytes.clear();
+            break;
+        }
+    }
+    close(sockfd);
+    co_return responseBytes;
+}
+
+Task<struct Message> Client::next(string channel, u32 waitMillis)
+{
+    struct Message messageStruct = {};
+    messageStruct.channelName = channel;
+    auto cached = this->lastSeen.find(channel);
+    if (cached != this->lastSeen.end())
+    {
+        messageStruct = cached->second;
+    }
+    struct Subscribe subscribeStruct = {channel, messageStruct.version, waitMillis};
+    bool askedOwner = this->owners.count(channel) != 0;
+    // Holding a version, the new one may come as the delta from it; no other
+    // capability is asked for, so the reply keeps the original encoding
+    u64 capabilities = messageStruct.version != 0 ? HMP221_CAP_DELTA : 0;
+    vec responseBytes = co_await roundTrip(hmp221::serialize(subscribeStruct), channel, capabilities);
+    // A cluster node only holds a long-poll for its own channels
+    if (!askedOwner && !responseBytes.empty() && hmp221::frame_type(responseBytes) == "Redirect" && learnOwner(responseBytes))
+    {
+        responseBytes = co_await roundTrip(hmp221::serialize(subscribeStruct), channel, capabilities);
+    }
+    // A NotModified reply means the cached message is still the latest
+    if (!responseBytes.empty() && hmp221::frame_type(responseBytes) == "Message")
+    {
+        struct Message received = hmp221::deserialize_message(responseBytes);
+        if (received.base != 0 && !hmp221::patch(messageStruct, received))
+        {
+            // The delta is from a version other than the cached one, which
+            // the channel moved past meanwhile: ask for the whole message
+            subscribeStruct.version = 0;
+            vec fullBytes = co_await roundTrip(hmp221::serialize(subscribeStruct), channel);
+            if (fullBytes.empty() || hmp221::frame_type(fullBytes) != "Message")
+            {
+                co_return messageStruct;
+            }
+            received = hmp221::deserialize_message(fullBytes);
+        }
+        messageStruct = received;
+        this->lastSeen[channel] = messageStruct;
+    }
+    co_return messageStruct;
+}
+
+Task<bool> Client::publishBatch(std::vector<struct Message> messages)
+{
+    IoWaiter waiter;
+    int sockfd = co_await connectToServer(&waiter);
+    if (sockfd < 0)
+    {
+        co_return false;
+    }
+    struct MultiMessage batchStruct;
+    batchStruct.messages = std::move(messages);
+    vec serializedBatch = hmp221::serialize(batchStruct);
+    // Encrypt the bytes
+    for (size_t i = 0; i < serializedBatch.size(); i++)
+    {
+        serializedBatch[i] ^= KEY;
+    }
+    bool sent = co_await writeAll(sockfd, &waiter, std::move(serializedBatch));
+    close(sockfd);
+    co_return sent;
+}
+
+Task<std::vector<struct Message>> Client::nextBatch(std::vector<string> channels)
+{
+    struct MultiRequest requestStruct;
+    requestStruct.names = channels;
+    vec responseBytes = co_await roundTrip(hmp221::serialize(requestStruct));
+    struct MultiMessage replyStruct;
+    if (!responseBytes.empty() && hmp221::frame_type(responseBytes) == "MultiMessage")
+    {
+        replyStruct = hmp221::deserialize_multi_message(responseBytes);
+    }
+    // Channels missing from a failed reply fall back to the cached message
+    replyStruct.messages.resize(channels.size());
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        struct Message &messageStruct = replyStruct.messages[i];
+        if (messageStruct.version != 0)
+        {
+            this->lastSeen[channels[i]] = messageStruct;
+            continue;
+        }
+        auto cached = this->lastSeen.find(channels[i]);
+        if (cached != this->lastSeen.end())
+        {
+            messageStruct = cached->second;
+        }
+        else
+        {
+            messageStruct.channelName = channels[i];
+        }
+    }
+    co_return replyStruct.messages;
+}
+
+Task<struct Stats> Client::stats()
+{
+    struct Stats statsStruct;
+    vec responseBytes = co_await roundTrip(hmp221::serialize(statsStruct));
+    if (!responseBytes.empty())
+    {
+        statsStruct = hmp221::deserialize_stats(responseBytes);
+    }
+    co_return statsStruct;
+}
+
+Task<bool> Client::watch(string channel, std::function<bool(const struct Message &)> onMessage, bool conflate)
+{
+    IoWaiter waiter;
+    bool askedOwner = this->owners.count(channel) != 0;
+    int sockfd = co_await connectToServer(&waiter, channel);
+    if (sockfd < 0)
+    {
+        co_return false;
+    }
+    auto cached = this->lastSeen.find(channel);
+    struct Watch watchStruct = {channel, cached != this->lastSeen.end() ? cached->second.version : 0, conflate};
+    vec serializedRequest = hmp221::serialize(watchStruct);
+    // Encrypt the bytes
+    for (size_t i = 0; i < serializedRequest.size(); i++)
+    {
+        serializedRequest[i] ^= KEY;
+    }
+    // Every message after the first is usually a delta from the one before;
+    // the Welcome is skipped like any frame that is not a Message
+    vec serializedHello = helloFrame(HMP221_CAP_DELTA);
+    serializedRequest.insert(serializedRequest.begin(), serializedHello.begin(), serializedHello.end());
+    if (!co_await writeAll(sockfd, &waiter, std::move(serializedRequest)))
+    {
+        close(sockfd);
+        co_return false;
+    }
+
+    // Messages keep arriving on the connection, several may come in one read
+    vec responseBytes;
+    while (true)
+    {
+        ssize_t n = read(sockfd, readBuffer, sizeof(readBuffer));
+        if (n > 0)
+        {
+            for (ssize_t i = 0; i < n; i++)
+            {
+                responseBytes.push_back(readBuffer[i] ^ KEY);
+            }
+            size_t offset = 0;
+            while (true)
+            {
+                long length = hmp221::frame_length(responseBytes.data() + offset, responseBytes.size() - offset);
+                if (length == 0)
+                {
+                    break;
+                }
+                if (length < 0)
+                {
+                    close(sockfd);
+                    co_return false;
+                }
+                vec frameBytes(responseBytes.begin() + offset, responseBytes.begin() + offset + length);
+                offset += length;
+                if (hmp221::frame_type(frameBytes) == "Ping")
+                {
+                    co_await answerPing(sockfd, &waiter, frameBytes);
+                    continue;
+                }
+                // A cluster node only serves watches of its own channels
+                if (hmp221::frame_type(frameBytes) == "Redirect")
+                {
+                    close(sockfd);
+                    if (askedOwner || !learnOwner(frameBytes))
+                    {
+                        co_return false;
+                    }
+                    bool watched = co_await watch(channel, onMessage, conflate);
+                    co_return watched;
+                }
+                if (hmp221::frame_type(frameBytes) != "Message")
+                {
+                    continue;
+                }
+                struct Message messageStruct = hmp221::deserialize_message(frameBytes);
+                if (messageStruct.base != 0)
+                {
+                    auto previous = this->lastSeen.find(channel);
+                    bool patched = previous != this->lastSeen.end() && hmp221::patch(previous->second, messageStruct);
+                    if (!patched)
+                    {
+                        // A message was missed, the delta is not from the
+                        // held one: fetch the whole message instead
+                        this->lastSeen.erase(channel);
+                        messageStruct = co_await next(channel);
+                        if (messageStruct.version == 0)
+                        {
+                            continue;
+                        }
+                    }
+                }
+                this->lastSeen[channel] = messageStruct;
+                if (!onMessage(messageStruct))
+                {
+                    close(sockfd);
+                    co_return true;
+                }
+            }
+            responseBytes.erase(responseBytes.begin(), responseBytes.begin() + offset);
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            co_await this->scheduler.readable(&waiter);
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            break;
+        }
+    }
+    close(sockfd);
+    co_return false;
+}
+
+/**
+ * @brief Write every byte to a file, which blocks rather than suspends
+ *
+ * @return true if all bytes were written
+ */
+static bool writeToFile(int fd, const u8 *bytes, size_t length)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t n = write(fd, bytes + written, length - written);
+        if (n > 0)
+        {
+            written += n;
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            perror("ERROR writing to file");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Read from a long-lived connection until a whole frame has arrived, answering Pings on the way
+ *
+ * @param buffered decrypted bytes read past the previous frame, kept for the next one
+ * @return the decrypted frame, empty if the connection ended or failed
+ */
+Task<vec> Client::readFrame(int fd, IoWaiter *waiter, vec &buffered)
+{
+    while (true)
+    {
+        long length = hmp221::frame_length(buffered.data(), buffered.size());
+        if (length < 0)
+        {
+            co_return vec();
+        }
+        if (length > 0)
+        {
+            vec frameBytes(buffered.begin(), buffered.begin() + length);
+            buffered.erase(buffered.begin(), buffered.begin() + length);
+            if (hmp221::frame_type(frameBytes) != "Ping")
+            {
+                co_return frameBytes;
+            }
+            co_await answerPing(fd, waiter, frameBytes);
+            continue;
+        }
+        ssize_t n = read(fd, readBuffer, sizeof(readBuffer));
+        if (n > 0)
+        {
+            size_t end = buffered.size();
+            buffered.resize(end + n);
+            for (ssize_t i = 0; i < n; i++)
+            {
+                buffered[end + i] = readBuffer[i] ^ KEY;
+            }
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            co_await this->scheduler.readable(waiter);
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            co_return vec();
+        }
+    }
+}
+
+Task<bool> Client::publishStream(string channel, int fd, u64 size)
+{
+    IoWaiter waiter;
+    int sockfd = co_await connectToServer(&waiter, channel);
+    if (sockfd < 0)
+    {
+        co_return false;
+    }
+    // The pieces only go out once the server has granted streaming
+    vec buffered;
+    bool greeted = co_await writeAll(sockfd, &waiter, helloFrame(STREAM_CAPABILITIES));
+    vec welcomeBytes;
+    if (greeted)
+    {
+        welcomeBytes = co_await readFrame(sockfd, &waiter, buffered);
+    }
+    if (welcomeBytes.empty() || hmp221::frame_type(welcomeBytes) != "Welcome" ||
+        (hmp221::deserialize_welcome(welcomeBytes).capabilities & HMP221_CAP_STREAM) == 0)
+    {
+        fprintf(stderr, "ERROR, the server does not take streamed messages\n");
+        close(sockfd);
+        co_return false;
+    }
+    struct Chunk chunkStruct = {channel, 0, size, 0, vec()};
+    bool sent = true;
+    do
+    {
+        size_t length = size - chunkStruct.offset < HMP221_CHUNK_SIZE ? size - chunkStruct.offset : HMP221_CHUNK_SIZE;
+        chunkStruct.bytes.resize(length);
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t n = pread(fd, chunkStruct.bytes.data() + done, length - done, chunkStruct.offset + done);
+            if (n > 0)
+            {
+                done += n;
+            }
+            else if (n == 0 || errno != EINTR)
+            {
+                perror("ERROR reading file");
+                close(sockfd);
+                co_return false;
+            }
+        }
+        vec serializedChunk = hmp221::serialize_compact(chunkStruct);
+        // Encrypt the bytes
+        for (size_t i = 0; i < serializedChunk.size(); i++)
+        {
+            serializedChunk[i] ^= KEY;
+        }
+        sent = co_await writeAll(sockfd, &waiter, std::move(serializedChunk));
+        chunkStruct.offset += length;
+    } while (sent && chunkStruct.offset < size);
+    if (!sent)
+    {
+        close(sockfd);
+        co_return false;
+    }
+    // The server closes its side once it has read everything, so the
+    // message is stored when the connection ends without a reply
+    shutdown(sockfd, SHUT_WR);
+    vec replyBytes = co_await readFrame(sockfd, &waiter, buffered);
+    close(sockfd);
+    co_return replyBytes.empty();
+}
+
+Task<i64> Client::fetchStream(string channel, int fd)
+{
+    IoWaiter waiter;
+    bool askedOwner = this->owners.count(channel) != 0;
+    int sockfd = co_await connectToServer(&waiter, channel);
+    if (sockfd < 0)
+    {
+        co_return -1;
+    }
+    // The request keeps the original encoding, since it goes out before the Welcome
+    struct Request requestStruct = {channel};
+    vec serializedRequest = hmp221::serialize(requestStruct);
+    for (size_t i = 0; i < serializedRequest.size(); i++)
+    {
+        serializedRequest[i] ^= KEY;
+    }
+    vec serializedHello = helloFrame(STREAM_CAPABILITIES);
+    serializedHello.insert(serializedHello.end(), serializedRequest.begin(), serializedRequest.end());
+    bool sent = co_await writeAll(sockfd, &waiter, std::move(serializedHello));
+    vec buffered;
+    vec welcomeBytes;
+    if (sent)
+    {
+        welcomeBytes = co_await readFrame(sockfd, &waiter, buffered);
+    }
+    if (welcomeBytes.empty() || hmp221::frame_type(welcomeBytes) != "Welcome")
+    {
+        close(sockfd);
+        co_return -1;
+    }
+
+    // A message that fits in a frame comes whole, a larger one in Chunk frames
+    i64 written = 0;
+    while (true)
+    {
+        vec frameBytes = co_await readFrame(sockfd, &waiter, buffered);
+        if (frameBytes.empty())
+        {
+            // A channel without message ends the connection with no reply
+            close(sockfd);
+            co_return written == 0 ? 0 : -1;
+        }
+        string frameType = hmp221::frame_type(frameBytes);
+        if (frameType == "Redirect")
+        {
+            close(sockfd);
+            if (written != 0 || askedOwner || !learnOwner(frameBytes))
+            {
+                co_return -1;
+            }
+            i64 fetched = co_await fetchStream(channel, fd);
+            co_return fetched;
+        }
+        if (frameType == "Message" && written == 0)
+        {
+            struct Message messageStruct = hmp221::deserialize_message(frameBytes);
+            close(sockfd);
+            if (messageStruct.compressed && !hmp221::decompress(messageStruct))
+            {
+                co_return -1;
+            }
+            if (!writeToFile(fd, messageStruct.contentBytes.data(), messageStruct.contentBytes.size()))
+            {
+                co_return -1;
+            }
+            co_return messageStruct.contentBytes.size();
+        }
+        if (frameType != "Chunk")
+        {
+            close(sockfd);
+            co_return -1;
+        }
+        struct Chunk chunkStruct = hmp221::deserialize_chunk(frameBytes);
+        if (chunkStruct.offset != (u64)written || !writeToFile(fd, chunkStruct.bytes.data(), chunkStruct.bytes.size()))
+        {
+            close(sockfd);
+            co_return -1;
+        }
+        written += chunkStruct.bytes.size();
+        if ((u64)written == chunkStruct.total)
+        {
+            close(sockfd);
+            co_return written;
+        }
+    }
+}
+
+// ----------------------------------------
+// Publisher
+// ----------------------------------------
+
+Publisher::Publisher(Client &client, size_t window) : client(client), window(window > 0 ? window : 1), sockfd(-1), nextId(1), granted(0)
+{
+}
+
+Publisher::~Publisher()
+{
+    if (this->sockfd >= 0)
+    {
+        close(this->sockfd);
+    }
+}
+
+Task<bool> Publisher::publish(string channel, vec bytes)
+{
+    while (this->unacked.size() >= this->window)
+    {
+        // Awaited as statements of their own: GCC mishandles co_await inside &&
+        bool received = co_await receiveAcks();
+        if (!received)
+        {
+            bool reconnected = co_await reconnect();
+            if (!reconnected)
+            {
+                co_return false;
+            }
+        }
+    }
+
+    u32 id = this->nextId++;
+    if (this->nextId == 0)
+    {
+        this->nextId = 1; // 0 means a publish without an Ack
+    }
+    struct Message messageStruct = {};
+    messageStruct.channelName = channel;
+    messageStruct.contentBytes = std::move(bytes);
+    messageStruct.id = id;
+    // Publishes pipelined before the Welcome arrives use the original encoding, uncompressed
+    if ((this->granted & HMP221_CAP_COMPRESS) != 0)
+    {
+        hmp221::compress(messageStruct);
+    }
+    vec serializedMessageStruct = (this->granted & HMP221_CAP_COMPACT) != 0 ? hmp221::serialize_compact(messageStruct) : hmp221::serialize(messageStruct);
+    // Encrypt the bytes
+    for (size_t i = 0; i < serializedMessageStruct.size(); i++)
+    {
+        serializedMessageStruct[i] ^= KEY;
+    }
+    this->unacked.emplace_back(id, serializedMessageStruct);
+
+    // A failed write leaves the message in flight; reconnecting sends it again
+    bool sent = false;
+    if (this->sockfd >= 0)
+    {
+        sent = co_await this->client.writeAll(this->sockfd, &this->waiter, std::move(serializedMessageStruct));
+    }
+    if (sent)
+    {
+        co_return true;
+    }
+    bool reconnected = co_await reconnect();
+    co_return reconnected;
+}
+
+Task<bool> Publisher::flush()
+{
+    while (!this->unacked.empty())
+    {
+        // Awaited as statements of their own: GCC mishandles co_await inside &&
+        bool received = co_await receiveAcks();
+        if (!received)
+        {
+            bool reconnected = co_await reconnect();
+            if (!reconnected)
+            {
+                co_return false;
+            }
+        }
+    }
+    co_return true;
+}
+
+/**
+ * @brief Read what the server sent and drop every message it acknowledged
+ *
+ * @return false if the connection is gone
+ */
+Task<bool> Publisher::receiveAcks()
+{
+    while (this->sockfd >= 0)
+    {
+        ssize_t n = read(this->sockfd, readBuffer, sizeof(readBuffer));
+        if (n > 0)
+        {
+            for (ssize_t i = 0; i < n; i++)
+            {
+                this->inbound.push_back(readBuffer[i] ^ KEY);
+            }
+            size_t offset = 0;
+            while (true)
+            {
+                long length = hmp221::frame_length(this->inbound.data() + offset, this->inbound.size() - offset);
+                if (length <= 0)
+                {
+                    break;
+                }
+                vec frameBytes(this->inbound.begin() + offset, this->inbound.begin() + offset + length);
+                offset += length;
+                if (hmp221::frame_type(frameBytes) == "Ping")
+                {
+                    co_await this->client.answerPing(this->sockfd, &this->waiter, frameBytes);
+                    continue;
+                }
+                if (hmp221::frame_type(frameBytes) == "Welcome")
+                {
+                    this->granted = hmp221::deserialize_welcome(frameBytes).capabilities;
+                    continue;
+                }
+                if (hmp221::frame_type(frameBytes) != "Ack")
+                {
+                    continue;
+                }
+                // Ids are compared as serial numbers so that they may wrap around
+                u32 acked = hmp221::deserialize_ack(frameBytes).id;
+                while (!this->unacked.empty() && (int32_t)(acked - this->unacked.front().first) >= 0)
+                {
+                    this->unacked.pop_front();
+                }
+            }
+            this->inbound.erase(this->inbound.begin(), this->inbound.begin() + offset);
+            co_return true;
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            co_await this->client.scheduler.readable(&this->waiter);
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            break;
+        }
+    }
+    co_return false;
+}
+
+/**
+ * @brief Open a new connection and send every message in flight again, in order
+ *
+ * @return false if the server could not be reached after PUBLISH_RETRIES attempts
+ */
+Task<bool> Publisher::reconnect()
+{
+    if (this->sockfd >= 0)
+    {
+        close(this->sockfd);
+        this->sockfd = -1;
+    }
+    this->inbound.clear();
+    u64 backoff = PUBLISH_BACKOFF;
+    for (int attempt = 0; attempt < PUBLISH_RETRIES; attempt++)
+    {
+        if (attempt > 0)
+        {
+            co_await this->client.scheduler.sleep(backoff);
+            backoff *= 2;
+        }
+        this->waiter = IoWaiter();
+        int fd = co_await this->client.connectToServer(&this->waiter);
+        if (fd < 0)
+        {
+            continue;
+        }
+        this->granted = 0;
+        vec pending = helloFrame();
+        for (size_t i = 0; i < this->unacked.size(); i++)
+        {
+            pending.insert(pending.end(), this->unacked[i].second.begin(), this->unacked[i].second.end());
+        }
+        if (co_await this->client.writeAll(fd, &this->waiter, std::move(pending)))
+        {
+            this->sockfd = fd;
+            co_return true;
+        }
+        close(fd);
+    }
+    co_return false;
+}
+
+// ----------------------------------------
+// LocalSession
+// ----------------------------------------
+
+LocalSession::LocalSession(Client &client, size_t capacity) : client(client), capacity(capacity)
+{
+    this->sockfd = -1;
+    this->granted = 0;
+    this->memory = MAP_FAILED;
+    this->serverDoorbell = -1;
+    this->doorbell = -1;
+}
+
+LocalSession::~LocalSession()
+{
+    if (this->sockfd >= 0)
+    {
+        close(this->sockfd);
+    }
+    if (this->memory != MAP_FAILED)
+    {
+        munmap(this->memory, 2 * (SHM_RING_HEADER + this->capacity));
+    }
+    if (this->serverDoorbell >= 0)
+    {
+        close(this->serverDoorbell);
+    }
+    if (this->doorbell >= 0)
+    {
+        close(this->doorbell);
+    }
+}
+
+/**
+ * @brief Connect to the server's Unix domain socket and attach the rings
+ *
+ * The memory file and both eventfds travel with the Attach request as
+ * SCM_RIGHTS. The server answers with an Attach on the socket, which carries
+ * nothing else afterwards; it is only watched to notice the server going away.
+ *
+ * @return false if the server could not be reached or refused the rings
+ */
+Task<bool> LocalSession::open()
+{
+    if (this->client.unixPath.empty())
+    {
+        fprintf(stderr, "ERROR, shared-memory rings need the server's unix socket\n");
+        co_return false;
+    }
+    this->sockfd = co_await this->client.connectToServer(&this->waiter);
+    if (this->sockfd < 0)
+    {
+        co_return false;
+    }
+    size_t size = 2 * (SHM_RING_HEADER + this->capacity);
+    int memoryFd = memfd_create("hmp221-rings", MFD_CLOEXEC);
+    if (memoryFd < 0 || ftruncate(memoryFd, size) < 0)
+    {
+        perror("ERROR creating shared memory");
+        co_return false;
+    }
+    this->memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0);
+    this->serverDoorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    this->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->memory == MAP_FAILED || this->serverDoorbell < 0 || this->doorbell < 0)
+    {
+        perror("ERROR setting up rings");
+        close(memoryFd);
+        co_return false;
+    }
+    this->requests.attach(this->memory, this->capacity);
+    this->replies.attach((u8 *)this->memory + SHM_RING_HEADER + this->capacity, this->capacity);
+    this->requests.reset();
+    this->replies.reset();
+
+    struct Attach attachStruct = {this->capacity};
+    vec serializedAttach = hmp221::serialize(attachStruct);
+    // Encrypt the bytes
+    for (size_t i = 0; i < serializedAttach.size(); i++)
+    {
+        serializedAttach[i] ^= KEY;
+    }
+    int fds[3] = {memoryFd, this->serverDoorbell, this->doorbell};
+    struct iovec iov = {serializedAttach.data(), serializedAttach.size()};
+    char control[CMSG_SPACE(sizeof(fds))];
+    bzero(control, sizeof(control));
+    struct msghdr message;
+    bzero(&message, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    // The socket is new and the frame small, so it goes out whole
+    ssize_t sent = sendmsg(this->sockfd, &message, MSG_NOSIGNAL);
+    close(memoryFd);
+    if (sent != (ssize_t)serializedAttach.size())
+    {
+        perror("ERROR attaching rings");
+        co_return false;
+    }
+
+    vec responseBytes;
+    while (true)
+    {
+        ssize_t n = read(this->sockfd, readBuffer, sizeof(readBuffer));
+        if (n > 0)
+        {
+            for (ssize_t i = 0; i < n; i++)
+            {
+                responseBytes.push_back(readBuffer[i] ^ KEY);
+            }
+            long length = hmp221::frame_length(responseBytes.data(), responseBytes.size());
+            if (length != 0)
+            {
+                break;
+            }
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            co_await this->client.scheduler.readable(&this->waiter);
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            break;
+        }
+    }
+    if (responseBytes.empty() || hmp221::frame_type(responseBytes) != "Attach")
+    {
+        fprintf(stderr, "ERROR, the server refused the rings\n");
+        co_return false;
+    }
+    // Either descriptor resumes whoever waits on the session
+    this->client.scheduler.watch(this->doorbell, &this->waiter);
+
+    // The Hello is the first frame through the rings
+    bool greeted = co_await send(helloFrame());
+    if (!greeted)
+    {
+        co_return false;
+    }
+    vec welcomeBytes = co_await receive();
+    if (welcomeBytes.empty() || hmp221::frame_type(welcomeBytes) != "Welcome")
+    {
+        fprintf(stderr, "ERROR, the server did not answer the Hello\n");
+        co_return false;
+    }
+    this->granted = hmp221::deserialize_welcome(welcomeBytes).capabilities;
+    co_return true;
+}
+
+/**
+ * @brief Sleep until the server rings the doorbell
+ *
+ * The caller has announced beforehand, in the ring, that it is about to sleep.
+ *
+ * @return false if the server closed the connection
+ */
+Task<bool> LocalSession::wait()
+{
+    char probe;
+    ssize_t n = recv(this->sockfd, &probe, 1, MSG_DONTWAIT | MSG_PEEK);
+    if (n == 0 || (n < 0 && errno != EAGAIN))
+    {
+        co_return false;
+    }
+    co_await this->client.scheduler.readable(&this->waiter);
+    co_return true;
+}
+
+/**
+ * @brief Copy encrypted frames into the requests ring, waiting while it is full
+ *
+ * @return false if the server went away
+ */
+Task<bool> LocalSession::send(vec bytes)
+{
+    size_t written = 0;
+    while (written < bytes.size())
+    {
+        ssize_t n = this->requests.write(bytes.data() + written, bytes.size() - written);
+        if (n < 0)
+        {
+            co_return false;
+        }
+        if (n > 0)
+        {
+            written += n;
+            if (this->requests.wakeConsumer())
+            {
+                u64 one = 1;
+                write(this->serverDoorbell, &one, sizeof(one));
+            }
+            continue;
+        }
+        // Drained before announcing the wait, so that the server's signal is not lost
+        u64 rung;
+        read(this->doorbell, &rung, sizeof(rung));
+        if (!this->requests.waitForRoom())
+        {
+            continue;
+        }
+        bool woken = co_await wait();
+        if (!woken)
+        {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+/**
+ * @brief Read the replies ring until a whole frame has arrived, answering Pings on the way
+ *
+ * @return the decrypted frame, empty if the server went away
+ */
+Task<vec> LocalSession::receive()
+{
+    while (true)
+    {
+        long length = hmp221::frame_length(this->inbound.data(), this->inbound.size());
+        if (length < 0)
+        {
+            co_return vec();
+        }
+        if (length > 0)
+        {
+            vec frameBytes(this->inbound.begin(), this->inbound.begin() + length);
+            this->inbound.erase(this->inbound.begin(), this->inbound.begin() + length);
+            if (hmp221::frame_type(frameBytes) != "Ping")
+            {
+                co_return frameBytes;
+            }
+            struct Pong pongStruct = {hmp221::deserialize_ping(frameBytes).id};
+            vec serializedPong = hmp221::serialize(pongStruct);
+            for (size_t i = 0; i < serializedPong.size(); i++)
+            {
+                serializedPong[i] ^= KEY;
+            }
+            bool sent = co_await send(std::move(serializedPong));
+            if (!sent)
+            {
+                co_return vec();
+            }
+            continue;
+        }
+
+        ssize_t n = this->replies.read(readBuffer, sizeof(readBuffer));
+        if (n < 0)
+        {
+            co_return vec();
+        }
+        if (n > 0)
+        {
+            if (this->replies.wakeProducer())
+            {
+                u64 one = 1;
+                write(this->serverDoorbell, &one, sizeof(one));
+            }
+            for (ssize_t i = 0; i < n; i++)
+            {
+                this->inbound.push_back(readBuffer[i] ^ KEY);
+            }
+            continue;
+        }
+        u64 rung;
+        read(this->doorbell, &rung, sizeof(rung));
+        if (!this->replies.sleep())
+        {
+            continue;
+        }
+        bool woken = co_await wait();
+        if (!woken)
+        {
+            co_return vec();
+        }
+    }
+}
+
+Task<bool> LocalSession::publish(string channel, vec bytes)
+{
+    struct Message messageStruct = {};
+    messageStruct.channelName = channel;
+    messageStruct.contentBytes = std::move(bytes);
+    if ((this->granted & HMP221_CAP_COMPRESS) != 0)
+    {
+        hmp221::compress(messageStruct);
+    }
+    vec serializedMessageStruct = (this->granted & HMP221_CAP_COMPACT) != 0 ? hmp221::serialize_compact(messageStruct) : hmp221::serialize(messageStruct);
+    // Encrypt the bytes
+    for (size_t i = 0; i < serializedMessageStruct.size(); i++)
+    {
+        serializedMessageStruct[i] ^= KEY;
+    }
+    bool sent = co_await send(std::move(serializedMessageStruct));
+    co_return sent;
+}
+
+Task<struct Message> LocalSession::next(string channel)
+{
+    // Asked as a batch of one, which is answered even when the channel has no message
+    struct MultiRequest requestStruct;
+    requestStruct.names.push_back(channel);
+    vec serializedRequest = (this->granted & HMP221_CAP_COMPACT) != 0 ? hmp221::serialize_compact(requestStruct) : hmp221::serialize(requestStruct);
+    for (size_t i = 0; i < serializedRequest.size(); i++)
+    {
+        serializedRequest[i] ^= KEY;
+    }
+    struct Message messageStruct = {};
+    messageStruct.channelName = channel;
+    bool sent = co_await send(std::move(serializedRequest));
+    if (!sent)
+    {
+        co_return messageStruct;
+    }
+    vec responseBytes = co_await receive();
+    if (!responseBytes.empty() && hmp221::frame_type(responseBytes) == "MultiMessage")
+    {
+        struct MultiMessage replyStruct = hmp221::deserialize_multi_message(responseBytes);
+        if (!replyStruct.messages.empty() && replyStruct.messages[0].version != 0)
+        {
+            messageStruct = replyStruct.messages[0];
+        }
+    }
+    co_return messageStruct;
+}
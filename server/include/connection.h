@@ -0,0 +1,229 @@
+#include <vector>
+#include <deque>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "hmp221.hpp"
+#include "ratelimit.h"
+#include "shmring.h"
+#include "timerwheel.h"
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+using namespace std;
+
+// Another server this one keeps a link to, defined by the server
+struct ClusterNode;
+
+// Reply to a request forwarded to the cluster node that owns its channel. It
+// holds the request's place in the outbound queue of the connection that
+// asked, so replies still leave in the order of the requests although the
+// owner answers later.
+struct PendingReply
+{
+  // The connection that asked
+  int fd;
+  unsigned long connectionId;
+
+  // Whether bytes is the encrypted reply; empty bytes send nothing.
+  // closeAfter closes the connection once the reply is written, like a
+  // subscribe of a channel without message, or a request the node never
+  // answered.
+  bool ready;
+  vector<unsigned char> bytes;
+  bool closeAfter;
+
+  // A batch subscribe spanning several nodes is answered part by part into
+  // batch; parts is how many are still to come. single marks a plain
+  // subscribe, which is asked as a batch of one so that it always gets a reply.
+  // For an Ack, parts counts the forwarded publishes the owners have not
+  // acknowledged yet, and bytes already holds the Ack.
+  struct MultiMessage batch;
+  size_t parts;
+  bool single;
+
+  // Capabilities of the connection that asked, which the reply is encoded for
+  u64 capabilities;
+};
+
+// A request sent on a cluster link and waiting for the owner's reply. The
+// owner answers a connection's requests in order, so replies are matched
+// first in, first out.
+struct ForwardedRequest
+{
+  shared_ptr<PendingReply> reply;
+
+  // Where the messages of a batch reply go in reply->batch; empty when the
+  // reply is relayed as it is
+  vector<size_t> slots;
+};
+
+// Shared memory a local client attached to its connection. Frames travel
+// through the rings instead of the socket, which then only tells the server
+// when the client goes away.
+struct LocalRings
+{
+  void *memory;
+  size_t size;
+  ShmRing requests; // written by the client
+  ShmRing replies;  // written by the server
+  int doorbell;     // eventfd the client signals, watched by the event loop
+  int clientDoorbell; // eventfd the server signals
+};
+
+// File holding the payload of a message streamed in Chunk frames, encrypted
+// as it goes out on the wire. It has no name, and it is closed once the last
+// connection writing from it and the store are done with it.
+struct SpoolFile
+{
+  int fd;
+  u64 size;
+
+  SpoolFile(int fd, u64 size) : fd(fd), size(size) {}
+  ~SpoolFile() { close(this->fd); }
+};
+
+// An encrypted frame waiting to be written. The bytes of a published message
+// are shared by every connection it is pushed to, so queueing it on one more
+// connection costs a reference count rather than a copy.
+struct OutboundFrame
+{
+  shared_ptr<const vector<unsigned char>> bytes;
+
+  // Channel of a pushed message, which a slow consumer may lose; empty for
+  // replies to the connection's own requests, which are never dropped
+  string channel;
+
+  // Set instead of bytes for the reply of a forwarded request; writing stops
+  // at it until the reply is ready
+  shared_ptr<PendingReply> pending;
+
+  // Set instead of bytes for the payload of a Chunk frame, written from
+  // fileLength bytes of the file at fileOffset
+  shared_ptr<SpoolFile> file;
+  u64 fileOffset;
+  u64 fileLength;
+};
+
+// A client connection served by the event loop, or a link to another node
+// of the cluster or to the primary of a replica. Frames may arrive split
+// across reads and replies may not fit the socket at once, so both
+// directions are buffered here between readiness events.
+struct Connection
+{
+  int fd;
+
+  // Unique for the lifetime of the server, unlike fd numbers which are reused
+  unsigned long id;
+
+  // "ip:port" of the client, for messages
+  string peer;
+
+  // Whether the client came in on the Unix domain socket, descriptors it
+  // passed that no Attach has taken yet, and the rings it attached, NULL
+  // while it uses the socket
+  bool local;
+  vector<int> passedFds;
+  LocalRings *rings;
+
+  // Protocol version and capabilities agreed with the client's Hello, both 0
+  // when it sent none. The first frame settles them for the rest of the
+  // connection, so a device that never heard of Hello keeps the original
+  // encoding and no frame has to be inspected for which one it uses.
+  u64 protocolVersion;
+  u64 capabilities;
+  bool protocolSettled;
+
+  // Decrypted bytes of a frame that has not fully arrived yet
+  vector<unsigned char> inbound;
+
+  // Message the client is publishing in Chunk frames, written to upload as
+  // the pieces arrive; NULL when there is none
+  shared_ptr<SpoolFile> upload;
+  string uploadChannel;
+  u64 uploadReceived;
+
+  // Frames waiting for the socket to accept them, bounded by the server's
+  // queue limit. outboundOffset bytes of the front frame are already written.
+  deque<OutboundFrame> outbound;
+  size_t outboundOffset;
+
+  // Latest undelivered message of each channel watched in conflated mode, in
+  // the order the channels first got one. A newer message replaces the
+  // pending one in place, so there is at most one per channel however fast
+  // the channel is published to. They move to outbound once it is empty.
+  unordered_map<string, shared_ptr<const vector<unsigned char>>> latest;
+  deque<string> latestOrder;
+
+  // Whether EPOLLOUT is currently registered for the socket
+  bool wantsWrite;
+
+  // Whether the server's io_uring reads and writes the socket instead of
+  // epoll telling when it is ready. A multishot receive is armed on it while
+  // receiving, and pollingWritable while a file frame waits for room.
+  // Sends of the first framesInFlight frames of outbound are submitted, in
+  // writesInFlight linked writes; those frames stay until the writes complete.
+  bool onUring;
+  bool receiving;
+  bool pollingWritable;
+  int writesInFlight;
+  size_t framesInFlight;
+
+  // Whether large frames go out with MSG_ZEROCOPY. The kernel then reads
+  // them from memory while it sends, so every such send keeps the frames it
+  // took, under its number, until the error queue reports it complete.
+  bool zerocopy;
+  unsigned int zerocopySends;
+  deque<pair<unsigned int, vector<shared_ptr<const vector<unsigned char>>>>> zerocopyHeld;
+
+  // Close the connection as soon as outbound is flushed
+  bool closeAfterFlush;
+
+  // The connection cannot go on: its queue overflowed under the disconnect
+  // policy, or the cluster node a request of it needs is unreachable. It is
+  // closed at the next safe point.
+  bool broken;
+
+  // Tokens of the channels this connection watches
+  vector<unsigned long> watches;
+
+  // Packet id of the last acknowledged publish stored since the last Ack, 0
+  // when there is none. One cumulative Ack is sent per read, however many
+  // publishes the read held.
+  unsigned int pendingAck;
+
+  // Rate limits of this connection and of its source address. A frame that
+  // finds a bucket empty stays in inbound and the socket is not read until
+  // throttledUntil (milliseconds, 0 when not throttled).
+  TokenBucket requestBucket;
+  TokenBucket byteBucket;
+  SourceState *source;
+  in_addr_t sourceAddress;
+  unsigned long throttledUntil;
+  TimerNode throttleTimer;
+
+  // When the client last sent anything, in milliseconds. The idle timer
+  // fires when the connection may have been quiet for long enough, and a
+  // Ping is sent once per quiet spell before the connection is closed.
+  unsigned long lastActivity;
+  bool pingSent;
+  TimerNode idleTimer;
+
+  // The server a link connects to, NULL for a client. A link carries
+  // forwarded requests out and their replies back, pipelined: it does not
+  // wait for a reply before sending the next request.
+  ClusterNode *clusterNode;
+  deque<ForwardedRequest> forwarded;
+
+  // Acknowledged publishes sent on a link, by the packet id the link gave
+  // them, and the Ack of the client connection each one holds back
+  deque<pair<unsigned int, shared_ptr<PendingReply>>> unacked;
+  unsigned int nextPacketId;
+
+  // Ack of a client's read that published to other nodes, waiting for them
+  shared_ptr<PendingReply> ackReply;
+};
+
+#endif
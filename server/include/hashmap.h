@@ -1,6 +1,12 @@
 #include <linkedlist.h>
 #include <functional>
+#include <algorithm>
 #include <iostream>
+#include <time.h>
+#include "hmp221.hpp"
+
+// Smallest message worth a delta from the one it replaces
+#define DELTA_THRESHOLD 256
 
 using namespace std;
 
@@ -13,6 +19,46 @@ private:
   // The number of buckets in the array
   size_t size;
 
+  // The number of buckets holding at least one item, kept up to date so the
+  // load factor is known without scanning the array on every insert
+  size_t usedBuckets;
+
+  // The number of channels and the bytes of their names, messages and deltas,
+  // kept up to date on every insert and replace for the metrics
+  size_t items;
+  size_t storedBytes;
+
+  // The number of messages dropped because their time to live ran out
+  size_t expiredCount;
+
+  // Highest version an unlinked entry had. A channel that comes back counts
+  // on from there, so a client holding a version of the old entry never
+  // takes a new message for it.
+  unsigned long retiredVersion;
+
+  // Drop the message of an entry if it has expired, so lookups never see a
+  // stale one. Returns the entry, or NULL if it went with its message.
+  linkedlist::Node *expireIfDue(linkedlist::Node *node);
+
+  // Forget the delta of an entry, whose message is replaced or dropped
+  void clearDelta(linkedlist::Node *node);
+
+  static unsigned long nowMillis();
+
+  // Append a new item to the bucket list it hashes to, growing the array if needed
+  linkedlist::Node *insert(linkedlist::LinkedList *list, string channel, vector<unsigned char> &messageBytes, unsigned long version);
+
+  // Find a channel's entry, creating one with version 0 and no message if nobody published on it yet
+  linkedlist::Node *findOrPlaceholder(string channel);
+
+  // Unlink and free an entry, which must not be used afterwards
+  void unlink(linkedlist::Node *node);
+
+  // Unlink an entry without a message once no waiter or watcher holds it,
+  // so channels that never get a message or lost it do not grow the map.
+  // Returns whether it was unlinked.
+  bool removeIfUnused(linkedlist::Node *node);
+
   // Generate a prehash for an item with a given size
   unsigned long prehash(string channel);
 
@@ -44,10 +90,71 @@ public:
   // Returns the number of items the hash set can hold before reallocating
   size_t capacity();
 
+  // Returns an estimate of the heap memory held by the hash set, in bytes
+  size_t memoryUsage();
+
   // Print Table. You can do this in a way that helps you implement your hash set.
   void print();
 
   vector<unsigned char> get(string channel);
+
+  // Latest message of a channel together with its version (0 if the channel has no message)
+  vector<unsigned char> get(string channel, unsigned long *version);
+
+  // The same, and whether the message is stored compressed
+  vector<unsigned char> get(string channel, unsigned long *version, bool *compressed);
+
+  // Version of the latest message of a channel, 0 if nothing was published on it
+  unsigned long version(string channel);
+
+  // Delta from the message a channel held before its latest one, and that
+  // message's version in base; empty when there is none or it is no shorter
+  // than the latest message
+  vector<unsigned char> delta(string channel, unsigned long *base);
+
+  // Store a message and hand back the tokens of the waiters parked on that channel,
+  // followed by those of its watchers. The channel is looked up once whether it
+  // is replaced or inserted.
+  // With expiresAt (monotonic milliseconds), the message is dropped at that time.
+  // A replica passes the version its primary gave the message instead of
+  // counting its own, so versions mean the same on every node.
+  // A compressed message is kept as it is, for lookups to hand out unchanged.
+  // A message of at least DELTA_THRESHOLD bytes that replaces another also
+  // gets a delta from it, kept while it is the latest.
+  bool put(string channel, vector<unsigned char> messageBytes, vector<unsigned long> *woken, unsigned long expiresAt = 0,
+           unsigned long version = 0, bool compressed = false);
+
+  // Call visit with every channel holding a message, its version, when it
+  // expires (0 for never) and whether it is compressed. Expired messages are
+  // dropped on the way, so they are not visited.
+  void forEach(function<void(const string &, const vector<unsigned char> &, unsigned long, unsigned long, bool)> visit);
+
+  // Drop the message of a channel if its time to live has run out. The entry
+  // goes too, unless long-polls or watches hold it; it then stays with a new
+  // version and no message. Either way a subscriber holding the old version
+  // learns that the message is gone. Returns whether a message was dropped.
+  bool expire(string channel);
+
+  // Drop the message of a channel now, like an expiry does, e.g. because the
+  // primary of a replica no longer has it. Returns whether there was one.
+  bool drop(string channel);
+
+  // Returns the number of messages dropped because they expired
+  size_t expired();
+
+  // Park a waiter on a channel until the next put on it. A channel nobody
+  // published on yet is created with version 0 to hold the waiter.
+  void park(string channel, unsigned long token);
+
+  // Drop a parked waiter, e.g. once its wait has timed out. The entry of a
+  // channel nobody published on goes with its last waiter or watcher.
+  void unpark(string channel, unsigned long token);
+
+  // Add a watcher to a channel. Unlike a parked waiter it stays after a put,
+  // until it is removed with unwatch.
+  void watch(string channel, unsigned long token);
+
+  void unwatch(string channel, unsigned long token);
 };
 
 unsigned long HashMap::prehash(string channel)
@@ -73,6 +180,11 @@ HashMap::HashMap(size_t size)
     this->array[i] = new linkedlist::LinkedList();
   }
   this->size = size;
+  this->usedBuckets = 0;
+  this->items = 0;
+  this->storedBytes = 0;
+  this->expiredCount = 0;
+  this->retiredVersion = 0;
 }
 
 HashMap::HashMap()
@@ -83,61 +195,293 @@ HashMap::HashMap()
     this->array[i] = new linkedlist::LinkedList();
   }
   this->size = 10;
+  this->usedBuckets = 0;
+  this->items = 0;
+  this->storedBytes = 0;
+  this->expiredCount = 0;
+  this->retiredVersion = 0;
 }
 
 HashMap::~HashMap()
 {
   for (int i = 0; i < this->size; i++)
   {
-    array[i]->~LinkedList();
+    delete array[i];
   }
+  delete[] array;
 }
 
 vector<unsigned char> HashMap::get(string channel)
+{
+  unsigned long version;
+  return this->get(channel, &version);
+}
+
+vector<unsigned char> HashMap::get(string channel, unsigned long *version)
+{
+  bool compressed;
+  return this->get(channel, version, &compressed);
+}
+
+vector<unsigned char> HashMap::get(string channel, unsigned long *version, bool *compressed)
 {
   vector<unsigned char> output;
-  unsigned long hashed = hash(channel);
-  bool res = this->array[hashed]->containsItem(channel);
-  if (res)
+  linkedlist::Node *node = this->array[hash(channel)]->findItem(channel);
+  *version = 0;
+  *compressed = false;
+  if (node != NULL && (node = this->expireIfDue(node)) != NULL)
   {
-    output = this->array[hashed]->getLatestMessage(channel);
+    output = node->messageBytes;
+    *version = node->version;
+    *compressed = node->compressed;
   }
   return output;
 }
 
-unsigned long HashMap::hash(string channel)
+unsigned long HashMap::version(string channel)
 {
-  unsigned long pre = this->prehash(channel);
-  unsigned long s = (unsigned long)(pre % this->size);
-  return s;
+  linkedlist::Node *node = this->array[hash(channel)]->findItem(channel);
+  if (node == NULL || (node = this->expireIfDue(node)) == NULL)
+  {
+    return 0;
+  }
+  return node->version;
 }
 
-bool HashMap::put(string channel, vector<unsigned char> messageBytes)
+vector<unsigned char> HashMap::delta(string channel, unsigned long *base)
 {
-  unsigned long hashed = hash(channel);
-  if (this->containsKey(channel))
+  linkedlist::Node *node = this->array[hash(channel)]->findItem(channel);
+  *base = 0;
+  if (node == NULL || (node = this->expireIfDue(node)) == NULL)
   {
-    this->array[hashed]->replaceItem(channel, messageBytes);
-    return true;
+    return vector<unsigned char>();
   }
+  *base = node->deltaBase;
+  return node->delta;
+}
 
-  this->array[hashed]->insertAtTail(channel, messageBytes);
-  int buckets = 0;
-  for (int i = 0; i < this->size; i++)
+void HashMap::clearDelta(linkedlist::Node *node)
+{
+  this->storedBytes -= node->delta.size();
+  vector<unsigned char>().swap(node->delta);
+  node->deltaBase = 0;
+}
+
+linkedlist::Node *HashMap::expireIfDue(linkedlist::Node *node)
+{
+  if (node->expiresAt == 0 || node->expiresAt > nowMillis())
   {
-    if (this->array[i]->length > 0)
+    return node;
+  }
+  this->clearDelta(node);
+  this->storedBytes -= node->messageBytes.size();
+  vector<unsigned char>().swap(node->messageBytes);
+  node->version++;
+  node->expiresAt = 0;
+  node->compressed = false;
+  node->hasMessage = false;
+  this->expiredCount++;
+  return this->removeIfUnused(node) ? NULL : node;
+}
+
+bool HashMap::expire(string channel)
+{
+  linkedlist::Node *node = this->array[hash(channel)]->findItem(channel);
+  if (node == NULL || node->expiresAt == 0)
+  {
+    return false;
+  }
+  size_t before = this->expiredCount;
+  this->expireIfDue(node);
+  return this->expiredCount != before;
+}
+
+bool HashMap::drop(string channel)
+{
+  linkedlist::Node *node = this->array[hash(channel)]->findItem(channel);
+  if (node == NULL || !node->hasMessage)
+  {
+    return false;
+  }
+  this->clearDelta(node);
+  this->storedBytes -= node->messageBytes.size();
+  vector<unsigned char>().swap(node->messageBytes);
+  node->version++;
+  node->expiresAt = 0;
+  node->compressed = false;
+  node->hasMessage = false;
+  this->removeIfUnused(node);
+  return true;
+}
+
+size_t HashMap::expired()
+{
+  return this->expiredCount;
+}
+
+unsigned long HashMap::nowMillis()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool HashMap::put(string channel, vector<unsigned char> messageBytes, vector<unsigned long> *woken, unsigned long expiresAt,
+                  unsigned long version, bool compressed)
+{
+  // One walk of the bucket list finds the item to replace, if there is one
+  linkedlist::LinkedList *list = this->array[hash(channel)];
+  linkedlist::Node *node = list->findItem(channel);
+  woken->clear();
+  if (node != NULL)
+  {
+    this->clearDelta(node);
+    if (!compressed && !node->compressed && !node->messageBytes.empty() && messageBytes.size() >= DELTA_THRESHOLD)
     {
-      buckets++;
+      vector<unsigned char> delta = hmp221::diff(node->messageBytes, messageBytes);
+      if (delta.size() < messageBytes.size())
+      {
+        this->storedBytes += delta.size();
+        node->delta.swap(delta);
+        node->deltaBase = node->version;
+      }
     }
+    this->storedBytes += messageBytes.size() - node->messageBytes.size();
+    node->messageBytes.swap(messageBytes);
+    node->version = version != 0 ? version : max(node->version, this->retiredVersion) + 1;
+    node->expiresAt = expiresAt;
+    node->compressed = compressed;
+    node->hasMessage = true;
+    woken->assign(node->waiters.begin(), node->waiters.end());
+    node->waiters.clear();
+    woken->insert(woken->end(), node->watchers.begin(), node->watchers.end());
+    return true;
+  }
+  node = this->insert(list, channel, messageBytes, version != 0 ? version : this->retiredVersion + 1);
+  node->expiresAt = expiresAt;
+  node->compressed = compressed;
+  node->hasMessage = true;
+  return true;
+}
+
+linkedlist::Node *HashMap::insert(linkedlist::LinkedList *list, string channel, vector<unsigned char> &messageBytes, unsigned long version)
+{
+  if (list->length == 0)
+  {
+    this->usedBuckets++;
   }
-  double loadfactor = (double)(buckets) / (double)(this->size);
+  list->insertAtTail(channel, messageBytes, version);
+  this->items++;
+  this->storedBytes += channel.size() + messageBytes.size();
+  double loadfactor = (double)(this->usedBuckets) / (double)(this->size);
   if (loadfactor >= 0.70)
   {
     this->resize(this->size * 2);
   }
+  // The resize moves every entry to a new node
+  return this->array[hash(channel)]->findItem(channel);
+}
+
+void HashMap::forEach(function<void(const string &, const vector<unsigned char> &, unsigned long, unsigned long, bool)> visit)
+{
+  for (size_t i = 0; i < this->size; i++)
+  {
+    for (int j = 0; j < this->array[i]->length;)
+    {
+      linkedlist::Node *node = this->expireIfDue(this->array[i]->itemAtIndex(j));
+      if (node == NULL)
+      {
+        // The next entry moved up to index j
+        continue;
+      }
+      j++;
+      if (!node->messageBytes.empty())
+      {
+        visit(node->channel, node->messageBytes, node->version, node->expiresAt, node->compressed);
+      }
+    }
+  }
+}
+
+void HashMap::park(string channel, unsigned long token)
+{
+  this->findOrPlaceholder(channel)->waiters.insert(token);
+}
+
+void HashMap::watch(string channel, unsigned long token)
+{
+  this->findOrPlaceholder(channel)->watchers.insert(token);
+}
+
+void HashMap::unwatch(string channel, unsigned long token)
+{
+  linkedlist::Node *node = this->array[hash(channel)]->findItem(channel);
+  if (node != NULL)
+  {
+    node->watchers.erase(token);
+    this->removeIfUnused(node);
+  }
+}
+
+linkedlist::Node *HashMap::findOrPlaceholder(string channel)
+{
+  linkedlist::LinkedList *list = this->array[hash(channel)];
+  linkedlist::Node *node = list->findItem(channel);
+  if (node == NULL)
+  {
+    vector<unsigned char> noMessage;
+    node = this->insert(list, channel, noMessage, 0);
+  }
+  return node;
+}
+
+void HashMap::unpark(string channel, unsigned long token)
+{
+  linkedlist::Node *node = this->array[hash(channel)]->findItem(channel);
+  if (node != NULL)
+  {
+    node->waiters.erase(token);
+    this->removeIfUnused(node);
+  }
+}
+
+bool HashMap::removeIfUnused(linkedlist::Node *node)
+{
+  if (node->hasMessage || !node->waiters.empty() || !node->watchers.empty())
+  {
+    return false;
+  }
+  this->unlink(node);
   return true;
 }
 
+void HashMap::unlink(linkedlist::Node *node)
+{
+  linkedlist::LinkedList *list = this->array[hash(node->channel)];
+  this->items--;
+  this->storedBytes -= node->channel.size() + node->messageBytes.size() + node->delta.size();
+  this->retiredVersion = max(this->retiredVersion, node->version);
+  string channel = node->channel;
+  list->removeItem(channel);
+  if (list->length == 0)
+  {
+    this->usedBuckets--;
+  }
+}
+
+unsigned long HashMap::hash(string channel)
+{
+  unsigned long pre = this->prehash(channel);
+  unsigned long s = (unsigned long)(pre % this->size);
+  return s;
+}
+
+bool HashMap::put(string channel, vector<unsigned char> messageBytes)
+{
+  vector<unsigned long> woken;
+  return this->put(channel, messageBytes, &woken);
+}
+
 bool HashMap::containsKey(string channel)
 {
   unsigned long hashed = hash(channel);
@@ -148,7 +492,7 @@ bool HashMap::containsKey(string channel)
 void HashMap::resize(size_t new_size)
 {
   linkedlist::LinkedList **old = this->array;
-  linkedlist::Node *element[this->len()];
+  vector<linkedlist::Node *> element(this->len());
   size_t limit = this->size;
   size_t currentIndex = 0;
   for (size_t i = 0; i < limit; i++)
@@ -167,27 +511,44 @@ void HashMap::resize(size_t new_size)
   {
     this->array[i] = new linkedlist::LinkedList();
   }
+  this->usedBuckets = 0;
   for (int i = 0; i < currentIndex; i++)
   {
-    this->put(element[i]->channel, element[i]->messageBytes);
+    // Move the entry as is, so its version survives the resize
+    linkedlist::LinkedList *list = this->array[hash(element[i]->channel)];
+    if (list->length == 0)
+    {
+      this->usedBuckets++;
+    }
+    list->insertAtTail(element[i]->channel, element[i]->messageBytes, element[i]->version);
+    linkedlist::Node *moved = list->itemAtIndex(list->length - 1);
+    moved->waiters.swap(element[i]->waiters);
+    moved->watchers.swap(element[i]->watchers);
+    moved->expiresAt = element[i]->expiresAt;
+    moved->compressed = element[i]->compressed;
+    moved->hasMessage = element[i]->hasMessage;
+    moved->delta.swap(element[i]->delta);
+    moved->deltaBase = element[i]->deltaBase;
   }
   for (int i = 0; i < limit; i++)
   {
-    old[i]->~LinkedList();
+    delete old[i];
   }
+  delete[] old;
 }
 
 size_t HashMap::len()
 {
-  size_t len = 0;
-  for (int i = 0; i < this->size; i++)
-  {
-    len += this->array[i]->length;
-  }
-  return len;
+  return this->items;
 }
 
 size_t HashMap::capacity()
 {
   return (size_t)(0.7 * (double)this->size) - 1;
 }
+
+size_t HashMap::memoryUsage()
+{
+  return this->storedBytes + this->items * sizeof(linkedlist::Node) +
+         this->size * (sizeof(linkedlist::LinkedList *) + sizeof(linkedlist::LinkedList));
+}
@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifndef HASHRING_H
+#define HASHRING_H
+
+using namespace std;
+
+// Consistent-hash ring that maps a channel name to the cluster node owning it.
+// Every node is placed at many points of the ring, its virtual nodes, and a
+// channel belongs to the node of the first point at or after its hash. The
+// points of one node are spread all over the ring, so the channels are shared
+// out evenly, and adding a node only moves the channels that land on its
+// points. Every node of a cluster builds the same ring from the same list.
+class HashRing
+{
+private:
+  // (position, node index), sorted by position
+  vector<pair<uint32_t, int>> points;
+
+public:
+  // Place a node at replicas points of the ring, named after its address
+  void add(const string &name, int node, int replicas);
+
+  // Index of the node owning key, -1 when the ring is empty
+  int owner(const string &key) const;
+
+  size_t size() const { return this->points.size(); }
+
+  static uint32_t hash(const string &key);
+};
+
+/**
+ * @brief 32-bit FNV-1a, finished with the MurmurHash3 mixer
+ *
+ * Names of virtual nodes only differ in their last characters; the mixer
+ * spreads them over the whole ring instead of next to each other.
+ */
+uint32_t HashRing::hash(const string &key)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < key.size(); i++)
+  {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+void HashRing::add(const string &name, int node, int replicas)
+{
+  for (int i = 0; i < replicas; i++)
+  {
+    this->points.push_back(make_pair(hash(name + "#" + to_string(i)), node));
+  }
+  // Ties are broken by node index, so every node sorts the ring alike
+  sort(this->points.begin(), this->points.end());
+}
+
+int HashRing::owner(const string &key) const
+{
+  if (this->points.empty())
+  {
+    return -1;
+  }
+  auto found = lower_bound(this->points.begin(), this->points.end(), make_pair(hash(key), -1));
+  if (found == this->points.end())
+  {
+    // Past the last point the ring wraps around to the first
+    found = this->points.begin();
+  }
+  return found->second;
+}
+
+#endif
@@ -0,0 +1,233 @@
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+// Records below this level are compiled out, e.g. -DHMP221_LOG_LEVEL=0 to see every request
+#ifndef HMP221_LOG_LEVEL
+#define HMP221_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RECORD_SIZE 256 // longer records are truncated
+#define LOG_RING_SIZE 4096  // records waiting for the writer, a power of two
+#define LOG_FLUSH_MILLIS 10 // how long the writer sleeps when there is nothing to write
+
+// A formatted record in the ring. sequence tells whose turn the slot is:
+// equal to the slot's position when free for a producer, one past it once
+// the record is ready for the writer.
+struct LogRecord
+{
+  std::atomic<unsigned long> sequence;
+  int level;
+  int length;
+  char text[LOG_RECORD_SIZE];
+};
+
+// Logger that takes console output off the request path. Callers format a
+// record straight into a slot of a bounded lock-free ring and return; a
+// background thread drains the ring and writes many records per write().
+// When the ring is full the record is dropped and counted rather than
+// blocking the caller.
+class Logger
+{
+private:
+  LogRecord *ring;
+  std::atomic<unsigned long> head; // next slot a producer claims
+  unsigned long tail;              // next slot the writer reads, only touched by the writer
+  std::atomic<unsigned long> dropped;
+  std::atomic<bool> running;
+  std::thread writer;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+
+  void drain();
+  void writeLoop();
+
+public:
+  Logger();
+  ~Logger();
+
+  // Start the writer thread; records logged before are written once it runs
+  void start();
+
+  // Write every pending record and stop the writer thread
+  void stop();
+
+  // Format a record printf-style; a newline is appended
+  void log(int level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+};
+
+Logger::Logger()
+{
+  this->ring = new LogRecord[LOG_RING_SIZE];
+  for (unsigned long i = 0; i < LOG_RING_SIZE; i++)
+  {
+    this->ring[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  this->head.store(0);
+  this->tail = 0;
+  this->dropped.store(0);
+  this->running.store(false);
+}
+
+Logger::~Logger()
+{
+  this->stop();
+  delete[] this->ring;
+}
+
+void Logger::start()
+{
+  if (!this->running.exchange(true))
+  {
+    this->writer = std::thread(&Logger::writeLoop, this);
+  }
+}
+
+void Logger::stop()
+{
+  if (this->running.exchange(false))
+  {
+    this->wakeup.notify_one();
+    this->writer.join();
+  }
+}
+
+void Logger::log(int level, const char *format, ...)
+{
+  unsigned long position = this->head.load(std::memory_order_relaxed);
+  LogRecord *record;
+  while (true)
+  {
+    record = &this->ring[position & (LOG_RING_SIZE - 1)];
+    long turn = (long)(record->sequence.load(std::memory_order_acquire) - position);
+    if (turn == 0)
+    {
+      if (this->head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (turn < 0)
+    {
+      // The writer has not caught up with this slot yet
+      this->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else
+    {
+      position = this->head.load(std::memory_order_relaxed);
+    }
+  }
+
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(record->text, LOG_RECORD_SIZE - 1, format, args);
+  va_end(args);
+  if (length < 0)
+  {
+    length = 0;
+  }
+  if (length > LOG_RECORD_SIZE - 2)
+  {
+    length = LOG_RECORD_SIZE - 2;
+  }
+  record->text[length] = '\n';
+  record->length = length + 1;
+  record->level = level;
+  record->sequence.store(position + 1, std::memory_order_release);
+}
+
+/**
+ * @brief Write every ready record, batching stdout and stderr records separately
+ */
+void Logger::drain()
+{
+  static char out[65536];
+  static char err[65536];
+  size_t outLength = 0;
+  size_t errLength = 0;
+  while (true)
+  {
+    LogRecord *record = &this->ring[this->tail & (LOG_RING_SIZE - 1)];
+    if (record->sequence.load(std::memory_order_acquire) != this->tail + 1)
+    {
+      break;
+    }
+    bool toStderr = record->level >= LOG_LEVEL_WARN;
+    char *buffer = toStderr ? err : out;
+    size_t &length = toStderr ? errLength : outLength;
+    if (length + record->length > sizeof(out))
+    {
+      write(toStderr ? STDERR_FILENO : STDOUT_FILENO, buffer, length);
+      length = 0;
+    }
+    memcpy(buffer + length, record->text, record->length);
+    length += record->length;
+    record->sequence.store(this->tail + LOG_RING_SIZE, std::memory_order_release);
+    this->tail++;
+  }
+
+  unsigned long lost = this->dropped.exchange(0, std::memory_order_relaxed);
+  if (lost > 0)
+  {
+    errLength += snprintf(err + errLength, sizeof(err) - errLength, "%lu log records dropped\n", lost);
+  }
+  if (outLength > 0)
+  {
+    write(STDOUT_FILENO, out, outLength);
+  }
+  if (errLength > 0)
+  {
+    write(STDERR_FILENO, err, errLength);
+  }
+}
+
+void Logger::writeLoop()
+{
+  while (this->running.load())
+  {
+    this->drain();
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->wakeup.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MILLIS));
+  }
+  this->drain();
+}
+
+static Logger logger;
+
+#if HMP221_LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logger.log(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if HMP221_LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) logger.log(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#if HMP221_LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) logger.log(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+
+#define LOG_ERROR(...) logger.log(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,102 @@
+#include <vector>
+#include <string>
+#include <utility>
+#include <time.h>
+#include "hdrhistogram.hpp"
+
+#ifndef METRICS_H
+#define METRICS_H
+
+using namespace std;
+
+// Steps of request handling whose latency the server records
+enum Operation
+{
+  OP_ACCEPT,
+  OP_DECODE,
+  OP_GET,
+  OP_PUT,
+  OP_ENCODE,
+  OP_WRITE,
+  OP_COUNT
+};
+
+static const char *operationNames[OP_COUNT] = {"accept", "decode", "get", "put", "encode", "write"};
+
+// Counters and latency histograms of the event loop. Only the loop thread
+// touches them, so recording is a plain increment with no lock or atomic.
+struct Metrics
+{
+  // Nanoseconds spent in each operation
+  HdrHistogram latency[OP_COUNT];
+
+  unsigned long requests;
+  unsigned long bytesIn;
+  unsigned long bytesOut;
+  unsigned long connectionsAccepted;
+  unsigned long framesDropped;
+  unsigned long framesConflated;
+  unsigned long slowConsumersDisconnected;
+  unsigned long acksSent;
+  unsigned long connectionsRejected;
+  unsigned long throttles;
+  unsigned long idleDisconnects;
+  unsigned long pingsSent;
+  unsigned long requestsForwarded;
+  unsigned long redirects;
+  unsigned long linkFailures;
+  unsigned long snapshotsSent;
+  unsigned long snapshotsApplied;
+  unsigned long datagramsReceived;
+  unsigned long datagramsDropped;
+  unsigned long ringsAttached;
+  unsigned long handshakes;
+  unsigned long compressedStored; // messages stored with a compressed payload
+  unsigned long spooledStored;    // messages stored in a spool file, published in Chunk frames
+  unsigned long sendfileBytes;    // bytes written to sockets straight from spool files
+  unsigned long deltasSent;       // messages sent as a delta from the version the client held
+  unsigned long zerocopyBytes;    // bytes handed to sockets with MSG_ZEROCOPY
+  unsigned long zerocopyCopied;   // MSG_ZEROCOPY sends the kernel copied after all
+  unsigned long uringEnters;      // io_uring_enter calls of the io_uring backend
+  unsigned long uringCompletions; // completions it handled
+  unsigned long startMillis;
+};
+
+/**
+ * @brief Read a monotonic clock with nanosecond resolution
+ */
+inline unsigned long currentNanos()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Record the time an operation took since it started
+ *
+ * @param start currentNanos() when the operation started
+ */
+inline void recordSince(Metrics *metrics, Operation op, unsigned long start)
+{
+  metrics->latency[op].record(currentNanos() - start);
+}
+
+/**
+ * @brief Append the count and latency percentiles of every operation as named values
+ */
+inline void appendLatencies(Metrics *metrics, vector<pair<string, u64>> *values)
+{
+  for (int op = 0; op < OP_COUNT; op++)
+  {
+    HdrHistogram &histogram = metrics->latency[op];
+    string name = operationNames[op];
+    values->push_back(make_pair(name + "_count", histogram.count()));
+    values->push_back(make_pair(name + "_p50_ns", histogram.percentile(50)));
+    values->push_back(make_pair(name + "_p99_ns", histogram.percentile(99)));
+    values->push_back(make_pair(name + "_p999_ns", histogram.percentile(99.9)));
+    values->push_back(make_pair(name + "_max_ns", histogram.max()));
+  }
+}
+
+#endif
@@ -0,0 +1,93 @@
+#include <netinet/in.h>
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+// Token bucket refilled at rate tokens per second up to burst tokens. A
+// rate of 0 means unlimited, so an unconfigured bucket costs one compare.
+struct TokenBucket
+{
+  double rate;
+  double burst;
+  double tokens;
+  unsigned long lastNanos;
+};
+
+// Limits applied to each connection, or to all connections of one source address
+struct RateLimit
+{
+  double requestsPerSecond; // 0 for unlimited
+  double bytesPerSecond;    // 0 for unlimited
+};
+
+// What the server tracks per source address: its share of the rate limit and
+// how many connections it has open
+struct SourceState
+{
+  TokenBucket requests;
+  TokenBucket bytes;
+  size_t connections;
+};
+
+/**
+ * @brief Start a bucket full, allowing a second's worth of tokens in a burst
+ */
+static inline void bucketInit(TokenBucket *bucket, double rate, unsigned long now)
+{
+  bucket->rate = rate;
+  bucket->burst = rate;
+  bucket->tokens = rate;
+  bucket->lastNanos = now;
+}
+
+static inline void bucketRefill(TokenBucket *bucket, unsigned long now)
+{
+  if (now > bucket->lastNanos)
+  {
+    bucket->tokens += (now - bucket->lastNanos) * bucket->rate / 1e9;
+    if (bucket->tokens > bucket->burst)
+    {
+      bucket->tokens = bucket->burst;
+    }
+    bucket->lastNanos = now;
+  }
+}
+
+/**
+ * @brief Whether amount tokens can be taken now
+ *
+ * An amount larger than the burst is allowed once the bucket is full and
+ * leaves it in debt, so a large frame is slowed down rather than never let in.
+ */
+static inline bool bucketReady(TokenBucket *bucket, double amount, unsigned long now)
+{
+  if (bucket->rate == 0)
+  {
+    return true;
+  }
+  bucketRefill(bucket, now);
+  return bucket->tokens >= (amount < bucket->burst ? amount : bucket->burst);
+}
+
+static inline void bucketTake(TokenBucket *bucket, double amount)
+{
+  if (bucket->rate != 0)
+  {
+    bucket->tokens -= amount;
+  }
+}
+
+/**
+ * @brief Nanoseconds until bucketReady() holds for amount
+ */
+static inline unsigned long bucketWait(TokenBucket *bucket, double amount)
+{
+  if (bucket->rate == 0)
+  {
+    return 0;
+  }
+  double needed = (amount < bucket->burst ? amount : bucket->burst) - bucket->tokens;
+  return needed > 0 ? (unsigned long)(needed * 1e9 / bucket->rate) + 1 : 0;
+}
+
+#endif
@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+// Layout of the memory a local client shares with the server: the ring the
+// client writes requests to, then the ring the server writes replies to,
+// each a header followed by capacity bytes.
+#define SHM_RING_HEADER 256
+
+// Shared state of one ring. head and tail count bytes since the ring was
+// created and only grow, so head - tail is always the number of bytes
+// waiting and neither side needs to tell a full ring from an empty one.
+// They sit on cache lines of their own, since each is written by one side
+// only.
+struct ShmRingHeader
+{
+  std::atomic<uint64_t> head; // written by the producer
+  char headPad[56];
+  std::atomic<uint64_t> tail; // written by the consumer
+  char tailPad[56];
+  // Set by the consumer before it sleeps on its eventfd, and by the
+  // producer when the ring is too full for what it has to write. The other
+  // side clears the flag and signals the eventfd, so a side that is busy
+  // anyway costs no system call.
+  std::atomic<uint32_t> consumerSleeping;
+  std::atomic<uint32_t> producerWaiting;
+};
+
+// Single-producer single-consumer byte ring in memory shared by two
+// processes. Frames are written as a stream, exactly as they would be to a
+// socket, and may wrap around the end of the ring.
+class ShmRing
+{
+private:
+  ShmRingHeader *header;
+  unsigned char *data;
+  size_t capacity; // a power of two
+
+public:
+  ShmRing() : header(NULL), data(NULL), capacity(0) {}
+
+  // Use the ring at memory, which holds SHM_RING_HEADER + capacity bytes
+  void attach(void *memory, size_t capacity)
+  {
+    this->header = (ShmRingHeader *)memory;
+    this->data = (unsigned char *)memory + SHM_RING_HEADER;
+    this->capacity = capacity;
+  }
+
+  // Zero the header of a new ring, before the other side maps it
+  void reset()
+  {
+    this->header->head.store(0);
+    this->header->tail.store(0);
+    this->header->consumerSleeping.store(0);
+    this->header->producerWaiting.store(0);
+  }
+
+  // Whether head and tail describe a ring. The other process can store
+  // anything in them, so read and write check the values they loaded before
+  // using them to copy.
+  bool consistent(uint64_t head, uint64_t tail) const { return tail <= head && head - tail <= this->capacity; }
+
+  size_t readable() const { return this->header->head.load(std::memory_order_acquire) - this->header->tail.load(std::memory_order_relaxed); }
+
+  size_t writable() const { return this->capacity - (this->header->head.load(std::memory_order_relaxed) - this->header->tail.load(std::memory_order_acquire)); }
+
+  // Copy as much of the buffers as fits into the ring. Returns the number
+  // of bytes written, 0 when the ring is full, -1 when head and tail are
+  // not consistent.
+  ssize_t write(const struct iovec *iov, int count)
+  {
+    uint64_t head = this->header->head.load(std::memory_order_relaxed);
+    uint64_t tail = this->header->tail.load(std::memory_order_acquire);
+    if (!this->consistent(head, tail))
+    {
+      return -1;
+    }
+    size_t room = this->capacity - (head - tail);
+    size_t written = 0;
+    for (int i = 0; i < count && written < room; i++)
+    {
+      size_t length = iov[i].iov_len < room - written ? iov[i].iov_len : room - written;
+      this->copyIn((const unsigned char *)iov[i].iov_base, length, head + written);
+      written += length;
+    }
+    // The bytes are in place before the consumer can see the new head
+    this->header->head.store(head + written, std::memory_order_release);
+    return written;
+  }
+
+  ssize_t write(const unsigned char *bytes, size_t length)
+  {
+    struct iovec iov = {(void *)bytes, length};
+    return this->write(&iov, 1);
+  }
+
+  // Copy up to length waiting bytes out of the ring. Returns the number of
+  // bytes read, 0 when the ring is empty, -1 when head and tail are not
+  // consistent.
+  ssize_t read(unsigned char *bytes, size_t length)
+  {
+    uint64_t head = this->header->head.load(std::memory_order_acquire);
+    uint64_t tail = this->header->tail.load(std::memory_order_relaxed);
+    if (!this->consistent(head, tail))
+    {
+      return -1;
+    }
+    size_t waiting = head - tail;
+    if (length > waiting)
+    {
+      length = waiting;
+    }
+    size_t offset = tail & (this->capacity - 1);
+    size_t first = length < this->capacity - offset ? length : this->capacity - offset;
+    memcpy(bytes, this->data + offset, first);
+    memcpy(bytes + first, this->data, length - first);
+    // The bytes are copied out before the producer may overwrite them
+    this->header->tail.store(tail + length, std::memory_order_release);
+    return length;
+  }
+
+  // Announce that the consumer is about to sleep. Returns false if bytes
+  // arrived meanwhile, in which case it must not sleep.
+  bool sleep()
+  {
+    this->header->consumerSleeping.store(1, std::memory_order_relaxed);
+    // Either the producer sees the flag or this sees the producer's bytes
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (this->readable() > 0)
+    {
+      this->header->consumerSleeping.store(0, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+  // Whether the consumer has to be woken after a write; clears the flag
+  bool wakeConsumer()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return this->header->consumerSleeping.load(std::memory_order_relaxed) != 0 &&
+           this->header->consumerSleeping.exchange(0) != 0;
+  }
+
+  // Announce that the producer waits for room. Returns false if room was
+  // made meanwhile, in which case it must not wait.
+  bool waitForRoom()
+  {
+    this->header->producerWaiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (this->writable() > 0)
+    {
+      this->header->producerWaiting.store(0, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+  // Whether the producer has to be woken after a read; clears the flag
+  bool wakeProducer()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return this->header->producerWaiting.load(std::memory_order_relaxed) != 0 &&
+           this->header->producerWaiting.exchange(0) != 0;
+  }
+
+private:
+  void copyIn(const unsigned char *bytes, size_t length, uint64_t position)
+  {
+    size_t offset = position & (this->capacity - 1);
+    size_t first = length < this->capacity - offset ? length : this->capacity - offset;
+    memcpy(this->data + offset, bytes, first);
+    memcpy(this->data, bytes + first, length - first);
+  }
+};
+
+#endif
@@ -0,0 +1,253 @@
+#include <stddef.h>
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS) // slots per level, a tick each on level 0
+#define WHEEL_LEVELS 4                // 2^32 ticks, 49 days of milliseconds
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+// A timer that lives inside what it times, e.g. a connection. It is linked
+// into the wheel directly, so scheduling and cancelling allocate nothing.
+// owner and kind tell the code handling an expired timer what it belongs to.
+struct TimerNode
+{
+  TimerNode *prev;
+  TimerNode *next; // NULL when not scheduled
+  unsigned long deadline;
+  int kind;
+  void *owner;
+};
+
+/**
+ * @brief Initialize a timer that is not scheduled yet
+ */
+static inline void timerInit(TimerNode *node, int kind, void *owner)
+{
+  node->prev = NULL;
+  node->next = NULL;
+  node->deadline = 0;
+  node->kind = kind;
+  node->owner = owner;
+}
+
+// Hierarchical timing wheel with a tick of one millisecond. Level 0 has a
+// slot per tick; every slot of level n covers a whole turn of level n - 1 and
+// is spread over the lower levels when that turn starts. Scheduling and
+// cancelling are O(1) list operations, and each tick only looks at one slot,
+// so the cost does not depend on how many timers are pending.
+class TimerWheel
+{
+private:
+  TimerNode slots[WHEEL_LEVELS][WHEEL_SLOTS]; // list heads
+  TimerNode due;                              // timers expired but not yet handed out
+  unsigned long current;                      // next tick to process; earlier ticks are done
+  size_t count;
+
+  static void link(TimerNode *head, TimerNode *node);
+  static void unlink(TimerNode *node);
+  void place(TimerNode *node);
+  void cascade(int level, size_t slot);
+
+public:
+  TimerWheel();
+
+  // Start the wheel at the given time; timers are scheduled relative to it
+  void start(unsigned long now);
+
+  // Schedule a timer, or move it if it is already scheduled
+  void schedule(TimerNode *node, unsigned long deadline);
+
+  // Unschedule a timer; does nothing if it is not scheduled
+  void cancel(TimerNode *node);
+
+  static bool scheduled(const TimerNode *node) { return node->next != NULL; }
+
+  // Next timer whose deadline is at or before now, unscheduled, or NULL when
+  // there is none. A timer cancelled while others are being handled is never
+  // returned, so handling one timer may safely cancel another.
+  TimerNode *expire(unsigned long now);
+
+  // Earliest time expire() may have a timer to return, ~0 when nothing is
+  // scheduled. It is exact for the current turn of level 0 and the start of
+  // the next turn otherwise, so a sleep ends at most every 256 ticks.
+  unsigned long nextExpiry();
+
+  size_t size() { return this->count; }
+};
+
+TimerWheel::TimerWheel()
+{
+  for (int level = 0; level < WHEEL_LEVELS; level++)
+  {
+    for (size_t slot = 0; slot < WHEEL_SLOTS; slot++)
+    {
+      this->slots[level][slot].prev = &this->slots[level][slot];
+      this->slots[level][slot].next = &this->slots[level][slot];
+    }
+  }
+  this->due.prev = &this->due;
+  this->due.next = &this->due;
+  this->current = 0;
+  this->count = 0;
+}
+
+void TimerWheel::start(unsigned long now)
+{
+  this->current = now;
+}
+
+void TimerWheel::link(TimerNode *head, TimerNode *node)
+{
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+void TimerWheel::unlink(TimerNode *node)
+{
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = NULL;
+  node->next = NULL;
+}
+
+/**
+ * @brief Link a timer into the lowest level whose turn still reaches its deadline
+ *
+ * A deadline further away than the wheel spans goes into the last slot
+ * reachable and is placed again when it comes up.
+ */
+void TimerWheel::place(TimerNode *node)
+{
+  unsigned long deadline = node->deadline < this->current ? this->current : node->deadline;
+  for (int level = 0; level < WHEEL_LEVELS; level++)
+  {
+    int shift = level * WHEEL_BITS;
+    if ((deadline >> shift) - (this->current >> shift) < WHEEL_SLOTS)
+    {
+      link(&this->slots[level][(deadline >> shift) & WHEEL_MASK], node);
+      return;
+    }
+  }
+  int shift = (WHEEL_LEVELS - 1) * WHEEL_BITS;
+  link(&this->slots[WHEEL_LEVELS - 1][((this->current >> shift) - 1) & WHEEL_MASK], node);
+}
+
+void TimerWheel::schedule(TimerNode *node, unsigned long deadline)
+{
+  if (node->next != NULL)
+  {
+    unlink(node);
+    this->count--;
+  }
+  node->deadline = deadline;
+  this->place(node);
+  this->count++;
+}
+
+void TimerWheel::cancel(TimerNode *node)
+{
+  if (node->next != NULL)
+  {
+    unlink(node);
+    this->count--;
+  }
+}
+
+/**
+ * @brief Spread the timers of a slot over the lower levels
+ */
+void TimerWheel::cascade(int level, size_t slot)
+{
+  TimerNode *head = &this->slots[level][slot];
+  while (head->next != head)
+  {
+    TimerNode *node = head->next;
+    unlink(node);
+    this->place(node);
+  }
+}
+
+TimerNode *TimerWheel::expire(unsigned long now)
+{
+  while (true)
+  {
+    while (this->due.next == &this->due)
+    {
+      if (this->current > now)
+      {
+        return NULL;
+      }
+      if (this->count == 0)
+      {
+        // Nothing to find on the way
+        this->current = now + 1;
+        return NULL;
+      }
+      // A new turn of level 0 starts a slot of level 1, and so on up. The
+      // highest level goes first so its timers can fall all the way down.
+      if ((this->current & WHEEL_MASK) == 0)
+      {
+        int top = 1;
+        while (top + 1 < WHEEL_LEVELS && ((this->current >> (top * WHEEL_BITS)) & WHEEL_MASK) == 0)
+        {
+          top++;
+        }
+        for (int level = top; level >= 1; level--)
+        {
+          this->cascade(level, (this->current >> (level * WHEEL_BITS)) & WHEEL_MASK);
+        }
+      }
+      TimerNode *head = &this->slots[0][this->current & WHEEL_MASK];
+      while (head->next != head)
+      {
+        TimerNode *node = head->next;
+        unlink(node);
+        link(&this->due, node);
+      }
+      this->current++;
+    }
+
+    TimerNode *node = this->due.next;
+    unlink(node);
+    this->count--;
+    if (node->deadline > now)
+    {
+      // Parked in the last slot because it was beyond the span of the wheel
+      this->schedule(node, node->deadline);
+      continue;
+    }
+    return node;
+  }
+}
+
+unsigned long TimerWheel::nextExpiry()
+{
+  if (this->count == 0)
+  {
+    return ~0UL;
+  }
+  if (this->due.next != &this->due)
+  {
+    return this->current;
+  }
+  for (unsigned long tick = this->current; tick < this->current + WHEEL_SLOTS; tick++)
+  {
+    // Timers of the higher levels come down when a turn starts
+    if ((tick & WHEEL_MASK) == 0)
+    {
+      return tick;
+    }
+    TimerNode *head = &this->slots[0][tick & WHEEL_MASK];
+    if (head->next != head)
+    {
+      return tick;
+    }
+  }
+  return this->current + WHEEL_SLOTS;
+}
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <time.h>
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// Stages of request handling that trace points mark
+enum TraceStage
+{
+  TRACE_ACCEPT,
+  TRACE_READ,
+  TRACE_REQUEST,
+  TRACE_DECODE,
+  TRACE_GET,
+  TRACE_PUT,
+  TRACE_ENCODE,
+  TRACE_WRITE,
+  TRACE_STAGES
+};
+
+#ifdef HMP221_TRACE
+
+#define TRACE_RING_SIZE (1 << 16) // events kept per thread, a power of two
+
+static const char *traceStageNames[TRACE_STAGES] = {"accept", "read", "request", "decode", "get", "put", "encode", "write"};
+
+// One finished stage, 32 bytes so two fit in a cache line
+struct TraceEvent
+{
+  unsigned long start; // ticks
+  unsigned int duration; // ticks
+  unsigned int stage;
+  unsigned long connectionId;
+  unsigned long size; // bytes handled by the stage
+};
+
+// Events of one thread. Only the owning thread writes and dumps it, so the
+// ring needs no lock: recording is a store and an increment, and the oldest
+// events are overwritten once the ring is full. The events go with the thread.
+struct TraceRing
+{
+  TraceEvent *events;
+  unsigned long next;
+
+  ~TraceRing() { delete[] this->events; }
+};
+
+static thread_local TraceRing traceRing = {NULL, 0};
+
+// Clock and tick counter read together when the first event is recorded, to turn ticks into time
+static unsigned long traceBaseTicks;
+static unsigned long traceBaseNanos;
+
+static inline unsigned long traceNanos()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// A tick is a TSC cycle where there is one, a nanosecond elsewhere
+static inline unsigned long traceTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return traceNanos();
+#endif
+}
+
+static inline void traceRecord(TraceStage stage, unsigned long start, unsigned long connectionId, unsigned long size)
+{
+  unsigned long end = traceTicks();
+  if (__builtin_expect(traceRing.events == NULL, 0))
+  {
+    traceRing.events = new TraceEvent[TRACE_RING_SIZE];
+    traceBaseTicks = start;
+    traceBaseNanos = traceNanos();
+  }
+  TraceEvent &event = traceRing.events[traceRing.next++ & (TRACE_RING_SIZE - 1)];
+  event.start = start;
+  event.duration = (unsigned int)(end - start);
+  event.stage = stage;
+  event.connectionId = connectionId;
+  event.size = size;
+}
+
+/**
+ * @brief Write the events of the calling thread's ring in Chrome trace format
+ *
+ * The file opens in chrome://tracing and ui.perfetto.dev; each connection is
+ * shown as its own track.
+ *
+ * @param path where to write the JSON file
+ */
+static inline void traceDump(const char *path)
+{
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+  {
+    perror("ERROR opening trace file");
+    return;
+  }
+  fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  if (traceRing.events != NULL)
+  {
+    unsigned long nanos = traceNanos() - traceBaseNanos;
+    unsigned long ticks = traceTicks() - traceBaseTicks;
+    double microsPerTick = ticks > 0 ? nanos / 1000.0 / ticks : 0.001;
+    unsigned long count = traceRing.next < TRACE_RING_SIZE ? traceRing.next : TRACE_RING_SIZE;
+    for (unsigned long i = traceRing.next - count; i < traceRing.next; i++)
+    {
+      TraceEvent &event = traceRing.events[i & (TRACE_RING_SIZE - 1)];
+      fprintf(out, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %lu, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"bytes\": %lu}}%s\n",
+              traceStageNames[event.stage], event.connectionId, (long)(event.start - traceBaseTicks) * microsPerTick,
+              event.duration * microsPerTick, event.size, i + 1 < traceRing.next ? "," : "");
+    }
+  }
+  fprintf(out, "]}\n");
+  fclose(out);
+}
+
+// Start timing a stage; the variable holds the start tick
+#define TRACE_BEGIN(var) unsigned long var = traceTicks()
+// Record the stage started by TRACE_BEGIN(var)
+#define TRACE_END(var, stage, connectionId, size) traceRecord(stage, var, connectionId, size)
+
+#else
+
+// Tracing is compiled out: trace points leave no code behind
+#define TRACE_BEGIN(var)
+#define TRACE_END(var, stage, connectionId, size)
+
+#endif
+
+#endif
@@ -0,0 +1,328 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#ifndef URING_H
+#define URING_H
+
+// Features the server relies on: one mapping for both rings, no lost
+// completions, submissions copied when they are handed over, sockets polled
+// inside the kernel, and a timeout on the wait
+#define URING_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE | \
+                        IORING_FEAT_FAST_POLL | IORING_FEAT_EXT_ARG)
+
+// An io_uring instance driven with the raw system calls. Requests are
+// prepared in the submission queue and handed to the kernel together by the
+// next wait, so one system call submits everything a turn of the event loop
+// asked for and collects what completed. Only one thread uses it.
+class Uring
+{
+private:
+  int fd;
+  void *rings;
+  size_t ringsSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+
+  // Submission queue: the kernel consumes entries up to tail from head
+  std::atomic<uint32_t> *sqHead;
+  std::atomic<uint32_t> *sqTail;
+  uint32_t sqMask;
+  uint32_t sqEntries;
+  uint32_t sqeTail; // entries prepared, not all visible to the kernel yet
+
+  // Completion queue: the kernel posts entries up to tail, read from head
+  std::atomic<uint32_t> *cqHead;
+  std::atomic<uint32_t> *cqTail;
+  uint32_t cqMask;
+  struct io_uring_cqe *cqes;
+
+  // Ring of provided buffers the kernel picks receive buffers from
+  struct io_uring_buf_ring *bufferRing;
+  size_t bufferRingSize;
+  unsigned char *buffers;
+  uint32_t bufferCount;
+  uint32_t bufferSize;
+  uint16_t bufferTail;
+
+public:
+  Uring() : fd(-1), rings(MAP_FAILED), sqes((struct io_uring_sqe *)MAP_FAILED), bufferRing(NULL), buffers(NULL) {}
+
+  ~Uring()
+  {
+    if (this->buffers != NULL)
+    {
+      munmap(this->buffers, (size_t)this->bufferCount * this->bufferSize);
+    }
+    if (this->bufferRing != NULL)
+    {
+      munmap(this->bufferRing, this->bufferRingSize);
+    }
+    if (this->sqes != MAP_FAILED)
+    {
+      munmap(this->sqes, this->sqesSize);
+    }
+    if (this->rings != MAP_FAILED)
+    {
+      munmap(this->rings, this->ringsSize);
+    }
+    if (this->fd >= 0)
+    {
+      ::close(this->fd);
+    }
+  }
+
+  // Create the rings with room for entries submissions. Returns false with
+  // errno set when the kernel has no io_uring or lacks a feature.
+  bool setup(unsigned entries)
+  {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    this->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (this->fd < 0)
+    {
+      return false;
+    }
+    if ((params.features & URING_FEATURES) != URING_FEATURES)
+    {
+      errno = EOPNOTSUPP;
+      return false;
+    }
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    this->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+    this->rings = mmap(NULL, this->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQ_RING);
+    if (this->rings == MAP_FAILED)
+    {
+      return false;
+    }
+    this->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    this->sqes = (struct io_uring_sqe *)mmap(NULL, this->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQES);
+    if (this->sqes == MAP_FAILED)
+    {
+      return false;
+    }
+    unsigned char *base = (unsigned char *)this->rings;
+    this->sqHead = (std::atomic<uint32_t> *)(base + params.sq_off.head);
+    this->sqTail = (std::atomic<uint32_t> *)(base + params.sq_off.tail);
+    this->sqMask = *(uint32_t *)(base + params.sq_off.ring_mask);
+    this->sqEntries = params.sq_entries;
+    this->sqeTail = this->sqTail->load(std::memory_order_relaxed);
+    // Slot i of the queue always names entry i
+    uint32_t *array = (uint32_t *)(base + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; i++)
+    {
+      array[i] = i;
+    }
+    this->cqHead = (std::atomic<uint32_t> *)(base + params.cq_off.head);
+    this->cqTail = (std::atomic<uint32_t> *)(base + params.cq_off.tail);
+    this->cqMask = *(uint32_t *)(base + params.cq_off.ring_mask);
+    this->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    return true;
+  }
+
+  // Register count buffers of size bytes each as buffer group group, for
+  // receives that let the kernel pick one. count is a power of two.
+  bool provideBuffers(uint32_t count, uint32_t size, uint16_t group)
+  {
+    this->bufferRingSize = count * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, this->bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+    {
+      return false;
+    }
+    this->bufferRing = (struct io_uring_buf_ring *)ring;
+    void *memory = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+      return false;
+    }
+    this->buffers = (unsigned char *)memory;
+    this->bufferCount = count;
+    this->bufferSize = size;
+    this->bufferTail = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+      return false;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+      this->recycle(i);
+    }
+    return true;
+  }
+
+  unsigned char *buffer(uint16_t id) { return this->buffers + (size_t)id * this->bufferSize; }
+
+  // Give a buffer a completed receive picked back to the kernel
+  void recycle(uint16_t id)
+  {
+    // Not bufs[]: in C++ the empty struct in front of it moves it off the slots
+    struct io_uring_buf *slot = (struct io_uring_buf *)this->bufferRing + (this->bufferTail & (this->bufferCount - 1));
+    slot->addr = (uint64_t)(uintptr_t)this->buffer(id);
+    slot->len = this->bufferSize;
+    slot->bid = id;
+    this->bufferTail++;
+    // The slot is filled in before the kernel can see the new tail
+    __atomic_store_n(&this->bufferRing->tail, this->bufferTail, __ATOMIC_RELEASE);
+  }
+
+  // Next submission entry, zeroed. When the queue is full, what it holds is
+  // submitted first.
+  struct io_uring_sqe *prepare()
+  {
+    while (this->sqeTail - this->sqHead->load(std::memory_order_acquire) == this->sqEntries)
+    {
+      this->enter(0, -1);
+    }
+    struct io_uring_sqe *sqe = &this->sqes[this->sqeTail & this->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    this->sqeTail++;
+    return sqe;
+  }
+
+  // Hand the prepared entries to the kernel and, unless completions are
+  // already waiting, sleep until one arrives or timeoutMillis pass (-1 for
+  // no limit). Returns -1 with errno set on failure; a timeout or a signal
+  // is not one.
+  int submitAndWait(int timeoutMillis)
+  {
+    bool waiting = this->cqHead->load(std::memory_order_relaxed) != this->cqTail->load(std::memory_order_acquire);
+    return this->enter(waiting ? 0 : 1, timeoutMillis);
+  }
+
+  // Next completion, NULL when none is left; seen() moves past it
+  struct io_uring_cqe *completion()
+  {
+    uint32_t head = this->cqHead->load(std::memory_order_relaxed);
+    if (head == this->cqTail->load(std::memory_order_acquire))
+    {
+      return NULL;
+    }
+    return &this->cqes[head & this->cqMask];
+  }
+
+  void seen() { this->cqHead->store(this->cqHead->load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  // Accept connections on a listening socket until cancelled
+  void acceptMultishot(int listenfd, uint64_t data)
+  {
+    struct io_uring_sqe *sqe = this->prepare();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = data;
+  }
+
+  // Receive into buffers of the group, one completion per read, until the
+  // stream ends, the buffers run out or the receive is cancelled
+  void receiveMultishot(int sockfd, uint16_t group, uint64_t data)
+  {
+    struct io_uring_sqe *sqe = this->prepare();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sockfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = data;
+  }
+
+  // Send the whole message. A linked send only starts once this one is
+  // complete, and is cancelled if this one fails.
+  void sendmsg(int sockfd, const struct msghdr *message, bool linked, uint64_t data)
+  {
+    struct io_uring_sqe *sqe = this->prepare();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = linked ? IOSQE_IO_LINK : 0;
+    sqe->user_data = data;
+  }
+
+  // Complete once for poll events on a descriptor, or every time with multishot
+  void poll(int pollfd, uint32_t events, bool multishot, uint64_t data)
+  {
+    struct io_uring_sqe *sqe = this->prepare();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = pollfd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = data;
+  }
+
+  // Shut a socket down in both directions, which ends the requests still
+  // waiting on it
+  void shutdown(int sockfd, bool linked, uint64_t data)
+  {
+    struct io_uring_sqe *sqe = this->prepare();
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = sockfd;
+    sqe->len = SHUT_RDWR;
+    sqe->flags = linked ? IOSQE_IO_LINK : 0;
+    sqe->user_data = data;
+  }
+
+  void close(int closefd, uint64_t data)
+  {
+    struct io_uring_sqe *sqe = this->prepare();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = closefd;
+    sqe->user_data = data;
+  }
+
+  // Cancel the request submitted with user data target
+  void cancel(uint64_t target, uint64_t data)
+  {
+    struct io_uring_sqe *sqe = this->prepare();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = data;
+  }
+
+private:
+  int enter(unsigned minComplete, int timeoutMillis)
+  {
+    // The entries are written before the kernel can see the new tail
+    this->sqTail->store(this->sqeTail, std::memory_order_release);
+    unsigned submit = this->sqeTail - this->sqHead->load(std::memory_order_acquire);
+    unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (minComplete > 0 && timeoutMillis >= 0)
+    {
+      ts.tv_sec = timeoutMillis / 1000;
+      ts.tv_nsec = (long long)(timeoutMillis % 1000) * 1000000;
+      arg.ts = (uint64_t)(uintptr_t)&ts;
+      flags |= IORING_ENTER_EXT_ARG;
+    }
+    long n = syscall(__NR_io_uring_enter, this->fd, submit, minComplete, flags,
+                     (flags & IORING_ENTER_EXT_ARG) != 0 ? (void *)&arg : NULL, sizeof(arg));
+    if (n < 0 && (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY))
+    {
+      return 0;
+    }
+    return (int)n;
+  }
+};
+
+#endif
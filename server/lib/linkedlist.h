@@ -17,11 +17,13 @@ namespace linkedlist
         size_t length;
         LinkedList();
         ~LinkedList();
-        size_t insertAtTail(string channel, vector<unsigned char> messageBytes);
+        size_t insertAtTail(string channel, vector<unsigned char> messageBytes, unsigned long version = 1);
         void printList();
         bool containsItem(string channel);
+        Node *findItem(string channel);
         Node *itemAtIndex(int index);
         bool replaceItem(string channel, vector<unsigned char> newContentBytes);
+        bool removeItem(string channel);
         vector<unsigned char> getLatestMessage(string channel);
     };
 
@@ -39,17 +41,18 @@ namespace linkedlist
         {
             Node *t = temp;
             temp = temp->next;
-            free(t);
+            delete t;
         }
     }
 
-    size_t LinkedList::insertAtTail(string channel, vector<unsigned char> messageBytes)
+    size_t LinkedList::insertAtTail(string channel, vector<unsigned char> messageBytes, unsigned long version)
     {
         Node *node = new Node(channel, messageBytes);
         if (node == NULL)
         {
             return 1;
         }
+        node->version = version;
         // if list is empty.
         if (this->head == NULL)
         {
@@ -87,6 +90,7 @@ namespace linkedlist
             if (current->channel.compare(channel) == 0)
             {
                 current->messageBytes = newContentBytes;
+                current->version++;
                 return true;
             }
             current = current->next;
@@ -94,6 +98,51 @@ namespace linkedlist
         return false;
     }
 
+    // Unlinks and frees the item of a channel; returns false if there is none
+    bool LinkedList::removeItem(string channel)
+    {
+        Node *previous = NULL;
+        Node *current = this->head;
+        for (int i = 0; i < this->length; i++)
+        {
+            if (current->channel.compare(channel) == 0)
+            {
+                if (previous == NULL)
+                {
+                    this->head = current->next;
+                }
+                else
+                {
+                    previous->next = current->next;
+                }
+                if (this->tail == current)
+                {
+                    this->tail = previous;
+                }
+                this->length--;
+                delete current;
+                return true;
+            }
+            previous = current;
+            current = current->next;
+        }
+        return false;
+    }
+
+    Node *LinkedList::findItem(string channel)
+    {
+        Node *current = this->head;
+        for (int i = 0; i < this->length; i++)
+        {
+            if (current->channel.compare(channel) == 0)
+            {
+                return current;
+            }
+            current = current->next;
+        }
+        return NULL;
+    }
+
     vector<unsigned char> LinkedList::getLatestMessage(string channel)
     {
         vector<unsigned char> output;
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#include <vector>
+#include <unordered_set>
 
 namespace linkedlist {
 
@@ -10,6 +12,14 @@ namespace linkedlist {
         public:
             string channel;
             vector<unsigned char> messageBytes;
+            unsigned long version; // Bumped every time messageBytes is replaced
+            unsigned long expiresAt; // Monotonic milliseconds at which messageBytes is dropped, 0 for never
+            bool compressed; // messageBytes hold the payload compressed, as it was published
+            bool hasMessage; // False for an entry nobody published on yet, and once its message expired or was dropped
+            vector<unsigned char> delta; // hmp221::diff from the message of version deltaBase to messageBytes, empty when none is shorter
+            unsigned long deltaBase;
+            unordered_set<unsigned long> waiters; // Long-polls parked until the next replace
+            unordered_set<unsigned long> watchers; // Watches told about every replace until they leave
             linkedlist::Node* next;
             Node(string channel);
             Node(string channel, vector<unsigned char> messageBytes);
@@ -26,6 +36,11 @@ namespace linkedlist {
     {
         this->channel = channel;
         this->messageBytes = messageBytes;
+        this->version = 1;
+        this->expiresAt = 0;
+        this->compressed = false;
+        this->hasMessage = false;
+        this->deltaBase = 0;
         this->next = NULL;
     }
     
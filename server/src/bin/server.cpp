@@ -3,36 +3,360 @@
 #include <string.h>
 #include <iostream>
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 #include "hmp221.hpp"
 #include <fstream>
 #include <sys/stat.h>
 #include "hashmap.h"
+#include "connection.h"
+#include "hashring.h"
+#include "timerwheel.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
+#include "uring.h"
 #define KEY 42
+#define MAX_EVENTS 1024
+#define MAX_FRAME_BYTES 262144 // A client whose frame grows past this is disconnected
+#define MAX_IOVECS 64           // Queued frames handed to one writev call
+#define ZEROCOPY_THRESHOLD 16384 // Smallest frame sent with MSG_ZEROCOPY; copying smaller ones is cheaper
+#define CLUSTER_REPLICAS 128    // Points of each node on the hash ring, unless --vnodes says otherwise
+#define REPLICATION_BACKLOG 65536 // Changes kept for replicas to resume from, unless --replication-backlog says otherwise
+#define SNAPSHOT_CHUNK 256        // Messages per Snapshot frame
+#define RECONNECT_DELAY 1000      // Milliseconds a replica waits before linking to its primary again
+#define UDP_BATCH 64              // Datagrams taken from the socket by one recvmmsg call
+#define MAX_DATAGRAM_BYTES 65536  // Largest datagram, which is as large as UDP allows
+#define UDP_RECEIVE_BUFFER 4194304 // Bytes the kernel may hold for the UDP socket, absorbing bursts between reads
+#define MIN_RING_BYTES 4096          // Smallest ring a local client may attach
+#define MAX_RING_BYTES (64 << 20)    // Largest ring a local client may attach
+#define RING_READS 16                // Reads of a ring per wakeup before other connections get their turn
+#define MAX_SPOOLED_BYTES 0xffffffffUL // Largest message a client may publish in Chunk frames
+#define URING_ENTRIES 4096           // Submissions io_uring takes at once; more in one turn of the loop are submitted early
+#define URING_BUFFERS 1024           // Receive buffers provided to io_uring, a power of two
+#define URING_BUFFER_BYTES 16384     // Size of each receive buffer
+#define URING_LINKED_WRITES 4        // Linked writes of up to MAX_IOVECS frames submitted for a connection at once
+// Capabilities granted to a client that asks for them in its Hello
+#define SERVER_CAPABILITIES (HMP221_CAP_COMPACT | HMP221_CAP_COMPRESS | HMP221_CAP_BATCH | HMP221_CAP_PUSH | HMP221_CAP_STREAM | HMP221_CAP_DELTA)
 
 using namespace std;
+
+// A subscribe request parked in the store until its channel gets a new version,
+// or a watch that is told about every new version until its connection closes
+struct LongPoll
+{
+    int fd;
+    unsigned long connectionId;
+    string channel;
+    bool watch;
+    bool conflate; // a watch that only needs the latest message of the channel
+    TimerNode timer; // timeout of a long-poll; watches have none
+};
+
+// Message published in Chunk frames, kept in a file while the store only
+// holds an empty payload at its version. A later version of the channel
+// makes it stale.
+struct SpooledMessage
+{
+    shared_ptr<SpoolFile> file;
+    unsigned long version;
+};
+
+// What a completion of the io_uring backend is for, in the low bits of its
+// user data. A write's user data is its UringWrite; the others carry the
+// socket and the low half of its connection's id, see uringData.
+enum UringKind
+{
+    URING_WRITE,    // a linked send of queued frames
+    URING_ACCEPT,   // multishot accept on the TCP listening socket
+    URING_RECEIVE,  // multishot receive on a client connection
+    URING_WRITABLE, // a connection writing from a spool file has room again
+    URING_EPOLL,    // the epoll instance has events for the sockets io_uring does not serve
+    URING_IGNORED   // a cancel, shutdown or close, which needs nothing done when it completes
+};
+
+// Frames handed to io_uring in one send. They are referenced here rather
+// than only by the connection's queue, so the kernel may go on reading them
+// until the completion comes, even if the connection is closed before.
+struct UringWrite
+{
+    int fd;
+    unsigned long connectionId;
+    struct msghdr message;
+    vector<struct iovec> iov;
+    vector<shared_ptr<const vec>> frames;
+};
+
+// What to do when a pushed message finds a watcher's outbound queue full
+enum SlowConsumerPolicy
+{
+    SLOW_CONSUMER_DROP_OLDEST, // lose the oldest pushed message still queued
+    SLOW_CONSUMER_CONFLATE,    // overwrite the queued message of the same channel, else drop the oldest
+    SLOW_CONSUMER_DISCONNECT   // close the connection
+};
+
+// What a timer of the wheel belongs to, telling the type of its owner
+enum TimerKind
+{
+    TIMER_LONG_POLL, // owner: the longPolls entry
+    TIMER_THROTTLE,  // owner: the Connection
+    TIMER_IDLE,      // owner: the Connection
+    TIMER_EXPIRY,    // owner: the expiries entry of the channel
+    TIMER_RECONNECT  // owner: the Server
+};
+
+// A server of the cluster, as listed by --cluster, or the primary of a replica
+struct ClusterNode
+{
+    string name; // "host:port", which also places the node on the ring
+    struct sockaddr_in address;
+    Connection *link; // connection forwarding requests to the node, NULL until one is needed
+};
+
+// State shared by every connection the event loop serves
+struct Server
+{
+    int epfd;
+    // io_uring backend with --io-uring, NULL when the loop runs on epoll
+    // alone. It accepts TCP clients and reads and writes their sockets;
+    // everything else stays on the epoll instance, which the ring polls.
+    Uring *uring;
+    bool epollReady;
+    unsigned int sockfd;
+    // Datagram socket on the same port with --udp, -1 otherwise. Its
+    // publishes are handled as if a connection had sent them, one that never
+    // gets a reply; buffers hold what one recvmmsg call reads.
+    int udpfd;
+    Connection *datagrams;
+    vector<unsigned char> datagramBuffers;
+    // Unix domain socket for clients on the same host with --unix, -1
+    // otherwise, and the connections that moved onto shared-memory rings, by
+    // the eventfd their client signals
+    int unixfd;
+    string unixPath;
+    unordered_map<int, Connection *> doorbells;
+    // Directory of the files holding messages published in Chunk frames,
+    // and those messages by channel
+    string spoolDir;
+    unordered_map<string, SpooledMessage> spooled;
+    HashMap *map;
+    unordered_map<int, Connection *> connections;
+    unordered_map<unsigned long, LongPoll> longPolls;
+    unsigned long nextConnectionId;
+    unsigned long nextPollToken;
+    // Frames a connection may have queued before the slow-consumer policy applies
+    size_t queueLimit;
+    SlowConsumerPolicy slowConsumerPolicy;
+    // Admission control: connections beyond these limits are closed on accept, 0 for unlimited
+    size_t maxConnections;
+    size_t maxSourceConnections;
+    // Requests and bytes per second allowed to each connection and to each source address
+    RateLimit connectionLimit;
+    RateLimit sourceLimit;
+    unordered_map<in_addr_t, SourceState> sources;
+    // Every deadline of the event loop: long-poll timeouts, throttles, idle
+    // connections and expiring messages
+    TimerWheel timers;
+    // Expiry timers of the channels whose message has a time to live
+    unordered_map<string, TimerNode> expiries;
+    // Close connections quiet for idleTimeout milliseconds, and ping them
+    // after keepalive milliseconds; 0 for never
+    unsigned long idleTimeout;
+    unsigned long keepalive;
+    unsigned int nextPingId;
+    // Time to live of messages published without one, 0 for forever
+    unsigned long messageTtl;
+    // Cluster mode: the ring maps every channel to one of the nodes, and
+    // requests for channels of other nodes are forwarded to them. nodes is
+    // empty when the server runs on its own; self is its index in nodes.
+    vector<ClusterNode> nodes;
+    int self;
+    HashRing ring;
+    // Replication, as a primary: every stored message is a change with the
+    // next sequence number. Once a replica has asked for the feed, the last
+    // backlogLimit changes are kept encrypted, so a replica that reconnects
+    // resumes from them instead of taking a whole snapshot again. epoch tells
+    // runs of the server apart, since sequences start over with the store.
+    u64 epoch;
+    u64 sequence;
+    bool replicating;
+    deque<pair<u64, shared_ptr<const vec>>> backlog;
+    size_t backlogLimit;
+    vector<Connection *> replicas;
+    // Replication, as a replica of upstream (no name when the server is not
+    // one): the primary's epoch and the last of its changes applied, and how
+    // old that change was when it arrived. While a snapshot comes in,
+    // synced holds the channels it had so far.
+    ClusterNode upstream;
+    u64 upstreamEpoch;
+    u64 upstreamSequence;
+    unsigned long replicationLag;
+    bool syncing;
+    unordered_set<string> synced;
+    TimerNode reconnectTimer;
+    Metrics metrics;
+    // Where to dump the metrics every statsInterval milliseconds, NULL for never
+    const char *statsFile;
+    unsigned long statsInterval;
+    unsigned long nextStatsDump;
+};
+
 string checkMessageType(vec bytes);
-void processSubscribeRequest(unsigned int newsockfd, vec responseBytes, HashMap *map);
-void processPublishRequest(vec responseBytes, HashMap *map);
-void pushToBuffer(char buffer[], vec *serializedMessageStruct);
-void processClientConnection(int newsockfd, char *hostName, int hostPortNo, int comPortNo);
-vec serializeFile(HashMap *map, string fileName);
+void processSubscribeRequest(Server *server, Connection *conn, vec requestBytes);
+void processConditionalSubscribeRequest(Server *server, Connection *conn, vec requestBytes);
+void processPublishRequest(Server *server, Connection *conn, vec requestBytes);
+void processBatchSubscribeRequest(Server *server, Connection *conn, vec requestBytes);
+void processBatchPublishRequest(Server *server, Connection *conn, vec requestBytes);
+void publishMessages(Server *server, Connection *conn, struct MultiMessage &batchStruct);
+void processStatsRequest(Server *server, Connection *conn, vec requestBytes);
+void processHelloRequest(Server *server, Connection *conn, vec requestBytes, bool firstFrame);
+void processWatchRequest(Server *server, Connection *conn, vec requestBytes);
+bool resolveNode(string name, ClusterNode *node);
+bool configureCluster(Server *server, string selfName, string list, int replicas);
+int remoteOwner(Server *server, const string &channel);
+shared_ptr<PendingReply> newReply(Connection *conn);
+shared_ptr<PendingReply> holdReply(Connection *conn);
+Connection *linkTo(Server *server, Connection *conn, ClusterNode *target);
+void forwardPublishes(Server *server, Connection *conn, ClusterNode *target, struct MultiMessage &batchStruct);
+void forwardRequest(Server *server, Connection *conn, ClusterNode *target, vec requestBytes, shared_ptr<PendingReply> reply, vector<size_t> slots);
+void redirectRequest(Server *server, Connection *conn, string channel, int node);
+Connection *openLink(Server *server, ClusterNode *target);
+void processLinkReplies(Server *server, Connection *link);
+bool fillReply(ForwardedRequest &request, vec &replyBytes);
+void flushLinks(Server *server);
+Connection *findConnection(Server *server, int fd, unsigned long connectionId);
+void pushFrame(Server *server, Connection *conn, OutboundFrame &frame);
+void pushLatest(Server *server, Connection *conn, OutboundFrame &frame);
+struct Stats collectStats(Server *server);
+void dumpStats(Server *server);
+void storeMessage(Server *server, Connection *conn, struct Message &messageStruct, unsigned long version = 0,
+                  shared_ptr<SpoolFile> file = shared_ptr<SpoolFile>());
+void processChunkRequest(Server *server, Connection *conn, vec requestBytes);
+shared_ptr<SpoolFile> findSpooled(Server *server, const string &channel, unsigned long version);
+bool readSpooled(SpoolFile *file, vec &contentBytes);
+void queueSpooled(Server *server, Connection *conn, const string &channel, unsigned long version, shared_ptr<SpoolFile> file);
+ssize_t writeFromFile(Server *server, Connection *conn, OutboundFrame &frame);
+void deltaFor(Server *server, Connection *conn, struct Message &message, unsigned long held);
+void replicateChange(Server *server, Connection *conn, struct Message &messageStruct, unsigned long version, unsigned long expiresAt);
+void processReplicateRequest(Server *server, Connection *conn, vec requestBytes);
+void connectUpstream(Server *server);
+bool applyReplication(Server *server, Connection *link, vec &frameBytes);
+void queueFrame(Connection *conn, vec *serializedP);
+void serveForever(Server *server);
+void acceptConnections(Server *server, int listenfd);
+int openUnixSocket(Server *server, string path, int backlog);
+void processAttachRequest(Server *server, Connection *conn, vec requestBytes);
+ssize_t writeToRing(Connection *conn, struct iovec *iov, int count);
+void readFromRings(Server *server, Connection *conn);
+void noteActivity(Server *server, Connection *conn);
+int openDatagramSocket(Server *server, int port);
+void readDatagrams(Server *server);
+void processDatagram(Server *server, unsigned char *bytes, size_t length);
+void readFromConnection(Server *server, Connection *conn);
+void receiveBytes(Server *server, Connection *conn, const unsigned char *bytes, size_t n);
+void admitConnection(Server *server, int newsockfd, bool local, struct sockaddr_in cli_addr);
+void handleEvents(Server *server, struct epoll_event *events, int n);
+Uring *startRing(Server *server);
+void handleCompletions(Server *server);
+u64 uringData(Connection *conn, UringKind kind);
+Connection *findUringConnection(Server *server, u64 data);
+void armReceive(Server *server, Connection *conn);
+void completeReceive(Server *server, struct io_uring_cqe *cqe);
+void submitWrites(Server *server, Connection *conn, struct iovec *iov, int count);
+void completeWrite(Server *server, UringWrite *write, int result);
+bool processInbound(Server *server, Connection *conn);
+bool admitFrame(Server *server, Connection *conn, size_t length);
+void runTimers(Server *server);
+void resumeThrottled(Server *server, Connection *conn);
+void checkIdle(Server *server, Connection *conn);
+void scheduleIdle(Server *server, Connection *conn);
+void expireLongPoll(Server *server, pair<const unsigned long, LongPoll> *entry);
+void expireMessage(Server *server, pair<const string, TimerNode> *entry);
+void updateInterest(Server *server, Connection *conn, bool wantsWrite);
+void flushConnection(Server *server, Connection *conn);
+size_t dropWritten(Connection *conn, size_t written);
+ssize_t sendZerocopy(Server *server, Connection *conn, struct iovec *iov, int count);
+bool reapZerocopy(Server *server, Connection *conn);
+void closeConnection(Server *server, Connection *conn);
+unsigned long currentMillis();
+unsigned long wallMillis();
+
+/**
+ * @brief Subroutine to encode a reply in the encoding a connection negotiated
+ */
+template <typename Frame>
+vec encodeFor(u64 capabilities, Frame &frame)
+{
+    return (capabilities & HMP221_CAP_COMPACT) != 0 ? hmp221::serialize_compact(frame) : hmp221::serialize(frame);
+}
+
+// Messages are also decompressed for connections that did not negotiate compression
+vec encodeFor(u64 capabilities, struct Message &frame);
+vec encodeFor(u64 capabilities, struct MultiMessage &frame);
+
+template <typename Frame>
+vec encodeFor(Connection *conn, Frame &frame)
+{
+    return encodeFor(conn->capabilities, frame);
+}
+
+#ifdef HMP221_TRACE
+// Set by SIGUSR2; the event loop then dumps the trace ring
+static volatile sig_atomic_t traceDumpRequested = 0;
+
+void requestTraceDump(int signo)
+{
+    traceDumpRequested = 1;
+}
+#endif
 
 int main(int argv, char **argc)
 {
     bool hasHostNameFlag = false;
-    // char *mode;
-    // char *filePath;
     char *serverInfo;
+    const char *statsFile = NULL;
+    unsigned long statsInterval = 10;
+    size_t queueLimit = 1024;
+    SlowConsumerPolicy slowConsumerPolicy = SLOW_CONSUMER_DROP_OLDEST;
+    int backlog = SOMAXCONN;
+    size_t maxConnections = 0;
+    size_t maxSourceConnections = 0;
+    RateLimit connectionLimit = {0, 0};
+    RateLimit sourceLimit = {0, 0};
+    unsigned long idleTimeout = 0;
+    unsigned long keepalive = 0;
+    unsigned long messageTtl = 0;
+    const char *clusterList = NULL;
+    int replicas = CLUSTER_REPLICAS;
+    const char *replicaOf = NULL;
+    size_t replicationBacklog = REPLICATION_BACKLOG;
+    bool udp = false;
+    const char *unixPath = NULL;
+    const char *spoolDir = "/tmp";
+    bool ioUring = false;
     char *hostName;
     int hostPortNo;
-    int comPortNo = 8888; // Port number that a socket used to communicate with children processes bound to.
-                          // Data delivered through this socket comes from the hashmap
-    unsigned int sockfd, newsockfd, clilen;
-    struct sockaddr_in serv_addr, cli_addr;
-    int n, pid;
+    unsigned int sockfd;
+    struct sockaddr_in serv_addr;
+    logger.start();
     for (int i = 1; i < argv; i++)
     {
         char *currentString = *(argc + i);
@@ -41,29 +365,134 @@ int main(int argv, char **argc)
             hasHostNameFlag = true;
             serverInfo = *(argc + i + 1);
         }
+        else if (strcmp(currentString, "--stats-file") == 0 && i + 1 < argv)
+        {
+            statsFile = *(argc + i + 1);
+        }
+        else if (strcmp(currentString, "--stats-interval") == 0 && i + 1 < argv)
+        {
+            statsInterval = strtoul(*(argc + i + 1), NULL, 10);
+        }
+        else if (strcmp(currentString, "--queue-limit") == 0 && i + 1 < argv)
+        {
+            queueLimit = strtoul(*(argc + i + 1), NULL, 10);
+        }
+        else if (strcmp(currentString, "--slow-consumer") == 0 && i + 1 < argv)
+        {
+            char *policy = *(argc + i + 1);
+            if (strcmp(policy, "conflate") == 0)
+            {
+                slowConsumerPolicy = SLOW_CONSUMER_CONFLATE;
+            }
+            else if (strcmp(policy, "disconnect") == 0)
+            {
+                slowConsumerPolicy = SLOW_CONSUMER_DISCONNECT;
+            }
+        }
+        else if (strcmp(currentString, "--backlog") == 0 && i + 1 < argv)
+        {
+            backlog = atoi(*(argc + i + 1));
+        }
+        else if (strcmp(currentString, "--max-connections") == 0 && i + 1 < argv)
+        {
+            maxConnections = strtoul(*(argc + i + 1), NULL, 10);
+        }
+        else if (strcmp(currentString, "--max-source-connections") == 0 && i + 1 < argv)
+        {
+            maxSourceConnections = strtoul(*(argc + i + 1), NULL, 10);
+        }
+        else if (strcmp(currentString, "--rate-limit") == 0 && i + 1 < argv)
+        {
+            connectionLimit.requestsPerSecond = strtod(*(argc + i + 1), NULL);
+        }
+        else if (strcmp(currentString, "--byte-limit") == 0 && i + 1 < argv)
+        {
+            connectionLimit.bytesPerSecond = strtod(*(argc + i + 1), NULL);
+        }
+        else if (strcmp(currentString, "--source-rate-limit") == 0 && i + 1 < argv)
+        {
+            sourceLimit.requestsPerSecond = strtod(*(argc + i + 1), NULL);
+        }
+        else if (strcmp(currentString, "--source-byte-limit") == 0 && i + 1 < argv)
+        {
+            sourceLimit.bytesPerSecond = strtod(*(argc + i + 1), NULL);
+        }
+        else if (strcmp(currentString, "--idle-timeout") == 0 && i + 1 < argv)
+        {
+            idleTimeout = strtoul(*(argc + i + 1), NULL, 10);
+        }
+        else if (strcmp(currentString, "--keepalive") == 0 && i + 1 < argv)
+        {
+            keepalive = strtoul(*(argc + i + 1), NULL, 10);
+        }
+        else if (strcmp(currentString, "--message-ttl") == 0 && i + 1 < argv)
+        {
+            messageTtl = strtoul(*(argc + i + 1), NULL, 10);
+        }
+        else if (strcmp(currentString, "--cluster") == 0 && i + 1 < argv)
+        {
+            clusterList = *(argc + i + 1);
+        }
+        else if (strcmp(currentString, "--vnodes") == 0 && i + 1 < argv)
+        {
+            replicas = atoi(*(argc + i + 1));
+        }
+        else if (strcmp(currentString, "--replica-of") == 0 && i + 1 < argv)
+        {
+            replicaOf = *(argc + i + 1);
+        }
+        else if (strcmp(currentString, "--replication-backlog") == 0 && i + 1 < argv)
+        {
+            replicationBacklog = strtoul(*(argc + i + 1), NULL, 10);
+        }
+        else if (strcmp(currentString, "--udp") == 0)
+        {
+            udp = true;
+        }
+        else if (strcmp(currentString, "--unix") == 0 && i + 1 < argv)
+        {
+            unixPath = *(argc + i + 1);
+        }
+        else if (strcmp(currentString, "--spool-dir") == 0 && i + 1 < argv)
+        {
+            spoolDir = *(argc + i + 1);
+        }
+        else if (strcmp(currentString, "--io-uring") == 0)
+        {
+            ioUring = true;
+        }
     }
 
     if (!hasHostNameFlag)
     {
-        cout << "No --hostname flag found." << endl;
+        LOG_ERROR("No --hostname flag found.");
+        return 1;
+    }
+    if (clusterList != NULL && replicaOf != NULL)
+    {
+        LOG_ERROR("A server cannot be both a cluster node and a replica.");
         return 1;
     }
 
     // extract hostname and port number
+    string selfName = serverInfo;
     hostName = strtok(serverInfo, ":");
     hostPortNo = atoi(strtok(NULL, ":"));
 
-    printf("Server is running at %s:%d\n", hostName, hostPortNo);
+    LOG_INFO("Server is running at %s:%d", hostName, hostPortNo);
 
     /* First call to socket() function */
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
     if (sockfd < 0)
     {
-        perror("ERROR opening socket");
+        LOG_ERROR("ERROR opening socket: %s", strerror(errno));
         exit(1);
     }
 
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     /* Initialize socket structure */
     bzero((char *)&serv_addr, sizeof(serv_addr));
 
@@ -74,301 +503,3944 @@ int main(int argv, char **argc)
     /* Now bind the host address using bind() call.*/
     if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
     {
-        perror("ERROR on binding");
+        LOG_ERROR("ERROR on binding: %s", strerror(errno));
         exit(1);
     }
 
-    // Establish a socket for communication between parent and children processes
-    int comSockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    if (comSockfd < 0)
+    /* Now start listening for the clients. Every connection is served by
+     * the event loop in this process, next to the hashmap. A short backlog
+     * makes the kernel drop SYNs of a connection burst, which the clients
+     * only retry after a second, so it defaults to the system maximum.
+     */
+    if (listen(sockfd, backlog > 0 ? backlog : SOMAXCONN) == -1)
     {
-        perror("ERROR opening socket");
+        LOG_ERROR("ERROR on binding: %s", strerror(errno));
         exit(1);
     }
 
-    /* Initialize socket structure */
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(comPortNo);
-
-    /* Now bind the host address using bind() call.*/
-    if (bind(comSockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    Server server;
+    server.sockfd = sockfd;
+    server.map = new HashMap(100);
+    server.nextConnectionId = 1;
+    server.nextPollToken = 1;
+    server.queueLimit = queueLimit > 0 ? queueLimit : 1;
+    server.slowConsumerPolicy = slowConsumerPolicy;
+    server.maxConnections = maxConnections;
+    server.maxSourceConnections = maxSourceConnections;
+    server.connectionLimit = connectionLimit;
+    server.sourceLimit = sourceLimit;
+    server.idleTimeout = idleTimeout * 1000;
+    server.keepalive = keepalive * 1000;
+    server.nextPingId = 1;
+    server.messageTtl = messageTtl * 1000;
+    server.self = -1;
+    if (clusterList != NULL && !configureCluster(&server, selfName, clusterList, replicas > 0 ? replicas : 1))
+    {
+        return 1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    server.epoch = ((u64)now.tv_sec * 1000000000 + now.tv_nsec) ^ getpid();
+    server.sequence = 0;
+    server.replicating = false;
+    server.backlogLimit = replicationBacklog > 0 ? replicationBacklog : 1;
+    server.upstream.link = NULL;
+    if (replicaOf != NULL && !resolveNode(replicaOf, &server.upstream))
+    {
+        return 1;
+    }
+    server.upstreamEpoch = 0;
+    server.upstreamSequence = 0;
+    server.replicationLag = 0;
+    server.syncing = false;
+    timerInit(&server.reconnectTimer, TIMER_RECONNECT, &server);
+    server.metrics.framesDropped = 0;
+    server.metrics.framesConflated = 0;
+    server.metrics.slowConsumersDisconnected = 0;
+    server.metrics.acksSent = 0;
+    server.metrics.connectionsRejected = 0;
+    server.metrics.throttles = 0;
+    server.metrics.idleDisconnects = 0;
+    server.metrics.pingsSent = 0;
+    server.metrics.requestsForwarded = 0;
+    server.metrics.redirects = 0;
+    server.metrics.linkFailures = 0;
+    server.metrics.snapshotsSent = 0;
+    server.metrics.snapshotsApplied = 0;
+    server.metrics.datagramsReceived = 0;
+    server.metrics.datagramsDropped = 0;
+    server.metrics.ringsAttached = 0;
+    server.metrics.handshakes = 0;
+    server.metrics.compressedStored = 0;
+    server.metrics.spooledStored = 0;
+    server.metrics.sendfileBytes = 0;
+    server.metrics.deltasSent = 0;
+    server.metrics.zerocopyBytes = 0;
+    server.metrics.zerocopyCopied = 0;
+    server.metrics.uringEnters = 0;
+    server.metrics.uringCompletions = 0;
+    server.metrics.requests = 0;
+    server.metrics.bytesIn = 0;
+    server.metrics.bytesOut = 0;
+    server.metrics.connectionsAccepted = 0;
+    server.metrics.startMillis = currentMillis();
+    server.statsFile = statsFile;
+    server.spoolDir = spoolDir;
+    server.statsInterval = (statsInterval > 0 ? statsInterval : 1) * 1000;
+    server.nextStatsDump = server.metrics.startMillis + server.statsInterval;
+    server.timers.start(server.metrics.startMillis);
+    server.epfd = epoll_create1(0);
+    if (server.epfd < 0)
     {
-        perror("ERROR on binding");
+        LOG_ERROR("ERROR creating epoll instance: %s", strerror(errno));
         exit(1);
     }
 
-    /* Now start listening for the clients, here
-     * process will go in sleep mode and will wait
-     * for the incoming connection
-     */
-
-    if (listen(sockfd, 5) == -1)
+    // The ring accepts TCP clients itself, epoll is the fallback
+    server.uring = ioUring ? startRing(&server) : NULL;
+    server.epollReady = false;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = sockfd;
+    if (server.uring == NULL && epoll_ctl(server.epfd, EPOLL_CTL_ADD, sockfd, &event) < 0)
     {
-        perror("ERROR on binding");
+        LOG_ERROR("ERROR watching listening socket: %s", strerror(errno));
         exit(1);
     }
-    clilen = sizeof(cli_addr);
+    server.datagrams = NULL;
+    server.udpfd = udp ? openDatagramSocket(&server, hostPortNo) : -1;
+    server.unixfd = unixPath != NULL ? openUnixSocket(&server, unixPath, backlog > 0 ? backlog : SOMAXCONN) : -1;
 
-    HashMap *map = new HashMap(100);
+    // A client that goes away with frames still queued must fail the write, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    if (!server.upstream.name.empty())
+    {
+        LOG_INFO("Replica of %s", server.upstream.name.c_str());
+        connectUpstream(&server);
+    }
+#ifdef HMP221_TRACE
+    signal(SIGUSR2, requestTraceDump);
+#endif
+    serveForever(&server);
+    return 0;
+}
 
+/**
+ * @brief Subroutine to serve every client connection from a single epoll loop
+ *
+ * @param server the listening socket, the hashmap and the open connections
+ */
+void serveForever(Server *server)
+{
+    struct epoll_event events[MAX_EVENTS];
     while (1)
     {
-        newsockfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
-
-        if (newsockfd < 0)
+        // Sleep until the next socket event, the next timer of the wheel or
+        // the next metrics dump
+        int timeout = -1;
+        unsigned long deadline = server->timers.nextExpiry();
+        if (server->statsFile != NULL && server->nextStatsDump < deadline)
         {
-            perror("ERROR on accept new client connection");
-            exit(1);
+            deadline = server->nextStatsDump;
         }
-
-        pid = fork();
-
-        if (pid < 0)
+        if (deadline != ~0UL)
         {
-            perror("ERROR on forking new process");
-            exit(1);
+            unsigned long now = currentMillis();
+            timeout = deadline <= now ? 0 : (int)(deadline - now);
         }
 
-        if (pid == 0)
+        if (server->uring != NULL)
         {
-            /* This is the child process */
-            close(sockfd);
-            close(comSockfd);
-            processClientConnection(newsockfd, hostName, hostPortNo, comPortNo++);
-            exit(0);
+            // One system call submits what the last turn prepared and waits
+            server->metrics.uringEnters++;
+            if (server->uring->submitAndWait(server->epollReady ? 0 : timeout) < 0)
+            {
+                LOG_ERROR("ERROR waiting for completions: %s", strerror(errno));
+                exit(1);
+            }
+            handleCompletions(server);
+            if (server->epollReady)
+            {
+                // Sockets epoll reported may still be ready without waking
+                // the ring again, so it is asked until it has nothing left
+                struct epoll_event events[MAX_EVENTS];
+                int n = epoll_wait(server->epfd, events, MAX_EVENTS, 0);
+                server->epollReady = n > 0;
+                handleEvents(server, events, n > 0 ? n : 0);
+            }
         }
         else
         {
-            close(newsockfd);
-            if (listen(comSockfd, 5) == -1)
+            int n = epoll_wait(server->epfd, events, MAX_EVENTS, timeout);
+            if (n < 0 && errno != EINTR)
             {
-                perror("ERROR on binding parent-child connection socket");
+                LOG_ERROR("ERROR waiting for socket events: %s", strerror(errno));
                 exit(1);
             }
+            handleEvents(server, events, n);
+        }
 
-            // Listen to communication request from child process
-            int newComSockfd = accept(comSockfd, (struct sockaddr *)&cli_addr, &clilen);
+        runTimers(server);
+        // Requests forwarded while handling the events go out together
+        flushLinks(server);
+        if (server->statsFile != NULL && currentMillis() >= server->nextStatsDump)
+        {
+            dumpStats(server);
+            server->nextStatsDump = currentMillis() + server->statsInterval;
+        }
+#ifdef HMP221_TRACE
+        // The signal interrupts the wait, so the dump happens right away
+        if (traceDumpRequested)
+        {
+            traceDumpRequested = 0;
+            string tracePath = "hmp221-trace-" + to_string(getpid()) + ".json";
+            traceDump(tracePath.c_str());
+            LOG_INFO("Trace written to %s", tracePath.c_str());
+        }
+#endif
+    } /* end of while */
+}
 
-            if (newComSockfd < 0)
+/**
+ * @brief Subroutine to serve the sockets epoll reported ready
+ */
+void handleEvents(Server *server, struct epoll_event *events, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        int fd = events[i].data.fd;
+        if (fd == (int)server->sockfd || fd == server->unixfd)
+        {
+            acceptConnections(server, fd);
+            continue;
+        }
+        if (fd == server->udpfd)
+        {
+            readDatagrams(server);
+            continue;
+        }
+        // The connection may have been closed by an earlier event of this batch
+        auto found = server->connections.find(fd);
+        if (found == server->connections.end())
+        {
+            auto ringing = server->doorbells.find(fd);
+            if (ringing != server->doorbells.end())
             {
-                perror("ERROR on accept from child process");
-                exit(1);
+                readFromRings(server, ringing->second);
             }
-            char buffer[65536];
-            bzero(buffer, 65536);
-            n = read(newComSockfd, buffer, 65536);
-
-            // Decrypted the message and push all bytes to a vector
-            vec responseBytes;
-            for (int i = 0; i < 65536; i++)
+            continue;
+        }
+        Connection *conn = found->second;
+        if (events[i].events & EPOLLOUT)
+        {
+            flushConnection(server, conn);
+            if (server->connections.count(fd) == 0)
             {
-                responseBytes.push_back(buffer[i] ^ KEY);
+                continue;
             }
+        }
+        // Completions of zero-copy sends are reported as EPOLLERR too
+        bool reaped = false;
+        if ((events[i].events & EPOLLERR) && !conn->zerocopyHeld.empty())
+        {
+            reaped = reapZerocopy(server, conn);
+            if (server->connections.count(fd) == 0)
+            {
+                continue;
+            }
+        }
+        if ((events[i].events & (EPOLLIN | EPOLLHUP)) || ((events[i].events & EPOLLERR) && !reaped))
+        {
+            readFromConnection(server, conn);
+        }
+    }
+}
 
-            string messageType = checkMessageType(responseBytes);
-
-            if (messageType.compare("subscribe") == 0)
+/**
+ * @brief Subroutine to set up the io_uring backend
+ *
+ * It needs multishot accept and receive and provided buffer rings, all in
+ * Linux 6.0. A kernel without multishot receive only tells when one
+ * completes, so one is tried on a socket pair first.
+ *
+ * @return the ring, with the listening socket and the epoll instance
+ * submitted, or NULL to stay on epoll
+ */
+Uring *startRing(Server *server)
+{
+    Uring *uring = new Uring();
+    if (!uring->setup(URING_ENTRIES) || !uring->provideBuffers(URING_BUFFERS, URING_BUFFER_BYTES, 0))
+    {
+        LOG_WARN("io_uring is not available (%s), using epoll.", strerror(errno));
+        delete uring;
+        return NULL;
+    }
+    int pair[2];
+    bool multishot = false;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) == 0)
+    {
+        uring->receiveMultishot(pair[0], 0, 0);
+        write(pair[1], "", 1);
+        shutdown(pair[1], SHUT_WR);
+        // The byte comes first, then the end of the stream ends the receive
+        bool ended = false;
+        while (!ended && uring->submitAndWait(1000) >= 0)
+        {
+            struct io_uring_cqe *cqe = uring->completion();
+            if (cqe == NULL)
             {
-                processSubscribeRequest(newComSockfd, responseBytes, map);
-                printf("Terminating connection with %s:%d.\n", hostName, hostPortNo);
-                printf("--------------------------------\n");
+                break;
             }
-            else
+            multishot = multishot || (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) != 0);
+            if (cqe->flags & IORING_CQE_F_BUFFER)
             {
-                // vector to stored decrypted bytes
-                vec responseBytes;
-                for (int i = 0; i < 65536; i++)
-                {
-                    responseBytes.push_back(buffer[i] ^ KEY);
-                }
-                processPublishRequest(responseBytes, map);
-                printf("Terminating connection with %s:%d.\n", hostName, hostPortNo);
-                printf("--------------------------------\n");
+                uring->recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
             }
-            close(newComSockfd);
+            ended = (cqe->flags & IORING_CQE_F_MORE) == 0;
+            uring->seen();
         }
-    } /* end of while */
-
-    return 0;
+        close(pair[0]);
+        close(pair[1]);
+    }
+    if (!multishot)
+    {
+        LOG_WARN("io_uring has no multishot receive, using epoll.");
+        delete uring;
+        return NULL;
+    }
+    uring->acceptMultishot(server->sockfd, URING_ACCEPT);
+    uring->poll(server->epfd, POLLIN, true, URING_EPOLL);
+    LOG_INFO("Serving TCP clients through io_uring");
+    return uring;
 }
 
-void ppause(int n)
+/**
+ * @brief Subroutine to handle every completion the ring has
+ *
+ * A completion is copied out before it is handled, since handling it may
+ * fill the submission queue and flush it, which lets the kernel post more.
+ */
+void handleCompletions(Server *server)
 {
-    int x = 0;
-    while (x < n)
+    struct io_uring_cqe *cqe;
+    while ((cqe = server->uring->completion()) != NULL)
     {
-        x += 1;
+        struct io_uring_cqe done = *cqe;
+        server->uring->seen();
+        server->metrics.uringCompletions++;
+        switch (done.user_data & 7)
+        {
+        case URING_WRITE:
+            completeWrite(server, (UringWrite *)(uintptr_t)done.user_data, done.res);
+            break;
+        case URING_ACCEPT:
+            if (done.res >= 0)
+            {
+                struct sockaddr_in cli_addr;
+                socklen_t clilen = sizeof(cli_addr);
+                bzero(&cli_addr, sizeof(cli_addr));
+                getpeername(done.res, (struct sockaddr *)&cli_addr, &clilen);
+                admitConnection(server, done.res, false, cli_addr);
+            }
+            else if (done.res != -EINTR && done.res != -ECONNABORTED)
+            {
+                LOG_ERROR("ERROR on accept new client connection: %s", strerror(-done.res));
+            }
+            if ((done.flags & IORING_CQE_F_MORE) == 0)
+            {
+                server->uring->acceptMultishot(server->sockfd, URING_ACCEPT);
+            }
+            break;
+        case URING_RECEIVE:
+            completeReceive(server, &done);
+            break;
+        case URING_WRITABLE:
+        {
+            Connection *conn = findUringConnection(server, done.user_data);
+            if (conn != NULL)
+            {
+                conn->pollingWritable = false;
+                flushConnection(server, conn);
+            }
+            break;
+        }
+        case URING_EPOLL:
+            server->epollReady = true;
+            if ((done.flags & IORING_CQE_F_MORE) == 0)
+            {
+                server->uring->poll(server->epfd, POLLIN, true, URING_EPOLL);
+            }
+            break;
+        default:
+            // A cancelled receive tells on its own completion
+            break;
+        }
     }
 }
 
 /**
- * @brief process client request to a child process
+ * @brief Subroutine to tag a request of the ring with the connection it is for
  *
- * @param hostName Name of parent process
- * @param hostPortNo Port number that the parent's socket is bound to
- * @param comPortNo Port number of parent's communication socket
+ * With the low half of the connection id next to the socket, a completion
+ * that arrives after the connection closed is not taken for a later one
+ * that got the same descriptor.
  */
-void processClientConnection(int newsockfd, char *hostName, int hostPortNo, int comPortNo)
+u64 uringData(Connection *conn, UringKind kind)
 {
+    return (u64)(u32)conn->id << 32 | (u64)(u32)conn->fd << 3 | kind;
+}
 
-    // Creating a child-parent connection:
-    char buffer[65536];
-    int sockfd, n;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
-
-    /* Create a socket point to communicate with comSockfd in parent process*/
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    if (sockfd < 0)
+Connection *findUringConnection(Server *server, u64 data)
+{
+    auto found = server->connections.find((int)((data >> 3) & 0x1fffffff));
+    if (found == server->connections.end() || (u32)found->second->id != (u32)(data >> 32))
     {
-        perror("ERROR opening socket");
-        exit(1);
+        return NULL;
     }
+    return found->second;
+}
 
-    server = gethostbyname(hostName);
+void armReceive(Server *server, Connection *conn)
+{
+    conn->receiving = true;
+    server->uring->receiveMultishot(conn->fd, 0, uringData(conn, URING_RECEIVE));
+}
 
-    if (server == NULL)
+/**
+ * @brief Subroutine to process what a multishot receive read into a provided buffer
+ *
+ * The receive stops at the end of the stream or an error, which close the
+ * connection, and when the buffers ran out or a throttle cancelled it,
+ * after which it is armed again unless the connection is still throttled.
+ */
+void completeReceive(Server *server, struct io_uring_cqe *cqe)
+{
+    Connection *conn = findUringConnection(server, cqe->user_data);
+    if (conn != NULL && (cqe->flags & IORING_CQE_F_MORE) == 0)
     {
-        fprintf(stderr, "ERROR, no such host\n");
-        exit(0);
+        conn->receiving = false;
     }
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(comPortNo);
-
-    ppause(0x0FFFFFFF);
-    /* Now connect to the server to establish parent-child communication channel*/
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    if (conn != NULL && cqe->res > 0)
     {
-        perror("ERROR establishing communication channel with parent process");
-        exit(1);
+        receiveBytes(server, conn, server->uring->buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT), cqe->res);
     }
-
-    // Take client request message
-    bzero(buffer, 65536);
-    n = read(newsockfd, buffer, 65536);
-
-    if (n < 0)
+    if (cqe->flags & IORING_CQE_F_BUFFER)
     {
-        perror("ERROR reading from client socket");
-        exit(1);
+        server->uring->recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
     }
-
-    n = write(sockfd, buffer, 65536);
-    if (n < 0)
+    // Processing the bytes may have closed the connection
+    conn = findUringConnection(server, cqe->user_data);
+    if (conn == NULL)
     {
-        perror("ERROR writing to parent-child socket");
-        exit(1);
+        return;
     }
-
-    bzero(buffer, 65536);
-    n = read(sockfd, buffer, 65536);
-    if (n < 0)
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED))
     {
-        perror("ERROR reading from parent-child socket");
-        exit(1);
+        closeConnection(server, conn);
+        return;
     }
-
-    n = write(newsockfd, buffer, 65536);
-    if (n < 0)
+    if (!conn->receiving && conn->throttledUntil == 0)
     {
-        perror("ERROR writing to client socket");
-        exit(1);
+        armReceive(server, conn);
     }
-    close(sockfd);
 }
 
 /**
- * @brief Subroutine to check the type of incomming client request (subscribe or publish)
- * 
- * @param bytes bytes sent from client 
- * @return the request type
+ * @brief Subroutine to submit the sends of a connection's queued frames to the ring
+ *
+ * The frames go in linked sends of up to MAX_IOVECS each, so the kernel
+ * sends them in order without the event loop in between. A send only
+ * completes once all of its bytes are in the socket, so one that ends early
+ * failed and cancels those linked after it.
+ *
+ * @param iov the bytes of the first count frames of outbound
  */
-string checkMessageType(vec bytes)
+void submitWrites(Server *server, Connection *conn, struct iovec *iov, int count)
 {
-    if (bytes.size() < 5)
-    { // FIXME: Check for the exact byte
-        throw;
-    }
-    vec message_slice = hmp221::slice(bytes, 2, 10);
-    string message_string = hmp221::deserialize_string(message_slice);
-    if (message_string.compare("Message") == 0)
+    auto frame = conn->outbound.begin();
+    for (int first = 0; first < count; first += MAX_IOVECS)
     {
-        return string("publish");
+        int group = min(count - first, MAX_IOVECS);
+        UringWrite *write = new UringWrite();
+        write->fd = conn->fd;
+        write->connectionId = conn->id;
+        write->iov.assign(iov + first, iov + first + group);
+        for (int i = 0; i < group; i++, ++frame)
+        {
+            write->frames.push_back(frame->bytes);
+        }
+        bzero(&write->message, sizeof(write->message));
+        write->message.msg_iov = write->iov.data();
+        write->message.msg_iovlen = group;
+        server->uring->sendmsg(conn->fd, &write->message, first + group < count, (u64)(uintptr_t)write);
+        conn->writesInFlight++;
     }
-    return string("subscribe");
+    conn->framesInFlight = count;
 }
 
 /**
- * @brief Subroutine to process the subscribe request from the client
- * 
- * @param newComSockfd the socket via which communication is done
- * @param responseBytes decrypted bytes sent from client
- * @param map hashmap to store the channel:message pairs
+ * @brief Subroutine to drop the frames a send of the ring wrote, and go on with the rest
+ *
+ * @param result bytes written, or the negated errno
  */
-void processSubscribeRequest(unsigned int newComSockfd, vec responseBytes, HashMap *map)
+void completeWrite(Server *server, UringWrite *write, int result)
 {
-    struct Request requestStruct = hmp221::deserialize_request(responseBytes);
-    string channel = requestStruct.name;
-    struct Message messageStruct;
-    vec serializedMessageStruct;
-    if (map->get(channel).size() == 0)
+    Connection *conn = findConnection(server, write->fd, write->connectionId);
+    delete write;
+    if (conn == NULL)
     {
-        perror("No message published on this channel.");
-    } else {
-        messageStruct = {channelName: channel, contentBytes: map->get(channel)};
-        std::cout << channel << std::endl;
-        serializedMessageStruct = hmp221::serialize(messageStruct);
+        return;
     }
-    // Encrypt the bytes 
-    for (int i = 0; i < serializedMessageStruct.size(); i++)
+    conn->writesInFlight--;
+    if (result > 0)
     {
-        serializedMessageStruct[i] ^= KEY;
+        server->metrics.bytesOut += result;
+        conn->framesInFlight -= min(dropWritten(conn, result), conn->framesInFlight);
     }
-    char buffer[serializedMessageStruct.size()];
-    // Push the encrypted bytes to buffer
-    pushToBuffer(buffer, &serializedMessageStruct);
-
-    /* Send message to the server */
-    int n = write(newComSockfd, buffer, serializedMessageStruct.size());
-    if (n < 0)
+    else if (result < 0 && result != -ECANCELED)
     {
-        perror("ERROR writing to socket");
-        exit(1);
+        closeConnection(server, conn);
+        return;
+    }
+    if (conn->writesInFlight == 0)
+    {
+        conn->framesInFlight = 0;
+        flushConnection(server, conn);
     }
-    cout << "Message sent.\nDone." << endl;
 }
 
 /**
- * @brief Subroutine to process the message published from the client
- * 
- * @param responseBytes the decrypted bytes sent from the client
- * @param map hashmap to store the message under an unique channel
+ * @brief Subroutine to accept every pending client connection
+ *
+ * Clients on the Unix domain socket count as one source, the loopback
+ * address, for admission control and rate limits.
+ *
+ * @param server the listening sockets and the open connections
+ * @param listenfd the listening socket that became readable
  */
-void processPublishRequest(vec responseBytes, HashMap *map)
+void acceptConnections(Server *server, int listenfd)
 {
-    struct Message messageStruct = hmp221::deserialize_message(responseBytes);
-    printf("Received a message of %ld bytes\n", messageStruct.contentBytes.size());
-    string channel = messageStruct.channelName;
-    map->put(channel, messageStruct.contentBytes);
+    bool local = listenfd == server->unixfd;
+    while (1)
+    {
+        struct sockaddr_in cli_addr;
+        socklen_t clilen = sizeof(cli_addr);
+        unsigned long start = currentNanos();
+        TRACE_BEGIN(acceptTrace);
+        int newsockfd = accept4(listenfd, local ? NULL : (struct sockaddr *)&cli_addr, local ? NULL : &clilen, SOCK_NONBLOCK);
+        if (newsockfd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+            {
+                LOG_ERROR("ERROR on accept new client connection: %s", strerror(errno));
+            }
+            return;
+        }
+        recordSince(&server->metrics, OP_ACCEPT, start);
+        TRACE_END(acceptTrace, TRACE_ACCEPT, server->nextConnectionId, 0);
+        admitConnection(server, newsockfd, local, cli_addr);
+    }
 }
 
 /**
- * @brief Subroutine to push a vector of bytes to a buffer
- * 
- * @param buffer 
- * @param bytesP 
+ * @brief Subroutine to serve a connection just accepted, unless the limits shed it
+ *
+ * @param newsockfd the connected socket, non-blocking
+ * @param local whether it came in on the Unix domain socket
+ * @param cli_addr address of the client over TCP
  */
-void pushToBuffer(char buffer[], vec *bytesP)
+void admitConnection(Server *server, int newsockfd, bool local, struct sockaddr_in cli_addr)
 {
-    for (int i = 0; i < bytesP->size(); i++)
+    if (local)
+    {
+        cli_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        cli_addr.sin_port = 0;
+    }
+
+    // Shed load before the connection costs anything more than the accept
+    SourceState &source = server->sources[cli_addr.sin_addr.s_addr];
+    if ((server->maxConnections > 0 && server->connections.size() >= server->maxConnections) ||
+        (server->maxSourceConnections > 0 && source.connections >= server->maxSourceConnections))
+    {
+        if (source.connections == 0)
+        {
+            server->sources.erase(cli_addr.sin_addr.s_addr);
+        }
+        close(newsockfd);
+        server->metrics.connectionsRejected++;
+        LOG_DEBUG("Rejected a connection from %s", inet_ntoa(cli_addr.sin_addr));
+        return;
+    }
+    unsigned long now = currentNanos();
+    if (source.connections == 0 && source.requests.lastNanos == 0)
+    {
+        bucketInit(&source.requests, server->sourceLimit.requestsPerSecond, now);
+        bucketInit(&source.bytes, server->sourceLimit.bytesPerSecond, now);
+    }
+    source.connections++;
+    server->metrics.connectionsAccepted++;
+
+    Connection *conn = new Connection();
+    conn->fd = newsockfd;
+    conn->id = server->nextConnectionId++;
+    conn->peer = local ? "unix:" + server->unixPath : string(inet_ntoa(cli_addr.sin_addr)) + ":" + to_string(ntohs(cli_addr.sin_port));
+    conn->local = local;
+    conn->protocolVersion = 0;
+    conn->capabilities = 0;
+    conn->protocolSettled = false;
+    conn->rings = NULL;
+    conn->outboundOffset = 0;
+    conn->wantsWrite = false;
+    conn->closeAfterFlush = false;
+    // Local clients may pass descriptors, which only a plain recvmsg takes,
+    // so they stay on epoll
+    conn->onUring = server->uring != NULL && !local;
+    conn->receiving = false;
+    conn->pollingWritable = false;
+    conn->writesInFlight = 0;
+    conn->framesInFlight = 0;
+    // Unix domain sockets have no MSG_ZEROCOPY, and the ring copies its sends
+    int zerocopy = 1;
+    conn->zerocopy = !local && !conn->onUring && setsockopt(newsockfd, SOL_SOCKET, SO_ZEROCOPY, &zerocopy, sizeof(zerocopy)) == 0;
+    conn->zerocopySends = 0;
+    conn->broken = false;
+    conn->pendingAck = 0;
+    conn->clusterNode = NULL;
+    conn->nextPacketId = 1;
+    conn->source = &source;
+    conn->sourceAddress = cli_addr.sin_addr.s_addr;
+    conn->throttledUntil = 0;
+    timerInit(&conn->throttleTimer, TIMER_THROTTLE, conn);
+    timerInit(&conn->idleTimer, TIMER_IDLE, conn);
+    conn->lastActivity = currentMillis();
+    conn->pingSent = false;
+    scheduleIdle(server, conn);
+    bucketInit(&conn->requestBucket, server->connectionLimit.requestsPerSecond, now);
+    bucketInit(&conn->byteBucket, server->connectionLimit.bytesPerSecond, now);
+    if (conn->onUring)
+    {
+        server->connections[newsockfd] = conn;
+        armReceive(server, conn);
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = newsockfd;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, newsockfd, &event) < 0)
     {
-        buffer[i] = (*bytesP)[i];
+        LOG_ERROR("ERROR watching client connection: %s", strerror(errno));
+        close(newsockfd);
+        source.connections--;
+        server->timers.cancel(&conn->idleTimer);
+        delete conn;
+        return;
     }
+    server->connections[newsockfd] = conn;
+}
+
+/**
+ * @brief Subroutine to listen on a Unix domain socket for clients on the same host
+ *
+ * A local client skips name resolution and the TCP stack, and may move its
+ * connection onto shared memory with an Attach.
+ *
+ * @param path where to create the socket; a stale one left there is replaced
+ * @return the listening socket
+ */
+int openUnixSocket(Server *server, string path, int backlog)
+{
+    struct sockaddr_un address;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        LOG_ERROR("Unix socket path %s is too long", path.c_str());
+        exit(1);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        LOG_ERROR("ERROR opening unix socket: %s", strerror(errno));
+        exit(1);
+    }
+    bzero((char *)&address, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, backlog) < 0)
+    {
+        LOG_ERROR("ERROR on binding unix socket: %s", strerror(errno));
+        exit(1);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        LOG_ERROR("ERROR watching unix socket: %s", strerror(errno));
+        exit(1);
+    }
+    server->unixPath = path;
+    LOG_INFO("Accepting local clients on %s", path.c_str());
+    return fd;
+}
+
+/**
+ * @brief Subroutine to move a local connection onto the shared-memory rings its client set up
+ *
+ * The client passes a memory file holding both rings, the eventfd it
+ * signals when it has written requests or made room for replies, and the
+ * eventfd it waits on. The Attach is answered on the socket, which carries
+ * nothing else from then on. A request that cannot be honoured closes the
+ * connection.
+ *
+ * @param conn the connection the request came from
+ * @param requestBytes decrypted bytes sent from client
+ */
+void processAttachRequest(Server *server, Connection *conn, vec requestBytes)
+{
+    struct Attach attachStruct = hmp221::deserialize_attach(requestBytes);
+    size_t capacity = attachStruct.capacity;
+    if (!conn->local || conn->rings != NULL || conn->passedFds.size() != 3 || !conn->outbound.empty() ||
+        capacity < MIN_RING_BYTES || capacity > MAX_RING_BYTES || (capacity & (capacity - 1)) != 0)
+    {
+        LOG_WARN("Refused to attach rings for %s.", conn->peer.c_str());
+        conn->broken = true;
+        return;
+    }
+    int memoryFd = conn->passedFds[0];
+    LocalRings *rings = new LocalRings();
+    rings->size = 2 * (SHM_RING_HEADER + capacity);
+    rings->doorbell = conn->passedFds[1];
+    rings->clientDoorbell = conn->passedFds[2];
+    conn->passedFds.clear();
+    struct stat memoryStat;
+    rings->memory = fstat(memoryFd, &memoryStat) == 0 && (size_t)memoryStat.st_size >= rings->size
+                        ? mmap(NULL, rings->size, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0)
+                        : MAP_FAILED;
+    close(memoryFd);
+    fcntl(rings->doorbell, F_SETFL, O_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = rings->doorbell;
+    if (rings->memory == MAP_FAILED || epoll_ctl(server->epfd, EPOLL_CTL_ADD, rings->doorbell, &event) < 0)
+    {
+        LOG_WARN("Cannot attach rings for %s: %s", conn->peer.c_str(), strerror(errno));
+        if (rings->memory != MAP_FAILED)
+        {
+            munmap(rings->memory, rings->size);
+        }
+        close(rings->doorbell);
+        close(rings->clientDoorbell);
+        delete rings;
+        conn->broken = true;
+        return;
+    }
+    rings->requests.attach(rings->memory, capacity);
+    rings->replies.attach((unsigned char *)rings->memory + SHM_RING_HEADER + capacity, capacity);
+
+    // The reply is the last frame on the socket; it is small and the socket empty, so it fits
+    vec serializedReply = hmp221::serialize(attachStruct);
+    for (size_t i = 0; i < serializedReply.size(); i++)
+    {
+        serializedReply[i] ^= KEY;
+    }
+    if (write(conn->fd, serializedReply.data(), serializedReply.size()) != (ssize_t)serializedReply.size())
+    {
+        epoll_ctl(server->epfd, EPOLL_CTL_DEL, rings->doorbell, NULL);
+        munmap(rings->memory, rings->size);
+        close(rings->doorbell);
+        close(rings->clientDoorbell);
+        delete rings;
+        conn->broken = true;
+        return;
+    }
+    server->metrics.bytesOut += serializedReply.size();
+    conn->rings = rings;
+    server->doorbells[rings->doorbell] = conn;
+    server->metrics.ringsAttached++;
+    // Until the first doorbell the server waits for requests like after any read
+    if (!rings->requests.sleep())
+    {
+        u64 one = 1;
+        write(rings->doorbell, &one, sizeof(one));
+    }
+    LOG_DEBUG("Attached rings of %zu bytes for %s", capacity, conn->peer.c_str());
+}
+
+/**
+ * @brief Subroutine to copy queued frames into the reply ring of an attached connection, like writev
+ *
+ * @return bytes written, or -1 with EAGAIN when the ring is full; the client
+ *         then signals the server's doorbell once it has made room. -1 with
+ *         EPROTO when the client left the ring's head and tail inconsistent,
+ *         which closes the connection.
+ */
+ssize_t writeToRing(Connection *conn, struct iovec *iov, int count)
+{
+    ShmRing &replies = conn->rings->replies;
+    ssize_t n = replies.write(iov, count);
+    if (n == 0)
+    {
+        if (replies.waitForRoom())
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        n = replies.write(iov, count);
+    }
+    if (n < 0)
+    {
+        LOG_WARN("Reply ring of %s is corrupt.", conn->peer.c_str());
+        errno = EPROTO;
+        return -1;
+    }
+    if (n > 0 && replies.wakeConsumer())
+    {
+        u64 one = 1;
+        write(conn->rings->clientDoorbell, &one, sizeof(one));
+    }
+    return n;
+}
+
+/**
+ * @brief Subroutine to handle the doorbell of an attached connection
+ *
+ * The client rings it when it wrote requests while the server was not
+ * looking, or made room for replies the server was waiting to write. The
+ * requests ring is read until it is empty, as far as the rate limits allow;
+ * a client that keeps writing is left for the next turn of the event loop
+ * after RING_READS reads.
+ *
+ * @param conn the attached connection
+ */
+void readFromRings(Server *server, Connection *conn)
+{
+    LocalRings *rings = conn->rings;
+    u64 rung;
+    read(rings->doorbell, &rung, sizeof(rung));
+    if (!conn->outbound.empty() || !conn->latest.empty())
+    {
+        int fd = conn->fd;
+        unsigned long id = conn->id;
+        flushConnection(server, conn);
+        if (findConnection(server, fd, id) == NULL)
+        {
+            return;
+        }
+    }
+
+    unsigned char buffer[65536];
+    for (int reads = 0; conn->throttledUntil == 0; reads++)
+    {
+        if (reads == RING_READS)
+        {
+            // Ring the doorbell to come back after the other connections
+            u64 one = 1;
+            write(rings->doorbell, &one, sizeof(one));
+            break;
+        }
+        TRACE_BEGIN(readTrace);
+        ssize_t n = rings->requests.read(buffer, sizeof(buffer));
+        TRACE_END(readTrace, TRACE_READ, conn->id, n > 0 ? n : 0);
+        if (n < 0)
+        {
+            LOG_WARN("Request ring of %s is corrupt.", conn->peer.c_str());
+            closeConnection(server, conn);
+            return;
+        }
+        if (n == 0)
+        {
+            // The client rings the doorbell for the next request
+            if (rings->requests.sleep())
+            {
+                break;
+            }
+            continue;
+        }
+        if (rings->requests.wakeProducer())
+        {
+            u64 one = 1;
+            write(rings->clientDoorbell, &one, sizeof(one));
+        }
+        server->metrics.bytesIn += n;
+        noteActivity(server, conn);
+        for (ssize_t i = 0; i < n; i++)
+        {
+            conn->inbound.push_back(buffer[i] ^ KEY);
+        }
+        if (!processInbound(server, conn))
+        {
+            return;
+        }
+    }
+    flushConnection(server, conn);
+}
+
+/**
+ * @brief Subroutine to open the socket for publishes sent as datagrams
+ *
+ * A device that only publishes a few bytes now and then saves the TCP
+ * handshake and teardown, and the server saves a connection per device.
+ *
+ * @param port the port the server listens on, which the datagrams use as well
+ * @return the socket
+ */
+int openDatagramSocket(Server *server, int port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        LOG_ERROR("ERROR opening datagram socket: %s", strerror(errno));
+        exit(1);
+    }
+    int receiveBuffer = UDP_RECEIVE_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+
+    struct sockaddr_in address;
+    bzero((char *)&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        LOG_ERROR("ERROR on binding datagram socket: %s", strerror(errno));
+        exit(1);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        LOG_ERROR("ERROR watching datagram socket: %s", strerror(errno));
+        exit(1);
+    }
+
+    Connection *datagrams = new Connection();
+    datagrams->fd = fd;
+    datagrams->id = server->nextConnectionId++;
+    datagrams->peer = "udp";
+    datagrams->local = false;
+    datagrams->protocolVersion = 0;
+    datagrams->capabilities = 0;
+    datagrams->protocolSettled = true;
+    datagrams->rings = NULL;
+    datagrams->outboundOffset = 0;
+    datagrams->wantsWrite = false;
+    datagrams->closeAfterFlush = false;
+    datagrams->zerocopy = false;
+    datagrams->onUring = false;
+    datagrams->zerocopySends = 0;
+    datagrams->broken = false;
+    datagrams->pendingAck = 0;
+    datagrams->clusterNode = NULL;
+    datagrams->nextPacketId = 1;
+    datagrams->source = NULL;
+    datagrams->sourceAddress = 0;
+    datagrams->throttledUntil = 0;
+    timerInit(&datagrams->throttleTimer, TIMER_THROTTLE, datagrams);
+    timerInit(&datagrams->idleTimer, TIMER_IDLE, datagrams);
+    datagrams->lastActivity = 0;
+    datagrams->pingSent = false;
+    bucketInit(&datagrams->requestBucket, 0, 0);
+    bucketInit(&datagrams->byteBucket, 0, 0);
+    server->datagrams = datagrams;
+    server->datagramBuffers.resize((size_t)UDP_BATCH * MAX_DATAGRAM_BYTES);
+    LOG_INFO("Accepting publishes as datagrams on port %d", port);
+    return fd;
+}
+
+/**
+ * @brief Subroutine to read every datagram waiting on the socket
+ *
+ * recvmmsg takes up to UDP_BATCH datagrams per system call, so a burst of
+ * small publishes costs a few calls rather than one each.
+ */
+void readDatagrams(Server *server)
+{
+    struct mmsghdr messages[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    for (int i = 0; i < UDP_BATCH; i++)
+    {
+        iov[i].iov_base = server->datagramBuffers.data() + (size_t)i * MAX_DATAGRAM_BYTES;
+        iov[i].iov_len = MAX_DATAGRAM_BYTES;
+        bzero(&messages[i], sizeof(messages[i]));
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (1)
+    {
+        TRACE_BEGIN(readTrace);
+        int n = recvmmsg(server->udpfd, messages, UDP_BATCH, MSG_DONTWAIT, NULL);
+        TRACE_END(readTrace, TRACE_READ, server->datagrams->id, n > 0 ? n : 0);
+        if (n <= 0)
+        {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                LOG_ERROR("ERROR receiving datagrams: %s", strerror(errno));
+            }
+            return;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            server->metrics.datagramsReceived++;
+            server->metrics.bytesIn += messages[i].msg_len;
+            if (messages[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                server->metrics.datagramsDropped++;
+                continue;
+            }
+            processDatagram(server, (unsigned char *)iov[i].iov_base, messages[i].msg_len);
+        }
+        if (n < UDP_BATCH)
+        {
+            // The socket is drained; reading again would only return EAGAIN
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Subroutine to publish the messages of one datagram
+ *
+ * A datagram holds one or more whole Message or MultiMessage frames, and
+ * nothing else: there is no reply to send a subscriber on. Packet ids are
+ * ignored, since an Ack could not be sent either. A datagram that is not
+ * made of such frames is dropped as a whole.
+ *
+ * @param bytes the encrypted datagram, decrypted in place
+ * @param length size of the datagram
+ */
+void processDatagram(Server *server, unsigned char *bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        bytes[i] ^= KEY;
+    }
+    vector<pair<size_t, size_t>> frames;
+    size_t offset = 0;
+    while (offset < length)
+    {
+        long frameLength = hmp221::frame_length(bytes + offset, length - offset);
+        if (frameLength <= 0)
+        {
+            server->metrics.datagramsDropped++;
+            return;
+        }
+        frames.push_back(make_pair(offset, (size_t)frameLength));
+        offset += frameLength;
+    }
+
+    // Every frame is decoded before any is published, so a datagram with
+    // something else in it publishes nothing
+    Connection *conn = server->datagrams;
+    vector<struct MultiMessage> batches(frames.size());
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        vec requestBytes(bytes + frames[i].first, bytes + frames[i].first + frames[i].second);
+        server->metrics.requests++;
+        string frameType = hmp221::frame_type(requestBytes);
+        unsigned long start = currentNanos();
+        TRACE_BEGIN(decodeTrace);
+        try
+        {
+            if (frameType == "Message")
+            {
+                batches[i].messages.push_back(hmp221::deserialize_message(requestBytes));
+            }
+            else if (frameType == "MultiMessage")
+            {
+                batches[i] = hmp221::deserialize_multi_message(requestBytes);
+            }
+            else
+            {
+                server->metrics.datagramsDropped++;
+                return;
+            }
+        }
+        catch (const std::exception &)
+        {
+            // A DecodeError, or a length that asks for more memory than there is
+            server->metrics.datagramsDropped++;
+            return;
+        }
+        recordSince(&server->metrics, OP_DECODE, start);
+        TRACE_END(decodeTrace, TRACE_DECODE, conn->id, requestBytes.size());
+    }
+    for (size_t i = 0; i < batches.size(); i++)
+    {
+        TRACE_BEGIN(requestTrace);
+        for (size_t j = 0; j < batches[i].messages.size(); j++)
+        {
+            batches[i].messages[j].id = 0;
+        }
+        publishMessages(server, conn, batches[i]);
+        TRACE_END(requestTrace, TRACE_REQUEST, conn->id, frames[i].second);
+    }
+    // Nobody to tell when a cluster node was unreachable; the messages are lost, as a datagram may be
+    conn->broken = false;
+}
+
+/**
+ * @brief Subroutine to read what a client sent and process every complete frame
+ *
+ * @param server the hashmap and the open connections
+ * @param conn the connection that became readable
+ */
+void readFromConnection(Server *server, Connection *conn)
+{
+    char buffer[65536];
+    TRACE_BEGIN(readTrace);
+    int n;
+    if (conn->local)
+    {
+        // A local client may pass descriptors along, for an Attach
+        struct iovec iov = {buffer, sizeof(buffer)};
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct msghdr message;
+        bzero(&message, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        n = recvmsg(conn->fd, &message, MSG_CMSG_CLOEXEC);
+        for (struct cmsghdr *cmsg = n >= 0 ? CMSG_FIRSTHDR(&message) : NULL; cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                int *fds = (int *)CMSG_DATA(cmsg);
+                for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+                {
+                    conn->passedFds.push_back(fds[i]);
+                }
+            }
+        }
+    }
+    else
+    {
+        n = read(conn->fd, buffer, sizeof(buffer));
+    }
+    TRACE_END(readTrace, TRACE_READ, conn->id, n > 0 ? n : 0);
+    // Once attached, the socket only tells that the client went away
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR) || (n > 0 && conn->rings != NULL))
+    {
+        closeConnection(server, conn);
+        return;
+    }
+    if (n < 0)
+    {
+        return;
+    }
+    receiveBytes(server, conn, (unsigned char *)buffer, n);
+}
+
+/**
+ * @brief Subroutine to process bytes a client sent, whichever backend read them
+ *
+ * @param bytes what the read returned, still encrypted
+ */
+void receiveBytes(Server *server, Connection *conn, const unsigned char *bytes, size_t n)
+{
+    server->metrics.bytesIn += n;
+    noteActivity(server, conn);
+
+    // Decrypt the bytes and append them to what is left of the last read
+    for (size_t i = 0; i < n; i++)
+    {
+        conn->inbound.push_back(bytes[i] ^ KEY);
+    }
+    if (conn->clusterNode != NULL)
+    {
+        processLinkReplies(server, conn);
+        return;
+    }
+    if (processInbound(server, conn))
+    {
+        flushConnection(server, conn);
+    }
+}
+
+/**
+ * @brief Subroutine to push back the idle deadline of a client that sent something
+ */
+void noteActivity(Server *server, Connection *conn)
+{
+    if (conn->clusterNode == NULL && (server->idleTimeout != 0 || server->keepalive != 0))
+    {
+        conn->lastActivity = currentMillis();
+        conn->pingSent = false;
+        if (!TimerWheel::scheduled(&conn->idleTimer))
+        {
+            scheduleIdle(server, conn);
+        }
+    }
+}
+
+/**
+ * @brief Subroutine to process every complete frame a connection has sent, as far as its rate limits allow
+ *
+ * @param server the hashmap and the open connections
+ * @param conn the connection whose inbound bytes to process
+ * @return false if the connection was closed
+ */
+bool processInbound(Server *server, Connection *conn)
+{
+    size_t offset = 0;
+    while (offset < conn->inbound.size())
+    {
+        long length = hmp221::frame_length(conn->inbound.data() + offset, conn->inbound.size() - offset);
+        if (length == 0)
+        {
+            break;
+        }
+        if (length < 0)
+        {
+            LOG_WARN("Malformed frame from %s.", conn->peer.c_str());
+            closeConnection(server, conn);
+            return false;
+        }
+        if (!admitFrame(server, conn, length))
+        {
+            break;
+        }
+        vec requestBytes(conn->inbound.begin() + offset, conn->inbound.begin() + offset + length);
+        offset += length;
+        server->metrics.requests++;
+        TRACE_BEGIN(requestTrace);
+
+        if (hmp221::is_compact(requestBytes) && (conn->capabilities & HMP221_CAP_COMPACT) == 0)
+        {
+            LOG_WARN("Compact frame from %s, which did not negotiate it.", conn->peer.c_str());
+            closeConnection(server, conn);
+            return false;
+        }
+        string messageType = checkMessageType(requestBytes);
+        // The first frame settles the protocol of the connection; an Attach only changes its transport
+        bool firstFrame = !conn->protocolSettled && messageType.compare("attach") != 0;
+        if (firstFrame)
+        {
+            conn->protocolSettled = true;
+        }
+        // A frame that is whole but does not read as its type is the client's
+        // fault; only its connection goes
+        try
+        {
+            if (messageType.compare("subscribe") == 0)
+            {
+                processSubscribeRequest(server, conn, requestBytes);
+            }
+            else if (messageType.compare("conditional subscribe") == 0)
+            {
+                processConditionalSubscribeRequest(server, conn, requestBytes);
+            }
+            else if (messageType.compare("batch subscribe") == 0)
+            {
+                processBatchSubscribeRequest(server, conn, requestBytes);
+            }
+            else if (messageType.compare("batch publish") == 0)
+            {
+                processBatchPublishRequest(server, conn, requestBytes);
+            }
+            else if (messageType.compare("stats") == 0)
+            {
+                processStatsRequest(server, conn, requestBytes);
+            }
+            else if (messageType.compare("watch") == 0)
+            {
+                processWatchRequest(server, conn, requestBytes);
+            }
+            else if (messageType.compare("ping") == 0)
+            {
+                struct Pong pongStruct = {hmp221::deserialize_ping(requestBytes).id};
+                vec serializedReply = hmp221::serialize(pongStruct);
+                queueFrame(conn, &serializedReply);
+            }
+            else if (messageType.compare("pong") == 0)
+            {
+                // Reading it was all a keepalive needs
+            }
+            else if (messageType.compare("replicate") == 0)
+            {
+                processReplicateRequest(server, conn, requestBytes);
+            }
+            else if (messageType.compare("attach") == 0)
+            {
+                processAttachRequest(server, conn, requestBytes);
+            }
+            else if (messageType.compare("hello") == 0)
+            {
+                processHelloRequest(server, conn, requestBytes, firstFrame);
+            }
+            else if (messageType.compare("chunk") == 0)
+            {
+                processChunkRequest(server, conn, requestBytes);
+            }
+            else if (messageType.compare("publish") == 0)
+            {
+                processPublishRequest(server, conn, requestBytes);
+            }
+            else
+            {
+                LOG_WARN("Unexpected %s frame from %s.", hmp221::frame_type(requestBytes).c_str(), conn->peer.c_str());
+                conn->broken = true;
+            }
+        }
+        catch (const hmp221::DecodeError &e)
+        {
+            LOG_WARN("Malformed %s frame from %s: %s.", hmp221::frame_type(requestBytes).c_str(), conn->peer.c_str(), e.what());
+            conn->broken = true;
+        }
+        catch (const std::exception &e)
+        {
+            // Every connection shares this process, so one request that fails
+            // in any other way, e.g. out of memory, also only closes its own
+            LOG_ERROR("ERROR handling %s frame from %s: %s", hmp221::frame_type(requestBytes).c_str(), conn->peer.c_str(), e.what());
+            conn->broken = true;
+        }
+        TRACE_END(requestTrace, TRACE_REQUEST, conn->id, length);
+        // A message this connection published may have overflowed its own watch queue, a cluster node it needs is unreachable, or the frame was malformed
+        if (conn->broken)
+        {
+            closeConnection(server, conn);
+            return false;
+        }
+    }
+    conn->inbound.erase(conn->inbound.begin(), conn->inbound.begin() + offset);
+
+    if (conn->inbound.size() > MAX_FRAME_BYTES)
+    {
+        LOG_WARN("Frame from %s is too large.", conn->peer.c_str());
+        closeConnection(server, conn);
+        return false;
+    }
+
+    // Acknowledge every publish of this read at once, once the other nodes
+    // of the cluster have acknowledged those forwarded to them
+    if (conn->pendingAck != 0)
+    {
+        struct Ack ackStruct = {conn->pendingAck};
+        vec serializedReply = encodeFor(conn, ackStruct);
+        if (conn->ackReply)
+        {
+            conn->ackReply->bytes = serializedReply;
+            OutboundFrame frame = {};
+            frame.pending = conn->ackReply;
+            conn->outbound.push_back(frame);
+            conn->ackReply.reset();
+        }
+        else
+        {
+            queueFrame(conn, &serializedReply);
+        }
+        conn->pendingAck = 0;
+        server->metrics.acksSent++;
+    }
+    return true;
+}
+
+/**
+ * @brief Subroutine to charge a frame to the rate limits of its connection and source address
+ *
+ * When a bucket is empty, the frame is left unprocessed and the connection is
+ * not read again until the bucket has refilled. The kernel then holds the
+ * rest of what the client sends, and TCP flow control slows the client down
+ * without costing other connections anything.
+ *
+ * @param length size of the frame in bytes
+ * @return whether the frame may be processed now
+ */
+bool admitFrame(Server *server, Connection *conn, size_t length)
+{
+    if (conn->requestBucket.rate == 0 && conn->byteBucket.rate == 0 &&
+        conn->source->requests.rate == 0 && conn->source->bytes.rate == 0)
+    {
+        return true;
+    }
+    unsigned long now = currentNanos();
+    if (bucketReady(&conn->requestBucket, 1, now) && bucketReady(&conn->byteBucket, length, now) &&
+        bucketReady(&conn->source->requests, 1, now) && bucketReady(&conn->source->bytes, length, now))
+    {
+        bucketTake(&conn->requestBucket, 1);
+        bucketTake(&conn->byteBucket, length);
+        bucketTake(&conn->source->requests, 1);
+        bucketTake(&conn->source->bytes, length);
+        return true;
+    }
+
+    unsigned long wait = max(max(bucketWait(&conn->requestBucket, 1), bucketWait(&conn->byteBucket, length)),
+                             max(bucketWait(&conn->source->requests, 1), bucketWait(&conn->source->bytes, length)));
+    if (conn->throttledUntil == 0)
+    {
+        server->metrics.throttles++;
+    }
+    conn->throttledUntil = currentMillis() + wait / 1000000 + 1;
+    server->timers.schedule(&conn->throttleTimer, conn->throttledUntil);
+    updateInterest(server, conn, conn->wantsWrite);
+    return false;
+}
+
+/**
+ * @brief Subroutine to go on with a throttled connection once its wait is over
+ */
+void resumeThrottled(Server *server, Connection *conn)
+{
+    conn->throttledUntil = 0;
+    // Frames already read come first; reading resumes if they all fit
+    if (!processInbound(server, conn))
+    {
+        return;
+    }
+    if (conn->throttledUntil == 0)
+    {
+        updateInterest(server, conn, conn->wantsWrite);
+        if (conn->rings != NULL)
+        {
+            // What is left in the ring was not read while throttled
+            readFromRings(server, conn);
+            return;
+        }
+    }
+    flushConnection(server, conn);
+}
+
+/**
+ * @brief Subroutine to handle every timer of the wheel that is due
+ *
+ * @param server the timers and what they belong to
+ */
+void runTimers(Server *server)
+{
+    unsigned long now = currentMillis();
+    TimerNode *timer;
+    while ((timer = server->timers.expire(now)) != NULL)
+    {
+        switch (timer->kind)
+        {
+        case TIMER_LONG_POLL:
+            expireLongPoll(server, (pair<const unsigned long, LongPoll> *)timer->owner);
+            break;
+        case TIMER_THROTTLE:
+            resumeThrottled(server, (Connection *)timer->owner);
+            break;
+        case TIMER_IDLE:
+            checkIdle(server, (Connection *)timer->owner);
+            break;
+        case TIMER_EXPIRY:
+            expireMessage(server, (pair<const string, TimerNode> *)timer->owner);
+            break;
+        case TIMER_RECONNECT:
+            connectUpstream((Server *)timer->owner);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Subroutine to set the idle timer of a connection to its next deadline
+ *
+ * That is when the connection is due a Ping, or, once the Ping is sent, when
+ * it is due to be closed. The timer is only moved when it fires, not on every
+ * read: a connection that was busy meanwhile just gets a later deadline then.
+ */
+void scheduleIdle(Server *server, Connection *conn)
+{
+    unsigned long deadline = server->idleTimeout != 0 ? conn->lastActivity + server->idleTimeout : ~0UL;
+    if (server->keepalive != 0 && !conn->pingSent && conn->lastActivity + server->keepalive < deadline)
+    {
+        deadline = conn->lastActivity + server->keepalive;
+    }
+    if (deadline != ~0UL)
+    {
+        server->timers.schedule(&conn->idleTimer, deadline);
+    }
+}
+
+/**
+ * @brief Subroutine to ping or close a connection that has been quiet for too long
+ */
+void checkIdle(Server *server, Connection *conn)
+{
+    unsigned long quiet = currentMillis() - conn->lastActivity;
+    if (server->idleTimeout != 0 && quiet >= server->idleTimeout)
+    {
+        LOG_DEBUG("Closing %s after %lu ms without a frame", conn->peer.c_str(), quiet);
+        server->metrics.idleDisconnects++;
+        closeConnection(server, conn);
+        return;
+    }
+    bool ping = server->keepalive != 0 && quiet >= server->keepalive && !conn->pingSent;
+    if (ping)
+    {
+        conn->pingSent = true;
+    }
+    scheduleIdle(server, conn);
+    if (ping)
+    {
+        struct Ping pingStruct = {server->nextPingId++};
+        vec serializedPing = hmp221::serialize(pingStruct);
+        queueFrame(conn, &serializedPing);
+        server->metrics.pingsSent++;
+        flushConnection(server, conn);
+    }
+}
+
+/**
+ * @brief Subroutine to tell epoll which events of a connection matter
+ *
+ * A throttled connection is not read, and EPOLLOUT is only asked for while
+ * there is something left to write. The socket of a connection on rings
+ * stays readable, so that the server notices when the client goes away.
+ */
+void updateInterest(Server *server, Connection *conn, bool wantsWrite)
+{
+    conn->wantsWrite = wantsWrite;
+    if (conn->onUring)
+    {
+        // The ring sends whatever is submitted; only receiving stops while
+        // the connection is throttled
+        if (conn->throttledUntil == 0 && !conn->receiving)
+        {
+            armReceive(server, conn);
+        }
+        else if (conn->throttledUntil != 0 && conn->receiving)
+        {
+            server->uring->cancel(uringData(conn, URING_RECEIVE), URING_IGNORED);
+        }
+        return;
+    }
+    struct epoll_event event;
+    // The client's doorbell tells when an attached ring has room again
+    event.events = (conn->throttledUntil == 0 ? (u32)EPOLLIN : 0u) | (wantsWrite && conn->rings == NULL ? (u32)EPOLLOUT : 0u);
+    event.data.fd = conn->fd;
+    epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/**
+ * @brief Subroutine to write as many of a connection's queued frames as the socket accepts
+ *
+ * Queued frames are handed to the socket together with writev, so a
+ * subscriber that fell behind catches up in a few system calls.
+ *
+ * @param server the open connections
+ * @param conn the connection to flush
+ */
+void flushConnection(Server *server, Connection *conn)
+{
+    while (!conn->outbound.empty() || !conn->latest.empty())
+    {
+        // The completions of the ring's writes come back here
+        if (conn->writesInFlight > 0)
+        {
+            break;
+        }
+        // Conflated messages stay replaceable until the socket is ready for them
+        if (conn->outbound.empty())
+        {
+            while (!conn->latestOrder.empty() && conn->outbound.size() < MAX_IOVECS)
+            {
+                string channel = conn->latestOrder.front();
+                conn->latestOrder.pop_front();
+                OutboundFrame frame = {};
+                frame.bytes = conn->latest[channel];
+                frame.channel = channel;
+                conn->latest.erase(channel);
+                conn->outbound.push_back(frame);
+            }
+        }
+        // The ring takes several linked writes at once
+        struct iovec iov[MAX_IOVECS * URING_LINKED_WRITES];
+        int limit = conn->onUring ? MAX_IOVECS * URING_LINKED_WRITES : MAX_IOVECS;
+        int count = 0;
+        bool large = false;
+        for (auto it = conn->outbound.begin(); it != conn->outbound.end() && count < limit; ++it, ++count)
+        {
+            if (it->pending)
+            {
+                // The reply of a forwarded request holds back everything queued behind it
+                if (!it->pending->ready)
+                {
+                    break;
+                }
+                if (it->pending->closeAfter)
+                {
+                    conn->closeAfterFlush = true;
+                }
+                it->bytes = shared_ptr<const vec>(it->pending, &it->pending->bytes);
+                it->pending.reset();
+            }
+            if (it->file)
+            {
+                // A piece of a spool file is written on its own, once it is in front
+                break;
+            }
+            size_t skip = count == 0 ? conn->outboundOffset : 0;
+            iov[count].iov_base = (void *)(it->bytes->data() + skip);
+            iov[count].iov_len = it->bytes->size() - skip;
+            large = large || iov[count].iov_len >= ZEROCOPY_THRESHOLD;
+        }
+        bool fromFile = count == 0 && !conn->outbound.empty() && conn->outbound.front().file;
+        if (count == 0 && !fromFile)
+        {
+            break;
+        }
+        if (conn->onUring && !fromFile)
+        {
+            submitWrites(server, conn, iov, count);
+            break;
+        }
+        unsigned long start = currentNanos();
+        TRACE_BEGIN(writeTrace);
+        ssize_t n;
+        if (fromFile)
+        {
+            n = writeFromFile(server, conn, conn->outbound.front());
+        }
+        else if (conn->rings != NULL)
+        {
+            n = writeToRing(conn, iov, count);
+        }
+        else if (large && conn->zerocopy)
+        {
+            n = sendZerocopy(server, conn, iov, count);
+        }
+        else
+        {
+            n = writev(conn->fd, iov, count);
+        }
+        TRACE_END(writeTrace, TRACE_WRITE, conn->id, n > 0 ? n : 0);
+        recordSince(&server->metrics, OP_WRITE, start);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (conn->onUring && !conn->pollingWritable)
+                {
+                    conn->pollingWritable = true;
+                    server->uring->poll(conn->fd, POLLOUT, false, uringData(conn, URING_WRITABLE));
+                }
+                break;
+            }
+            closeConnection(server, conn);
+            return;
+        }
+        server->metrics.bytesOut += n;
+        dropWritten(conn, n);
+    }
+
+    // Frames the kernel still sends from memory must outlive the connection
+    bool drained = conn->outbound.empty() && conn->latest.empty();
+    if (drained && conn->closeAfterFlush && conn->zerocopyHeld.empty())
+    {
+        closeConnection(server, conn);
+        return;
+    }
+
+    // Only ask for EPOLLOUT while there is something left to write. A reply
+    // awaited from another node is written when it arrives instead.
+    bool waiting = !conn->outbound.empty() && conn->outbound.front().pending && !conn->outbound.front().pending->ready;
+    bool wantsWrite = !drained && !waiting;
+    if (wantsWrite != conn->wantsWrite)
+    {
+        updateInterest(server, conn, wantsWrite);
+    }
+}
+
+/**
+ * @brief Subroutine to drop the frames that went out completely, and empty replies
+ *
+ * @param written bytes written from the front of the queue
+ * @return the number of frames dropped
+ */
+size_t dropWritten(Connection *conn, size_t written)
+{
+    size_t dropped = 0;
+    while (!conn->outbound.empty() && (conn->outbound.front().bytes || conn->outbound.front().file))
+    {
+        const OutboundFrame &front = conn->outbound.front();
+        size_t remaining = (front.file ? front.fileLength : front.bytes->size()) - conn->outboundOffset;
+        if (written < remaining)
+        {
+            conn->outboundOffset += written;
+            break;
+        }
+        written -= remaining;
+        conn->outbound.pop_front();
+        conn->outboundOffset = 0;
+        dropped++;
+    }
+    return dropped;
+}
+
+/**
+ * @brief Subroutine to write queued frames with MSG_ZEROCOPY, like writev
+ *
+ * The kernel sends the frames straight from their shared buffers instead of
+ * copying them into the socket, so the send holds on to them until
+ * reapZerocopy sees it complete. When the kernel runs short of memory to pin
+ * the pages, the frames are copied as usual.
+ *
+ * @return bytes written, or -1 with errno set like writev
+ */
+ssize_t sendZerocopy(Server *server, Connection *conn, struct iovec *iov, int count)
+{
+    struct msghdr message;
+    bzero(&message, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    ssize_t n = sendmsg(conn->fd, &message, MSG_ZEROCOPY);
+    if (n < 0 && errno == ENOBUFS)
+    {
+        return writev(conn->fd, iov, count);
+    }
+    if (n <= 0)
+    {
+        return n;
+    }
+
+    // Every send that took bytes gets the next number, however many it took
+    vector<shared_ptr<const vec>> held;
+    size_t taken = 0;
+    auto it = conn->outbound.begin();
+    for (int i = 0; i < count && taken < (size_t)n; i++, ++it)
+    {
+        held.push_back(it->bytes);
+        taken += iov[i].iov_len;
+    }
+    conn->zerocopyHeld.push_back(make_pair(conn->zerocopySends++, held));
+    server->metrics.zerocopyBytes += n;
+    return n;
+}
+
+/**
+ * @brief Subroutine to release the frames of the zero-copy sends the kernel completed
+ *
+ * Completions arrive on the socket's error queue as ranges of send numbers,
+ * in order. Once the kernel reports that it copied a send after all, as it
+ * always does on loopback, the notifications are pure overhead and the
+ * connection goes back to writev.
+ *
+ * @return whether the error queue held completions, rather than the socket an error
+ */
+bool reapZerocopy(Server *server, Connection *conn)
+{
+    bool reaped = false;
+    while (true)
+    {
+        char control[128];
+        struct msghdr message;
+        bzero(&message, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(conn->fd, &message, MSG_ERRQUEUE) < 0)
+        {
+            break;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+        {
+            bool recvErr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                           (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+            struct sock_extended_err *error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (!recvErr || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+            reaped = true;
+            while (!conn->zerocopyHeld.empty() && (int)(conn->zerocopyHeld.front().first - error->ee_data) <= 0)
+            {
+                conn->zerocopyHeld.pop_front();
+            }
+            if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                server->metrics.zerocopyCopied++;
+                conn->zerocopy = false;
+            }
+        }
+    }
+    // A connection closing after its last frame waited for these
+    if (conn->zerocopyHeld.empty() && conn->closeAfterFlush)
+    {
+        flushConnection(server, conn);
+    }
+    return reaped;
+}
+
+/**
+ * @brief Subroutine to close a connection and forget about it
+ *
+ * Long-polls the connection parked stay in the store until they are woken or
+ * time out; they are dropped then because the connection id no longer matches.
+ * Watches never end on their own, so they are removed here.
+ */
+void closeConnection(Server *server, Connection *conn)
+{
+    for (size_t i = 0; i < conn->watches.size(); i++)
+    {
+        auto found = server->longPolls.find(conn->watches[i]);
+        if (found != server->longPolls.end())
+        {
+            server->map->unwatch(found->second.channel, found->first);
+            server->longPolls.erase(found);
+        }
+    }
+    server->timers.cancel(&conn->throttleTimer);
+    server->timers.cancel(&conn->idleTimer);
+    for (size_t i = 0; i < conn->passedFds.size(); i++)
+    {
+        close(conn->passedFds[i]);
+    }
+    if (conn->rings != NULL)
+    {
+        epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->rings->doorbell, NULL);
+        server->doorbells.erase(conn->rings->doorbell);
+        close(conn->rings->doorbell);
+        close(conn->rings->clientDoorbell);
+        munmap(conn->rings->memory, conn->rings->size);
+        delete conn->rings;
+    }
+
+    vector<shared_ptr<PendingReply>> unanswered;
+    if (conn->clusterNode != NULL)
+    {
+        // Requests still waiting for the node get no reply; the connections
+        // that sent them are closed once the replies before are written
+        LOG_WARN("Lost the link to %s.", conn->peer.c_str());
+        server->metrics.linkFailures++;
+        conn->clusterNode->link = NULL;
+        if (conn->clusterNode == &server->upstream)
+        {
+            // A snapshot cut short starts over on the next link
+            server->syncing = false;
+            server->synced.clear();
+            server->timers.schedule(&server->reconnectTimer, currentMillis() + RECONNECT_DELAY);
+        }
+        for (size_t i = 0; i < conn->forwarded.size(); i++)
+        {
+            unanswered.push_back(conn->forwarded[i].reply);
+        }
+        for (size_t i = 0; i < conn->unacked.size(); i++)
+        {
+            unanswered.push_back(conn->unacked[i].second);
+        }
+        for (size_t i = 0; i < unanswered.size(); i++)
+        {
+            if (!unanswered[i]->ready)
+            {
+                unanswered[i]->ready = true;
+                unanswered[i]->closeAfter = true;
+                unanswered[i]->bytes.clear();
+            }
+        }
+    }
+    else
+    {
+        if (!server->replicas.empty())
+        {
+            server->replicas.erase(remove(server->replicas.begin(), server->replicas.end(), conn), server->replicas.end());
+        }
+        // Forget the source address once it has no connections and no debt left
+        conn->source->connections--;
+        if (conn->source->connections == 0 &&
+            bucketReady(&conn->source->requests, conn->source->requests.burst, currentNanos()) &&
+            bucketReady(&conn->source->bytes, conn->source->bytes.burst, currentNanos()))
+        {
+            server->sources.erase(conn->sourceAddress);
+        }
+    }
+    if (conn->onUring)
+    {
+        // Requests of the ring hold the socket open until they end, which
+        // the shutdown makes them do; their completions find no connection.
+        // The descriptor is only closed with the next submission, so no new
+        // connection can get its number before.
+        server->uring->shutdown(conn->fd, true, URING_IGNORED);
+        server->uring->close(conn->fd, URING_IGNORED);
+    }
+    else
+    {
+        epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    server->connections.erase(conn->fd);
+    delete conn;
+
+    for (size_t i = 0; i < unanswered.size(); i++)
+    {
+        Connection *asking = findConnection(server, unanswered[i]->fd, unanswered[i]->connectionId);
+        if (asking != NULL)
+        {
+            flushConnection(server, asking);
+        }
+    }
+}
+
+/**
+ * @brief Subroutine to look up the connection a long-poll was parked by
+ *
+ * @return the connection, or NULL if it was closed in the meantime
+ */
+Connection *findLongPollConnection(Server *server, LongPoll &poll)
+{
+    return findConnection(server, poll.fd, poll.connectionId);
+}
+
+/**
+ * @brief Subroutine to look up a connection by its descriptor and id
+ *
+ * @return the connection, or NULL if it was closed and the descriptor maybe reused
+ */
+Connection *findConnection(Server *server, int fd, unsigned long connectionId)
+{
+    auto found = server->connections.find(fd);
+    if (found == server->connections.end() || found->second->id != connectionId)
+    {
+        return NULL;
+    }
+    return found->second;
+}
+
+/**
+ * @brief Subroutine to answer a long-poll whose timeout has passed with NotModified
+ *
+ * @param server the parked long-polls
+ * @param entry the long-poll and its token
+ */
+void expireLongPoll(Server *server, pair<const unsigned long, LongPoll> *entry)
+{
+    unsigned long token = entry->first;
+    LongPoll poll = entry->second;
+    server->longPolls.erase(token);
+    server->map->unpark(poll.channel, token);
+
+    Connection *conn = findLongPollConnection(server, poll);
+    if (conn != NULL)
+    {
+        struct NotModified notModifiedStruct = {poll.channel, server->map->version(poll.channel)};
+        vec serializedReply = encodeFor(conn, notModifiedStruct);
+        queueFrame(conn, &serializedReply);
+        flushConnection(server, conn);
+    }
+}
+
+/**
+ * @brief Subroutine to drop the message of a channel whose time to live has run out
+ *
+ * Lookups drop an expired message too, so this only frees the memory of
+ * channels nobody reads anymore.
+ *
+ * @param server the hashmap and the expiry timers
+ * @param entry the channel and its timer
+ */
+void expireMessage(Server *server, pair<const string, TimerNode> *entry)
+{
+    string channel = entry->first;
+    server->expiries.erase(channel);
+    if (server->map->expire(channel))
+    {
+        server->spooled.erase(channel);
+    }
+}
+
+/**
+ * @brief Subroutine to check the type of incomming client request (subscribe, conditional subscribe, watch, publish, a batch of either or stats)
+ *
+ * @param bytes bytes sent from client
+ * @return the request type, "" for a frame no client sends
+ */
+string checkMessageType(vec bytes)
+{
+    string frameType = hmp221::frame_type(bytes);
+    if (frameType.compare("Request") == 0)
+    {
+        return string("subscribe");
+    }
+    if (frameType.compare("Message") == 0)
+    {
+        return string("publish");
+    }
+    if (frameType.compare("Subscribe") == 0)
+    {
+        return string("conditional subscribe");
+    }
+    if (frameType.compare("MultiRequest") == 0)
+    {
+        return string("batch subscribe");
+    }
+    if (frameType.compare("MultiMessage") == 0)
+    {
+        return string("batch publish");
+    }
+    if (frameType.compare("Stats") == 0)
+    {
+        return string("stats");
+    }
+    if (frameType.compare("Watch") == 0)
+    {
+        return string("watch");
+    }
+    if (frameType.compare("Ping") == 0)
+    {
+        return string("ping");
+    }
+    if (frameType.compare("Pong") == 0)
+    {
+        return string("pong");
+    }
+    if (frameType.compare("Replicate") == 0)
+    {
+        return string("replicate");
+    }
+    if (frameType.compare("Attach") == 0)
+    {
+        return string("attach");
+    }
+    if (frameType.compare("Hello") == 0)
+    {
+        return string("hello");
+    }
+    if (frameType.compare("Chunk") == 0)
+    {
+        return string("chunk");
+    }
+    return string("");
+}
+
+/**
+ * @brief Subroutine to process the subscribe request from the client
+ *
+ * @param server the hashmap that stores the channel:message pairs
+ * @param conn the connection the request came from
+ * @param requestBytes decrypted bytes sent from client
+ */
+void processSubscribeRequest(Server *server, Connection *conn, vec requestBytes)
+{
+    unsigned long start = currentNanos();
+    TRACE_BEGIN(decodeTrace);
+    struct Request requestStruct = hmp221::deserialize_request(requestBytes);
+    recordSince(&server->metrics, OP_DECODE, start);
+    TRACE_END(decodeTrace, TRACE_DECODE, conn->id, requestBytes.size());
+    string channel = requestStruct.name;
+    int owner = remoteOwner(server, channel);
+    if (owner >= 0)
+    {
+        // Asked as a batch of one, which the owner answers even when the
+        // channel has no message
+        shared_ptr<PendingReply> reply = holdReply(conn);
+        reply->single = true;
+        reply->parts = 1;
+        reply->batch.messages.resize(1);
+        struct MultiRequest partStruct;
+        partStruct.names.push_back(channel);
+        forwardRequest(server, conn, &server->nodes[owner], hmp221::serialize(partStruct), reply, vector<size_t>(1, 0));
+        return;
+    }
+    start = currentNanos();
+    TRACE_BEGIN(getTrace);
+    unsigned long version;
+    bool compressed;
+    vec contentBytes = server->map->get(channel, &version, &compressed);
+    recordSince(&server->metrics, OP_GET, start);
+    TRACE_END(getTrace, TRACE_GET, conn->id, contentBytes.size());
+    shared_ptr<SpoolFile> file = findSpooled(server, channel, version);
+    if (file)
+    {
+        queueSpooled(server, conn, channel, version, file);
+        return;
+    }
+    if (contentBytes.size() == 0)
+    {
+        // Clients of this request read until the connection ends when there is no message
+        LOG_DEBUG("No message published on this channel.");
+        conn->closeAfterFlush = true;
+        return;
+    }
+    struct Message messageStruct = {};
+    messageStruct.channelName = channel;
+    messageStruct.contentBytes = contentBytes;
+    messageStruct.compressed = compressed;
+    LOG_DEBUG("%s", channel.c_str());
+    start = currentNanos();
+    TRACE_BEGIN(encodeTrace);
+    vec serializedMessageStruct = encodeFor(conn, messageStruct);
+    recordSince(&server->metrics, OP_ENCODE, start);
+    TRACE_END(encodeTrace, TRACE_ENCODE, conn->id, serializedMessageStruct.size());
+    queueFrame(conn, &serializedMessageStruct);
+    LOG_DEBUG("Message sent.\nDone.");
+}
+
+/**
+ * @brief Subroutine to process a subscribe request from a client that caches channel values
+ *
+ * Only when the channel has moved past the version the client holds is the
+ * full message sent. Otherwise the reply is a short NotModified frame, or, if
+ * the client asked to wait, the request is parked on the channel in the
+ * hashmap until the next publish or its timeout.
+ *
+ * @param server the hashmap and the parked long-polls
+ * @param conn the connection the request came from
+ * @param requestBytes decrypted bytes sent from client
+ */
+void processConditionalSubscribeRequest(Server *server, Connection *conn, vec requestBytes)
+{
+    unsigned long start = currentNanos();
+    TRACE_BEGIN(decodeTrace);
+    struct Subscribe subscribeStruct = hmp221::deserialize_subscribe(requestBytes);
+    recordSince(&server->metrics, OP_DECODE, start);
+    TRACE_END(decodeTrace, TRACE_DECODE, conn->id, requestBytes.size());
+    int owner = remoteOwner(server, subscribeStruct.name);
+    if (owner >= 0)
+    {
+        // A parked long-poll would hold back every reply behind it on the link
+        if (subscribeStruct.timeout == 0)
+        {
+            // Links speak the original encoding, whatever the client used
+            forwardRequest(server, conn, &server->nodes[owner], hmp221::serialize(subscribeStruct), holdReply(conn), vector<size_t>());
+        }
+        else
+        {
+            redirectRequest(server, conn, subscribeStruct.name, owner);
+        }
+        return;
+    }
+    unsigned long version;
+    bool compressed;
+    start = currentNanos();
+    TRACE_BEGIN(getTrace);
+    vec contentBytes = server->map->get(subscribeStruct.name, &version, &compressed);
+    recordSince(&server->metrics, OP_GET, start);
+    TRACE_END(getTrace, TRACE_GET, conn->id, contentBytes.size());
+    vec serializedReply;
+    start = currentNanos();
+    TRACE_BEGIN(encodeTrace);
+    shared_ptr<SpoolFile> file = findSpooled(server, subscribeStruct.name, version);
+    if (file && version != subscribeStruct.version)
+    {
+        queueSpooled(server, conn, subscribeStruct.name, version, file);
+        return;
+    }
+    if (version != subscribeStruct.version)
+    {
+        struct Message messageStruct = {};
+        messageStruct.channelName = subscribeStruct.name;
+        messageStruct.contentBytes = contentBytes;
+        messageStruct.version = version;
+        messageStruct.compressed = compressed;
+        deltaFor(server, conn, messageStruct, subscribeStruct.version);
+        serializedReply = encodeFor(conn, messageStruct);
+    }
+    else if (subscribeStruct.timeout == 0)
+    {
+        struct NotModified notModifiedStruct = {subscribeStruct.name, version};
+        serializedReply = encodeFor(conn, notModifiedStruct);
+    }
+    else
+    {
+        unsigned long token = server->nextPollToken++;
+        LongPoll poll = {};
+        poll.fd = conn->fd;
+        poll.connectionId = conn->id;
+        poll.channel = subscribeStruct.name;
+        auto entry = server->longPolls.insert(make_pair(token, poll)).first;
+        server->map->park(subscribeStruct.name, token);
+        timerInit(&entry->second.timer, TIMER_LONG_POLL, &*entry);
+        server->timers.schedule(&entry->second.timer, currentMillis() + subscribeStruct.timeout);
+        return;
+    }
+    recordSince(&server->metrics, OP_ENCODE, start);
+    TRACE_END(encodeTrace, TRACE_ENCODE, conn->id, serializedReply.size());
+    queueFrame(conn, &serializedReply);
+}
+
+/**
+ * @brief Subroutine to process a batch subscribe request from the client
+ *
+ * The latest message of every channel listed goes back in a single
+ * MultiMessage frame, so the whole batch costs one write.
+ *
+ * @param server the hashmap that stores the channel:message pairs
+ * @param conn the connection the request came from
+ * @param requestBytes decrypted bytes sent from client
+ */
+void processBatchSubscribeRequest(Server *server, Connection *conn, vec requestBytes)
+{
+    unsigned long start = currentNanos();
+    TRACE_BEGIN(decodeTrace);
+    struct MultiRequest requestStruct = hmp221::deserialize_multi_request(requestBytes);
+    recordSince(&server->metrics, OP_DECODE, start);
+    TRACE_END(decodeTrace, TRACE_DECODE, conn->id, requestBytes.size());
+    struct MultiMessage replyStruct;
+    replyStruct.messages.resize(requestStruct.names.size());
+    // Positions of the channels every other node of the cluster owns
+    vector<vector<size_t>> remote(server->nodes.size());
+    size_t parts = 0;
+    for (int i = 0; i < requestStruct.names.size(); i++)
+    {
+        struct Message &messageStruct = replyStruct.messages[i];
+        messageStruct.channelName = requestStruct.names[i];
+        int owner = remoteOwner(server, requestStruct.names[i]);
+        if (owner >= 0)
+        {
+            parts += remote[owner].empty() ? 1 : 0;
+            remote[owner].push_back(i);
+            continue;
+        }
+        start = currentNanos();
+        TRACE_BEGIN(getTrace);
+        messageStruct.contentBytes = server->map->get(requestStruct.names[i], &messageStruct.version, &messageStruct.compressed);
+        recordSince(&server->metrics, OP_GET, start);
+        TRACE_END(getTrace, TRACE_GET, conn->id, messageStruct.contentBytes.size());
+        // A batch is one frame, so a spooled message has to fit in memory.
+        // An empty entry would pass for the message, so the connection is
+        // closed instead.
+        shared_ptr<SpoolFile> file = findSpooled(server, requestStruct.names[i], messageStruct.version);
+        if (file && !readSpooled(file.get(), messageStruct.contentBytes))
+        {
+            LOG_WARN("Spooled message on %s too large for a batch to %s.", requestStruct.names[i].c_str(), conn->peer.c_str());
+            conn->broken = true;
+            return;
+        }
+    }
+    if (parts > 0)
+    {
+        // Each owner is asked for its channels in one frame, and the reply is
+        // put together as their answers come in
+        shared_ptr<PendingReply> reply = holdReply(conn);
+        reply->batch = replyStruct;
+        reply->parts = parts;
+        for (size_t node = 0; node < remote.size(); node++)
+        {
+            if (remote[node].empty())
+            {
+                continue;
+            }
+            struct MultiRequest partStruct;
+            for (size_t i = 0; i < remote[node].size(); i++)
+            {
+                partStruct.names.push_back(requestStruct.names[remote[node][i]]);
+            }
+            forwardRequest(server, conn, &server->nodes[node], hmp221::serialize(partStruct), reply, remote[node]);
+        }
+        return;
+    }
+    start = currentNanos();
+    TRACE_BEGIN(encodeTrace);
+    vec serializedReply = encodeFor(conn, replyStruct);
+    recordSince(&server->metrics, OP_ENCODE, start);
+    TRACE_END(encodeTrace, TRACE_ENCODE, conn->id, serializedReply.size());
+    queueFrame(conn, &serializedReply);
+}
+
+/**
+ * @brief Subroutine to process the message published from the client
+ *
+ * @param server the hashmap and the parked long-polls
+ * @param conn the connection the message came from
+ * @param requestBytes the decrypted bytes sent from the client
+ */
+void processPublishRequest(Server *server, Connection *conn, vec requestBytes)
+{
+    unsigned long start = currentNanos();
+    TRACE_BEGIN(decodeTrace);
+    struct Message messageStruct = hmp221::deserialize_message(requestBytes);
+    recordSince(&server->metrics, OP_DECODE, start);
+    TRACE_END(decodeTrace, TRACE_DECODE, conn->id, requestBytes.size());
+    LOG_DEBUG("Received a message of %zu bytes", messageStruct.contentBytes.size());
+    if (messageStruct.id != 0)
+    {
+        conn->pendingAck = messageStruct.id;
+    }
+    // A replica only serves reads; its primary stores the message and
+    // streams it back like any other change
+    int owner = remoteOwner(server, messageStruct.channelName);
+    if (owner >= 0 || !server->upstream.name.empty())
+    {
+        struct MultiMessage batchStruct;
+        batchStruct.messages.push_back(messageStruct);
+        forwardPublishes(server, conn, owner >= 0 ? &server->nodes[owner] : &server->upstream, batchStruct);
+        return;
+    }
+    storeMessage(server, conn, messageStruct);
+}
+
+/**
+ * @brief Subroutine to process many messages published by the client in one frame
+ *
+ * @param server the hashmap and the parked long-polls
+ * @param conn the connection the messages came from
+ * @param requestBytes the decrypted bytes sent from the client
+ */
+void processBatchPublishRequest(Server *server, Connection *conn, vec requestBytes)
+{
+    unsigned long start = currentNanos();
+    TRACE_BEGIN(decodeTrace);
+    struct MultiMessage batchStruct = hmp221::deserialize_multi_message(requestBytes);
+    recordSince(&server->metrics, OP_DECODE, start);
+    TRACE_END(decodeTrace, TRACE_DECODE, conn->id, requestBytes.size());
+    LOG_DEBUG("Received a batch of %zu messages", batchStruct.messages.size());
+    publishMessages(server, conn, batchStruct);
+}
+
+/**
+ * @brief Subroutine to store or forward every message of a batch
+ *
+ * @param server the hashmap, the parked long-polls and the cluster
+ * @param conn the connection the messages came from
+ * @param batchStruct the messages
+ */
+void publishMessages(Server *server, Connection *conn, struct MultiMessage &batchStruct)
+{
+    if (!server->upstream.name.empty())
+    {
+        for (int i = 0; i < batchStruct.messages.size(); i++)
+        {
+            if (batchStruct.messages[i].id != 0)
+            {
+                conn->pendingAck = batchStruct.messages[i].id;
+            }
+        }
+        forwardPublishes(server, conn, &server->upstream, batchStruct);
+        return;
+    }
+    // Messages of channels every other node of the cluster owns, sent on as one batch per node
+    vector<struct MultiMessage> remote(server->nodes.size());
+    for (int i = 0; i < batchStruct.messages.size(); i++)
+    {
+        if (batchStruct.messages[i].id != 0)
+        {
+            conn->pendingAck = batchStruct.messages[i].id;
+        }
+        int owner = remoteOwner(server, batchStruct.messages[i].channelName);
+        if (owner >= 0)
+        {
+            remote[owner].messages.push_back(batchStruct.messages[i]);
+            continue;
+        }
+        storeMessage(server, conn, batchStruct.messages[i]);
+    }
+    for (size_t node = 0; node < remote.size(); node++)
+    {
+        if (!remote[node].messages.empty())
+        {
+            forwardPublishes(server, conn, &server->nodes[node], remote[node]);
+        }
+    }
+}
+
+/**
+ * @brief Subroutine to store a message in the hashmap
+ *
+ * The long-polls parked on the channel are answered with the new message,
+ * which is serialized and encrypted once for all of them.
+ *
+ * @param server the hashmap and the parked long-polls
+ * @param conn the connection the message came from
+ * @param messageStruct the message to store
+ * @param version the version the primary gave a replicated message, whose ttl
+ *        is then taken as it is; 0 to count the next version here
+ * @param file the spool file holding the payload of a message published in
+ *        Chunk frames, whose contentBytes are then empty; NULL otherwise
+ */
+void storeMessage(Server *server, Connection *conn, struct Message &messageStruct, unsigned long version, shared_ptr<SpoolFile> file)
+{
+    string channel = messageStruct.channelName;
+    vector<unsigned long> woken;
+    unsigned long ttl = messageStruct.ttl != 0 || version != 0 ? messageStruct.ttl : server->messageTtl;
+    unsigned long expiresAt = ttl != 0 ? currentMillis() + ttl : 0;
+    unsigned long start = currentNanos();
+    TRACE_BEGIN(putTrace);
+    server->map->put(channel, messageStruct.contentBytes, &woken, expiresAt, version, messageStruct.compressed);
+    recordSince(&server->metrics, OP_PUT, start);
+    TRACE_END(putTrace, TRACE_PUT, conn->id, messageStruct.contentBytes.size());
+    if (messageStruct.compressed)
+    {
+        server->metrics.compressedStored++;
+    }
+    if (file)
+    {
+        SpooledMessage spooledMessage = {file, server->map->version(channel)};
+        server->spooled[channel] = spooledMessage;
+        server->metrics.spooledStored++;
+    }
+    else if (!server->spooled.empty())
+    {
+        server->spooled.erase(channel);
+    }
+    // Spooled messages are refused once replicas follow, so every change has its payload
+    server->sequence++;
+    if (server->replicating)
+    {
+        replicateChange(server, conn, messageStruct, version != 0 ? version : server->map->version(channel), expiresAt);
+    }
+
+    // The channel's expiry timer follows its latest message
+    if (expiresAt != 0)
+    {
+        auto entry = server->expiries.insert(make_pair(channel, TimerNode())).first;
+        if (entry->second.owner == NULL)
+        {
+            timerInit(&entry->second, TIMER_EXPIRY, &*entry);
+        }
+        server->timers.schedule(&entry->second, expiresAt);
+    }
+    else if (!server->expiries.empty())
+    {
+        auto entry = server->expiries.find(channel);
+        if (entry != server->expiries.end())
+        {
+            server->timers.cancel(&entry->second);
+            server->expiries.erase(entry);
+        }
+    }
+    if (woken.empty())
+    {
+        return;
+    }
+
+    // Subscribers get the stored version, not the publisher's packet id
+    messageStruct.version = server->map->version(channel);
+    messageStruct.id = 0;
+    messageStruct.ttl = 0;
+    // Encoded once per encoding the waiting connections speak, when the first
+    // of them needs it, and shared by the others. A compressed message is
+    // forwarded as it is, and only decompressed for those that cannot take it.
+    // Connections that take deltas get the one from the previous version,
+    // except conflated watches, which may have skipped that version.
+    shared_ptr<const vec> encoded[8];
+    vec deltaBytes;
+    unsigned long deltaBase = 0;
+    bool deltaFetched = false;
+    for (int i = 0; i < woken.size(); i++)
+    {
+        auto found = server->longPolls.find(woken[i]);
+        if (found == server->longPolls.end())
+        {
+            continue;
+        }
+        LongPoll poll = found->second;
+        if (!poll.watch)
+        {
+            server->timers.cancel(&found->second.timer);
+            server->longPolls.erase(found);
+        }
+        Connection *waiting = findLongPollConnection(server, poll);
+        if (waiting == NULL)
+        {
+            continue;
+        }
+        bool delta = false;
+        if ((waiting->capabilities & HMP221_CAP_DELTA) != 0 && !poll.conflate && !file && !messageStruct.compressed)
+        {
+            if (!deltaFetched)
+            {
+                deltaBytes = server->map->delta(channel, &deltaBase);
+                deltaFetched = true;
+            }
+            delta = !deltaBytes.empty();
+        }
+        int encoding = ((waiting->capabilities & HMP221_CAP_COMPACT) != 0 ? 1 : 0) |
+                       (messageStruct.compressed && (waiting->capabilities & HMP221_CAP_COMPRESS) == 0 ? 2 : 0) |
+                       (delta ? 4 : 0);
+        if (delta)
+        {
+            server->metrics.deltasSent++;
+        }
+        if (!file && !encoded[encoding])
+        {
+            start = currentNanos();
+            TRACE_BEGIN(encodeTrace);
+            struct Message deltaStruct;
+            if (delta)
+            {
+                deltaStruct = messageStruct;
+                deltaStruct.contentBytes = deltaBytes;
+                deltaStruct.base = deltaBase;
+            }
+            vec serializedMessageStruct = encodeFor(waiting, delta ? deltaStruct : messageStruct);
+            for (size_t j = 0; j < serializedMessageStruct.size(); j++)
+            {
+                serializedMessageStruct[j] ^= KEY;
+            }
+            recordSince(&server->metrics, OP_ENCODE, start);
+            TRACE_END(encodeTrace, TRACE_ENCODE, conn->id, serializedMessageStruct.size());
+            encoded[encoding] = make_shared<vec>(std::move(serializedMessageStruct));
+        }
+        shared_ptr<const vec> sharedBytes = encoded[encoding];
+        if (file)
+        {
+            // The pieces of a spooled message are written from its file, and
+            // neither dropped nor conflated
+            queueSpooled(server, waiting, channel, messageStruct.version, file);
+        }
+        else if (poll.conflate)
+        {
+            OutboundFrame frame = {};
+            frame.bytes = sharedBytes;
+            frame.channel = channel;
+            pushLatest(server, waiting, frame);
+        }
+        else if (poll.watch)
+        {
+            OutboundFrame frame = {};
+            frame.bytes = sharedBytes;
+            frame.channel = channel;
+            pushFrame(server, waiting, frame);
+        }
+        else
+        {
+            // A long-poll waits for exactly this reply, so it is never dropped
+            OutboundFrame frame = {};
+            frame.bytes = sharedBytes;
+            waiting->outbound.push_back(frame);
+        }
+        // The publisher's own connection is flushed once all of its frames are processed
+        if (waiting != conn)
+        {
+            if (waiting->broken)
+            {
+                closeConnection(server, waiting);
+            }
+            else
+            {
+                flushConnection(server, waiting);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Subroutine to process a piece of a message the client publishes in Chunk frames
+ *
+ * The pieces go to an unnamed file in the spool directory as they arrive,
+ * encrypted as they will be written out again, so a message of up to 4 GiB
+ * never has to fit in memory or in one frame. The last piece stores it.
+ *
+ * @param server the hashmap, the parked long-polls and the spool directory
+ * @param conn the connection the piece came from
+ * @param requestBytes decrypted bytes sent from client
+ */
+void processChunkRequest(Server *server, Connection *conn, vec requestBytes)
+{
+    if ((conn->capabilities & HMP221_CAP_STREAM) == 0)
+    {
+        LOG_WARN("Chunk from %s, which did not negotiate streaming.", conn->peer.c_str());
+        conn->broken = true;
+        return;
+    }
+    struct Chunk chunkStruct = hmp221::deserialize_chunk(requestBytes);
+    if (chunkStruct.offset == 0)
+    {
+        conn->upload.reset();
+        int owner = remoteOwner(server, chunkStruct.name);
+        if (owner >= 0)
+        {
+            // The rest of the pieces are ignored until the connection closes
+            redirectRequest(server, conn, chunkStruct.name, owner);
+            conn->closeAfterFlush = true;
+            return;
+        }
+        // The replication feed carries each change in one frame, so a primary refuses them too
+        if (!server->upstream.name.empty() || server->replicating || chunkStruct.total > MAX_SPOOLED_BYTES)
+        {
+            LOG_WARN("Chunk from %s cannot be stored here.", conn->peer.c_str());
+            conn->broken = true;
+            return;
+        }
+        string path = server->spoolDir + "/hmp221-spool-XXXXXX";
+        int fd = mkostemp(&path[0], O_CLOEXEC);
+        if (fd < 0)
+        {
+            LOG_ERROR("ERROR creating spool file in %s: %s", server->spoolDir.c_str(), strerror(errno));
+            conn->broken = true;
+            return;
+        }
+        // Nothing else needs the name, and the space is freed with the last descriptor
+        unlink(path.c_str());
+        conn->upload = make_shared<SpoolFile>(fd, chunkStruct.total);
+        conn->uploadChannel = chunkStruct.name;
+        conn->uploadReceived = 0;
+    }
+    if (conn->closeAfterFlush)
+    {
+        return;
+    }
+    if (!conn->upload || chunkStruct.name != conn->uploadChannel || chunkStruct.offset != conn->uploadReceived ||
+        chunkStruct.total != conn->upload->size || chunkStruct.bytes.size() > chunkStruct.total - chunkStruct.offset)
+    {
+        LOG_WARN("Chunk from %s out of order.", conn->peer.c_str());
+        conn->broken = true;
+        return;
+    }
+    for (size_t i = 0; i < chunkStruct.bytes.size(); i++)
+    {
+        chunkStruct.bytes[i] ^= KEY;
+    }
+    size_t written = 0;
+    while (written < chunkStruct.bytes.size())
+    {
+        ssize_t n = pwrite(conn->upload->fd, chunkStruct.bytes.data() + written, chunkStruct.bytes.size() - written,
+                           chunkStruct.offset + written);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            LOG_ERROR("ERROR writing spool file: %s", strerror(errno));
+            conn->upload.reset();
+            conn->broken = true;
+            return;
+        }
+        written += n;
+    }
+    conn->uploadReceived += written;
+    if (conn->uploadReceived < conn->upload->size)
+    {
+        return;
+    }
+    shared_ptr<SpoolFile> file = conn->upload;
+    conn->upload.reset();
+    if (server->replicating)
+    {
+        LOG_WARN("Chunk from %s cannot be stored once replicas follow.", conn->peer.c_str());
+        conn->broken = true;
+        return;
+    }
+    struct Message messageStruct = {};
+    messageStruct.channelName = chunkStruct.name;
+    storeMessage(server, conn, messageStruct, 0, file);
+}
+
+/**
+ * @brief Subroutine to find the spool file holding the message a channel has at a version
+ *
+ * @return the file, NULL when the message at that version is in the store
+ *         itself; an entry for an older version is forgotten on the way
+ */
+shared_ptr<SpoolFile> findSpooled(Server *server, const string &channel, unsigned long version)
+{
+    if (server->spooled.empty())
+    {
+        return shared_ptr<SpoolFile>();
+    }
+    auto found = server->spooled.find(channel);
+    if (found == server->spooled.end())
+    {
+        return shared_ptr<SpoolFile>();
+    }
+    if (found->second.version != version)
+    {
+        // The message expired or was dropped since
+        server->spooled.erase(found);
+        return shared_ptr<SpoolFile>();
+    }
+    return found->second.file;
+}
+
+/**
+ * @brief Subroutine to read a spooled message into memory, for a frame that has to hold it whole
+ *
+ * @param contentBytes the decrypted payload, empty when it is larger than
+ *        HMP221_MAX_INFLATED or cannot be read
+ * @return whether the payload was read
+ */
+bool readSpooled(SpoolFile *file, vec &contentBytes)
+{
+    contentBytes.clear();
+    if (file->size > HMP221_MAX_INFLATED)
+    {
+        return false;
+    }
+    contentBytes.resize(file->size);
+    size_t done = 0;
+    while (done < contentBytes.size())
+    {
+        ssize_t n = pread(file->fd, contentBytes.data() + done, contentBytes.size() - done, done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            LOG_ERROR("ERROR reading spool file: %s", strerror(errno));
+            contentBytes.clear();
+            return false;
+        }
+        done += n;
+    }
+    for (size_t i = 0; i < contentBytes.size(); i++)
+    {
+        contentBytes[i] ^= KEY;
+    }
+    return true;
+}
+
+/**
+ * @brief Subroutine to queue a spooled message on a connection
+ *
+ * A connection that negotiated streaming gets it in Chunk frames, each a
+ * small header followed by a range of the file that is written with
+ * sendfile and never copied into the server. Any other connection gets one
+ * Message frame, which needs the payload in memory. Past
+ * HMP221_MAX_INFLATED it cannot have one, and since an empty payload would
+ * pass for the message, the connection is closed instead.
+ *
+ * @param conn the connection to queue it on
+ * @param channel the channel of the message
+ * @param version its version
+ * @param file the spool file holding it
+ */
+void queueSpooled(Server *, Connection *conn, const string &channel, unsigned long version, shared_ptr<SpoolFile> file)
+{
+    if ((conn->capabilities & HMP221_CAP_STREAM) == 0)
+    {
+        struct Message messageStruct = {};
+        messageStruct.channelName = channel;
+        messageStruct.version = version;
+        if (!readSpooled(file.get(), messageStruct.contentBytes))
+        {
+            LOG_WARN("Spooled message on %s too large for %s, which did not negotiate streaming.", channel.c_str(),
+                     conn->peer.c_str());
+            conn->broken = true;
+            return;
+        }
+        vec serializedMessageStruct = encodeFor(conn, messageStruct);
+        queueFrame(conn, &serializedMessageStruct);
+        return;
+    }
+    u64 offset = 0;
+    do
+    {
+        u64 length = file->size - offset < HMP221_CHUNK_SIZE ? file->size - offset : HMP221_CHUNK_SIZE;
+        vec header = hmp221::chunk_header(channel, version, file->size, offset, length);
+        queueFrame(conn, &header);
+        if (length > 0)
+        {
+            OutboundFrame frame = {};
+            frame.file = file;
+            frame.fileOffset = offset;
+            frame.fileLength = length;
+            conn->outbound.push_back(frame);
+        }
+        offset += length;
+    } while (offset < file->size);
+}
+
+/**
+ * @brief Subroutine to write the front frame of a connection, a range of a spool file
+ *
+ * A socket takes it with sendfile, straight from the page cache. Rings live
+ * in memory the client reads, so for them the range is copied through a
+ * buffer like any frame.
+ *
+ * @param frame the front frame, of which outboundOffset bytes are written
+ * @return bytes written, or -1 with errno set like writev
+ */
+ssize_t writeFromFile(Server *server, Connection *conn, OutboundFrame &frame)
+{
+    off_t offset = frame.fileOffset + conn->outboundOffset;
+    size_t length = frame.fileLength - conn->outboundOffset;
+    ssize_t n;
+    if (conn->rings == NULL)
+    {
+        n = sendfile(conn->fd, frame.file->fd, &offset, length);
+        if (n > 0)
+        {
+            server->metrics.sendfileBytes += n;
+        }
+    }
+    else
+    {
+        unsigned char buffer[HMP221_CHUNK_SIZE];
+        n = pread(frame.file->fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+        if (n > 0)
+        {
+            struct iovec iov = {buffer, (size_t)n};
+            n = writeToRing(conn, &iov, 1);
+        }
+    }
+    if (n == 0)
+    {
+        // The file ended early; the connection cannot get the rest of the frame
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief Subroutine to settle the protocol of a connection that starts with a Hello
+ *
+ * The connection speaks the older of the two versions from now on, with the
+ * capabilities both sides have. A Hello after the first frame would change
+ * the encoding of frames already under way, so it closes the connection.
+ *
+ * @param conn the connection the request came from
+ * @param requestBytes decrypted bytes sent from client
+ * @param firstFrame whether the Hello is the first frame of the connection
+ */
+void processHelloRequest(Server *server, Connection *conn, vec requestBytes, bool firstFrame)
+{
+    if (!firstFrame)
+    {
+        LOG_WARN("Hello from %s after its first frame.", conn->peer.c_str());
+        conn->broken = true;
+        return;
+    }
+    struct Hello helloStruct = hmp221::deserialize_hello(requestBytes);
+    conn->protocolVersion = helloStruct.version < HMP221_PROTOCOL_VERSION ? helloStruct.version : HMP221_PROTOCOL_VERSION;
+    conn->capabilities = conn->protocolVersion == 0 ? 0 : helloStruct.capabilities & SERVER_CAPABILITIES;
+    server->metrics.handshakes++;
+
+    struct Welcome welcomeStruct = {conn->protocolVersion, conn->capabilities};
+    vec serializedReply = hmp221::serialize(welcomeStruct);
+    queueFrame(conn, &serializedReply);
+    LOG_DEBUG("%s speaks protocol %lu with capabilities 0x%lx", conn->peer.c_str(), conn->protocolVersion, conn->capabilities);
+}
+
+/**
+ * @brief Subroutine to restore a compressed payload for a connection that did not negotiate compression
+ *
+ * The store keeps a payload as it was published, so a malformed one only
+ * shows here; the client then gets an empty message rather than bytes it
+ * cannot read.
+ */
+void inflateFor(u64 capabilities, struct Message &message)
+{
+    if (!message.compressed || (capabilities & HMP221_CAP_COMPRESS) != 0)
+    {
+        return;
+    }
+    if (!hmp221::decompress(message))
+    {
+        LOG_WARN("Malformed compressed message on %s.", message.channelName.c_str());
+        message.contentBytes.clear();
+        message.compressed = false;
+    }
+}
+
+vec encodeFor(u64 capabilities, struct Message &frame)
+{
+    if (!frame.compressed || (capabilities & HMP221_CAP_COMPRESS) != 0)
+    {
+        return encodeFor<struct Message>(capabilities, frame);
+    }
+    struct Message inflated = frame;
+    inflateFor(capabilities, inflated);
+    return encodeFor<struct Message>(capabilities, inflated);
+}
+
+/**
+ * @brief Subroutine to send a message as the delta from the version a client holds
+ *
+ * Only when the connection negotiated deltas and the store kept one from
+ * exactly that version; otherwise the message goes out whole.
+ *
+ * @param held version of the channel the client holds, 0 for none
+ */
+void deltaFor(Server *server, Connection *conn, struct Message &message, unsigned long held)
+{
+    if ((conn->capabilities & HMP221_CAP_DELTA) == 0 || held == 0 || message.compressed)
+    {
+        return;
+    }
+    unsigned long base;
+    vec deltaBytes = server->map->delta(message.channelName, &base);
+    if (deltaBytes.empty() || base != held)
+    {
+        return;
+    }
+    message.contentBytes.swap(deltaBytes);
+    message.base = base;
+    server->metrics.deltasSent++;
+}
+
+vec encodeFor(u64 capabilities, struct MultiMessage &frame)
+{
+    bool compressed = false;
+    for (size_t i = 0; i < frame.messages.size() && !compressed; i++)
+    {
+        compressed = frame.messages[i].compressed;
+    }
+    if (!compressed || (capabilities & HMP221_CAP_COMPRESS) != 0)
+    {
+        return encodeFor<struct MultiMessage>(capabilities, frame);
+    }
+    struct MultiMessage inflated = frame;
+    for (size_t i = 0; i < inflated.messages.size(); i++)
+    {
+        inflateFor(capabilities, inflated.messages[i]);
+    }
+    return encodeFor<struct MultiMessage>(capabilities, inflated);
+}
+
+/**
+ * @brief Subroutine to answer a stats request with the server's current metrics
+ *
+ * @param server the metrics, the hashmap and the open connections
+ * @param conn the connection the request came from
+ */
+void processStatsRequest(Server *server, Connection *conn, vec)
+{
+    struct Stats statsStruct = collectStats(server);
+    vec serializedReply = hmp221::serialize(statsStruct);
+    queueFrame(conn, &serializedReply);
+}
+
+/**
+ * @brief Subroutine to hand a pushed message to a connection watching its channel in conflated mode
+ *
+ * If the connection still has an undelivered message of the channel, the new
+ * one takes its place, so a subscriber holds at most one message per channel
+ * no matter how fast the channel is published to.
+ *
+ * @param server the metrics
+ * @param conn the watching connection
+ * @param frame the encrypted message and its channel
+ */
+void pushLatest(Server *server, Connection *conn, OutboundFrame &frame)
+{
+    auto pending = conn->latest.find(frame.channel);
+    if (pending != conn->latest.end())
+    {
+        pending->second = frame.bytes;
+        server->metrics.framesConflated++;
+        return;
+    }
+    conn->latest[frame.channel] = frame.bytes;
+    conn->latestOrder.push_back(frame.channel);
+}
+
+/**
+ * @brief Subroutine to process a watch request from the client
+ *
+ * The connection is told about every later message of the channel, or only
+ * the latest one it has not received yet if it asked for conflation. If the
+ * client is behind the current version, the current message is sent at once.
+ *
+ * @param server the hashmap and the watches
+ * @param conn the connection the request came from
+ * @param requestBytes decrypted bytes sent from client
+ */
+void processWatchRequest(Server *server, Connection *conn, vec requestBytes)
+{
+    unsigned long start = currentNanos();
+    TRACE_BEGIN(decodeTrace);
+    struct Watch watchStruct = hmp221::deserialize_watch(requestBytes);
+    recordSince(&server->metrics, OP_DECODE, start);
+    TRACE_END(decodeTrace, TRACE_DECODE, conn->id, requestBytes.size());
+    int owner = remoteOwner(server, watchStruct.name);
+    if (owner >= 0)
+    {
+        redirectRequest(server, conn, watchStruct.name, owner);
+        return;
+    }
+
+    unsigned long token = server->nextPollToken++;
+    LongPoll poll = {};
+    poll.fd = conn->fd;
+    poll.connectionId = conn->id;
+    poll.channel = watchStruct.name;
+    poll.watch = true;
+    poll.conflate = watchStruct.conflate;
+    server->longPolls[token] = poll;
+    server->map->watch(watchStruct.name, token);
+    conn->watches.push_back(token);
+
+    unsigned long version;
+    start = currentNanos();
+    TRACE_BEGIN(getTrace);
+    bool compressed;
+    vec contentBytes = server->map->get(watchStruct.name, &version, &compressed);
+    recordSince(&server->metrics, OP_GET, start);
+    TRACE_END(getTrace, TRACE_GET, conn->id, contentBytes.size());
+    if (version == 0 || version == watchStruct.version)
+    {
+        return;
+    }
+    shared_ptr<SpoolFile> file = findSpooled(server, watchStruct.name, version);
+    if (file)
+    {
+        queueSpooled(server, conn, watchStruct.name, version, file);
+        return;
+    }
+    struct Message messageStruct = {};
+    messageStruct.channelName = watchStruct.name;
+    messageStruct.contentBytes = contentBytes;
+    messageStruct.version = version;
+    messageStruct.compressed = compressed;
+    deltaFor(server, conn, messageStruct, watchStruct.version);
+    start = currentNanos();
+    TRACE_BEGIN(encodeTrace);
+    vec serializedMessageStruct = encodeFor(conn, messageStruct);
+    recordSince(&server->metrics, OP_ENCODE, start);
+    TRACE_END(encodeTrace, TRACE_ENCODE, conn->id, serializedMessageStruct.size());
+    queueFrame(conn, &serializedMessageStruct);
+}
+
+/**
+ * @brief Subroutine to place every node of the cluster on the hash ring
+ *
+ * Every node must be started with the same list, so that they all build the
+ * same ring and agree on who owns a channel.
+ *
+ * @param selfName the --hostname of this server, which must be in the list
+ * @param list "host:port" of every node, separated by commas
+ * @param replicas points of each node on the ring
+ * @return false if a node cannot be resolved or this server is not listed
+ */
+bool configureCluster(Server *server, string selfName, string list, int replicas)
+{
+    size_t begin = 0;
+    while (begin < list.size())
+    {
+        size_t end = list.find(',', begin);
+        if (end == string::npos)
+        {
+            end = list.size();
+        }
+        string name = list.substr(begin, end - begin);
+        begin = end + 1;
+        ClusterNode node;
+        if (!resolveNode(name, &node))
+        {
+            return false;
+        }
+        if (name == selfName)
+        {
+            server->self = server->nodes.size();
+        }
+        server->ring.add(name, server->nodes.size(), replicas);
+        server->nodes.push_back(node);
+    }
+    if (server->self < 0)
+    {
+        LOG_ERROR("--cluster does not list this server as %s", selfName.c_str());
+        return false;
+    }
+    LOG_INFO("Cluster of %zu nodes, %zu points on the ring", server->nodes.size(), server->ring.size());
+    return true;
+}
+
+/**
+ * @brief Subroutine to look up the address of a node given as "host:port"
+ *
+ * @param name "host:port" of the node
+ * @param node filled in with the name and address, and no link yet
+ * @return false if the node cannot be resolved
+ */
+bool resolveNode(string name, ClusterNode *node)
+{
+    size_t colon = name.rfind(':');
+    struct hostent *host = colon == string::npos ? NULL : gethostbyname(name.substr(0, colon).c_str());
+    if (host == NULL)
+    {
+        LOG_ERROR("ERROR resolving %s", name.c_str());
+        return false;
+    }
+    node->name = name;
+    bzero((char *)&node->address, sizeof(node->address));
+    node->address.sin_family = AF_INET;
+    bcopy((char *)host->h_addr, (char *)&node->address.sin_addr.s_addr, host->h_length);
+    node->address.sin_port = htons(atoi(name.c_str() + colon + 1));
+    node->link = NULL;
+    return true;
+}
+
+/**
+ * @brief Subroutine to find the cluster node a channel belongs to
+ *
+ * @return the index of the node, or -1 if the channel belongs to this server
+ */
+int remoteOwner(Server *server, const string &channel)
+{
+    if (server->nodes.empty())
+    {
+        return -1;
+    }
+    int owner = server->ring.owner(channel);
+    return owner == server->self ? -1 : owner;
+}
+
+/**
+ * @brief Subroutine to start a reply that other nodes of the cluster have to complete
+ *
+ * @param conn the connection the reply goes to
+ */
+shared_ptr<PendingReply> newReply(Connection *conn)
+{
+    shared_ptr<PendingReply> reply = make_shared<PendingReply>();
+    reply->fd = conn->fd;
+    reply->connectionId = conn->id;
+    reply->ready = false;
+    reply->closeAfter = false;
+    reply->parts = 0;
+    reply->single = false;
+    reply->capabilities = conn->capabilities;
+    return reply;
+}
+
+/**
+ * @brief Subroutine to keep a place in a connection's outbound queue for the reply of a forwarded request
+ *
+ * @param conn the connection the request came from
+ * @return the reply, to be filled in when the owner answers
+ */
+shared_ptr<PendingReply> holdReply(Connection *conn)
+{
+    shared_ptr<PendingReply> reply = newReply(conn);
+    OutboundFrame frame = {};
+    frame.pending = reply;
+    conn->outbound.push_back(frame);
+    return reply;
+}
+
+/**
+ * @brief Subroutine to find the link to a cluster node or the primary, opening it if there is none
+ *
+ * If the node cannot be reached, the connection is closed instead of
+ * answered, so that its client asks again rather than trusting a reply.
+ *
+ * @param conn the connection whose request needs the node
+ * @param target the node
+ * @return the link, or NULL if there is none
+ */
+Connection *linkTo(Server *server, Connection *conn, ClusterNode *target)
+{
+    if (target->link == NULL)
+    {
+        target->link = openLink(server, target);
+        if (target->link == NULL)
+        {
+            conn->broken = true;
+        }
+    }
+    return target->link;
+}
+
+/**
+ * @brief Subroutine to send published messages on to the cluster node owning their channels, or to the primary
+ *
+ * The owner cannot acknowledge the client's packet ids, which only mean
+ * something on the client's connection. If any message of the batch must be
+ * acknowledged, the link gives the batch a packet id of its own, and the Ack
+ * of the client's read is held back until the owner has acknowledged it.
+ *
+ * @param conn the connection the messages came from
+ * @param target the owner
+ * @param batchStruct the messages; their packet ids are replaced
+ */
+void forwardPublishes(Server *server, Connection *conn, ClusterNode *target, struct MultiMessage &batchStruct)
+{
+    Connection *link = linkTo(server, conn, target);
+    if (link == NULL)
+    {
+        return;
+    }
+    bool acknowledged = false;
+    for (size_t i = 0; i < batchStruct.messages.size(); i++)
+    {
+        acknowledged = acknowledged || batchStruct.messages[i].id != 0;
+        batchStruct.messages[i].id = 0;
+    }
+    if (acknowledged)
+    {
+        unsigned int packetId = link->nextPacketId++;
+        if (link->nextPacketId == 0)
+        {
+            link->nextPacketId = 1;
+        }
+        // The owner acknowledges a batch by the id of its last acknowledged message
+        batchStruct.messages.back().id = packetId;
+        if (!conn->ackReply)
+        {
+            conn->ackReply = newReply(conn);
+        }
+        conn->ackReply->parts++;
+        link->unacked.push_back(make_pair(packetId, conn->ackReply));
+    }
+    vec serializedBatch = hmp221::serialize(batchStruct);
+    queueFrame(link, &serializedBatch);
+    server->metrics.requestsForwarded++;
+}
+
+/**
+ * @brief Subroutine to send a request on to the cluster node owning its channels
+ *
+ * The request is queued on the link to the node and written with everything
+ * else forwarded to it once the events at hand are handled.
+ *
+ * @param conn the connection the request came from
+ * @param target the owner
+ * @param requestBytes the decrypted request as the owner should get it
+ * @param reply where the owner's reply goes
+ * @param slots where the messages of a batch reply go in reply, empty to relay the reply as it is
+ */
+void forwardRequest(Server *server, Connection *conn, ClusterNode *target, vec requestBytes, shared_ptr<PendingReply> reply, vector<size_t> slots)
+{
+    Connection *link = linkTo(server, conn, target);
+    if (link == NULL)
+    {
+        return;
+    }
+    queueFrame(link, &requestBytes);
+    ForwardedRequest request = {reply, slots};
+    link->forwarded.push_back(request);
+    server->metrics.requestsForwarded++;
+}
+
+/**
+ * @brief Subroutine to tell a client which cluster node to ask about a channel
+ *
+ * Used for requests the owner may hold on to, long-polls and watches, which
+ * would hold back every reply behind them on a shared link.
+ */
+void redirectRequest(Server *server, Connection *conn, string channel, int node)
+{
+    struct Redirect redirectStruct = {channel, server->nodes[node].name};
+    vec serializedReply = hmp221::serialize(redirectStruct);
+    queueFrame(conn, &serializedReply);
+    server->metrics.redirects++;
+}
+
+/**
+ * @brief Subroutine to open the link to a cluster node or the primary
+ *
+ * The connection is established in the background; frames queued meanwhile
+ * are written once the socket becomes writable. To the other node, the link
+ * is a client like any other. A link to the primary starts by asking for
+ * the changes after the last one this replica applied.
+ *
+ * @param target the node
+ * @return the link, or NULL if it could not be opened
+ */
+Connection *openLink(Server *server, ClusterNode *target)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        LOG_ERROR("ERROR opening socket: %s", strerror(errno));
+        return NULL;
+    }
+    // Forwarded requests are small and a client is waiting for each of them
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    if (connect(fd, (struct sockaddr *)&target->address, sizeof(target->address)) < 0 && errno != EINPROGRESS)
+    {
+        LOG_WARN("Cannot reach %s: %s", target->name.c_str(), strerror(errno));
+        close(fd);
+        server->metrics.linkFailures++;
+        return NULL;
+    }
+
+    Connection *link = new Connection();
+    link->fd = fd;
+    link->id = server->nextConnectionId++;
+    link->peer = target->name;
+    link->local = false;
+    link->protocolVersion = 0;
+    link->capabilities = 0;
+    link->protocolSettled = true;
+    link->rings = NULL;
+    link->outboundOffset = 0;
+    link->wantsWrite = false;
+    link->closeAfterFlush = false;
+    link->zerocopy = false;
+    link->onUring = false;
+    link->zerocopySends = 0;
+    link->broken = false;
+    link->pendingAck = 0;
+    link->clusterNode = target;
+    link->nextPacketId = 1;
+    link->source = NULL;
+    link->sourceAddress = 0;
+    link->throttledUntil = 0;
+    timerInit(&link->throttleTimer, TIMER_THROTTLE, link);
+    timerInit(&link->idleTimer, TIMER_IDLE, link);
+    link->lastActivity = currentMillis();
+    link->pingSent = false;
+    bucketInit(&link->requestBucket, 0, 0);
+    bucketInit(&link->byteBucket, 0, 0);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        LOG_ERROR("ERROR watching cluster link: %s", strerror(errno));
+        close(fd);
+        delete link;
+        return NULL;
+    }
+    server->connections[fd] = link;
+    LOG_INFO("Linking to %s", target->name.c_str());
+    if (target == &server->upstream)
+    {
+        server->timers.cancel(&server->reconnectTimer);
+        struct Replicate replicateStruct = {server->upstreamEpoch, server->upstreamSequence};
+        vec serializedReplicate = hmp221::serialize(replicateStruct);
+        queueFrame(link, &serializedReplicate);
+    }
+    return link;
+}
+
+/**
+ * @brief Subroutine to hand every reply that arrived on a link to the request it answers
+ *
+ * @param server the open connections
+ * @param link the link that became readable
+ */
+void processLinkReplies(Server *server, Connection *link)
+{
+    vector<shared_ptr<PendingReply>> completed;
+    bool malformed = false;
+    size_t offset = 0;
+    while (offset < link->inbound.size())
+    {
+        long length = hmp221::frame_length(link->inbound.data() + offset, link->inbound.size() - offset);
+        if (length == 0)
+        {
+            break;
+        }
+        if (length < 0)
+        {
+            LOG_WARN("Malformed frame from cluster node %s.", link->peer.c_str());
+            closeConnection(server, link);
+            return;
+        }
+        vec replyBytes(link->inbound.begin() + offset, link->inbound.begin() + offset + length);
+        offset += length;
+        try
+        {
+            // The other node keeps an idle link alive like any client connection
+            string frameType = hmp221::frame_type(replyBytes);
+            if (frameType == "Ping")
+            {
+                struct Pong pongStruct = {hmp221::deserialize_ping(replyBytes).id};
+                vec serializedPong = hmp221::serialize(pongStruct);
+                queueFrame(link, &serializedPong);
+                continue;
+            }
+            // The primary streams changes on the link, unasked
+            if (frameType == "Change" || frameType == "Snapshot")
+            {
+                if (!applyReplication(server, link, replyBytes))
+                {
+                    return;
+                }
+                continue;
+            }
+            // Acks come at the end of the owner's read, after the replies to
+            // requests sent behind the publishes, so they are matched separately
+            if (frameType == "Ack")
+            {
+                unsigned int id = hmp221::deserialize_ack(replyBytes).id;
+                while (!link->unacked.empty() && (int)(link->unacked.front().first - id) <= 0)
+                {
+                    shared_ptr<PendingReply> reply = link->unacked.front().second;
+                    link->unacked.pop_front();
+                    if (!reply->ready && --reply->parts == 0)
+                    {
+                        // Encrypt the bytes
+                        for (size_t i = 0; i < reply->bytes.size(); i++)
+                        {
+                            reply->bytes[i] ^= KEY;
+                        }
+                        reply->ready = true;
+                        completed.push_back(reply);
+                    }
+                }
+                continue;
+            }
+            if (link->forwarded.empty())
+            {
+                LOG_WARN("Unexpected %s from cluster node %s.", frameType.c_str(), link->peer.c_str());
+                continue;
+            }
+            // Only taken off once read, so that a malformed reply is given up on with the link
+            ForwardedRequest request = link->forwarded.front();
+            bool complete = fillReply(request, replyBytes);
+            link->forwarded.pop_front();
+            if (complete)
+            {
+                completed.push_back(request.reply);
+            }
+        }
+        catch (const hmp221::DecodeError &e)
+        {
+            LOG_WARN("Malformed %s frame from cluster node %s: %s.", hmp221::frame_type(replyBytes).c_str(),
+                     link->peer.c_str(), e.what());
+            malformed = true;
+            break;
+        }
+        catch (const std::exception &e)
+        {
+            LOG_ERROR("ERROR handling %s frame from cluster node %s: %s", hmp221::frame_type(replyBytes).c_str(),
+                      link->peer.c_str(), e.what());
+            malformed = true;
+            break;
+        }
+    }
+    link->inbound.erase(link->inbound.begin(), link->inbound.begin() + offset);
+
+    for (size_t i = 0; i < completed.size(); i++)
+    {
+        Connection *asking = findConnection(server, completed[i]->fd, completed[i]->connectionId);
+        if (asking != NULL)
+        {
+            flushConnection(server, asking);
+        }
+    }
+    if (malformed)
+    {
+        closeConnection(server, link);
+    }
+}
+
+/**
+ * @brief Subroutine to fill in the reply of a forwarded request with what the owner answered
+ *
+ * @param request the request and where its answer goes
+ * @param replyBytes the decrypted answer of the owner
+ * @return whether the reply is now complete
+ */
+bool fillReply(ForwardedRequest &request, vec &replyBytes)
+{
+    PendingReply &reply = *request.reply;
+    if (reply.ready)
+    {
+        // Given up on when another part's link failed
+        return false;
+    }
+    if (request.slots.empty())
+    {
+        reply.bytes = replyBytes;
+        if ((reply.capabilities & HMP221_CAP_COMPRESS) == 0 && hmp221::frame_type(replyBytes) == "Message")
+        {
+            // The owner sends a compressed message as it stored it
+            struct Message messageStruct = hmp221::deserialize_message(replyBytes);
+            if (messageStruct.compressed)
+            {
+                reply.bytes = encodeFor(reply.capabilities, messageStruct);
+            }
+        }
+    }
+    else
+    {
+        if (hmp221::frame_type(replyBytes) == "MultiMessage")
+        {
+            struct MultiMessage partStruct = hmp221::deserialize_multi_message(replyBytes);
+            for (size_t i = 0; i < request.slots.size() && i < partStruct.messages.size(); i++)
+            {
+                reply.batch.messages[request.slots[i]] = partStruct.messages[i];
+            }
+        }
+        if (--reply.parts > 0)
+        {
+            return false;
+        }
+        if (!reply.single)
+        {
+            reply.bytes = encodeFor(reply.capabilities, reply.batch);
+        }
+        else if (reply.batch.messages[0].contentBytes.empty())
+        {
+            // Clients of a plain subscribe read until the connection ends when there is no message
+            reply.closeAfter = true;
+        }
+        else
+        {
+            struct Message &found = reply.batch.messages[0];
+            struct Message messageStruct = {};
+            messageStruct.channelName = found.channelName;
+            messageStruct.contentBytes = found.contentBytes;
+            messageStruct.compressed = found.compressed;
+            reply.bytes = encodeFor(reply.capabilities, messageStruct);
+        }
+    }
+    // Encrypt the bytes
+    for (size_t i = 0; i < reply.bytes.size(); i++)
+    {
+        reply.bytes[i] ^= KEY;
+    }
+    reply.ready = true;
+    return true;
+}
+
+/**
+ * @brief Subroutine to write what was forwarded to each cluster node, and the changes for each replica
+ *
+ * Forwarded requests and changes are only queued while the events of one
+ * epoll_wait are handled, so all of them for a node go out in as few writes
+ * as possible.
+ */
+void flushLinks(Server *server)
+{
+    for (size_t i = 0; i < server->nodes.size(); i++)
+    {
+        Connection *link = server->nodes[i].link;
+        if (link != NULL && !link->outbound.empty() && !link->wantsWrite)
+        {
+            flushConnection(server, link);
+        }
+    }
+    Connection *upstream = server->upstream.link;
+    if (upstream != NULL && !upstream->outbound.empty() && !upstream->wantsWrite)
+    {
+        flushConnection(server, upstream);
+    }
+    // Flushing may close a replica, which takes it out of the list
+    vector<Connection *> replicas = server->replicas;
+    for (size_t i = 0; i < replicas.size(); i++)
+    {
+        if (!replicas[i]->outbound.empty() && !replicas[i]->wantsWrite)
+        {
+            flushConnection(server, replicas[i]);
+        }
+    }
+}
+
+/**
+ * @brief Subroutine to stream a stored message to the replicas as the next change
+ *
+ * The change is serialized and encrypted once for the backlog and every
+ * replica. A replica with as many changes queued as the backlog holds could
+ * not resume from it anymore, so it is disconnected rather than let its
+ * queue grow; it takes a snapshot when it comes back.
+ *
+ * @param conn the connection the message came from
+ * @param messageStruct the message as it was published
+ * @param version the version the message got here
+ * @param expiresAt when the message expires (monotonic milliseconds), 0 for never
+ */
+void replicateChange(Server *server, Connection *conn, struct Message &messageStruct, unsigned long version, unsigned long expiresAt)
+{
+    unsigned long now = currentMillis();
+    u32 ttl = expiresAt == 0 ? 0 : (expiresAt > now ? expiresAt - now : 1);
+    struct Change changeStruct = {};
+    changeStruct.sequence = server->sequence;
+    changeStruct.stamp = wallMillis();
+    changeStruct.message.channelName = messageStruct.channelName;
+    changeStruct.message.contentBytes = messageStruct.contentBytes;
+    changeStruct.message.version = version;
+    changeStruct.message.ttl = ttl;
+    changeStruct.message.compressed = messageStruct.compressed;
+    vec serializedChange = hmp221::serialize(changeStruct);
+    for (size_t i = 0; i < serializedChange.size(); i++)
+    {
+        serializedChange[i] ^= KEY;
+    }
+    shared_ptr<const vec> sharedBytes = make_shared<vec>(std::move(serializedChange));
+    server->backlog.push_back(make_pair(server->sequence, sharedBytes));
+    if (server->backlog.size() > server->backlogLimit)
+    {
+        server->backlog.pop_front();
+    }
+
+    vector<Connection *> behind;
+    for (size_t i = 0; i < server->replicas.size(); i++)
+    {
+        Connection *replica = server->replicas[i];
+        if (replica->outbound.size() >= server->backlogLimit)
+        {
+            behind.push_back(replica);
+            continue;
+        }
+        OutboundFrame frame = {};
+        frame.bytes = sharedBytes;
+        replica->outbound.push_back(frame);
+    }
+    for (size_t i = 0; i < behind.size(); i++)
+    {
+        LOG_WARN("Replica %s fell behind by more than the backlog.", behind[i]->peer.c_str());
+        server->metrics.slowConsumersDisconnected++;
+        // The publisher's own connection is closed once its frame is processed
+        if (behind[i] == conn)
+        {
+            conn->broken = true;
+        }
+        else
+        {
+            closeConnection(server, behind[i]);
+        }
+    }
+}
+
+/**
+ * @brief Subroutine to start the change feed of a replica
+ *
+ * A replica that applied changes of this run of the server up to one still
+ * in the backlog gets the changes after it. Any other replica first gets a
+ * snapshot of the whole store, in frames of SNAPSHOT_CHUNK messages, as of
+ * the latest change; the feed goes on from there.
+ *
+ * @param conn the connection of the replica
+ * @param requestBytes decrypted bytes sent from the replica
+ */
+void processReplicateRequest(Server *server, Connection *conn, vec requestBytes)
+{
+    struct Replicate replicateStruct = hmp221::deserialize_replicate(requestBytes);
+    if (find(server->replicas.begin(), server->replicas.end(), conn) == server->replicas.end())
+    {
+        server->replicas.push_back(conn);
+    }
+    server->replicating = true;
+
+    u64 after = replicateStruct.sequence;
+    if (replicateStruct.epoch == server->epoch && after <= server->sequence &&
+        (after == server->sequence || (!server->backlog.empty() && server->backlog.front().first <= after + 1)))
+    {
+        // Sequences in the backlog have no gaps, so the first change to send is found by subtraction
+        size_t first = after == server->sequence ? server->backlog.size() : after + 1 - server->backlog.front().first;
+        for (size_t i = first; i < server->backlog.size(); i++)
+        {
+            OutboundFrame frame = {};
+            frame.bytes = server->backlog[i].second;
+            conn->outbound.push_back(frame);
+        }
+        LOG_INFO("Replica %s resumes after change %lu", conn->peer.c_str(), (unsigned long)after);
+        return;
+    }
+
+    struct Snapshot snapshotStruct = {};
+    snapshotStruct.epoch = server->epoch;
+    snapshotStruct.sequence = server->sequence;
+    size_t channels = 0;
+    unsigned long now = currentMillis();
+    server->map->forEach([&](const string &channel, const vec &bytes, unsigned long version, unsigned long expiresAt, bool compressed)
+                         {
+        u32 ttl = expiresAt == 0 ? 0 : (expiresAt > now ? expiresAt - now : 1);
+        struct Message messageStruct = {};
+        messageStruct.channelName = channel;
+        messageStruct.contentBytes = bytes;
+        messageStruct.version = version;
+        messageStruct.ttl = ttl;
+        messageStruct.compressed = compressed;
+        snapshotStruct.messages.push_back(messageStruct);
+        channels++;
+        if (snapshotStruct.messages.size() == SNAPSHOT_CHUNK)
+        {
+            vec serializedSnapshot = hmp221::serialize(snapshotStruct);
+            queueFrame(conn, &serializedSnapshot);
+            snapshotStruct.messages.clear();
+        } });
+    snapshotStruct.last = true;
+    vec serializedSnapshot = hmp221::serialize(snapshotStruct);
+    queueFrame(conn, &serializedSnapshot);
+    server->metrics.snapshotsSent++;
+    LOG_INFO("Sent replica %s a snapshot of %zu channels as of change %lu", conn->peer.c_str(), channels,
+             (unsigned long)server->sequence);
+}
+
+/**
+ * @brief Subroutine to link a replica to its primary, or to try again later if it cannot
+ */
+void connectUpstream(Server *server)
+{
+    if (server->upstream.link != NULL)
+    {
+        return;
+    }
+    server->upstream.link = openLink(server, &server->upstream);
+    if (server->upstream.link == NULL)
+    {
+        server->timers.schedule(&server->reconnectTimer, currentMillis() + RECONNECT_DELAY);
+        return;
+    }
+    // Nothing else may wake the event loop to send the Replicate
+    flushConnection(server, server->upstream.link);
+}
+
+/**
+ * @brief Subroutine to apply a change or a part of a snapshot the primary sent
+ *
+ * Changes are stored with the version the primary gave them, so they wake
+ * the long-polls and watches of this replica like a publish would. A change
+ * that does not follow the last one applied means the feed lost something;
+ * the link is then dropped and the replica takes a snapshot when it links
+ * again. The last part of a snapshot drops the messages the primary no
+ * longer has.
+ *
+ * @param link the link to the primary
+ * @param frameBytes the decrypted Change or Snapshot
+ * @return false if the link was closed
+ */
+bool applyReplication(Server *server, Connection *link, vec &frameBytes)
+{
+    if (hmp221::frame_type(frameBytes) == "Change")
+    {
+        struct Change changeStruct = hmp221::deserialize_change(frameBytes);
+        if (server->syncing || changeStruct.sequence != server->upstreamSequence + 1)
+        {
+            LOG_WARN("Change %lu from %s does not follow change %lu, syncing again.", (unsigned long)changeStruct.sequence,
+                     link->peer.c_str(), (unsigned long)server->upstreamSequence);
+            server->upstreamEpoch = 0;
+            closeConnection(server, link);
+            return false;
+        }
+        storeMessage(server, link, changeStruct.message, changeStruct.message.version);
+        server->upstreamSequence = changeStruct.sequence;
+        unsigned long now = wallMillis();
+        server->replicationLag = now > changeStruct.stamp ? now - changeStruct.stamp : 0;
+        return true;
+    }
+
+    struct Snapshot snapshotStruct = hmp221::deserialize_snapshot(frameBytes);
+    if (!server->syncing)
+    {
+        server->syncing = true;
+        server->synced.clear();
+    }
+    for (size_t i = 0; i < snapshotStruct.messages.size(); i++)
+    {
+        struct Message &messageStruct = snapshotStruct.messages[i];
+        server->synced.insert(messageStruct.channelName);
+        // Already held from the same run of the primary; watchers are not told twice
+        if (snapshotStruct.epoch == server->upstreamEpoch &&
+            server->map->version(messageStruct.channelName) == messageStruct.version)
+        {
+            continue;
+        }
+        storeMessage(server, link, messageStruct, messageStruct.version);
+    }
+    if (!snapshotStruct.last)
+    {
+        return true;
+    }
+
+    vector<string> stale;
+    server->map->forEach([&](const string &channel, const vec &, unsigned long, unsigned long, bool)
+                         {
+        if (server->synced.count(channel) == 0)
+        {
+            stale.push_back(channel);
+        } });
+    for (size_t i = 0; i < stale.size(); i++)
+    {
+        server->map->drop(stale[i]);
+        auto entry = server->expiries.find(stale[i]);
+        if (entry != server->expiries.end())
+        {
+            server->timers.cancel(&entry->second);
+            server->expiries.erase(entry);
+        }
+    }
+    LOG_INFO("Synced %zu channels from %s as of change %lu", server->synced.size(), link->peer.c_str(),
+             (unsigned long)snapshotStruct.sequence);
+    server->upstreamEpoch = snapshotStruct.epoch;
+    server->upstreamSequence = snapshotStruct.sequence;
+    server->syncing = false;
+    server->synced.clear();
+    server->metrics.snapshotsApplied++;
+    return true;
+}
+
+/**
+ * @brief Subroutine to take a snapshot of the server's counters and latency histograms
+ *
+ * @return every metric by name
+ */
+struct Stats collectStats(Server *server)
+{
+    struct Stats statsStruct;
+    vector<pair<string, u64>> &values = statsStruct.values;
+    Metrics &metrics = server->metrics;
+    values.push_back(make_pair(string("uptime_ms"), currentMillis() - metrics.startMillis));
+    values.push_back(make_pair(string("requests"), metrics.requests));
+    values.push_back(make_pair(string("bytes_in"), metrics.bytesIn));
+    values.push_back(make_pair(string("bytes_out"), metrics.bytesOut));
+    values.push_back(make_pair(string("connections_accepted"), metrics.connectionsAccepted));
+    values.push_back(make_pair(string("connections_active"), (u64)server->connections.size()));
+    values.push_back(make_pair(string("long_polls_parked"), (u64)server->longPolls.size()));
+    values.push_back(make_pair(string("channels"), (u64)server->map->len()));
+    values.push_back(make_pair(string("store_bytes"), (u64)server->map->memoryUsage()));
+    size_t queued = 0;
+    for (auto it = server->connections.begin(); it != server->connections.end(); ++it)
+    {
+        queued += it->second->outbound.size() + it->second->latest.size();
+    }
+    values.push_back(make_pair(string("frames_queued"), (u64)queued));
+    values.push_back(make_pair(string("frames_dropped"), metrics.framesDropped));
+    values.push_back(make_pair(string("frames_conflated"), metrics.framesConflated));
+    values.push_back(make_pair(string("slow_consumers_disconnected"), metrics.slowConsumersDisconnected));
+    values.push_back(make_pair(string("acks_sent"), metrics.acksSent));
+    values.push_back(make_pair(string("connections_rejected"), metrics.connectionsRejected));
+    values.push_back(make_pair(string("throttles"), metrics.throttles));
+    values.push_back(make_pair(string("idle_disconnects"), metrics.idleDisconnects));
+    values.push_back(make_pair(string("pings_sent"), metrics.pingsSent));
+    values.push_back(make_pair(string("messages_expired"), (u64)server->map->expired()));
+    values.push_back(make_pair(string("timers_pending"), (u64)server->timers.size()));
+    size_t forwardsPending = 0;
+    for (size_t i = 0; i < server->nodes.size(); i++)
+    {
+        if (server->nodes[i].link != NULL)
+        {
+            forwardsPending += server->nodes[i].link->forwarded.size();
+        }
+    }
+    values.push_back(make_pair(string("cluster_nodes"), (u64)server->nodes.size()));
+    values.push_back(make_pair(string("requests_forwarded"), metrics.requestsForwarded));
+    values.push_back(make_pair(string("forwards_pending"), (u64)forwardsPending));
+    values.push_back(make_pair(string("redirects"), metrics.redirects));
+    values.push_back(make_pair(string("link_failures"), metrics.linkFailures));
+    size_t replicationQueued = 0;
+    for (size_t i = 0; i < server->replicas.size(); i++)
+    {
+        replicationQueued += server->replicas[i]->outbound.size();
+    }
+    values.push_back(make_pair(string("replicas"), (u64)server->replicas.size()));
+    values.push_back(make_pair(string("replication_sequence"), server->sequence));
+    values.push_back(make_pair(string("replication_backlog"), (u64)server->backlog.size()));
+    values.push_back(make_pair(string("replication_queued"), (u64)replicationQueued));
+    values.push_back(make_pair(string("snapshots_sent"), metrics.snapshotsSent));
+    values.push_back(make_pair(string("replication_connected"), (u64)(server->upstream.link != NULL && !server->syncing ? 1 : 0)));
+    values.push_back(make_pair(string("replication_applied"), server->upstreamSequence));
+    values.push_back(make_pair(string("replication_lag_ms"), (u64)server->replicationLag));
+    values.push_back(make_pair(string("snapshots_applied"), metrics.snapshotsApplied));
+    values.push_back(make_pair(string("udp_datagrams"), metrics.datagramsReceived));
+    values.push_back(make_pair(string("udp_dropped"), metrics.datagramsDropped));
+    values.push_back(make_pair(string("rings_attached"), metrics.ringsAttached));
+    values.push_back(make_pair(string("handshakes"), metrics.handshakes));
+    values.push_back(make_pair(string("compressed_stored"), metrics.compressedStored));
+    values.push_back(make_pair(string("spooled_stored"), metrics.spooledStored));
+    values.push_back(make_pair(string("sendfile_bytes"), metrics.sendfileBytes));
+    values.push_back(make_pair(string("deltas_sent"), metrics.deltasSent));
+    values.push_back(make_pair(string("zerocopy_bytes"), metrics.zerocopyBytes));
+    values.push_back(make_pair(string("zerocopy_copied"), metrics.zerocopyCopied));
+    values.push_back(make_pair(string("uring_enters"), metrics.uringEnters));
+    values.push_back(make_pair(string("uring_completions"), metrics.uringCompletions));
+    values.push_back(make_pair(string("rings_active"), (u64)server->doorbells.size()));
+    appendLatencies(&metrics, &values);
+    return statsStruct;
+}
+
+/**
+ * @brief Subroutine to write the metrics to the stats file as a JSON object
+ *
+ * The file is written next to its final name and renamed over it, so a
+ * reader never sees half a dump.
+ */
+void dumpStats(Server *server)
+{
+    string tempPath = string(server->statsFile) + ".tmp";
+    FILE *out = fopen(tempPath.c_str(), "w");
+    if (out == NULL)
+    {
+        LOG_ERROR("ERROR opening stats file: %s", strerror(errno));
+        return;
+    }
+    struct Stats statsStruct = collectStats(server);
+    fprintf(out, "{\n");
+    for (size_t i = 0; i < statsStruct.values.size(); i++)
+    {
+        fprintf(out, "  \"%s\": %lu%s\n", statsStruct.values[i].first.c_str(), statsStruct.values[i].second,
+                i + 1 < statsStruct.values.size() ? "," : "");
+    }
+    fprintf(out, "}\n");
+    fclose(out);
+    if (rename(tempPath.c_str(), server->statsFile) < 0)
+    {
+        LOG_ERROR("ERROR writing stats file: %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief Subroutine to encrypt a serialized frame and queue it on a connection
+ *
+ * @param conn the connection to reply on
+ * @param serializedP the serialized frame, encrypted in place
+ */
+void queueFrame(Connection *conn, vec *serializedP)
+{
+    // Encrypt the bytes
+    for (int i = 0; i < serializedP->size(); i++)
+    {
+        (*serializedP)[i] ^= KEY;
+    }
+    OutboundFrame frame = {};
+    frame.bytes = make_shared<vec>(std::move(*serializedP));
+    conn->outbound.push_back(frame);
+}
+
+/**
+ * @brief Subroutine to queue a pushed message on a watching connection
+ *
+ * A subscriber that reads slower than its channels are published to would
+ * otherwise grow its queue without bound. Once the queue holds the server's
+ * limit, the slow-consumer policy decides what gives; other subscribers
+ * never wait for this one.
+ *
+ * @param server the queue limit and the policy
+ * @param conn the watching connection
+ * @param frame the encrypted message and its channel
+ */
+void pushFrame(Server *server, Connection *conn, OutboundFrame &frame)
+{
+    if (conn->outbound.size() < server->queueLimit)
+    {
+        conn->outbound.push_back(frame);
+        return;
+    }
+    // The front frame may be partly written already, and the ring may be
+    // sending the first few, so they have to stay
+    size_t first = max(conn->outboundOffset > 0 ? (size_t)1 : (size_t)0, conn->framesInFlight);
+    switch (server->slowConsumerPolicy)
+    {
+    case SLOW_CONSUMER_DISCONNECT:
+        LOG_WARN("Disconnecting slow consumer %s.", conn->peer.c_str());
+        server->metrics.slowConsumersDisconnected++;
+        conn->broken = true;
+        return;
+    case SLOW_CONSUMER_CONFLATE:
+        // The newest queued frame of the channel, so none queued behind it is older
+        for (size_t i = conn->outbound.size(); i-- > first;)
+        {
+            if (conn->outbound[i].channel == frame.channel)
+            {
+                conn->outbound[i].bytes = frame.bytes;
+                server->metrics.framesConflated++;
+                return;
+            }
+        }
+        // Nothing queued for this channel to overwrite, drop the oldest instead
+        __attribute__((fallthrough));
+    case SLOW_CONSUMER_DROP_OLDEST:
+        server->metrics.framesDropped++;
+        for (size_t i = first; i < conn->outbound.size(); i++)
+        {
+            if (!conn->outbound[i].channel.empty())
+            {
+                conn->outbound.erase(conn->outbound.begin() + i);
+                conn->outbound.push_back(frame);
+                return;
+            }
+        }
+        // Only replies are queued, which are never dropped; lose the new message
+        return;
+    }
+}
+
+/**
+ * @brief Subroutine to read a monotonic clock
+ *
+ * @return milliseconds since an arbitrary fixed point
+ */
+unsigned long currentMillis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Subroutine to read the wall clock, which unlike the monotonic clock means the same on every host
+ *
+ * @return milliseconds since the epoch
+ */
+unsigned long wallMillis()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include "hmp221.hpp"
 #include <iostream>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using std::begin;
 using std::end;
@@ -21,6 +25,10 @@ using std::end;
  */
 vec hmp221::slice(vec &bytes, int vbegin, int vend)
 {
+  if (vbegin < 0 || vend < vbegin - 1 || (size_t)vend >= bytes.size())
+  {
+    throw hmp221::DecodeError("slice past the end of the bytes");
+  }
   auto start = bytes.begin() + vbegin;
   auto end = bytes.begin() + vend + 1;
   vec result(vend - vbegin + 1);
@@ -29,293 +37,2751 @@ vec hmp221::slice(vec &bytes, int vbegin, int vend)
 }
 
 // ----------------------------------------
-// HMP221_U8
+// Compact encoding
 // ----------------------------------------
 
-// Serializing a u8 is simple: push the tag onto the vector, then the byte.
-vec hmp221::serialize(u8 item)
+// A compact frame starts with HMP221_COMPACT ORed with a type code, then the
+// length of the body as an LEB128 varint. The body lists the fields of the
+// frame in a fixed order, without keys: numbers are varints, and strings and
+// byte arrays are a varint length followed by the raw bytes. The first byte
+// of an original frame is always HMP221_M8, so the two never mix up.
+
+enum CompactType
+{
+  COMPACT_MESSAGE = 1,
+  COMPACT_REQUEST,
+  COMPACT_SUBSCRIBE,
+  COMPACT_NOT_MODIFIED,
+  COMPACT_MULTI_REQUEST,
+  COMPACT_MULTI_MESSAGE,
+  COMPACT_ACK,
+  COMPACT_WATCH,
+  COMPACT_CHUNK,
+  COMPACT_TYPES
+};
+
+static const char *compact_names[COMPACT_TYPES] = {"", "Message", "Request", "Subscribe", "NotModified",
+                                                   "MultiRequest", "MultiMessage", "Ack", "Watch", "Chunk"};
+
+// Optional fields of a compact message, flagged in the byte that starts it
+#define COMPACT_HAS_VERSION 0x1
+#define COMPACT_HAS_ID 0x2
+#define COMPACT_HAS_TTL 0x4
+#define COMPACT_COMPRESSED 0x8
+#define COMPACT_HAS_BASE 0x10
+
+#define MAX_VARINT_BYTES 10
+
+static void append_varint(vec &bytes, u64 value)
+{
+  while (value >= 0x80)
+  {
+    bytes.push_back((u8)(value | 0x80));
+    value >>= 7;
+  }
+  bytes.push_back((u8)value);
+}
+
+// Returns the number of bytes of the varint at index, 0 when it has not fully
+// arrived and -1 when it is too long to be one
+static long varint_size(const u8 *bytes, size_t size, size_t index)
+{
+  for (size_t i = 0; i < MAX_VARINT_BYTES; i++)
+  {
+    if (index + i >= size)
+    {
+      return 0;
+    }
+    if ((bytes[index + i] & 0x80) == 0)
+    {
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+static u64 read_varint(const vec &bytes, size_t &index)
+{
+  u64 value = 0;
+  for (int shift = 0; shift < 7 * MAX_VARINT_BYTES; shift += 7)
+  {
+    if (index >= bytes.size())
+    {
+      throw hmp221::DecodeError("varint past the end of the frame");
+    }
+    u8 byte = bytes[index++];
+    value |= (u64)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+    {
+      return value;
+    }
+  }
+  throw hmp221::DecodeError("varint longer than 10 bytes");
+}
+
+static void append_compact_string(vec &bytes, const u8 *data, size_t length)
+{
+  append_varint(bytes, length);
+  bytes.insert(end(bytes), data, data + length);
+}
+
+static string read_compact_string(vec &bytes, size_t &index)
+{
+  u64 length = read_varint(bytes, index);
+  if (length > bytes.size() - index)
+  {
+    throw hmp221::DecodeError("string past the end of the frame");
+  }
+  string result(bytes.begin() + index, bytes.begin() + index + length);
+  index += length;
+  return result;
+}
+
+// Wraps a body into a frame of the given type
+static vec compact_frame(CompactType type, vec &body)
 {
   vec bytes;
-  bytes.push_back(HMP221_U8);
-  bytes.push_back(item);
+  bytes.reserve(body.size() + 6);
+  bytes.push_back(HMP221_COMPACT | type);
+  append_varint(bytes, body.size());
+  bytes.insert(end(bytes), begin(body), end(body));
   return bytes;
 }
 
-u8 hmp221::deserialize_u8(vec bytes)
+// Moves index to the body of a compact frame of the given type
+static void read_compact_header(vec &bytes, size_t &index, CompactType type)
 {
-  // To deserialize the u8, we need at least two bytes in the serialized
-  // vector: one for the tag and one for the byte.
-  if (bytes.size() < 2)
+  if (bytes.empty() || bytes[0] != (HMP221_COMPACT | type))
   {
-    throw;
+    throw hmp221::DecodeError("not a compact frame of the expected type");
   }
-  // Check for the correct tag
-  if (bytes[0] == HMP221_U8)
+  index = 1;
+  read_varint(bytes, index);
+}
+
+static void append_compact_message(vec &bytes, struct Message &item)
+{
+  bytes.push_back((item.version != 0 ? COMPACT_HAS_VERSION : 0) | (item.id != 0 ? COMPACT_HAS_ID : 0) |
+                  (item.ttl != 0 ? COMPACT_HAS_TTL : 0) | (item.compressed ? COMPACT_COMPRESSED : 0) |
+                  (item.base != 0 ? COMPACT_HAS_BASE : 0));
+  append_compact_string(bytes, (const u8 *)item.channelName.data(), item.channelName.size());
+  append_compact_string(bytes, item.contentBytes.data(), item.contentBytes.size());
+  if (item.version != 0)
+  {
+    append_varint(bytes, item.version);
+  }
+  if (item.id != 0)
+  {
+    append_varint(bytes, item.id);
+  }
+  if (item.ttl != 0)
+  {
+    append_varint(bytes, item.ttl);
+  }
+  if (item.base != 0)
+  {
+    append_varint(bytes, item.base);
+  }
+}
+
+static struct Message read_compact_message(vec &bytes, size_t &index)
+{
+  if (index >= bytes.size())
+  {
+    throw hmp221::DecodeError("message past the end of the frame");
+  }
+  u8 flags = bytes[index++];
+  struct Message message = {};
+  message.compressed = (flags & COMPACT_COMPRESSED) != 0;
+  message.channelName = read_compact_string(bytes, index);
+  u64 length = read_varint(bytes, index);
+  if (length > bytes.size() - index)
+  {
+    throw hmp221::DecodeError("message bytes past the end of the frame");
+  }
+  message.contentBytes.assign(bytes.begin() + index, bytes.begin() + index + length);
+  index += length;
+  if (flags & COMPACT_HAS_VERSION)
+  {
+    message.version = read_varint(bytes, index);
+  }
+  if (flags & COMPACT_HAS_ID)
+  {
+    message.id = (u32)read_varint(bytes, index);
+  }
+  if (flags & COMPACT_HAS_TTL)
+  {
+    message.ttl = (u32)read_varint(bytes, index);
+  }
+  if (flags & COMPACT_HAS_BASE)
+  {
+    message.base = read_varint(bytes, index);
+  }
+  return message;
+}
+
+bool hmp221::is_compact(const vec &bytes)
+{
+  return !bytes.empty() && (bytes[0] & 0xf0) == HMP221_COMPACT;
+}
+
+// Measures a compact frame for frame_length
+static long compact_frame_length(const u8 *bytes, size_t size)
+{
+  if ((bytes[0] & 0x0f) == 0 || (bytes[0] & 0x0f) >= COMPACT_TYPES)
+  {
+    return -1;
+  }
+  long header = varint_size(bytes, size, 1);
+  if (header <= 0)
+  {
+    return header;
+  }
+  u64 length = 0;
+  for (long i = header; i > 0; i--)
+  {
+    length = (length << 7) | (bytes[i] & 0x7f);
+  }
+  if (length > (u64)1 << 32)
+  {
+    return -1;
+  }
+  return 1 + header + length <= size ? 1 + header + length : 0;
+}
+
+vec hmp221::serialize_compact(struct Message item)
+{
+  vec body;
+  append_compact_message(body, item);
+  return compact_frame(COMPACT_MESSAGE, body);
+}
+
+vec hmp221::serialize_compact(struct Request item)
+{
+  vec body;
+  append_compact_string(body, (const u8 *)item.name.data(), item.name.size());
+  return compact_frame(COMPACT_REQUEST, body);
+}
+
+vec hmp221::serialize_compact(struct Subscribe item)
+{
+  vec body;
+  append_compact_string(body, (const u8 *)item.name.data(), item.name.size());
+  append_varint(body, item.version);
+  append_varint(body, item.timeout);
+  return compact_frame(COMPACT_SUBSCRIBE, body);
+}
+
+vec hmp221::serialize_compact(struct NotModified item)
+{
+  vec body;
+  append_compact_string(body, (const u8 *)item.channelName.data(), item.channelName.size());
+  append_varint(body, item.version);
+  return compact_frame(COMPACT_NOT_MODIFIED, body);
+}
+
+vec hmp221::serialize_compact(struct MultiRequest item)
+{
+  vec body;
+  append_varint(body, item.names.size());
+  for (size_t i = 0; i < item.names.size(); i++)
+  {
+    append_compact_string(body, (const u8 *)item.names[i].data(), item.names[i].size());
+  }
+  return compact_frame(COMPACT_MULTI_REQUEST, body);
+}
+
+vec hmp221::serialize_compact(struct MultiMessage item)
+{
+  vec body;
+  append_varint(body, item.messages.size());
+  for (size_t i = 0; i < item.messages.size(); i++)
+  {
+    append_compact_message(body, item.messages[i]);
+  }
+  return compact_frame(COMPACT_MULTI_MESSAGE, body);
+}
+
+vec hmp221::serialize_compact(struct Ack item)
+{
+  vec body;
+  append_varint(body, item.id);
+  return compact_frame(COMPACT_ACK, body);
+}
+
+vec hmp221::serialize_compact(struct Watch item)
+{
+  vec body;
+  append_compact_string(body, (const u8 *)item.name.data(), item.name.size());
+  append_varint(body, item.version);
+  body.push_back(item.conflate ? 1 : 0);
+  return compact_frame(COMPACT_WATCH, body);
+}
+
+vec hmp221::chunk_header(const string &name, u64 version, u64 total, u64 offset, u64 length)
+{
+  vec body;
+  append_compact_string(body, (const u8 *)name.data(), name.size());
+  append_varint(body, version);
+  append_varint(body, total);
+  append_varint(body, offset);
+  append_varint(body, length);
+  vec bytes;
+  bytes.push_back(HMP221_COMPACT | COMPACT_CHUNK);
+  append_varint(bytes, body.size() + length);
+  bytes.insert(end(bytes), begin(body), end(body));
+  return bytes;
+}
+
+vec hmp221::serialize_compact(struct Chunk item)
+{
+  vec bytes = chunk_header(item.name, item.version, item.total, item.offset, item.bytes.size());
+  bytes.insert(end(bytes), begin(item.bytes), end(item.bytes));
+  return bytes;
+}
+
+struct Chunk hmp221::deserialize_chunk(vec bytes)
+{
+  size_t index;
+  read_compact_header(bytes, index, COMPACT_CHUNK);
+  struct Chunk chunk = {read_compact_string(bytes, index), 0, 0, 0, vec()};
+  chunk.version = read_varint(bytes, index);
+  chunk.total = read_varint(bytes, index);
+  chunk.offset = read_varint(bytes, index);
+  u64 length = read_varint(bytes, index);
+  if (length > bytes.size() - index)
+  {
+    throw hmp221::DecodeError("chunk bytes past the end of the frame");
+  }
+  chunk.bytes.assign(bytes.begin() + index, bytes.begin() + index + length);
+  return chunk;
+}
+
+// The readers of the compact frames, called by the deserializers below when
+// they are given one
+
+static struct Message read_compact_message_frame(vec &bytes)
+{
+  size_t index;
+  read_compact_header(bytes, index, COMPACT_MESSAGE);
+  return read_compact_message(bytes, index);
+}
+
+static struct Request read_compact_request(vec &bytes)
+{
+  size_t index;
+  read_compact_header(bytes, index, COMPACT_REQUEST);
+  struct Request request = {read_compact_string(bytes, index)};
+  return request;
+}
+
+static struct Subscribe read_compact_subscribe(vec &bytes)
+{
+  size_t index;
+  read_compact_header(bytes, index, COMPACT_SUBSCRIBE);
+  struct Subscribe subscribe = {read_compact_string(bytes, index), 0, 0};
+  subscribe.version = read_varint(bytes, index);
+  subscribe.timeout = (u32)read_varint(bytes, index);
+  return subscribe;
+}
+
+static struct NotModified read_compact_not_modified(vec &bytes)
+{
+  size_t index;
+  read_compact_header(bytes, index, COMPACT_NOT_MODIFIED);
+  struct NotModified notModified = {read_compact_string(bytes, index), 0};
+  notModified.version = read_varint(bytes, index);
+  return notModified;
+}
+
+static struct MultiRequest read_compact_multi_request(vec &bytes)
+{
+  size_t index;
+  read_compact_header(bytes, index, COMPACT_MULTI_REQUEST);
+  struct MultiRequest request;
+  u64 count = read_varint(bytes, index);
+  for (u64 i = 0; i < count; i++)
+  {
+    request.names.push_back(read_compact_string(bytes, index));
+  }
+  return request;
+}
+
+static struct MultiMessage read_compact_multi_message(vec &bytes)
+{
+  size_t index;
+  read_compact_header(bytes, index, COMPACT_MULTI_MESSAGE);
+  struct MultiMessage batch;
+  u64 count = read_varint(bytes, index);
+  for (u64 i = 0; i < count; i++)
+  {
+    batch.messages.push_back(read_compact_message(bytes, index));
+  }
+  return batch;
+}
+
+static struct Ack read_compact_ack(vec &bytes)
+{
+  size_t index;
+  read_compact_header(bytes, index, COMPACT_ACK);
+  struct Ack ack = {(u32)read_varint(bytes, index)};
+  return ack;
+}
+
+static struct Watch read_compact_watch(vec &bytes)
+{
+  size_t index;
+  read_compact_header(bytes, index, COMPACT_WATCH);
+  struct Watch watch = {read_compact_string(bytes, index), 0, false};
+  watch.version = read_varint(bytes, index);
+  if (index >= bytes.size())
+  {
+    throw hmp221::DecodeError("watch past the end of the frame");
+  }
+  watch.conflate = bytes[index] != 0;
+  return watch;
+}
+
+// ----------------------------------------
+// Compression
+// ----------------------------------------
+
+// Payloads are compressed in the LZ4 block format: a sequence is a token
+// holding the number of literals and the match length minus 4 in its two
+// nibbles, the literals, then the match as a 2-byte little-endian offset
+// back into the output. A nibble of 15 is continued by bytes that are added
+// to it until one is below 255. The last sequence has literals only. The
+// block is preceded by the varint length of the original bytes, so the
+// output is sized once and a reader can refuse a payload before expanding it.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // the last bytes are always literals
+#define LZ_MATCH_LIMIT 12  // and no match starts this close to the end
+
+static u32 read_u32_le(const u8 *bytes)
+{
+  return (u32)bytes[0] | (u32)bytes[1] << 8 | (u32)bytes[2] << 16 | (u32)bytes[3] << 24;
+}
+
+static void append_lz_length(vec &bytes, size_t length)
+{
+  while (length >= 255)
+  {
+    bytes.push_back(255);
+    length -= 255;
+  }
+  bytes.push_back((u8)length);
+}
+
+static void append_lz_sequence(vec &bytes, const u8 *literals, size_t literalCount, size_t offset, size_t matchLength)
+{
+  size_t matchCode = matchLength >= LZ_MIN_MATCH ? matchLength - LZ_MIN_MATCH : 0;
+  bytes.push_back((u8)((literalCount < 15 ? literalCount : 15) << 4 | (matchCode < 15 ? matchCode : 15)));
+  if (literalCount >= 15)
+  {
+    append_lz_length(bytes, literalCount - 15);
+  }
+  bytes.insert(end(bytes), literals, literals + literalCount);
+  if (matchLength == 0)
+  {
+    return;
+  }
+  bytes.push_back((u8)offset);
+  bytes.push_back((u8)(offset >> 8));
+  if (matchCode >= 15)
+  {
+    append_lz_length(bytes, matchCode - 15);
+  }
+}
+
+vec hmp221::compress(const vec &bytes)
+{
+  vec out;
+  out.reserve(bytes.size() / 2 + 16);
+  append_varint(out, bytes.size());
+  const u8 *data = bytes.data();
+  size_t size = bytes.size();
+  // Last position + 1 of each hashed 4-byte sequence, 0 for none
+  std::vector<u32> table(1 << LZ_HASH_BITS, 0);
+  size_t anchor = 0;
+  size_t i = 0;
+  while (size >= LZ_MATCH_LIMIT && i < size - LZ_MATCH_LIMIT)
+  {
+    u32 sequence = read_u32_le(data + i);
+    u32 hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t candidate = table[hash];
+    table[hash] = (u32)(i + 1);
+    if (candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET || read_u32_le(data + candidate - 1) != sequence)
+    {
+      i++;
+      continue;
+    }
+    size_t match = candidate - 1;
+    size_t length = LZ_MIN_MATCH;
+    while (i + length < size - LZ_LAST_LITERALS && data[match + length] == data[i + length])
+    {
+      length++;
+    }
+    append_lz_sequence(out, data + anchor, i - anchor, i - match, length);
+    i += length;
+    anchor = i;
+  }
+  append_lz_sequence(out, data + anchor, size - anchor, 0, 0);
+  return out;
+}
+
+// Reads the continuation bytes of a length nibble of 15
+static bool read_lz_length(const vec &bytes, size_t &index, size_t &length)
+{
+  u8 byte;
+  do
+  {
+    if (index >= bytes.size())
+    {
+      return false;
+    }
+    byte = bytes[index++];
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+bool hmp221::decompress(const vec &bytes, vec &out)
+{
+  long prefix = varint_size(bytes.data(), bytes.size(), 0);
+  if (prefix <= 0)
+  {
+    return false;
+  }
+  size_t index = 0;
+  u64 size = read_varint(bytes, index);
+  if (size > HMP221_MAX_INFLATED)
+  {
+    return false;
+  }
+  out.resize(size);
+  u8 *target = out.data();
+  size_t position = 0;
+  while (index < bytes.size())
+  {
+    u8 token = bytes[index++];
+    size_t literals = token >> 4;
+    if (literals == 15 && !read_lz_length(bytes, index, literals))
+    {
+      return false;
+    }
+    if (literals > bytes.size() - index || literals > size - position)
+    {
+      return false;
+    }
+    // An empty output has no memory to copy into
+    if (literals > 0)
+    {
+      memcpy(target + position, bytes.data() + index, literals);
+    }
+    position += literals;
+    index += literals;
+    if (index == bytes.size())
+    {
+      break; // the last sequence has no match
+    }
+    if (index + 2 > bytes.size())
+    {
+      return false;
+    }
+    size_t offset = bytes[index] | bytes[index + 1] << 8;
+    index += 2;
+    size_t length = token & 0xf;
+    if (length == 15 && !read_lz_length(bytes, index, length))
+    {
+      return false;
+    }
+    length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > position || length > size - position)
+    {
+      return false;
+    }
+    if (offset >= length)
+    {
+      memcpy(target + position, target + position - offset, length);
+    }
+    else
+    {
+      // The match overlaps the bytes it produces, so it is copied byte by byte
+      for (size_t k = 0; k < length; k++)
+      {
+        target[position + k] = target[position + k - offset];
+      }
+    }
+    position += length;
+  }
+  return position == size;
+}
+
+bool hmp221::compress(struct Message &item)
+{
+  if (item.compressed || item.contentBytes.size() < HMP221_COMPRESS_THRESHOLD)
+  {
+    return false;
+  }
+  vec compressed = compress(item.contentBytes);
+  if (compressed.size() >= item.contentBytes.size())
+  {
+    return false;
+  }
+  item.contentBytes.swap(compressed);
+  item.compressed = true;
+  return true;
+}
+
+bool hmp221::decompress(struct Message &item)
+{
+  if (!item.compressed)
+  {
+    return false;
+  }
+  vec inflated;
+  if (!decompress(item.contentBytes, inflated))
+  {
+    return false;
+  }
+  item.contentBytes.swap(inflated);
+  item.compressed = false;
+  return true;
+}
+
+// ----------------------------------------
+// Deltas
+// ----------------------------------------
+
+// A delta rebuilds a payload from the one it replaced: the varint length of
+// the result, then operations until it is complete. An operation starts with
+// a varint of its length shifted left once. A clear low bit copies that many
+// bytes of the base from the varint offset that follows, a set one adds the
+// bytes that follow it.
+//
+// diff finds copies two ways. It first tries the base right where the last
+// copy left off, which follows bytes changed in place. Failing that, it looks
+// the next DELTA_BLOCK bytes up among the aligned blocks of the base, which
+// finds content that moved because something before it grew or shrank.
+
+#define DELTA_BLOCK 8
+#define DELTA_MAX_HASH_BITS 16
+
+static inline size_t delta_hash(const u8 *bytes, int bits)
+{
+  u64 block;
+  memcpy(&block, bytes, sizeof(block));
+  return (size_t)((block * 0x9e3779b97f4a7c15ULL) >> (64 - bits));
+}
+
+static void append_delta_add(vec &bytes, const u8 *data, size_t length)
+{
+  if (length > 0)
+  {
+    append_varint(bytes, (u64)length << 1 | 1);
+    bytes.insert(end(bytes), data, data + length);
+  }
+}
+
+vec hmp221::diff(const vec &base, const vec &target)
+{
+  vec bytes;
+  append_varint(bytes, target.size());
+  int bits = 4;
+  while (bits < DELTA_MAX_HASH_BITS && ((size_t)1 << bits) < base.size() / DELTA_BLOCK * 2)
+  {
+    bits++;
+  }
+  // Offset of the first aligned block of the base with each hash, plus one
+  std::vector<u32> blocks((size_t)1 << bits, 0);
+  for (size_t offset = 0; offset + DELTA_BLOCK <= base.size() && offset < 0xffffffffUL; offset += DELTA_BLOCK)
+  {
+    u32 &slot = blocks[delta_hash(&base[offset], bits)];
+    if (slot == 0)
+    {
+      slot = (u32)offset + 1;
+    }
+  }
+  size_t position = 0;
+  size_t literal = 0;  // start of the bytes not covered by a copy yet
+  size_t expected = 0; // where the base continues after the last copy
+  while (position + DELTA_BLOCK <= target.size())
+  {
+    size_t from = base.size();
+    if (expected + DELTA_BLOCK <= base.size() && memcmp(&base[expected], &target[position], DELTA_BLOCK) == 0)
+    {
+      from = expected;
+    }
+    else
+    {
+      u32 slot = blocks[delta_hash(&target[position], bits)];
+      if (slot != 0 && memcmp(&base[slot - 1], &target[position], DELTA_BLOCK) == 0)
+      {
+        from = slot - 1;
+      }
+    }
+    if (from == base.size())
+    {
+      position++;
+      expected++;
+      continue;
+    }
+    // Grow the copy back over bytes that were to be added, then forward
+    while (position > literal && from > 0 && base[from - 1] == target[position - 1])
+    {
+      position--;
+      from--;
+    }
+    size_t length = DELTA_BLOCK;
+    while (position + length < target.size() && from + length < base.size() && base[from + length] == target[position + length])
+    {
+      length++;
+    }
+    append_delta_add(bytes, &target[literal], position - literal);
+    append_varint(bytes, (u64)length << 1);
+    append_varint(bytes, from);
+    position += length;
+    literal = position;
+    expected = from + length;
+  }
+  append_delta_add(bytes, target.data() + literal, target.size() - literal);
+  return bytes;
+}
+
+bool hmp221::patch(const vec &base, const vec &delta, vec &out)
+{
+  size_t index = 0;
+  if (varint_size(delta.data(), delta.size(), index) <= 0)
+  {
+    return false;
+  }
+  u64 size = read_varint(delta, index);
+  if (size > HMP221_MAX_INFLATED)
+  {
+    return false;
+  }
+  out.resize(size);
+  size_t position = 0;
+  while (position < size)
+  {
+    if (varint_size(delta.data(), delta.size(), index) <= 0)
+    {
+      return false;
+    }
+    u64 operation = read_varint(delta, index);
+    u64 length = operation >> 1;
+    if (length == 0 || length > size - position)
+    {
+      return false;
+    }
+    if (operation & 1)
+    {
+      if (length > delta.size() - index)
+      {
+        return false;
+      }
+      memcpy(&out[position], &delta[index], length);
+      index += length;
+    }
+    else
+    {
+      if (varint_size(delta.data(), delta.size(), index) <= 0)
+      {
+        return false;
+      }
+      u64 from = read_varint(delta, index);
+      if (from > base.size() || length > base.size() - from)
+      {
+        return false;
+      }
+      memcpy(&out[position], &base[from], length);
+    }
+    position += length;
+  }
+  return index == delta.size();
+}
+
+bool hmp221::patch(const struct Message &previous, struct Message &item)
+{
+  if (item.base == 0 || item.base != previous.version || previous.compressed)
+  {
+    return false;
+  }
+  vec whole;
+  if (!patch(previous.contentBytes, item.contentBytes, whole))
+  {
+    return false;
+  }
+  item.contentBytes.swap(whole);
+  item.base = 0;
+  return true;
+}
+
+// ----------------------------------------
+// HMP221_U8
+// ----------------------------------------
+
+// Serializing a u8 is simple: push the tag onto the vector, then the byte.
+vec hmp221::serialize(u8 item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_U8);
+  bytes.push_back(item);
+  return bytes;
+}
+
+u8 hmp221::deserialize_u8(vec bytes)
+{
+  // To deserialize the u8, we need at least two bytes in the serialized
+  // vector: one for the tag and one for the byte.
+  if (bytes.size() < 2)
+  {
+    throw hmp221::DecodeError("u8 too short");
+  }
+  // Check for the correct tag
+  if (bytes[0] == HMP221_U8)
+  {
+    // Directly return the byte. We can do this because the return type of the
+    // function is the same as the contents of the vector: u8.
+    return bytes[1];
+  }
+  else
+  {
+    // Throw if the tag is not a u8
+    throw hmp221::DecodeError("not a u8");
+  }
+}
+
+// ----------------------------------------
+// HMP221_U32 and HMP221_U64
+// ----------------------------------------
+
+// A u32 is the tag followed by the 4 bytes of the number, most significant first.
+vec hmp221::serialize(u32 item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_U32);
+  for (int shift = 24; shift >= 0; shift -= 8)
+  {
+    bytes.push_back((u8)(item >> shift));
+  }
+  return bytes;
+}
+
+u32 hmp221::deserialize_u32(vec bytes)
+{
+  if (bytes.size() < 5 || bytes[0] != HMP221_U32)
+  {
+    throw hmp221::DecodeError("not a u32");
+  }
+  u32 result = 0;
+  for (int i = 1; i < 5; i++)
+  {
+    result = (result << 8) | bytes[i];
+  }
+  return result;
+}
+
+
+// A u64 is the tag followed by the 8 bytes of the number, most significant first.
+vec hmp221::serialize(u64 item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_U64);
+  for (int shift = 56; shift >= 0; shift -= 8)
+  {
+    bytes.push_back((u8)(item >> shift));
+  }
+  return bytes;
+}
+
+u64 hmp221::deserialize_u64(vec bytes)
+{
+  if (bytes.size() < 9 || bytes[0] != HMP221_U64)
+  {
+    throw hmp221::DecodeError("not a u64");
+  }
+  u64 result = 0;
+  for (int i = 1; i < 9; i++)
+  {
+    result = (result << 8) | bytes[i];
+  }
+  return result;
+}
+
+// ----------------------------------------
+// HMP221_S8 and HMP221_S16
+// ----------------------------------------
+
+// We can handle S8, S16 and S32 in a single function by checking the length
+// of the input string. If it's fewer than 256 characters, we can output a
+// serialized S8. If it's up to 2^16, we can output a serialized S16, and up
+// to 2^32 an S32 with a 4-byte length.
+
+vec hmp221::serialize(string item)
+{
+  vec bytes;
+  if (item.size() < 256)
+  {
+    bytes.push_back(HMP221_S8);
+    bytes.push_back((u8)item.size());
+    // Push each byte of the string onto the vector
+    for (int i = 0; i < item.size(); i++)
+    {
+      bytes.push_back(item[i]);
+    }
+  }
+  else if (item.size() < 65536)
+  {
+    bytes.push_back(HMP221_S16);
+    u32 string_length = (u32)item.size();
+    // Push the first byte of the length onto the vector
+    bytes.push_back((u8)(string_length >> 8));
+    // Push the second byte of the length onto the vector
+    bytes.push_back((u8)(string_length));
+    // Push each byte of the string onto the vector
+    for (int i = 0; i < item.size(); i++)
+    {
+      bytes.push_back((u8)item[i]);
+    }
+  }
+  else if (item.size() <= 0xffffffffUL)
+  {
+    bytes.push_back(HMP221_S32);
+    u32 string_length = (u32)item.size();
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+      bytes.push_back((u8)(string_length >> shift));
+    }
+    bytes.insert(end(bytes), begin(item), end(item));
+  }
+  else
+  {
+    throw std::length_error("string longer than 4 GiB");
+  }
+  return bytes;
+}
+
+string hmp221::deserialize_string(vec bytes)
+{
+  if (bytes.size() < 2)
+  {
+    throw hmp221::DecodeError("string too short");
+  }
+  string deserialized_string("");
+  if (bytes[0] == HMP221_S8)
+  {
+    // The string length is byte 1
+    int string_length = bytes[1];
+    if (string_length + 2 > (int)bytes.size())
+    {
+      throw hmp221::DecodeError("string past the end of the bytes");
+    }
+    // The string starts at byte 2
+    for (int i = 2; i < (string_length + 2); i++)
+    {
+      deserialized_string += bytes[i];
+    }
+  }
+  else if (bytes[0] == HMP221_S16)
+  {
+    // Reconstruct the string length from bytes 1 and 2
+    int string_length = bytes.size() >= 3 ? (bytes[1] << 8) | bytes[2] : 0;
+    if (bytes.size() < 3 || string_length + 3 > (int)bytes.size())
+    {
+      throw hmp221::DecodeError("string past the end of the bytes");
+    }
+    // The string starts at byte 3
+    for (int i = 3; i < (string_length + 3); i++)
+    {
+      deserialized_string += bytes[i];
+    }
+  }
+  else if (bytes[0] == HMP221_S32 && bytes.size() >= 5)
+  {
+    // The string length is bytes 1 to 4 and the string starts at byte 5
+    size_t string_length = (size_t)bytes[1] << 24 | bytes[2] << 16 | bytes[3] << 8 | bytes[4];
+    if (string_length > bytes.size() - 5)
+    {
+      throw hmp221::DecodeError("string past the end of the bytes");
+    }
+    deserialized_string.assign(bytes.begin() + 5, bytes.begin() + 5 + string_length);
+  }
+  else
+  {
+    throw hmp221::DecodeError("not a string");
+  }
+  return deserialized_string;
+}
+
+// ----------------------------------------
+// HMP221_A8, HMP221_A16 and HMP221_A32
+// ----------------------------------------
+
+// Each of the following functions will be very similar. There are three cases
+// for the serialize function: one for the x8, x16 and x32 formats each.
+// In each function, we can leverage the serde functions written above
+// to convert items and vectors from one form to another.
+
+vec hmp221::serialize(std::vector<u8> item)
+{
+  vec bytes;
+  if (item.size() < X8)
+  {
+    bytes.push_back(HMP221_A8);
+    u8 size = (u8)item.size();
+    bytes.push_back(size);
+    for (int i = 0; i < item.size(); i++)
+    {
+      vec temp = serialize(item[i]);
+      for (int j = 0; j < temp.size(); j++)
+      {
+        bytes.push_back(temp[j]);
+      }
+    }
+  }
+  else if (item.size() < X16)
+  {
+    bytes.push_back(HMP221_A16);
+    u32 item_length = (u32)item.size();
+    bytes.push_back((u8)(item_length >> 8));
+    bytes.push_back((u8)(item_length));
+    for (int i = 0; i < item.size(); i++)
+    {
+      vec elem = serialize(item[i]);
+      bytes.insert(end(bytes), begin(elem), end(elem));
+    }
+  }
+  else if (item.size() <= 0xffffffffUL)
+  {
+    bytes.push_back(HMP221_A32);
+    u32 item_length = (u32)item.size();
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+      bytes.push_back((u8)(item_length >> shift));
+    }
+    bytes.reserve(bytes.size() + 2 * item.size());
+    for (size_t i = 0; i < item.size(); i++)
+    {
+      bytes.push_back(HMP221_U8);
+      bytes.push_back(item[i]);
+    }
+  }
+  else
+  {
+    throw std::length_error("array longer than 4 GiB");
+  }
+  return bytes;
+}
+
+std::vector<u8> hmp221::deserialize_vec_u8(vec bytes)
+{
+  if (bytes.size() < 3)
+  {
+    throw hmp221::DecodeError("array too short");
+  }
+  int el_size = 2;
+  std::vector<u8> result;
+  if (bytes[0] == HMP221_A8)
+  {
+    int size = el_size * bytes[1];
+    if (size + 2 > (int)bytes.size())
+    {
+      throw hmp221::DecodeError("array past the end of the bytes");
+    }
+    for (int i = 2; i < (size + 2); i += el_size)
+    {
+      vec sub_vec = slice(bytes, i, i + el_size);
+      u64 element = deserialize_u8(sub_vec);
+      result.push_back(element);
+    }
+  }
+  else if (bytes[0] == HMP221_A16)
+  {
+    int size = el_size * (((int)bytes[1]) << 8 | (int)bytes[2]);
+    if (size + 3 > (int)bytes.size())
+    {
+      throw hmp221::DecodeError("array past the end of the bytes");
+    }
+    for (int i = 2; i < (size + 2); i += el_size)
+    {
+      vec sub_vec = slice(bytes, i + 1, i + el_size);
+      u64 element = deserialize_u8(sub_vec);
+      result.push_back(element);
+    }
+  }
+  else if (bytes[0] == HMP221_A32 && bytes.size() >= 5)
+  {
+    size_t count = (size_t)bytes[1] << 24 | bytes[2] << 16 | bytes[3] << 8 | bytes[4];
+    if (count > (bytes.size() - 5) / el_size)
+    {
+      throw hmp221::DecodeError("array past the end of the bytes");
+    }
+    result.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+      result[i] = bytes[5 + el_size * i + 1];
+    }
+  }
+  else
+  {
+    throw hmp221::DecodeError("not an array");
+  }
+  return result;
+}
+
+// ----------------------------------------
+// HMP221_PACKED
+// ----------------------------------------
+
+// A packed array is the tag, a byte holding the element type, the 4-byte
+// count, most significant first, then the elements back to back in
+// little-endian order, with no tag per element. With HMP221_PACK_DELTA each
+// element is instead the difference from the one before it (the first from
+// 0), taken on its bits as an unsigned number and zigzag-encoded, so a slowly
+// moving series is mostly small numbers whose high bytes are 0 and compress
+// well. Floats are differenced bit for bit, which is exact.
+//
+// On a little-endian host the plain form is a memcpy, and with SSE2 the delta
+// form is encoded and decoded 128 bits at a time; the scalar loops only take
+// the last few elements, or everything on other hosts.
+
+#define PACKED_HEADER 6
+
+static size_t packed_width(u8 type)
+{
+  switch (type & ~HMP221_PACK_DELTA)
+  {
+  case HMP221_PACK_I16:
+    return 2;
+  case HMP221_PACK_I32:
+  case HMP221_PACK_F32:
+    return 4;
+  case HMP221_PACK_F64:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+// 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+template <typename U>
+static inline U zigzag(U delta)
+{
+  return (U)(delta << 1) ^ (U)(0 - (delta >> (sizeof(U) * 8 - 1)));
+}
+
+template <typename U>
+static inline U unzigzag(U value)
+{
+  return (U)(value >> 1) ^ (U)(0 - (value & 1));
+}
+
+template <typename U>
+static inline U load_le(const u8 *bytes)
+{
+  U value = 0;
+  for (size_t b = 0; b < sizeof(U); b++)
+  {
+    value |= (U)bytes[b] << (8 * b);
+  }
+  return value;
+}
+
+template <typename U>
+static inline void store_le(u8 *bytes, U value)
+{
+  for (size_t b = 0; b < sizeof(U); b++)
+  {
+    bytes[b] = (u8)(value >> (8 * b));
+  }
+}
+
+#if defined(__SSE2__)
+// Each kernel handles whole registers and returns how many elements it did.
+// An encoder lines every element up with the one before it by shifting the
+// register one lane and pulling in the last lane of the previous register.
+// A decoder turns differences back into values with a prefix sum: log2(lanes)
+// shifted adds, plus the last value of the previous register broadcast.
+
+static size_t pack_delta_simd(const u16 *in, size_t count, u8 *out)
+{
+  size_t i = 0;
+  __m128i previous = _mm_setzero_si128();
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i current = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i before = _mm_or_si128(_mm_slli_si128(current, 2), _mm_srli_si128(previous, 14));
+    __m128i delta = _mm_sub_epi16(current, before);
+    _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_xor_si128(_mm_slli_epi16(delta, 1), _mm_srai_epi16(delta, 15)));
+    previous = current;
+  }
+  return i;
+}
+
+static size_t pack_delta_simd(const u32 *in, size_t count, u8 *out)
+{
+  size_t i = 0;
+  __m128i previous = _mm_setzero_si128();
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i current = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i before = _mm_or_si128(_mm_slli_si128(current, 4), _mm_srli_si128(previous, 12));
+    __m128i delta = _mm_sub_epi32(current, before);
+    _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_xor_si128(_mm_slli_epi32(delta, 1), _mm_srai_epi32(delta, 31)));
+    previous = current;
+  }
+  return i;
+}
+
+static size_t pack_delta_simd(const u64 *in, size_t count, u8 *out)
+{
+  size_t i = 0;
+  __m128i previous = _mm_setzero_si128();
+  for (; i + 2 <= count; i += 2)
+  {
+    __m128i current = _mm_loadu_si128((const __m128i *)(in + i));
+    __m128i before = _mm_or_si128(_mm_slli_si128(current, 8), _mm_srli_si128(previous, 8));
+    __m128i delta = _mm_sub_epi64(current, before);
+    // SSE2 has no 64-bit arithmetic shift, so the sign is negated instead
+    __m128i sign = _mm_sub_epi64(_mm_setzero_si128(), _mm_srli_epi64(delta, 63));
+    _mm_storeu_si128((__m128i *)(out + 8 * i), _mm_xor_si128(_mm_slli_epi64(delta, 1), sign));
+    previous = current;
+  }
+  return i;
+}
+
+static size_t unpack_delta_simd(const u8 *in, size_t count, u16 *out)
+{
+  size_t i = 0;
+  __m128i running = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi16(1);
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i value = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+    value = _mm_xor_si128(_mm_srli_epi16(value, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(value, one)));
+    value = _mm_add_epi16(value, _mm_slli_si128(value, 2));
+    value = _mm_add_epi16(value, _mm_slli_si128(value, 4));
+    value = _mm_add_epi16(value, _mm_slli_si128(value, 8));
+    value = _mm_add_epi16(value, running);
+    _mm_storeu_si128((__m128i *)(out + i), value);
+    running = _mm_shuffle_epi32(_mm_shufflehi_epi16(value, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  return i;
+}
+
+static size_t unpack_delta_simd(const u8 *in, size_t count, u32 *out)
+{
+  size_t i = 0;
+  __m128i running = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi32(1);
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i value = _mm_loadu_si128((const __m128i *)(in + 4 * i));
+    value = _mm_xor_si128(_mm_srli_epi32(value, 1), _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(value, one)));
+    value = _mm_add_epi32(value, _mm_slli_si128(value, 4));
+    value = _mm_add_epi32(value, _mm_slli_si128(value, 8));
+    value = _mm_add_epi32(value, running);
+    _mm_storeu_si128((__m128i *)(out + i), value);
+    running = _mm_shuffle_epi32(value, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  return i;
+}
+
+static size_t unpack_delta_simd(const u8 *in, size_t count, u64 *out)
+{
+  size_t i = 0;
+  __m128i running = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi64x(1);
+  for (; i + 2 <= count; i += 2)
+  {
+    __m128i value = _mm_loadu_si128((const __m128i *)(in + 8 * i));
+    value = _mm_xor_si128(_mm_srli_epi64(value, 1), _mm_sub_epi64(_mm_setzero_si128(), _mm_and_si128(value, one)));
+    value = _mm_add_epi64(value, _mm_slli_si128(value, 8));
+    value = _mm_add_epi64(value, running);
+    _mm_storeu_si128((__m128i *)(out + i), value);
+    running = _mm_unpackhi_epi64(value, value);
+  }
+  return i;
+}
+#endif
+
+// in holds count elements of the width of U in host order
+template <typename U>
+static void pack_elements(const u8 *in, size_t count, bool delta, u8 *out)
+{
+  size_t i = 0;
+  U previous = 0;
+  if (count == 0)
+  {
+    return; // the elements of an empty vector may be NULL
+  }
+  if (!delta)
+  {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(out, in, count * sizeof(U));
+    return;
+#endif
+  }
+#if defined(__SSE2__)
+  else
+  {
+    i = pack_delta_simd((const U *)in, count, out);
+    if (i > 0)
+    {
+      memcpy(&previous, in + (i - 1) * sizeof(U), sizeof(U));
+    }
+  }
+#endif
+  for (; i < count; i++)
+  {
+    U value;
+    memcpy(&value, in + i * sizeof(U), sizeof(U));
+    store_le<U>(out + i * sizeof(U), delta ? zigzag<U>(value - previous) : value);
+    previous = value;
+  }
+}
+
+template <typename U>
+static void unpack_elements(const u8 *in, size_t count, bool delta, u8 *out)
+{
+  size_t i = 0;
+  U previous = 0;
+  if (count == 0)
+  {
+    return; // the elements of an empty vector may be NULL
+  }
+  if (!delta)
+  {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(out, in, count * sizeof(U));
+    return;
+#endif
+  }
+#if defined(__SSE2__)
+  else
+  {
+    i = unpack_delta_simd(in, count, (U *)out);
+    if (i > 0)
+    {
+      memcpy(&previous, out + (i - 1) * sizeof(U), sizeof(U));
+    }
+  }
+#endif
+  for (; i < count; i++)
+  {
+    U value = load_le<U>(in + i * sizeof(U));
+    if (delta)
+    {
+      value = previous + unzigzag<U>(value);
+    }
+    memcpy(out + i * sizeof(U), &value, sizeof(U));
+    previous = value;
+  }
+}
+
+// U is the unsigned type as wide as T, which the elements are handled as
+template <typename T, typename U>
+static vec serialize_packed(const std::vector<T> &item, u8 type, bool delta)
+{
+  if (item.size() > 0xffffffffUL)
+  {
+    throw std::length_error("packed array longer than 4 GiB");
+  }
+  vec bytes(PACKED_HEADER + item.size() * sizeof(U));
+  bytes[0] = HMP221_PACKED;
+  bytes[1] = type | (delta ? HMP221_PACK_DELTA : 0);
+  u32 count = (u32)item.size();
+  for (int i = 0; i < 4; i++)
+  {
+    bytes[2 + i] = (u8)(count >> (24 - 8 * i));
+  }
+  pack_elements<U>((const u8 *)item.data(), item.size(), delta, bytes.data() + PACKED_HEADER);
+  return bytes;
+}
+
+template <typename T, typename U>
+static std::vector<T> deserialize_packed(vec &bytes, u8 type)
+{
+  if (bytes.size() < PACKED_HEADER || bytes[0] != HMP221_PACKED || (bytes[1] & ~HMP221_PACK_DELTA) != type)
+  {
+    throw hmp221::DecodeError("not a packed array of the expected type");
+  }
+  size_t count = (size_t)bytes[2] << 24 | bytes[3] << 16 | bytes[4] << 8 | bytes[5];
+  if (count > (bytes.size() - PACKED_HEADER) / sizeof(U))
+  {
+    throw hmp221::DecodeError("packed array past the end of the bytes");
+  }
+  std::vector<T> result(count);
+  unpack_elements<U>(bytes.data() + PACKED_HEADER, count, (bytes[1] & HMP221_PACK_DELTA) != 0, (u8 *)result.data());
+  return result;
+}
+
+vec hmp221::serialize(const std::vector<i16> &item, bool delta)
+{
+  return serialize_packed<i16, u16>(item, HMP221_PACK_I16, delta);
+}
+
+std::vector<i16> hmp221::deserialize_vec_i16(vec bytes)
+{
+  return deserialize_packed<i16, u16>(bytes, HMP221_PACK_I16);
+}
+
+vec hmp221::serialize(const std::vector<i32> &item, bool delta)
+{
+  return serialize_packed<i32, u32>(item, HMP221_PACK_I32, delta);
+}
+
+std::vector<i32> hmp221::deserialize_vec_i32(vec bytes)
+{
+  return deserialize_packed<i32, u32>(bytes, HMP221_PACK_I32);
+}
+
+vec hmp221::serialize(const std::vector<f32> &item, bool delta)
+{
+  return serialize_packed<f32, u32>(item, HMP221_PACK_F32, delta);
+}
+
+std::vector<f32> hmp221::deserialize_vec_f32(vec bytes)
+{
+  return deserialize_packed<f32, u32>(bytes, HMP221_PACK_F32);
+}
+
+vec hmp221::serialize(const std::vector<f64> &item, bool delta)
+{
+  return serialize_packed<f64, u64>(item, HMP221_PACK_F64, delta);
+}
+
+std::vector<f64> hmp221::deserialize_vec_f64(vec bytes)
+{
+  return deserialize_packed<f64, u64>(bytes, HMP221_PACK_F64);
+}
+
+// Appends the map holding a message's name, bytes and version. Message
+// frames wrap one of these; MultiMessage frames carry an array of them.
+static void append_message_map(vec &bytes, struct Message &item)
+{
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x2 + (item.version != 0) + (item.id != 0) + (item.ttl != 0) + item.compressed + (item.base != 0)); // 2 k/v pairs, plus version, id, ttl, compressed and base when set
+
+  // k/v 1 is "name"
+  vec fileNamek = hmp221::serialize((string) "name");
+  bytes.insert(end(bytes), begin(fileNamek), end(fileNamek));
+  vec fileNamev = hmp221::serialize(item.channelName);
+  bytes.insert(end(bytes), begin(fileNamev), end(fileNamev));
+
+  // k/v 2 is "bytes"
+  vec bytesk = hmp221::serialize((string) "bytes");
+  bytes.insert(end(bytes), begin(bytesk), end(bytesk));
+  vec bytesv = hmp221::serialize(item.contentBytes);
+  bytes.insert(end(bytes), begin(bytesv), end(bytesv));
+
+  // k/v 3 is "version", only present on messages served from the store.
+  // It comes after "bytes" so readers that look for the first two pairs at
+  // fixed offsets are unaffected.
+  if (item.version != 0)
+  {
+    vec versionk = hmp221::serialize((string) "version");
+    bytes.insert(end(bytes), begin(versionk), end(versionk));
+    vec versionv = hmp221::serialize(item.version);
+    bytes.insert(end(bytes), begin(versionv), end(versionv));
+  }
+
+  // Then "id", only present on publishes that want an Ack
+  if (item.id != 0)
+  {
+    vec idk = hmp221::serialize((string) "id");
+    bytes.insert(end(bytes), begin(idk), end(idk));
+    vec idv = hmp221::serialize(item.id);
+    bytes.insert(end(bytes), begin(idv), end(idv));
+  }
+
+  // Then "ttl", only present on publishes that expire
+  if (item.ttl != 0)
+  {
+    vec ttlk = hmp221::serialize((string) "ttl");
+    bytes.insert(end(bytes), begin(ttlk), end(ttlk));
+    vec ttlv = hmp221::serialize(item.ttl);
+    bytes.insert(end(bytes), begin(ttlv), end(ttlv));
+  }
+
+  // Then "compressed", only present when the bytes are
+  if (item.compressed)
+  {
+    vec compressedk = hmp221::serialize((string) "compressed");
+    bytes.insert(end(bytes), begin(compressedk), end(compressedk));
+    vec compressedv = hmp221::serialize((u8)1);
+    bytes.insert(end(bytes), begin(compressedv), end(compressedv));
+  }
+
+  // The last k/v is "base", only present when the bytes are a delta
+  if (item.base != 0)
+  {
+    vec basek = hmp221::serialize((string) "base");
+    bytes.insert(end(bytes), begin(basek), end(basek));
+    vec basev = hmp221::serialize(item.base);
+    bytes.insert(end(bytes), begin(basev), end(basev));
+  }
+}
+
+vec hmp221::serialize(struct Message item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec message = serialize((string) "Message");
+  bytes.insert(end(bytes), begin(message), end(message));
+
+  // The value is an m8
+  append_message_map(bytes, item);
+  return bytes;
+}
+
+struct Message hmp221::deserialize_message(vec bytes)
+{
+  if (is_compact(bytes))
+  {
+    return read_compact_message_frame(bytes);
+  }
+  vec file_bytes_v;
+  if (bytes.size() < 21 || frame_type(bytes) != "Message")
+  {
+    throw hmp221::DecodeError("not a Message");
+  }
+
+  u8 name_len = bytes[20]; // extract the channel name
+  vec namev = slice(bytes, 19, 19 + name_len + 1);
+  string name = deserialize_string(namev);
+
+  int file_length_byte = 20 + name_len + 9;
+  u8 file_length_tag = file_length_byte < (int)bytes.size() ? bytes[file_length_byte - 1] : 0;
+  int length_bytes = file_length_tag == HMP221_A32 ? 4 : file_length_tag == HMP221_A16 ? 2 : 1;
+  if (file_length_byte + length_bytes > (int)bytes.size())
+  {
+    throw hmp221::DecodeError("message bytes past the end of the frame");
+  }
+  long file_length = bytes[file_length_byte];
+  int offset = 0; // = 0 when size <= 255, = 1 when size > 255
+  // The tag right before the length tells an A8 payload from an A16 or A32 one
+  if (file_length_tag == HMP221_A16)
+  {
+    file_length <<= 8;
+    file_length |= bytes[file_length_byte + 1];
+    offset = 1;
+  }
+  else if (file_length_tag == HMP221_A32)
+  {
+    for (int i = 1; i < 4; i++)
+    {
+      file_length = file_length << 8 | bytes[file_length_byte + i];
+    }
+    offset = 3;
+  }
+
+  int count = 0;
+  int index = file_bytes_v.size() + 2 + offset + file_length_byte;
+  if (index + 2 * file_length - 1 > (long)bytes.size())
+  {
+    throw hmp221::DecodeError("message bytes past the end of the frame");
+  }
+  while (count < file_length)
+  {
+    file_bytes_v.push_back(bytes[index]);
+    index += 2;
+    count += 1;
+  }
+  struct Message deserialized_message = {};
+  deserialized_message.channelName = name;
+  deserialized_message.contentBytes = file_bytes_v;
+
+  // Optional "version", "id" and "ttl" pairs follow the payload
+  int version_key = index - 1;
+  int id_key = version_key;
+  if (version_key + 18 <= (int)bytes.size() && bytes[version_key] == HMP221_S8 && bytes[version_key + 1] == 7)
+  {
+    vec version_slice = slice(bytes, version_key, version_key + 8);
+    if (deserialize_string(version_slice) == "version")
+    {
+      vec versionv = slice(bytes, version_key + 9, version_key + 17);
+      deserialized_message.version = deserialize_u64(versionv);
+      id_key += 18;
+    }
+  }
+  int ttl_key = id_key;
+  if (id_key + 9 <= (int)bytes.size() && bytes[id_key] == HMP221_S8 && bytes[id_key + 1] == 2 &&
+      bytes[id_key + 2] == 'i' && bytes[id_key + 3] == 'd')
+  {
+    vec idv = slice(bytes, id_key + 4, id_key + 8);
+    deserialized_message.id = deserialize_u32(idv);
+    ttl_key += 9;
+  }
+  int compressed_key = ttl_key;
+  if (ttl_key + 10 <= (int)bytes.size() && bytes[ttl_key] == HMP221_S8 && bytes[ttl_key + 1] == 3 &&
+      bytes[ttl_key + 2] == 't' && bytes[ttl_key + 3] == 't' && bytes[ttl_key + 4] == 'l')
+  {
+    vec ttlv = slice(bytes, ttl_key + 5, ttl_key + 9);
+    deserialized_message.ttl = deserialize_u32(ttlv);
+    compressed_key += 10;
+  }
+  int base_key = compressed_key;
+  if (compressed_key + 14 <= (int)bytes.size() && bytes[compressed_key] == HMP221_S8 && bytes[compressed_key + 1] == 10 &&
+      memcmp(&bytes[compressed_key + 2], "compressed", 10) == 0 && bytes[compressed_key + 12] == HMP221_U8)
+  {
+    deserialized_message.compressed = bytes[compressed_key + 13] != 0;
+    base_key += 14;
+  }
+  if (base_key + 15 <= (int)bytes.size() && bytes[base_key] == HMP221_S8 && bytes[base_key + 1] == 4 &&
+      memcmp(&bytes[base_key + 2], "base", 4) == 0)
+  {
+    vec basev = slice(bytes, base_key + 6, base_key + 14);
+    deserialized_message.base = deserialize_u64(basev);
+  }
+  return deserialized_message;
+}
+
+vec hmp221::serialize(struct Request item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec file = serialize((string) "Request");
+  bytes.insert(end(bytes), begin(file), end(file));
+
+  // The value is an m8
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x2); // 2 k/v pairs
+
+  // k/v 1 is "name"
+  vec fileNamek = serialize((string) "name");
+  bytes.insert(end(bytes), begin(fileNamek), end(fileNamek));
+  vec fileNamev = serialize(item.name);
+  bytes.insert(end(bytes), begin(fileNamev), end(fileNamev));
+  return bytes;
+}
+
+struct Request hmp221::deserialize_request(vec bytes)
+{
+  if (is_compact(bytes))
+  {
+    return read_compact_request(bytes);
+  }
+  if (bytes.size() < 21)
+  {
+    throw hmp221::DecodeError("request too short");
+  }
+  vec file_slice = slice(bytes, 2, 10);
+  string file_string = deserialize_string(file_slice);
+  if (file_string != "Request")
+  {
+    throw hmp221::DecodeError("not a Request");
+  }
+  u8 name_len = bytes[20]; // extract the length of the file name
+  vec namev = slice(bytes, 19, 19 + name_len + 1);
+  string name = deserialize_string(namev);
+  struct Request deserialized_request = {name};
+  return deserialized_request;
+}
+
+// ----------------------------------------
+// Framing
+// ----------------------------------------
+
+// Every hmp221 frame is a single self-describing value, so its length can be
+// worked out from the tags alone. This lets a reader on a stream socket know
+// when a whole frame has arrived without any extra length prefix on the wire.
+
+// Maps and arrays a frame may nest; the messages of a Snapshot are 4 deep
+#define MAX_NESTING 16
+
+/**
+ * @brief Subroutine to measure the encoded value starting at bytes[index]
+ *
+ * @param bytes start of the received bytes
+ * @param size number of bytes received so far
+ * @param index offset of the value's tag
+ * @param depth number of maps and arrays the value is in
+ * @return offset just past the value, 0 if more bytes are needed, -1 if malformed
+ */
+static long value_end(const u8 *bytes, size_t size, size_t index, int depth = 0)
+{
+  if (index >= size)
+  {
+    return 0;
+  }
+  // A run of map tags would otherwise recurse once per two bytes
+  if (depth > MAX_NESTING)
+  {
+    return -1;
+  }
+  u8 tag = bytes[index];
+  size_t count;
+  size_t header;
+  switch (tag)
+  {
+  case HMP221_U8:
+    return index + 2 <= size ? index + 2 : 0;
+  case HMP221_U32:
+    return index + 5 <= size ? index + 5 : 0;
+  case HMP221_U64:
+    return index + 9 <= size ? index + 9 : 0;
+  case HMP221_S8:
+  case HMP221_S16:
+  case HMP221_S32:
+  {
+    header = tag == HMP221_S8 ? 2 : tag == HMP221_S16 ? 3 : 5;
+    if (index + header > size)
+    {
+      return 0;
+    }
+    size_t length = 0;
+    for (size_t i = 1; i < header; i++)
+    {
+      length = length << 8 | bytes[index + i];
+    }
+    return index + header + length <= size ? index + header + length : 0;
+  }
+  case HMP221_A32:
+    if (index + 5 > size)
+    {
+      return 0;
+    }
+    count = (size_t)bytes[index + 1] << 24 | bytes[index + 2] << 16 | bytes[index + 3] << 8 | bytes[index + 4];
+    // Only arrays of u8 come this large, and those are measured without a walk
+    return index + 5 + 2 * count <= size ? index + 5 + 2 * count : 0;
+  case HMP221_PACKED:
+    if (index + PACKED_HEADER > size)
+    {
+      return 0;
+    }
+    if (packed_width(bytes[index + 1]) == 0)
+    {
+      return -1;
+    }
+    count = (size_t)bytes[index + 2] << 24 | bytes[index + 3] << 16 | bytes[index + 4] << 8 | bytes[index + 5];
+    count *= packed_width(bytes[index + 1]);
+    return index + PACKED_HEADER + count <= size ? index + PACKED_HEADER + count : 0;
+  case HMP221_A8:
+  case HMP221_A16:
+  case HMP221_M8:
+    header = tag == HMP221_A16 ? 3 : 2;
+    if (index + header > size)
+    {
+      return 0;
+    }
+    count = tag == HMP221_A16 ? (bytes[index + 1] << 8) | bytes[index + 2] : bytes[index + 1];
+    if (tag == HMP221_M8)
+    {
+      // Each pair is a key followed by a value
+      count *= 2;
+    }
+    index += header;
+    for (size_t i = 0; i < count; i++)
+    {
+      long next = value_end(bytes, size, index, depth + 1);
+      if (next <= 0)
+      {
+        return next;
+      }
+      index = next;
+    }
+    return index;
+  default:
+    return -1;
+  }
+}
+
+long hmp221::frame_length(const u8 *bytes, size_t size)
+{
+  if (size == 0)
+  {
+    return 0;
+  }
+  if ((bytes[0] & 0xf0) == HMP221_COMPACT)
+  {
+    return compact_frame_length(bytes, size);
+  }
+  // Deployed clients write Request maps that declare 2 k/v pairs but only
+  // carry "name", so those frames have to be measured by hand.
+  static const u8 request_prefix[] = {HMP221_M8, 0x1, HMP221_S8, 7, 'R', 'e', 'q', 'u', 'e', 's', 't', HMP221_M8};
+  size_t prefix_len = sizeof(request_prefix);
+  size_t compare_len = size < prefix_len ? size : prefix_len;
+  if (memcmp(bytes, request_prefix, compare_len) != 0)
+  {
+    return value_end(bytes, size, 0);
+  }
+  if (size < prefix_len)
+  {
+    return 0;
+  }
+  // Skip the pair count, then measure the "name" key and its value. A
+  // client that does write the second pair has its key right behind; the
+  // next frame would start with a map or a compact type instead.
+  long key_end = value_end(bytes, size, prefix_len + 1);
+  if (key_end <= 0)
+  {
+    return key_end;
+  }
+  long name_end = value_end(bytes, size, key_end);
+  if (name_end <= 0 || (size_t)name_end == size ||
+      (bytes[name_end] != HMP221_S8 && bytes[name_end] != HMP221_S16 && bytes[name_end] != HMP221_S32))
+  {
+    return name_end;
+  }
+  long second_key_end = value_end(bytes, size, name_end);
+  if (second_key_end <= 0)
+  {
+    return second_key_end;
+  }
+  return value_end(bytes, size, second_key_end);
+}
+
+vec hmp221::serialize(struct Subscribe item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec subscribe = serialize((string) "Subscribe");
+  bytes.insert(end(bytes), begin(subscribe), end(subscribe));
+
+  // The value is an m8
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(item.timeout != 0 ? 0x3 : 0x2); // 2 k/v pairs, 3 for a long-poll
+
+  // k/v 1 is "name"
+  vec namek = serialize((string) "name");
+  bytes.insert(end(bytes), begin(namek), end(namek));
+  vec namev = serialize(item.name);
+  bytes.insert(end(bytes), begin(namev), end(namev));
+
+  // k/v 2 is "version"
+  vec versionk = serialize((string) "version");
+  bytes.insert(end(bytes), begin(versionk), end(versionk));
+  vec versionv = serialize(item.version);
+  bytes.insert(end(bytes), begin(versionv), end(versionv));
+
+  // k/v 3 is "timeout", only present when the server should wait for a newer version
+  if (item.timeout != 0)
+  {
+    vec timeoutk = serialize((string) "timeout");
+    bytes.insert(end(bytes), begin(timeoutk), end(timeoutk));
+    vec timeoutv = serialize(item.timeout);
+    bytes.insert(end(bytes), begin(timeoutv), end(timeoutv));
+  }
+  return bytes;
+}
+
+struct Subscribe hmp221::deserialize_subscribe(vec bytes)
+{
+  if (is_compact(bytes))
+  {
+    return read_compact_subscribe(bytes);
+  }
+  if (bytes.size() < 24 || frame_type(bytes) != "Subscribe")
+  {
+    throw hmp221::DecodeError("not a Subscribe");
+  }
+  u8 name_len = bytes[22]; // extract the length of the channel name
+  vec namev = slice(bytes, 21, 22 + name_len);
+  string name = deserialize_string(namev);
+  int version_value = 23 + name_len + 9;
+  if (version_value + 9 > (int)bytes.size())
+  {
+    throw hmp221::DecodeError("subscribe version past the end of the frame");
+  }
+  vec versionv = slice(bytes, version_value, version_value + 8);
+  struct Subscribe deserialized_subscribe = {name, deserialize_u64(versionv), 0};
+
+  // An optional "timeout" pair follows the version; byte 14 is the pair count
+  int timeout_key = version_value + 9;
+  if (bytes[14] == 0x3 && timeout_key + 14 <= (int)bytes.size())
+  {
+    vec timeoutv = slice(bytes, timeout_key + 9, timeout_key + 13);
+    deserialized_subscribe.timeout = deserialize_u32(timeoutv);
+  }
+  return deserialized_subscribe;
+}
+
+vec hmp221::serialize(struct NotModified item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec notModified = serialize((string) "NotModified");
+  bytes.insert(end(bytes), begin(notModified), end(notModified));
+
+  // The value is an m8
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x2); // 2 k/v pairs
+
+  // k/v 1 is "name"
+  vec namek = serialize((string) "name");
+  bytes.insert(end(bytes), begin(namek), end(namek));
+  vec namev = serialize(item.channelName);
+  bytes.insert(end(bytes), begin(namev), end(namev));
+
+  // k/v 2 is "version"
+  vec versionk = serialize((string) "version");
+  bytes.insert(end(bytes), begin(versionk), end(versionk));
+  vec versionv = serialize(item.version);
+  bytes.insert(end(bytes), begin(versionv), end(versionv));
+  return bytes;
+}
+
+struct NotModified hmp221::deserialize_not_modified(vec bytes)
+{
+  if (is_compact(bytes))
+  {
+    return read_compact_not_modified(bytes);
+  }
+  if (bytes.size() < 26 || frame_type(bytes) != "NotModified")
+  {
+    throw hmp221::DecodeError("not a NotModified");
+  }
+  u8 name_len = bytes[24]; // extract the length of the channel name
+  vec namev = slice(bytes, 23, 24 + name_len);
+  string name = deserialize_string(namev);
+  int version_value = 25 + name_len + 9;
+  if (version_value + 9 > (int)bytes.size())
+  {
+    throw hmp221::DecodeError("not modified version past the end of the frame");
+  }
+  vec versionv = slice(bytes, version_value, version_value + 8);
+  struct NotModified deserialized_not_modified = {name, deserialize_u64(versionv)};
+  return deserialized_not_modified;
+}
+
+string hmp221::frame_type(vec &bytes)
+{
+  if (is_compact(bytes))
+  {
+    u8 type = bytes[0] & 0x0f;
+    return type < COMPACT_TYPES ? string(compact_names[type]) : string("");
+  }
+  // A frame is a map with a single pair whose key names the frame type
+  if (bytes.size() < 4 || bytes[0] != HMP221_M8 || bytes[2] != HMP221_S8 || bytes.size() < (size_t)(4 + bytes[3]))
+  {
+    return string("");
+  }
+  return string(bytes.begin() + 4, bytes.begin() + 4 + bytes[3]);
+}
+
+// ----------------------------------------
+// Batches
+// ----------------------------------------
+
+// Batch frames carry arrays of strings and maps, so they are read with a
+// cursor that follows the tags rather than at fixed offsets.
+
+// Reads the element count of an x8/x16 value, or an x32 one if tag32 is
+// given, and moves index past its header
+static size_t read_count(vec &bytes, size_t &index, u8 tag8, u8 tag16, u8 tag32 = 0)
+{
+  if (index + 2 > bytes.size())
+  {
+    throw hmp221::DecodeError("count past the end of the frame");
+  }
+  size_t count;
+  if (bytes[index] == tag8)
+  {
+    count = bytes[index + 1];
+    index += 2;
+  }
+  else if (bytes[index] == tag16 && index + 3 <= bytes.size())
+  {
+    count = (bytes[index + 1] << 8) | bytes[index + 2];
+    index += 3;
+  }
+  else if (tag32 != 0 && bytes[index] == tag32 && index + 5 <= bytes.size())
+  {
+    count = (size_t)bytes[index + 1] << 24 | bytes[index + 2] << 16 | bytes[index + 3] << 8 | bytes[index + 4];
+    index += 5;
+  }
+  else
+  {
+    throw hmp221::DecodeError("unexpected tag");
+  }
+  return count;
+}
+
+static string read_string(vec &bytes, size_t &index)
+{
+  size_t length = read_count(bytes, index, HMP221_S8, HMP221_S16, HMP221_S32);
+  if (index + length > bytes.size())
+  {
+    throw hmp221::DecodeError("string past the end of the frame");
+  }
+  string result(bytes.begin() + index, bytes.begin() + index + length);
+  index += length;
+  return result;
+}
+
+static vec read_u8_array(vec &bytes, size_t &index)
+{
+  size_t count = read_count(bytes, index, HMP221_A8, HMP221_A16, HMP221_A32);
+  if (index + 2 * count > bytes.size())
+  {
+    throw hmp221::DecodeError("array past the end of the frame");
+  }
+  vec result(count);
+  for (size_t i = 0; i < count; i++)
+  {
+    result[i] = bytes[index + 2 * i + 1];
+  }
+  index += 2 * count;
+  return result;
+}
+
+// Reads a message map written by append_message_map; unknown pairs are skipped
+static struct Message read_message_map(vec &bytes, size_t &index)
+{
+  struct Message item = {};
+  size_t pairs = read_count(bytes, index, HMP221_M8, HMP221_M8);
+  for (size_t i = 0; i < pairs; i++)
+  {
+    string key = read_string(bytes, index);
+    if (key == "name")
+    {
+      item.channelName = read_string(bytes, index);
+    }
+    else if (key == "bytes")
+    {
+      item.contentBytes = read_u8_array(bytes, index);
+    }
+    else if (key == "version" && index + 9 <= bytes.size())
+    {
+      item.version = hmp221::deserialize_u64(hmp221::slice(bytes, index, index + 8));
+      index += 9;
+    }
+    else if (key == "id" && index + 5 <= bytes.size())
+    {
+      item.id = hmp221::deserialize_u32(hmp221::slice(bytes, index, index + 4));
+      index += 5;
+    }
+    else if (key == "ttl" && index + 5 <= bytes.size())
+    {
+      item.ttl = hmp221::deserialize_u32(hmp221::slice(bytes, index, index + 4));
+      index += 5;
+    }
+    else if (key == "compressed" && index + 2 <= bytes.size() && bytes[index] == HMP221_U8)
+    {
+      item.compressed = bytes[index + 1] != 0;
+      index += 2;
+    }
+    else if (key == "base" && index + 9 <= bytes.size())
+    {
+      item.base = hmp221::deserialize_u64(hmp221::slice(bytes, index, index + 8));
+      index += 9;
+    }
+    else
+    {
+      long next = value_end(bytes.data(), bytes.size(), index);
+      if (next <= 0)
+      {
+        throw hmp221::DecodeError("malformed value in a message");
+      }
+      index = next;
+    }
+  }
+  return item;
+}
+
+// Appends the frame header of a batch: the frame type and the key of its only pair
+static void append_batch_header(vec &bytes, string type, string key, size_t count, u8 tag8, u8 tag16)
+{
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec typev = hmp221::serialize(type);
+  bytes.insert(end(bytes), begin(typev), end(typev));
+
+  // The value is an m8 with 1 k/v pair, an array
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1);
+  vec keyv = hmp221::serialize(key);
+  bytes.insert(end(bytes), begin(keyv), end(keyv));
+  if (count < X8)
+  {
+    bytes.push_back(tag8);
+    bytes.push_back((u8)count);
+  }
+  else if (count < X16)
+  {
+    bytes.push_back(tag16);
+    bytes.push_back((u8)(count >> 8));
+    bytes.push_back((u8)count);
+  }
+  else
+  {
+    throw std::length_error("batch of 65536 or more");
+  }
+}
+
+// Moves index to the array inside a batch frame of the given type and returns its length
+static size_t read_batch_header(vec &bytes, size_t &index, string type, string key)
+{
+  if (hmp221::frame_type(bytes) != type)
+  {
+    throw hmp221::DecodeError("not a batch of the expected type");
+  }
+  index = 4 + type.size();
+  read_count(bytes, index, HMP221_M8, HMP221_M8);
+  if (read_string(bytes, index) != key)
+  {
+    throw hmp221::DecodeError("unexpected key in a batch");
+  }
+  return read_count(bytes, index, HMP221_A8, HMP221_A16);
+}
+
+vec hmp221::serialize(struct MultiRequest item)
+{
+  vec bytes;
+  append_batch_header(bytes, "MultiRequest", "names", item.names.size(), HMP221_A8, HMP221_A16);
+  for (size_t i = 0; i < item.names.size(); i++)
+  {
+    vec namev = serialize(item.names[i]);
+    bytes.insert(end(bytes), begin(namev), end(namev));
+  }
+  return bytes;
+}
+
+struct MultiRequest hmp221::deserialize_multi_request(vec bytes)
+{
+  if (is_compact(bytes))
+  {
+    return read_compact_multi_request(bytes);
+  }
+  struct MultiRequest deserialized_request;
+  size_t index;
+  size_t count = read_batch_header(bytes, index, "MultiRequest", "names");
+  deserialized_request.names.reserve(count);
+  for (size_t i = 0; i < count; i++)
+  {
+    deserialized_request.names.push_back(read_string(bytes, index));
+  }
+  return deserialized_request;
+}
+
+vec hmp221::serialize(struct MultiMessage item)
+{
+  vec bytes;
+  append_batch_header(bytes, "MultiMessage", "messages", item.messages.size(), HMP221_A8, HMP221_A16);
+  for (size_t i = 0; i < item.messages.size(); i++)
+  {
+    append_message_map(bytes, item.messages[i]);
+  }
+  return bytes;
+}
+
+struct MultiMessage hmp221::deserialize_multi_message(vec bytes)
+{
+  if (is_compact(bytes))
+  {
+    return read_compact_multi_message(bytes);
+  }
+  struct MultiMessage deserialized_message;
+  size_t index;
+  size_t count = read_batch_header(bytes, index, "MultiMessage", "messages");
+  deserialized_message.messages.reserve(count);
+  for (size_t i = 0; i < count; i++)
+  {
+    deserialized_message.messages.push_back(read_message_map(bytes, index));
+  }
+  return deserialized_message;
+}
+
+// ----------------------------------------
+// Ack
+// ----------------------------------------
+
+// Ack, Ping and Pong are all {type: {"id": u32}}
+static vec serialize_id_frame(string type, u32 id)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec typev = hmp221::serialize(type);
+  bytes.insert(end(bytes), begin(typev), end(typev));
+
+  // The value is an m8 with 1 k/v pair
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1);
+  vec idk = hmp221::serialize((string) "id");
+  bytes.insert(end(bytes), begin(idk), end(idk));
+  vec idv = hmp221::serialize(id);
+  bytes.insert(end(bytes), begin(idv), end(idv));
+  return bytes;
+}
+
+static u32 deserialize_id_frame(vec &bytes, string type)
+{
+  // m8, 1, type (2 + length bytes), m8, 1, "id" (4 bytes), u32
+  size_t index = 2 + 2 + type.size() + 2 + 4;
+  if (bytes.size() < index + 5 || hmp221::frame_type(bytes) != type)
+  {
+    throw hmp221::DecodeError("not an id frame of the expected type");
+  }
+  return hmp221::deserialize_u32(hmp221::slice(bytes, index, index + 4));
+}
+
+vec hmp221::serialize(struct Ack item)
+{
+  return serialize_id_frame("Ack", item.id);
+}
+
+struct Ack hmp221::deserialize_ack(vec bytes)
+{
+  if (is_compact(bytes))
+  {
+    return read_compact_ack(bytes);
+  }
+  struct Ack deserialized_ack = {deserialize_id_frame(bytes, "Ack")};
+  return deserialized_ack;
+}
+
+// ----------------------------------------
+// Ping and Pong
+// ----------------------------------------
+
+vec hmp221::serialize(struct Ping item)
+{
+  return serialize_id_frame("Ping", item.id);
+}
+
+struct Ping hmp221::deserialize_ping(vec bytes)
+{
+  struct Ping deserialized_ping = {deserialize_id_frame(bytes, "Ping")};
+  return deserialized_ping;
+}
+
+vec hmp221::serialize(struct Pong item)
+{
+  return serialize_id_frame("Pong", item.id);
+}
+
+struct Pong hmp221::deserialize_pong(vec bytes)
+{
+  struct Pong deserialized_pong = {deserialize_id_frame(bytes, "Pong")};
+  return deserialized_pong;
+}
+
+// ----------------------------------------
+// Watch
+// ----------------------------------------
+
+vec hmp221::serialize(struct Watch item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec watch = serialize((string) "Watch");
+  bytes.insert(end(bytes), begin(watch), end(watch));
+
+  // The value is an m8 with 2 k/v pairs, 3 for a conflated watch
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(item.conflate ? 0x3 : 0x2);
+
+  // k/v 1 is "name"
+  vec namek = serialize((string) "name");
+  bytes.insert(end(bytes), begin(namek), end(namek));
+  vec namev = serialize(item.name);
+  bytes.insert(end(bytes), begin(namev), end(namev));
+
+  // k/v 2 is "version"
+  vec versionk = serialize((string) "version");
+  bytes.insert(end(bytes), begin(versionk), end(versionk));
+  vec versionv = serialize(item.version);
+  bytes.insert(end(bytes), begin(versionv), end(versionv));
+
+  // k/v 3 is "conflate", only present when set
+  if (item.conflate)
+  {
+    vec conflatek = serialize((string) "conflate");
+    bytes.insert(end(bytes), begin(conflatek), end(conflatek));
+    vec conflatev = serialize((u8)1);
+    bytes.insert(end(bytes), begin(conflatev), end(conflatev));
+  }
+  return bytes;
+}
+
+struct Watch hmp221::deserialize_watch(vec bytes)
+{
+  if (is_compact(bytes))
+  {
+    return read_compact_watch(bytes);
+  }
+  if (frame_type(bytes) != "Watch")
+  {
+    throw hmp221::DecodeError("not a Watch");
+  }
+  struct Watch deserialized_watch = {"", 0, false};
+  size_t index = 4 + 5;
+  size_t pairs = read_count(bytes, index, HMP221_M8, HMP221_M8);
+  for (size_t i = 0; i < pairs; i++)
+  {
+    string key = read_string(bytes, index);
+    if (key == "name")
+    {
+      deserialized_watch.name = read_string(bytes, index);
+    }
+    else if (key == "version" && index + 9 <= bytes.size())
+    {
+      deserialized_watch.version = deserialize_u64(slice(bytes, index, index + 8));
+      index += 9;
+    }
+    else if (key == "conflate" && index + 2 <= bytes.size() && bytes[index] == HMP221_U8)
+    {
+      deserialized_watch.conflate = bytes[index + 1] != 0;
+      index += 2;
+    }
+    else
+    {
+      long next = value_end(bytes.data(), bytes.size(), index);
+      if (next <= 0)
+      {
+        throw hmp221::DecodeError("malformed value in a watch");
+      }
+      index = next;
+    }
+  }
+  return deserialized_watch;
+}
+
+// ----------------------------------------
+// Redirect
+// ----------------------------------------
+
+vec hmp221::serialize(struct Redirect item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec redirect = serialize((string) "Redirect");
+  bytes.insert(end(bytes), begin(redirect), end(redirect));
+
+  // The value is an m8 with 2 k/v pairs
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x2);
+
+  // k/v 1 is "name"
+  vec namek = serialize((string) "name");
+  bytes.insert(end(bytes), begin(namek), end(namek));
+  vec namev = serialize(item.name);
+  bytes.insert(end(bytes), begin(namev), end(namev));
+
+  // k/v 2 is "node"
+  vec nodek = serialize((string) "node");
+  bytes.insert(end(bytes), begin(nodek), end(nodek));
+  vec nodev = serialize(item.node);
+  bytes.insert(end(bytes), begin(nodev), end(nodev));
+  return bytes;
+}
+
+struct Redirect hmp221::deserialize_redirect(vec bytes)
+{
+  if (frame_type(bytes) != "Redirect")
   {
-    // Directly return the byte. We can do this because the return type of the
-    // function is the same as the contents of the vector: u8.
-    return bytes[1];
+    throw hmp221::DecodeError("not a Redirect");
   }
-  else
+  struct Redirect deserialized_redirect;
+  size_t index = 4 + 8;
+  size_t pairs = read_count(bytes, index, HMP221_M8, HMP221_M8);
+  for (size_t i = 0; i < pairs; i++)
   {
-    // Throw if the tag is not a u8
-    throw;
+    string key = read_string(bytes, index);
+    if (key == "name")
+    {
+      deserialized_redirect.name = read_string(bytes, index);
+    }
+    else if (key == "node")
+    {
+      deserialized_redirect.node = read_string(bytes, index);
+    }
+    else
+    {
+      long next = value_end(bytes.data(), bytes.size(), index);
+      if (next <= 0)
+      {
+        throw hmp221::DecodeError("malformed value in a redirect");
+      }
+      index = next;
+    }
   }
+  return deserialized_redirect;
 }
 
 // ----------------------------------------
-// HMP221_S8 and HMP221_S16
+// Handshake, local transport and replication
 // ----------------------------------------
 
-// We can handle S8 and S16 in a single function by checking the length of the
-// input string. If it's fewer than 256 characters, we can output a serialized
-// S8. If it's up to 2^16, we can output a serialized S16.
+// These frames are maps of u64 pairs and messages, read with the cursor
 
-vec hmp221::serialize(string item)
+static void append_u64_pair(vec &bytes, string key, u64 value)
 {
-  vec bytes;
-  if (item.size() < 256)
-  {
-    bytes.push_back(HMP221_S8);
-    bytes.push_back((u8)item.size());
-    // Push each byte of the string onto the vector
-    for (int i = 0; i < item.size(); i++)
-    {
-      bytes.push_back(item[i]);
-    }
-  }
-  else if (item.size() < 65536)
+  vec keyv = hmp221::serialize(key);
+  bytes.insert(end(bytes), begin(keyv), end(keyv));
+  vec valuev = hmp221::serialize(value);
+  bytes.insert(end(bytes), begin(valuev), end(valuev));
+}
+
+static u64 read_u64(vec &bytes, size_t &index)
+{
+  if (index + 9 > bytes.size())
   {
-    bytes.push_back(HMP221_S16);
-    u32 string_length = (u32)item.size();
-    // Push the first byte of the length onto the vector
-    bytes.push_back((u8)(string_length >> 8));
-    // Push the second byte of the length onto the vector
-    bytes.push_back((u8)(string_length));
-    // Push each byte of the string onto the vector
-    for (int i = 0; i < item.size(); i++)
-    {
-      bytes.push_back((u8)item[i]);
-    }
+    throw hmp221::DecodeError("u64 past the end of the frame");
   }
-  else
+  u64 value = hmp221::deserialize_u64(hmp221::slice(bytes, index, index + 8));
+  index += 9;
+  return value;
+}
+
+// Moves index past a value this reader does not know
+static void skip_value(vec &bytes, size_t &index)
+{
+  long next = value_end(bytes.data(), bytes.size(), index);
+  if (next <= 0)
   {
-    throw;
+    throw hmp221::DecodeError("malformed value");
   }
+  index = next;
+}
+
+// Hello and Welcome only differ in their type
+static vec serialize_protocol_frame(string type, u64 version, u64 capabilities)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec typev = hmp221::serialize(type);
+  bytes.insert(end(bytes), begin(typev), end(typev));
+
+  // The value is an m8 with 2 k/v pairs
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x2);
+  append_u64_pair(bytes, "version", version);
+  append_u64_pair(bytes, "capabilities", capabilities);
   return bytes;
 }
 
-string hmp221::deserialize_string(vec bytes)
+static void deserialize_protocol_frame(vec &bytes, string type, u64 &version, u64 &capabilities)
 {
-  if (bytes.size() < 3)
+  if (hmp221::frame_type(bytes) != type)
   {
-    throw;
+    throw hmp221::DecodeError("not a protocol frame of the expected type");
   }
-  string deserialized_string("");
-  if (bytes[0] == HMP221_S8)
+  size_t index = 4 + type.size();
+  size_t pairs = read_count(bytes, index, HMP221_M8, HMP221_M8);
+  for (size_t i = 0; i < pairs; i++)
   {
-    // The string length is byte 1
-    int string_length = bytes[1];
-    // The string starts at byte 2
-    for (int i = 2; i < (string_length + 2); i++)
+    string key = read_string(bytes, index);
+    if (key == "version")
     {
-      deserialized_string += bytes[i];
+      version = read_u64(bytes, index);
     }
-  }
-  else if (bytes[0] == HMP221_S16)
-  {
-    // Reconstruct the string length from bytes 1 and 2
-    int string_length = (bytes[1] << 8) | bytes[2];
-    // The string starts at byte 3
-    for (int i = 3; i < (string_length + 3); i++)
+    else if (key == "capabilities")
     {
-      deserialized_string += bytes[i];
+      capabilities = read_u64(bytes, index);
+    }
+    else
+    {
+      skip_value(bytes, index);
     }
   }
-  return deserialized_string;
 }
 
-// ----------------------------------------
-// HMP221_A8 and HMP221_A16
-// ----------------------------------------
+vec hmp221::serialize(struct Hello item)
+{
+  return serialize_protocol_frame("Hello", item.version, item.capabilities);
+}
 
-// Each of the following functions will be very similar. There are two cases
-// for the serialize function: one for the x8 and one for the x16 formats.
-// In each function, we can leverage the serde functions written above
-// to convert items and vectors from one form to another.
+struct Hello hmp221::deserialize_hello(vec bytes)
+{
+  struct Hello deserialized_hello = {0, 0};
+  deserialize_protocol_frame(bytes, "Hello", deserialized_hello.version, deserialized_hello.capabilities);
+  return deserialized_hello;
+}
 
-vec hmp221::serialize(std::vector<u8> item)
+vec hmp221::serialize(struct Welcome item)
+{
+  return serialize_protocol_frame("Welcome", item.version, item.capabilities);
+}
+
+struct Welcome hmp221::deserialize_welcome(vec bytes)
+{
+  struct Welcome deserialized_welcome = {0, 0};
+  deserialize_protocol_frame(bytes, "Welcome", deserialized_welcome.version, deserialized_welcome.capabilities);
+  return deserialized_welcome;
+}
+
+vec hmp221::serialize(struct Attach item)
 {
   vec bytes;
-  if (item.size() < X8)
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec attach = serialize((string) "Attach");
+  bytes.insert(end(bytes), begin(attach), end(attach));
+
+  // The value is an m8 with 1 k/v pair
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1);
+  append_u64_pair(bytes, "capacity", item.capacity);
+  return bytes;
+}
+
+struct Attach hmp221::deserialize_attach(vec bytes)
+{
+  if (frame_type(bytes) != "Attach")
   {
-    bytes.push_back(HMP221_A8);
-    u8 size = (u8)item.size();
-    bytes.push_back(size);
-    for (int i = 0; i < item.size(); i++)
-    {
-      vec temp = serialize(item[i]);
-      for (int j = 0; j < temp.size(); j++)
-      {
-        bytes.push_back(temp[j]);
-      }
-    }
+    throw hmp221::DecodeError("not an Attach");
   }
-  else if (item.size() < X16)
+  struct Attach deserialized_attach = {0};
+  size_t index = 4 + 6;
+  size_t pairs = read_count(bytes, index, HMP221_M8, HMP221_M8);
+  for (size_t i = 0; i < pairs; i++)
   {
-    bytes.push_back(HMP221_A16);
-    u32 item_length = (u32)item.size();
-    bytes.push_back((u8)(item_length >> 8));
-    bytes.push_back((u8)(item_length));
-    for (int i = 0; i < item.size(); i++)
+    string key = read_string(bytes, index);
+    if (key == "capacity")
     {
-      vec elem = serialize(item[i]);
-      bytes.insert(end(bytes), begin(elem), end(elem));
+      deserialized_attach.capacity = read_u64(bytes, index);
+    }
+    else
+    {
+      skip_value(bytes, index);
     }
   }
-  else
-  {
-    throw;
-  }
+  return deserialized_attach;
+}
+
+vec hmp221::serialize(struct Replicate item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec replicate = serialize((string) "Replicate");
+  bytes.insert(end(bytes), begin(replicate), end(replicate));
+
+  // The value is an m8 with 2 k/v pairs
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x2);
+  append_u64_pair(bytes, "epoch", item.epoch);
+  append_u64_pair(bytes, "sequence", item.sequence);
   return bytes;
 }
 
-std::vector<u8> hmp221::deserialize_vec_u8(vec bytes)
+struct Replicate hmp221::deserialize_replicate(vec bytes)
 {
-  if (bytes.size() < 3)
+  if (frame_type(bytes) != "Replicate")
   {
-    throw;
+    throw hmp221::DecodeError("not a Replicate");
   }
-  int el_size = 2;
-  std::vector<u8> result;
-  if (bytes[0] == HMP221_A8)
+  struct Replicate deserialized_replicate = {0, 0};
+  size_t index = 4 + 9;
+  size_t pairs = read_count(bytes, index, HMP221_M8, HMP221_M8);
+  for (size_t i = 0; i < pairs; i++)
   {
-    int size = el_size * bytes[1];
-    for (int i = 2; i < (size + 2); i += el_size)
+    string key = read_string(bytes, index);
+    if (key == "epoch")
     {
-      vec sub_vec = slice(bytes, i, i + el_size);
-      u64 element = deserialize_u8(sub_vec);
-      result.push_back(element);
+      deserialized_replicate.epoch = read_u64(bytes, index);
     }
-  }
-  else if (bytes[0] == HMP221_A16)
-  {
-    int size = el_size * (((int)bytes[1]) << 8 | (int)bytes[2]);
-    for (int i = 2; i < (size + 2); i += el_size)
+    else if (key == "sequence")
     {
-      vec sub_vec = slice(bytes, i + 1, i + el_size);
-      u64 element = deserialize_u8(sub_vec);
-      result.push_back(element);
+      deserialized_replicate.sequence = read_u64(bytes, index);
+    }
+    else
+    {
+      skip_value(bytes, index);
     }
   }
-  return result;
+  return deserialized_replicate;
 }
 
-vec hmp221::serialize(struct Message item)
+vec hmp221::serialize(struct Change item)
 {
   vec bytes;
   bytes.push_back(HMP221_M8);
   bytes.push_back(0x1); // 1 k/v pair
-  vec message = serialize((string) "Message");
-  bytes.insert(end(bytes), begin(message), end(message));
+  vec change = serialize((string) "Change");
+  bytes.insert(end(bytes), begin(change), end(change));
 
-  // The value is an m8
+  // The value is an m8 with 3 k/v pairs, the last one a message map
   bytes.push_back(HMP221_M8);
-  bytes.push_back(0x2); // 2 k/v pairs
-
-  // k/v 1 is "name"
-  vec fileNamek = serialize((string) "name");
-  bytes.insert(end(bytes), begin(fileNamek), end(fileNamek));
-  vec fileNamev = serialize(item.channelName);
-  bytes.insert(end(bytes), begin(fileNamev), end(fileNamev));
-
-  // k/v 2 is "bytes"
-  vec bytesk = serialize((string) "bytes");
-  bytes.insert(end(bytes), begin(bytesk), end(bytesk));
-  vec bytesv = serialize(item.contentBytes);
-  bytes.insert(end(bytes), begin(bytesv), end(bytesv));
-
+  bytes.push_back(0x3);
+  append_u64_pair(bytes, "sequence", item.sequence);
+  append_u64_pair(bytes, "stamp", item.stamp);
+  vec messagek = serialize((string) "message");
+  bytes.insert(end(bytes), begin(messagek), end(messagek));
+  append_message_map(bytes, item.message);
   return bytes;
 }
 
-struct Message hmp221::deserialize_message(vec bytes)
+struct Change hmp221::deserialize_change(vec bytes)
 {
-  vec file_bytes_v;
-  if (bytes.size() < 5)
+  if (frame_type(bytes) != "Change")
   {
-    return {NULL, file_bytes_v};
+    throw hmp221::DecodeError("not a Change");
   }
-  vec file_slice = slice(bytes, 2, 10);
-  string file_string = deserialize_string(file_slice);
-  if (file_string.compare("Message") != 0)
+  struct Change deserialized_change = {};
+  size_t index = 4 + 6;
+  size_t pairs = read_count(bytes, index, HMP221_M8, HMP221_M8);
+  for (size_t i = 0; i < pairs; i++)
   {
-    return {NULL, file_bytes_v};
+    string key = read_string(bytes, index);
+    if (key == "sequence")
+    {
+      deserialized_change.sequence = read_u64(bytes, index);
+    }
+    else if (key == "stamp")
+    {
+      deserialized_change.stamp = read_u64(bytes, index);
+    }
+    else if (key == "message")
+    {
+      deserialized_change.message = read_message_map(bytes, index);
+    }
+    else
+    {
+      skip_value(bytes, index);
+    }
   }
+  return deserialized_change;
+}
 
-  u8 name_len = bytes[20]; // extract the channel name
-  vec namev = slice(bytes, 19, 19 + name_len + 1);
-  string name = deserialize_string(namev);
+vec hmp221::serialize(struct Snapshot item)
+{
+  vec bytes;
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x1); // 1 k/v pair
+  vec snapshot = serialize((string) "Snapshot");
+  bytes.insert(end(bytes), begin(snapshot), end(snapshot));
 
-  int file_length_byte = 20 + name_len + 9;
-  int file_length = bytes[file_length_byte];
-  int offset = 0; // = 0 when size <= 255, = 1 when size > 255
-  if (bytes[file_length_byte + 512] != 42)
+  // The value is an m8 with 4 k/v pairs, the last one an array of message maps
+  bytes.push_back(HMP221_M8);
+  bytes.push_back(0x4);
+  append_u64_pair(bytes, "epoch", item.epoch);
+  append_u64_pair(bytes, "sequence", item.sequence);
+  vec lastk = serialize((string) "last");
+  bytes.insert(end(bytes), begin(lastk), end(lastk));
+  vec lastv = serialize((u8)(item.last ? 1 : 0));
+  bytes.insert(end(bytes), begin(lastv), end(lastv));
+  vec messagesk = serialize((string) "messages");
+  bytes.insert(end(bytes), begin(messagesk), end(messagesk));
+  size_t count = item.messages.size();
+  if (count < X8)
   {
-    file_length <<= 8;
-    file_length |= bytes[file_length_byte + 1];
-    offset = 1;
+    bytes.push_back(HMP221_A8);
+    bytes.push_back((u8)count);
+  }
+  else if (count < X16)
+  {
+    bytes.push_back(HMP221_A16);
+    bytes.push_back((u8)(count >> 8));
+    bytes.push_back((u8)count);
+  }
+  else
+  {
+    throw std::length_error("snapshot part of 65536 or more messages");
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    append_message_map(bytes, item.messages[i]);
   }
+  return bytes;
+}
 
-  int count = 0;
-  int index = file_bytes_v.size() + 2 + offset + file_length_byte;
-  while (count < file_length)
+struct Snapshot hmp221::deserialize_snapshot(vec bytes)
+{
+  if (frame_type(bytes) != "Snapshot")
   {
-    file_bytes_v.push_back(bytes[index]);
-    index += 2;
-    count += 1;
+    throw hmp221::DecodeError("not a Snapshot");
   }
-  std::cout << name << std::endl;
-  struct Message deserialized_message = {name, file_bytes_v};
-  return deserialized_message;
+  struct Snapshot deserialized_snapshot = {};
+  size_t index = 4 + 8;
+  size_t pairs = read_count(bytes, index, HMP221_M8, HMP221_M8);
+  for (size_t i = 0; i < pairs; i++)
+  {
+    string key = read_string(bytes, index);
+    if (key == "epoch")
+    {
+      deserialized_snapshot.epoch = read_u64(bytes, index);
+    }
+    else if (key == "sequence")
+    {
+      deserialized_snapshot.sequence = read_u64(bytes, index);
+    }
+    else if (key == "last" && index + 2 <= bytes.size() && bytes[index] == HMP221_U8)
+    {
+      deserialized_snapshot.last = bytes[index + 1] != 0;
+      index += 2;
+    }
+    else if (key == "messages")
+    {
+      size_t count = read_count(bytes, index, HMP221_A8, HMP221_A16);
+      deserialized_snapshot.messages.reserve(count);
+      for (size_t j = 0; j < count; j++)
+      {
+        deserialized_snapshot.messages.push_back(read_message_map(bytes, index));
+      }
+    }
+    else
+    {
+      skip_value(bytes, index);
+    }
+  }
+  return deserialized_snapshot;
 }
 
-vec hmp221::serialize(struct Request item)
+// ----------------------------------------
+// Stats
+// ----------------------------------------
+
+vec hmp221::serialize(struct Stats item)
 {
   vec bytes;
   bytes.push_back(HMP221_M8);
   bytes.push_back(0x1); // 1 k/v pair
-  vec file = serialize((string) "Request");
-  bytes.insert(end(bytes), begin(file), end(file));
+  vec stats = serialize((string) "Stats");
+  bytes.insert(end(bytes), begin(stats), end(stats));
 
-  // The value is an m8
+  // The value is an m8 of counter names to u64 values, empty in a request
+  if (item.values.size() >= X8)
+  {
+    throw std::length_error("256 or more stats");
+  }
   bytes.push_back(HMP221_M8);
-  bytes.push_back(0x2); // 2 k/v pairs
-
-  // k/v 1 is "name"
-  vec fileNamek = serialize((string) "name");
-  bytes.insert(end(bytes), begin(fileNamek), end(fileNamek));
-  vec fileNamev = serialize(item.name);
-  bytes.insert(end(bytes), begin(fileNamev), end(fileNamev));
+  bytes.push_back((u8)item.values.size());
+  for (size_t i = 0; i < item.values.size(); i++)
+  {
+    vec namev = serialize(item.values[i].first);
+    bytes.insert(end(bytes), begin(namev), end(namev));
+    vec valuev = serialize(item.values[i].second);
+    bytes.insert(end(bytes), begin(valuev), end(valuev));
+  }
   return bytes;
 }
 
-struct Request hmp221::deserialize_request(vec bytes)
+struct Stats hmp221::deserialize_stats(vec bytes)
 {
-  if (bytes.size() < 10)
+  if (frame_type(bytes) != "Stats")
   {
-    throw;
+    throw hmp221::DecodeError("not a Stats");
   }
-  vec file_slice = slice(bytes, 2, 10);
-  string file_string = deserialize_string(file_slice);
-  if (file_string != "Request")
+  struct Stats deserialized_stats;
+  size_t index = 4 + 5;
+  size_t pairs = read_count(bytes, index, HMP221_M8, HMP221_M8);
+  for (size_t i = 0; i < pairs; i++)
   {
-    throw;
+    string name = read_string(bytes, index);
+    if (index + 9 > bytes.size() || bytes[index] != HMP221_U64)
+    {
+      throw hmp221::DecodeError("stat value is not a u64");
+    }
+    u64 value = deserialize_u64(slice(bytes, index, index + 8));
+    index += 9;
+    deserialized_stats.values.push_back(std::make_pair(name, value));
   }
-  u8 name_len = bytes[20]; // extract the length of the file name
-  vec namev = slice(bytes, 19, 19 + name_len + 1);
-  string name = deserialize_string(namev);
-  struct Request deserialized_request = {name};
-  return deserialized_request;
+  return deserialized_stats;
 }
 
 void hmp221::printVec(vec &bytes)
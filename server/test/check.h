@@ -0,0 +1,32 @@
+#include <stdio.h>
+
+#ifndef CHECK_H
+#define CHECK_H
+
+// Checks shared by the tests in this directory. Every failed check is
+// printed; main returns report(), so the exit status is 1 if there was one.
+
+static int failures = 0;
+
+#define CHECK(condition)                                                             \
+  do                                                                                 \
+  {                                                                                  \
+    if (!(condition))                                                                \
+    {                                                                                \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                                    \
+    }                                                                                \
+  } while (0)
+
+static inline int report()
+{
+  if (failures > 0)
+  {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
+
+#endif
@@ -0,0 +1,846 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <exception>
+#include "hmp221.hpp"
+#include "check.h"
+
+// Round trips of the encodings in src/lib.cpp, and what they make of bytes
+// cut short or made up.
+
+// Deterministic bytes, so a failure can be reproduced
+static u32 seed = 1;
+
+static u32 next_random()
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static vec random_bytes(size_t size, u32 alphabet)
+{
+  vec bytes(size);
+  for (size_t i = 0; i < size; i++)
+  {
+    bytes[i] = (u8)(next_random() % alphabet);
+  }
+  return bytes;
+}
+
+// Decodes bytes with decode, which may return anything but has to report a
+// malformed frame with a DecodeError. Returns whether it did.
+template <typename Decode>
+static bool rejects(Decode decode, const vec &bytes)
+{
+  try
+  {
+    decode(bytes);
+  }
+  catch (const hmp221::DecodeError &)
+  {
+    return true;
+  }
+  catch (const std::exception &e)
+  {
+    fprintf(stderr, "unexpected exception: %s\n", e.what());
+    failures++;
+    return true;
+  }
+  return false;
+}
+
+// A message with nothing but a channel and a payload
+static struct Message make_message(const string &channel, const vec &bytes)
+{
+  struct Message message = {};
+  message.channelName = channel;
+  message.contentBytes = bytes;
+  return message;
+}
+
+static bool same_message(const struct Message &a, const struct Message &b)
+{
+  return a.channelName == b.channelName && a.contentBytes == b.contentBytes && a.version == b.version &&
+         a.id == b.id && a.ttl == b.ttl && a.compressed == b.compressed && a.base == b.base;
+}
+
+// ----------------------------------------
+// Compact frames
+// ----------------------------------------
+
+static void test_compact_frames()
+{
+  struct Message full = make_message("temperature", random_bytes(300, 256));
+  full.version = 1234567;
+  full.id = 42;
+  full.ttl = 60000;
+  full.compressed = true;
+  full.base = 1234566;
+  struct Message bare = make_message("t", vec());
+  struct Message messages[] = {full, bare};
+  for (size_t m = 0; m < 2; m++)
+  {
+    vec frame = hmp221::serialize_compact(messages[m]);
+    CHECK(hmp221::is_compact(frame));
+    CHECK(hmp221::frame_type(frame) == "Message");
+    CHECK(hmp221::frame_length(frame.data(), frame.size()) == (long)frame.size());
+    CHECK(same_message(hmp221::deserialize_message(frame), messages[m]));
+
+    // A frame is measured only once all of it is there, and not past its end
+    for (size_t size = 1; size < frame.size(); size++)
+    {
+      CHECK(hmp221::frame_length(frame.data(), size) == 0);
+      vec cut(frame.begin(), frame.begin() + size);
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_message(b); }, cut));
+    }
+    vec longer = frame;
+    longer.insert(longer.end(), frame.begin(), frame.end());
+    CHECK(hmp221::frame_length(longer.data(), longer.size()) == (long)frame.size());
+  }
+
+  struct Subscribe subscribe = {"t", 300, 5000};
+  struct Subscribe readSubscribe = hmp221::deserialize_subscribe(hmp221::serialize_compact(subscribe));
+  CHECK(readSubscribe.name == "t" && readSubscribe.version == 300 && readSubscribe.timeout == 5000);
+
+  struct NotModified notModified = {"t", 1ul << 40};
+  struct NotModified readNotModified = hmp221::deserialize_not_modified(hmp221::serialize_compact(notModified));
+  CHECK(readNotModified.channelName == "t" && readNotModified.version == 1ul << 40);
+
+  struct MultiRequest multiRequest = {{"a", "", "ccc"}};
+  CHECK(hmp221::deserialize_multi_request(hmp221::serialize_compact(multiRequest)).names == multiRequest.names);
+
+  struct MultiMessage multiMessage = {{full, bare, full}};
+  struct MultiMessage readMultiMessage = hmp221::deserialize_multi_message(hmp221::serialize_compact(multiMessage));
+  CHECK(readMultiMessage.messages.size() == 3 && same_message(readMultiMessage.messages[0], full) &&
+        same_message(readMultiMessage.messages[1], bare) && same_message(readMultiMessage.messages[2], full));
+
+  struct Ack ack = {0xffffffff};
+  CHECK(hmp221::deserialize_ack(hmp221::serialize_compact(ack)).id == 0xffffffff);
+
+  struct Watch watch = {"t", 7, true};
+  struct Watch readWatch = hmp221::deserialize_watch(hmp221::serialize_compact(watch));
+  CHECK(readWatch.name == "t" && readWatch.version == 7 && readWatch.conflate);
+
+  struct Chunk chunk = {"big", 3, 100000, 65536, random_bytes(1000, 256)};
+  vec chunkFrame = hmp221::serialize_compact(chunk);
+  CHECK(hmp221::frame_length(chunkFrame.data(), chunkFrame.size()) == (long)chunkFrame.size());
+  struct Chunk readChunk = hmp221::deserialize_chunk(chunkFrame);
+  CHECK(readChunk.name == "big" && readChunk.version == 3 && readChunk.total == 100000 &&
+        readChunk.offset == 65536 && readChunk.bytes == chunk.bytes);
+  vec header = hmp221::chunk_header("big", 3, 100000, 65536, chunk.bytes.size());
+  CHECK(vec(chunkFrame.begin(), chunkFrame.begin() + header.size()) == header);
+
+  // Types past the last one, and lengths whose varint never ends or is too large
+  const u8 noType[] = {HMP221_COMPACT, 0};
+  const u8 pastTypes[] = {HMP221_COMPACT | 0xf, 0};
+  const u8 endless[] = {HMP221_COMPACT | 1, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80};
+  const u8 tooLong[] = {HMP221_COMPACT | 1, 0x80, 0x80, 0x80, 0x80, 0x20};
+  CHECK(hmp221::frame_length(noType, sizeof(noType)) == -1);
+  CHECK(hmp221::frame_length(pastTypes, sizeof(pastTypes)) == -1);
+  CHECK(hmp221::frame_length(endless, sizeof(endless)) == -1);
+  CHECK(hmp221::frame_length(tooLong, sizeof(tooLong)) == -1);
+  CHECK(hmp221::frame_length(endless, 5) == 0);
+
+  // Made-up bodies of every type either decode or are refused, and never
+  // read past the frame
+  for (int i = 0; i < 20000; i++)
+  {
+    vec body = random_bytes(next_random() % 40, i % 2 == 0 ? 256 : 4);
+    vec frame(1, (u8)(HMP221_COMPACT | (1 + i % 9)));
+    frame.push_back((u8)body.size());
+    frame.insert(frame.end(), body.begin(), body.end());
+    CHECK(hmp221::frame_length(frame.data(), frame.size()) == (long)frame.size());
+    rejects([](const vec &b) { hmp221::deserialize_message(b); }, frame);
+    rejects([](const vec &b) { hmp221::deserialize_request(b); }, frame);
+    rejects([](const vec &b) { hmp221::deserialize_subscribe(b); }, frame);
+    rejects([](const vec &b) { hmp221::deserialize_not_modified(b); }, frame);
+    rejects([](const vec &b) { hmp221::deserialize_multi_request(b); }, frame);
+    rejects([](const vec &b) { hmp221::deserialize_multi_message(b); }, frame);
+    rejects([](const vec &b) { hmp221::deserialize_ack(b); }, frame);
+    rejects([](const vec &b) { hmp221::deserialize_watch(b); }, frame);
+    rejects([](const vec &b) { hmp221::deserialize_chunk(b); }, frame);
+  }
+}
+
+// ----------------------------------------
+// Compression
+// ----------------------------------------
+
+static vec text_bytes(size_t size)
+{
+  static const char words[] = "{\"sensor\": 12, \"temperature\": 21.5, \"humidity\": 40} ";
+  vec bytes(size);
+  for (size_t i = 0; i < size; i++)
+  {
+    bytes[i] = words[(i + i / 97) % (sizeof(words) - 1)];
+  }
+  return bytes;
+}
+
+static void test_compression()
+{
+  // Sizes around the limits of the literal and match lengths, and past the largest offset
+  vec inputs[] = {vec(), vec(1, 'x'), random_bytes(12, 256), random_bytes(13, 256), vec(14, 'a'), vec(15 + 255, 'a'),
+                  text_bytes(600), text_bytes(70000), random_bytes(5000, 256), random_bytes(5000, 2),
+                  random_bytes(100000, 4)};
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++)
+  {
+    vec compressed = hmp221::compress(inputs[i]);
+    vec out;
+    CHECK(hmp221::decompress(compressed, out) && out == inputs[i]);
+    // Whatever a cut leaves, the claimed length is not reached. The length
+    // of an empty input is a whole block by itself.
+    size_t step = 1 + compressed.size() / 500;
+    for (size_t size = inputs[i].empty() ? 2 : 0; size < compressed.size(); size += size + step < compressed.size() ? step : 1)
+    {
+      CHECK(!hmp221::decompress(vec(compressed.begin(), compressed.begin() + size), out));
+    }
+  }
+  CHECK(hmp221::compress(text_bytes(70000)).size() < 70000 / 4);
+
+  // Offsets before the start of the output, lengths past its end or past the limit
+  const u8 badOffset[] = {8, 0x14, 'a', 5, 0};
+  const u8 zeroOffset[] = {8, 0x14, 'a', 0, 0};
+  const u8 tooMuch[] = {2, 0x30, 'a', 'b', 'c'};
+  const u8 tooLittle[] = {4, 0x30, 'a', 'b', 'c'};
+  const u8 huge[] = {0x80, 0x80, 0x80, 0x10, 0x10, 'a'};
+  vec out;
+  CHECK(!hmp221::decompress(vec(badOffset, badOffset + sizeof(badOffset)), out));
+  CHECK(!hmp221::decompress(vec(zeroOffset, zeroOffset + sizeof(zeroOffset)), out));
+  CHECK(!hmp221::decompress(vec(tooMuch, tooMuch + sizeof(tooMuch)), out));
+  CHECK(!hmp221::decompress(vec(tooLittle, tooLittle + sizeof(tooLittle)), out));
+  CHECK(!hmp221::decompress(vec(huge, huge + sizeof(huge)), out));
+  const u8 overlapping[] = {8, 0x13, 'a', 1, 0};
+  CHECK(hmp221::decompress(vec(overlapping, overlapping + sizeof(overlapping)), out) && out == vec(8, 'a'));
+
+  // Made-up input is refused or decoded, never read or written past its end
+  for (int i = 0; i < 20000; i++)
+  {
+    vec bytes = random_bytes(1 + next_random() % 40, i % 2 == 0 ? 256 : 32);
+    bytes[0] &= 0x7f;
+    if (hmp221::decompress(bytes, out))
+    {
+      CHECK(out.size() == bytes[0]);
+    }
+  }
+
+  // Messages are compressed only when long enough and shorter for it
+  struct Message small = make_message("t", text_bytes(HMP221_COMPRESS_THRESHOLD - 1));
+  CHECK(!hmp221::compress(small) && !small.compressed);
+  struct Message noise = make_message("t", random_bytes(4000, 256));
+  CHECK(!hmp221::compress(noise) && !noise.compressed && noise.contentBytes.size() == 4000);
+  struct Message text = make_message("t", text_bytes(4000));
+  CHECK(hmp221::compress(text) && text.compressed && text.contentBytes.size() < 4000);
+  CHECK(!hmp221::compress(text));
+  CHECK(hmp221::decompress(text) && !text.compressed && text.contentBytes == text_bytes(4000));
+  CHECK(!hmp221::decompress(text));
+  struct Message broken = make_message("t", vec(tooMuch, tooMuch + sizeof(tooMuch)));
+  broken.compressed = true;
+  CHECK(!hmp221::decompress(broken) && broken.compressed && broken.contentBytes.size() == sizeof(tooMuch));
+}
+
+// ----------------------------------------
+// Packed arrays
+// ----------------------------------------
+
+// The encoding element by element, as the description in src/lib.cpp has
+// it, to hold the SIMD kernels to
+template <typename T, typename U>
+static vec reference_packed(const std::vector<T> &values, u8 type, bool delta)
+{
+  vec bytes;
+  bytes.push_back(HMP221_PACKED);
+  bytes.push_back(type | (delta ? HMP221_PACK_DELTA : 0));
+  for (int shift = 24; shift >= 0; shift -= 8)
+  {
+    bytes.push_back((u8)(values.size() >> shift));
+  }
+  U previous = 0;
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    U value;
+    memcpy(&value, &values[i], sizeof(U));
+    U element = value;
+    if (delta)
+    {
+      U difference = value - previous;
+      element = (U)(difference << 1) ^ (U)(0 - (difference >> (sizeof(U) * 8 - 1)));
+    }
+    for (size_t b = 0; b < sizeof(U); b++)
+    {
+      bytes.push_back((u8)(element >> (8 * b)));
+    }
+    previous = value;
+  }
+  return bytes;
+}
+
+// Bit for bit, so that NaNs and -0.0 count too
+template <typename T>
+static bool same_bits(const std::vector<T> &a, const std::vector<T> &b)
+{
+  return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+template <typename T, typename U, typename Decode>
+static void check_packed(const std::vector<T> &values, u8 type, Decode decode)
+{
+  for (int delta = 0; delta < 2; delta++)
+  {
+    vec bytes = hmp221::serialize(values, delta != 0);
+    CHECK((bytes == reference_packed<T, U>(values, type, delta != 0)));
+    CHECK(same_bits(decode(bytes), values));
+    // Every cut that loses an element is refused
+    for (size_t size = 0; size < bytes.size(); size++)
+    {
+      CHECK(rejects(decode, vec(bytes.begin(), bytes.begin() + size)));
+    }
+  }
+}
+
+// values[i] for i below count, from a walk of small steps with a jump to
+// the extremes now and then, so deltas overflow in both directions
+template <typename T>
+static std::vector<T> walk(size_t count, T low, T high)
+{
+  std::vector<T> values(count);
+  T value = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    u32 r = next_random();
+    value = r % 11 == 0 ? high : r % 13 == 0 ? low : (T)((i64)value + (i64)(r % 7) - 3);
+    values[i] = value;
+  }
+  return values;
+}
+
+static void test_packed_arrays()
+{
+  const f32 f32Specials[] = {0.0f, -0.0f, 1.5f, -2.25e30f, 1e-40f, HUGE_VALF, -HUGE_VALF, NAN};
+  const f64 f64Specials[] = {0.0, -0.0, 1.5, -2.25e300, 1e-310, HUGE_VAL, -HUGE_VAL, NAN};
+  // Every length up to two registers of the narrowest type, and longer ones
+  // that end part-way through a register of each
+  for (size_t count = 0; count < 40; count += count < 17 ? 1 : 11)
+  {
+    std::vector<i16> i16s = walk<i16>(count, -32768, 32767);
+    std::vector<i32> i32s = walk<i32>(count, -2147483647 - 1, 2147483647);
+    std::vector<f32> f32s(count);
+    std::vector<f64> f64s(count);
+    for (size_t i = 0; i < count; i++)
+    {
+      f32s[i] = i % 3 == 0 ? f32Specials[next_random() % 8] : (f32)i32s[i] / 7;
+      f64s[i] = i % 3 == 0 ? f64Specials[next_random() % 8] : (f64)i32s[i] * 1e-3;
+    }
+    check_packed<i16, u16>(i16s, HMP221_PACK_I16, [](const vec &b) { return hmp221::deserialize_vec_i16(b); });
+    check_packed<i32, u32>(i32s, HMP221_PACK_I32, [](const vec &b) { return hmp221::deserialize_vec_i32(b); });
+    check_packed<f32, u32>(f32s, HMP221_PACK_F32, [](const vec &b) { return hmp221::deserialize_vec_f32(b); });
+    check_packed<f64, u64>(f64s, HMP221_PACK_F64, [](const vec &b) { return hmp221::deserialize_vec_f64(b); });
+  }
+  std::vector<i32> many = walk<i32>(100003, -2147483647 - 1, 2147483647);
+  CHECK(hmp221::deserialize_vec_i32(hmp221::serialize(many, true)) == many);
+
+  // An array of another type, or not an array at all
+  std::vector<i32> three(3, 7);
+  vec i32Bytes = hmp221::serialize(three);
+  CHECK(rejects([](const vec &b) { hmp221::deserialize_vec_i16(b); }, i32Bytes));
+  CHECK(rejects([](const vec &b) { hmp221::deserialize_vec_f32(b); }, i32Bytes));
+  CHECK(rejects([](const vec &b) { hmp221::deserialize_vec_f64(b); }, i32Bytes));
+  CHECK(rejects([](const vec &b) { hmp221::deserialize_vec_i32(b); }, hmp221::serialize((u32)7)));
+  // A count that claims more than the bytes hold
+  i32Bytes[5] = 4;
+  CHECK(rejects([](const vec &b) { hmp221::deserialize_vec_i32(b); }, i32Bytes));
+  i32Bytes[2] = 0xff;
+  CHECK(rejects([](const vec &b) { hmp221::deserialize_vec_i32(b); }, i32Bytes));
+}
+
+// ----------------------------------------
+// Deltas
+// ----------------------------------------
+
+static void test_deltas()
+{
+  vec base = text_bytes(5000);
+  vec edited = base;
+  edited[10] = '#';
+  edited[4000] = '#';
+  vec grown = base;
+  grown.insert(grown.begin() + 100, 37, '+');
+  vec shrunk = base;
+  shrunk.erase(shrunk.begin() + 2000, shrunk.begin() + 2333);
+  vec noise = random_bytes(3000, 256);
+  vec pairs[][2] = {{vec(), vec()}, {vec(), noise}, {noise, vec()}, {base, base}, {base, edited},
+                    {base, grown}, {base, shrunk}, {noise, base}, {vec(7, 'a'), vec(9, 'a')},
+                    {base, vec(base.begin() + 4000, base.end())}};
+  for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++)
+  {
+    vec delta = hmp221::diff(pairs[i][0], pairs[i][1]);
+    vec out;
+    CHECK(hmp221::patch(pairs[i][0], delta, out) && out == pairs[i][1]);
+    CHECK(delta.size() <= pairs[i][1].size() + 16);
+    // A cut or lengthened delta is refused, unless it still describes the target
+    for (size_t size = 0; size < delta.size(); size++)
+    {
+      if (hmp221::patch(pairs[i][0], vec(delta.begin(), delta.begin() + size), out))
+      {
+        CHECK(out.empty() && pairs[i][1].empty());
+      }
+    }
+    vec longer = delta;
+    longer.push_back(0);
+    CHECK(!hmp221::patch(pairs[i][0], longer, out));
+  }
+  CHECK(hmp221::diff(base, edited).size() < 100);
+  CHECK(hmp221::diff(base, grown).size() < 100);
+  CHECK(hmp221::diff(base, shrunk).size() < 100);
+
+  // Copies from past the end of a base shorter than the one diffed against
+  vec out;
+  CHECK(!hmp221::patch(vec(base.begin(), base.begin() + 4000), hmp221::diff(base, edited), out));
+  CHECK(!hmp221::patch(vec(), hmp221::diff(base, base), out));
+
+  // Operations of length 0, sizes over the limit, copies from huge offsets
+  const u8 emptyOperation[] = {4, 0, 0};
+  const u8 huge[] = {0x80, 0x80, 0x80, 0x10, 3, 'a'};
+  const u8 farCopy[] = {4, 8, 0xff, 0xff, 0xff, 0xff, 0x0f};
+  const u8 shortAdd[] = {4, 9, 'a', 'b', 'c'};
+  const u8 overlong[] = {2, 9, 'a', 'b', 'c', 'd'};
+  CHECK(!hmp221::patch(base, vec(emptyOperation, emptyOperation + sizeof(emptyOperation)), out));
+  CHECK(!hmp221::patch(base, vec(huge, huge + sizeof(huge)), out));
+  CHECK(!hmp221::patch(base, vec(farCopy, farCopy + sizeof(farCopy)), out));
+  CHECK(!hmp221::patch(base, vec(shortAdd, shortAdd + sizeof(shortAdd)), out));
+  CHECK(!hmp221::patch(base, vec(overlong, overlong + sizeof(overlong)), out));
+
+  // Made-up deltas are refused or applied, never read or written past their ends
+  for (int i = 0; i < 20000; i++)
+  {
+    vec delta = random_bytes(1 + next_random() % 30, i % 2 == 0 ? 256 : 16);
+    delta[0] &= 0x7f;
+    if (hmp221::patch(noise, delta, out))
+    {
+      CHECK(out.size() == delta[0]);
+    }
+  }
+
+  // A message is patched only from the version its delta was made against
+  struct Message previous = make_message("t", base);
+  previous.version = 41;
+  struct Message message = make_message("t", hmp221::diff(base, edited));
+  message.version = 42;
+  message.base = 41;
+  struct Message stale = previous;
+  stale.version = 40;
+  CHECK(!hmp221::patch(stale, message) && message.base == 41);
+  struct Message compressed = previous;
+  CHECK(hmp221::compress(compressed));
+  CHECK(!hmp221::patch(compressed, message) && message.base == 41);
+  CHECK(hmp221::patch(previous, message) && message.base == 0 && message.contentBytes == edited);
+  CHECK(!hmp221::patch(previous, message));
+}
+
+// ----------------------------------------
+// Request framing
+// ----------------------------------------
+
+static void test_request_frames()
+{
+  struct Request request = {};
+  request.name = "news";
+  vec legacy = hmp221::serialize(request);
+  CHECK(hmp221::frame_length(&legacy[0], legacy.size()) == (long)legacy.size());
+  CHECK(hmp221::deserialize_request(legacy).name == "news");
+  for (size_t size = 1; size < legacy.size(); size++)
+  {
+    CHECK(hmp221::frame_length(&legacy[0], size) == 0);
+  }
+
+  // The frame behind a legacy Request is not taken for its second pair
+  vec twoFrames = legacy;
+  vec next = hmp221::serialize(make_message("news", text_bytes(10)));
+  twoFrames.insert(twoFrames.end(), next.begin(), next.end());
+  CHECK(hmp221::frame_length(&twoFrames[0], twoFrames.size()) == (long)legacy.size());
+
+  // A Request that does carry the pair it declares is measured whole
+  const u8 pair[] = {HMP221_S8, 2, 'i', 'd', HMP221_S8, 1, 'x'};
+  vec complete = legacy;
+  complete.insert(complete.end(), pair, pair + sizeof(pair));
+  CHECK(hmp221::frame_length(&complete[0], complete.size()) == (long)complete.size());
+  CHECK(hmp221::deserialize_request(complete).name == "news");
+  for (size_t size = legacy.size() + 1; size < complete.size(); size++)
+  {
+    CHECK(hmp221::frame_length(&complete[0], size) == 0);
+  }
+}
+
+// ----------------------------------------
+// Long-poll subscribe
+// ----------------------------------------
+
+static void test_subscribe_frames()
+{
+  struct Subscribe conditional = {"sensor", 300, 0};
+  struct Subscribe longPoll = {"sensor", 300, 5000};
+  struct Subscribe subscribes[] = {conditional, longPoll};
+  for (size_t i = 0; i < 2; i++)
+  {
+    vec frame = hmp221::serialize(subscribes[i]);
+    CHECK(hmp221::frame_type(frame) == "Subscribe");
+    CHECK(hmp221::frame_length(frame.data(), frame.size()) == (long)frame.size());
+    struct Subscribe read = hmp221::deserialize_subscribe(frame);
+    CHECK(read.name == "sensor" && read.version == 300 && read.timeout == subscribes[i].timeout);
+    for (size_t size = 0; size < frame.size(); size++)
+    {
+      vec cut(frame.begin(), frame.begin() + size);
+      CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+    }
+  }
+  // A wait longer than a u8 or u16 holds is not cut short
+  struct Subscribe longWait = {"s", 1, 0xfffffff0};
+  CHECK(hmp221::deserialize_subscribe(hmp221::serialize(longWait)).timeout == 0xfffffff0);
+}
+
+// ----------------------------------------
+// Watch
+// ----------------------------------------
+
+static void test_watch_frames()
+{
+  struct Watch watch = {"feed", 0x123456789, false};
+  vec frame = hmp221::serialize(watch);
+  CHECK(hmp221::frame_type(frame) == "Watch");
+  CHECK(hmp221::frame_length(frame.data(), frame.size()) == (long)frame.size());
+  struct Watch read = hmp221::deserialize_watch(frame);
+  CHECK(read.name == "feed" && read.version == 0x123456789 && !read.conflate);
+  for (size_t size = 0; size < frame.size(); size++)
+  {
+    vec cut(frame.begin(), frame.begin() + size);
+    CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+    CHECK(rejects([](const vec &b) { hmp221::deserialize_watch(b); }, cut));
+  }
+  struct Watch conflated = {"sensor", 9, true};
+  read = hmp221::deserialize_watch(hmp221::serialize(conflated));
+  CHECK(read.name == "sensor" && read.version == 9 && read.conflate);
+}
+
+// ----------------------------------------
+// Ack
+// ----------------------------------------
+
+static void test_ack_frames()
+{
+  u32 ids[] = {1, 200, 70000, 0xffffffff};
+  for (size_t i = 0; i < 4; i++)
+  {
+    struct Ack ack = {ids[i]};
+    vec frame = hmp221::serialize(ack);
+    CHECK(hmp221::frame_type(frame) == "Ack");
+    CHECK(hmp221::frame_length(frame.data(), frame.size()) == (long)frame.size());
+    CHECK(hmp221::deserialize_ack(frame).id == ids[i]);
+    for (size_t size = 0; size < frame.size(); size++)
+    {
+      vec cut(frame.begin(), frame.begin() + size);
+      CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_ack(b); }, cut));
+    }
+  }
+  // The id of a publish goes both ways
+  struct Message message = make_message("t", text_bytes(10));
+  message.id = 0xfffffffe;
+  CHECK(hmp221::deserialize_message(hmp221::serialize(message)).id == 0xfffffffe);
+}
+
+// ----------------------------------------
+// Handshake
+// ----------------------------------------
+
+static void test_handshake_frames()
+{
+  struct Hello hello = {HMP221_PROTOCOL_VERSION, HMP221_CAP_COMPACT | HMP221_CAP_DELTA | 0x8000000000000000ul};
+  vec helloFrame = hmp221::serialize(hello);
+  CHECK(hmp221::frame_type(helloFrame) == "Hello");
+  struct Hello readHello = hmp221::deserialize_hello(helloFrame);
+  CHECK(readHello.version == hello.version && readHello.capabilities == hello.capabilities);
+
+  struct Welcome welcome = {0, 0};
+  vec welcomeFrame = hmp221::serialize(welcome);
+  CHECK(hmp221::frame_type(welcomeFrame) == "Welcome");
+  struct Welcome readWelcome = hmp221::deserialize_welcome(welcomeFrame);
+  CHECK(readWelcome.version == 0 && readWelcome.capabilities == 0);
+  welcome.version = 300;
+  welcome.capabilities = HMP221_CAP_STREAM;
+  readWelcome = hmp221::deserialize_welcome(hmp221::serialize(welcome));
+  CHECK(readWelcome.version == 300 && readWelcome.capabilities == HMP221_CAP_STREAM);
+
+  vec frames[] = {helloFrame, welcomeFrame};
+  for (size_t f = 0; f < 2; f++)
+  {
+    CHECK(hmp221::frame_length(frames[f].data(), frames[f].size()) == (long)frames[f].size());
+    for (size_t size = 0; size < frames[f].size(); size++)
+    {
+      vec cut(frames[f].begin(), frames[f].begin() + size);
+      CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_hello(b); }, cut));
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_welcome(b); }, cut));
+    }
+  }
+}
+
+// ----------------------------------------
+// Redirect
+// ----------------------------------------
+
+static void test_redirect_frames()
+{
+  struct Redirect redirect = {"orders", "node-3.example.com:8083"};
+  vec frame = hmp221::serialize(redirect);
+  CHECK(hmp221::frame_type(frame) == "Redirect");
+  CHECK(hmp221::frame_length(frame.data(), frame.size()) == (long)frame.size());
+  struct Redirect read = hmp221::deserialize_redirect(frame);
+  CHECK(read.name == "orders" && read.node == "node-3.example.com:8083");
+  for (size_t size = 0; size < frame.size(); size++)
+  {
+    vec cut(frame.begin(), frame.begin() + size);
+    CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+    CHECK(rejects([](const vec &b) { hmp221::deserialize_redirect(b); }, cut));
+  }
+  struct Redirect empty = {"", ""};
+  read = hmp221::deserialize_redirect(hmp221::serialize(empty));
+  CHECK(read.name.empty() && read.node.empty());
+}
+
+// ----------------------------------------
+// Chunks
+// ----------------------------------------
+
+static void test_chunk_frames()
+{
+  // Empty pieces, the last piece of a 4 GiB message, and lengths around the
+  // varint steps all keep their header in front of the bytes
+  struct Chunk empty = {"e", 0, 0, 0, vec()};
+  struct Chunk last = {string(200, 'n'), 0xffffffffff, 0xffffffff, 0xffffffff - 10, random_bytes(10, 256)};
+  struct Chunk full = {"f", 1, 3 * HMP221_CHUNK_SIZE, HMP221_CHUNK_SIZE, random_bytes(HMP221_CHUNK_SIZE, 256)};
+  struct Chunk edge = {"g", 2, 200, 0, random_bytes(127, 256)};
+  struct Chunk chunks[] = {empty, last, full, edge};
+  for (size_t c = 0; c < 4; c++)
+  {
+    vec frame = hmp221::serialize_compact(chunks[c]);
+    CHECK(hmp221::frame_type(frame) == "Chunk");
+    CHECK(hmp221::frame_length(frame.data(), frame.size()) == (long)frame.size());
+    struct Chunk read = hmp221::deserialize_chunk(frame);
+    CHECK(read.name == chunks[c].name && read.version == chunks[c].version && read.total == chunks[c].total &&
+          read.offset == chunks[c].offset && read.bytes == chunks[c].bytes);
+    vec header = hmp221::chunk_header(chunks[c].name, chunks[c].version, chunks[c].total, chunks[c].offset,
+                                      chunks[c].bytes.size());
+    CHECK(header.size() + chunks[c].bytes.size() == frame.size());
+    CHECK(vec(frame.begin(), frame.begin() + header.size()) == header);
+
+    // A piece is only taken whole; the frame behind it is not part of it
+    for (size_t size = 0; size < frame.size(); size += 1 + size / 8)
+    {
+      vec cut(frame.begin(), frame.begin() + size);
+      CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_chunk(b); }, cut));
+    }
+    vec twice = frame;
+    twice.insert(twice.end(), frame.begin(), frame.end());
+    CHECK(hmp221::frame_length(twice.data(), twice.size()) == (long)frame.size());
+  }
+
+  // Chunk frames only exist in the compact encoding
+  CHECK(rejects([](const vec &b) { hmp221::deserialize_chunk(b); }, hmp221::serialize(make_message("e", vec(4, 1)))));
+}
+
+// ----------------------------------------
+// Attach
+// ----------------------------------------
+
+static void test_attach_frames()
+{
+  u64 capacities[] = {4096, 1 << 20, 64 << 20, 0xffffffffffful};
+  for (size_t i = 0; i < 4; i++)
+  {
+    struct Attach attach = {capacities[i]};
+    vec frame = hmp221::serialize(attach);
+    CHECK(hmp221::frame_type(frame) == "Attach");
+    CHECK(hmp221::frame_length(frame.data(), frame.size()) == (long)frame.size());
+    CHECK(hmp221::deserialize_attach(frame).capacity == capacities[i]);
+    for (size_t size = 0; size < frame.size(); size++)
+    {
+      vec cut(frame.begin(), frame.begin() + size);
+      CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_attach(b); }, cut));
+    }
+  }
+}
+
+// ----------------------------------------
+// Replication
+// ----------------------------------------
+
+static void test_replication_frames()
+{
+  struct Replicate resume = {0x1122334455667788, 987654321};
+  vec replicateFrame = hmp221::serialize(resume);
+  CHECK(hmp221::frame_type(replicateFrame) == "Replicate");
+  struct Replicate readResume = hmp221::deserialize_replicate(replicateFrame);
+  CHECK(readResume.epoch == 0x1122334455667788 && readResume.sequence == 987654321);
+  struct Replicate fresh = {0, 0};
+  readResume = hmp221::deserialize_replicate(hmp221::serialize(fresh));
+  CHECK(readResume.epoch == 0 && readResume.sequence == 0);
+
+  struct Message message = make_message("prices", random_bytes(500, 256));
+  message.version = 77;
+  message.ttl = 30000;
+  message.compressed = true;
+  struct Change change = {123456, 1760000000000, message};
+  vec changeFrame = hmp221::serialize(change);
+  CHECK(hmp221::frame_type(changeFrame) == "Change");
+  struct Change readChange = hmp221::deserialize_change(changeFrame);
+  CHECK(readChange.sequence == 123456 && readChange.stamp == 1760000000000);
+  CHECK(same_message(readChange.message, message));
+
+  // A snapshot part may be empty, e.g. the only part of an empty store
+  struct Snapshot snapshot = {0x1122334455667788, 123456, false, {message, make_message("empty", vec())}};
+  struct Snapshot last = {0x1122334455667788, 123456, true, {}};
+  vec snapshotFrame = hmp221::serialize(snapshot);
+  CHECK(hmp221::frame_type(snapshotFrame) == "Snapshot");
+  struct Snapshot readSnapshot = hmp221::deserialize_snapshot(snapshotFrame);
+  CHECK(readSnapshot.epoch == snapshot.epoch && readSnapshot.sequence == 123456 && !readSnapshot.last);
+  CHECK(readSnapshot.messages.size() == 2 && same_message(readSnapshot.messages[0], snapshot.messages[0]) &&
+        same_message(readSnapshot.messages[1], snapshot.messages[1]));
+  readSnapshot = hmp221::deserialize_snapshot(hmp221::serialize(last));
+  CHECK(readSnapshot.last && readSnapshot.messages.empty());
+
+  // Cut frames wait for more bytes and are refused
+  vec frames[] = {replicateFrame, changeFrame, snapshotFrame};
+  for (size_t f = 0; f < 3; f++)
+  {
+    CHECK(hmp221::frame_length(frames[f].data(), frames[f].size()) == (long)frames[f].size());
+    for (size_t size = 0; size < frames[f].size(); size++)
+    {
+      vec cut(frames[f].begin(), frames[f].begin() + size);
+      CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_replicate(b); }, cut));
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_change(b); }, cut));
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_snapshot(b); }, cut));
+    }
+  }
+}
+
+// ----------------------------------------
+// Batch frames
+// ----------------------------------------
+
+static void test_batch_frames()
+{
+  struct MultiRequest request = {};
+  request.names.push_back("a");
+  request.names.push_back("");
+  request.names.push_back(string(300, 'c'));
+  vec requestFrame = hmp221::serialize(request);
+  CHECK(hmp221::frame_type(requestFrame) == "MultiRequest");
+  CHECK(hmp221::frame_length(requestFrame.data(), requestFrame.size()) == (long)requestFrame.size());
+  CHECK(hmp221::deserialize_multi_request(requestFrame).names == request.names);
+  CHECK(hmp221::deserialize_multi_request(hmp221::serialize(MultiRequest())).names.empty());
+
+  struct Message full = make_message("temperature", random_bytes(300, 256));
+  full.version = 1234567;
+  full.id = 42;
+  full.ttl = 60000;
+  full.compressed = true;
+  full.base = 1234566;
+  struct Message bare = make_message("t", vec());
+  struct MultiMessage batch = {};
+  batch.messages.push_back(full);
+  batch.messages.push_back(bare);
+  batch.messages.push_back(make_message("big", random_bytes(70000, 256)));
+  vec batchFrame = hmp221::serialize(batch);
+  CHECK(hmp221::frame_type(batchFrame) == "MultiMessage");
+  CHECK(hmp221::frame_length(batchFrame.data(), batchFrame.size()) == (long)batchFrame.size());
+  struct MultiMessage read = hmp221::deserialize_multi_message(batchFrame);
+  CHECK(read.messages.size() == 3);
+  for (size_t i = 0; i < read.messages.size() && i < 3; i++)
+  {
+    CHECK(same_message(read.messages[i], batch.messages[i]));
+  }
+  CHECK(hmp221::deserialize_multi_message(hmp221::serialize(MultiMessage())).messages.empty());
+
+  // Cut frames wait for more bytes and are refused; the frame behind one is not taken for part of it
+  batch.messages.pop_back();
+  vec frames[] = {requestFrame, hmp221::serialize(batch)};
+  for (size_t f = 0; f < 2; f++)
+  {
+    for (size_t size = 1; size < frames[f].size(); size++)
+    {
+      vec cut(frames[f].begin(), frames[f].begin() + size);
+      CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_multi_request(b); }, cut));
+      CHECK(rejects([](const vec &b) { hmp221::deserialize_multi_message(b); }, cut));
+    }
+    vec twice = frames[f];
+    twice.insert(twice.end(), frames[f].begin(), frames[f].end());
+    CHECK(hmp221::frame_length(twice.data(), twice.size()) == (long)frames[f].size());
+  }
+}
+
+// ----------------------------------------
+// Stats
+// ----------------------------------------
+
+static void test_stats_frames()
+{
+  // A request carries no values
+  struct Stats request;
+  vec requestFrame = hmp221::serialize(request);
+  CHECK(hmp221::frame_type(requestFrame) == "Stats");
+  CHECK(hmp221::frame_length(requestFrame.data(), requestFrame.size()) == (long)requestFrame.size());
+  CHECK(hmp221::deserialize_stats(requestFrame).values.empty());
+
+  struct Stats reply;
+  for (u64 i = 0; i < 255; i++)
+  {
+    reply.values.push_back(std::make_pair("stat_" + std::to_string(i), i == 0 ? ~0ul : i * i));
+  }
+  vec replyFrame = hmp221::serialize(reply);
+  CHECK(hmp221::frame_length(replyFrame.data(), replyFrame.size()) == (long)replyFrame.size());
+  CHECK(hmp221::deserialize_stats(replyFrame).values == reply.values);
+  for (size_t size = 0; size < replyFrame.size(); size += 7)
+  {
+    vec cut(replyFrame.begin(), replyFrame.begin() + size);
+    CHECK(hmp221::frame_length(cut.data(), cut.size()) == 0);
+    CHECK(rejects([](const vec &b) { hmp221::deserialize_stats(b); }, cut));
+  }
+
+  // The pair count is one byte
+  reply.values.push_back(std::make_pair("one_too_many", 1));
+  bool refused = false;
+  try
+  {
+    hmp221::serialize(reply);
+  }
+  catch (const std::length_error &)
+  {
+    refused = true;
+  }
+  CHECK(refused);
+}
+
+int main()
+{
+  test_compact_frames();
+  test_compression();
+  test_packed_arrays();
+  test_deltas();
+  test_request_frames();
+  test_subscribe_frames();
+  test_watch_frames();
+  test_ack_frames();
+  test_handshake_frames();
+  test_redirect_frames();
+  test_chunk_frames();
+  test_attach_frames();
+  test_replication_frames();
+  test_batch_frames();
+  test_stats_frames();
+  return report();
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "hashmap.h"
+#include "check.h"
+
+// The store in include/hashmap.h: versions, time to live, and the long-polls
+// and watches held on its channels.
+
+static vector<unsigned char> bytes_of(const string &text)
+{
+  return vector<unsigned char>(text.begin(), text.end());
+}
+
+// ----------------------------------------
+// Long-polls
+// ----------------------------------------
+
+static void test_parked_waiters()
+{
+  HashMap map;
+  vector<unsigned long> woken;
+
+  // A channel nobody published on holds its waiters with version 0
+  map.park("news", 1);
+  map.park("news", 2);
+  CHECK(map.containsKey("news") && map.len() == 1);
+  CHECK(map.version("news") == 0 && map.get("news").empty());
+
+  // The next put wakes every one of them, once
+  CHECK(map.put("news", bytes_of("first"), &woken));
+  sort(woken.begin(), woken.end());
+  CHECK(woken.size() == 2 && woken[0] == 1 && woken[1] == 2);
+  CHECK(map.version("news") == 1);
+  CHECK(map.put("news", bytes_of("second"), &woken) && woken.empty());
+  CHECK(map.version("news") == 2 && map.get("news") == bytes_of("second"));
+
+  // A waiter that timed out is not woken, and the entry of a channel without
+  // a message goes with its last waiter
+  map.park("quiet", 3);
+  map.park("quiet", 4);
+  map.unpark("quiet", 3);
+  CHECK(map.containsKey("quiet"));
+  map.unpark("quiet", 4);
+  CHECK(!map.containsKey("quiet") && map.len() == 1);
+  map.unpark("quiet", 4);
+  map.park("news", 5);
+  map.unpark("news", 5);
+  CHECK(map.put("news", bytes_of("third"), &woken) && woken.empty());
+
+  // Waiters move with their entries when the table grows
+  for (unsigned long token = 0; token < 100; token++)
+  {
+    map.park("channel" + to_string(token), token);
+  }
+  CHECK(map.len() == 101 && map.capacity() >= 100);
+  for (unsigned long token = 0; token < 100; token++)
+  {
+    CHECK(map.put("channel" + to_string(token), bytes_of("x"), &woken));
+    CHECK(woken.size() == 1 && woken[0] == token);
+  }
+}
+
+static void test_watchers()
+{
+  HashMap map;
+  vector<unsigned long> woken;
+
+  // Watchers stay after a put and come after the parked waiters
+  map.watch("feed", 10);
+  map.watch("feed", 11);
+  map.park("feed", 1);
+  CHECK(map.version("feed") == 0);
+  CHECK(map.put("feed", bytes_of("a"), &woken));
+  CHECK(woken.size() == 3 && woken[0] == 1);
+  sort(woken.begin() + 1, woken.end());
+  CHECK(woken.size() == 3 && woken[1] == 10 && woken[2] == 11);
+  CHECK(map.put("feed", bytes_of("b"), &woken));
+  sort(woken.begin(), woken.end());
+  CHECK(woken.size() == 2 && woken[0] == 10 && woken[1] == 11);
+  map.unwatch("feed", 10);
+  CHECK(map.put("feed", bytes_of("c"), &woken) && woken.size() == 1 && woken[0] == 11);
+
+  // The entry of a channel without a message goes with its last watcher
+  map.watch("quiet", 12);
+  CHECK(map.containsKey("quiet"));
+  map.unwatch("quiet", 12);
+  CHECK(!map.containsKey("quiet"));
+  map.unwatch("quiet", 12);
+  map.unwatch("feed", 11);
+  CHECK(map.containsKey("feed") && map.get("feed") == bytes_of("c"));
+}
+
+static void test_versions()
+{
+  HashMap map;
+  vector<unsigned long> woken;
+  CHECK(map.version("t") == 0);
+  map.put("t", bytes_of("a"));
+  map.put("t", bytes_of("b"));
+  unsigned long version;
+  CHECK(map.get("t", &version) == bytes_of("b") && version == 2);
+
+  // A channel that goes away and comes back counts on, so a long-poll
+  // holding a version of the old entry still takes the new message for newer
+  CHECK(map.drop("t") && !map.containsKey("t"));
+  CHECK(map.version("t") == 0);
+  map.park("t", 7);
+  CHECK(map.put("t", bytes_of("c"), &woken) && woken.size() == 1);
+  CHECK(map.version("t") > 3);
+  unsigned long before = map.version("t");
+  map.put("u", bytes_of("d"));
+  CHECK(map.version("u") > 3 && map.version("t") == before);
+}
+
+// ----------------------------------------
+// Replicas
+// ----------------------------------------
+
+static void test_replica_puts()
+{
+  HashMap map;
+  vector<unsigned long> woken;
+
+  // A replica stores the versions its primary gave, gaps and all
+  map.watch("a", 1);
+  CHECK(map.put("a", bytes_of("x"), &woken, 0, 500) && woken.size() == 1);
+  CHECK(map.version("a") == 500);
+  map.put("a", bytes_of("y"), &woken, 0, 900);
+  map.put("b", bytes_of("z"), &woken, 0, 901, true);
+  unsigned long version;
+  bool compressed;
+  CHECK(map.get("a", &version, &compressed) == bytes_of("y") && version == 900 && !compressed);
+  CHECK(map.get("b", &version, &compressed) == bytes_of("z") && version == 901 && compressed);
+
+  // A snapshot is taken with forEach, which only visits channels holding a message
+  map.park("waiting", 2);
+  vector<string> visited;
+  map.forEach([&](const string &channel, const vector<unsigned char> &bytes, unsigned long version, unsigned long expiresAt,
+                  bool compressed) {
+    visited.push_back(channel);
+    CHECK(expiresAt == 0);
+    CHECK(channel != "a" || (bytes == bytes_of("y") && version == 900 && !compressed));
+    CHECK(channel != "b" || (bytes == bytes_of("z") && version == 901 && compressed));
+  });
+  sort(visited.begin(), visited.end());
+  CHECK(visited.size() == 2 && visited[0] == "a" && visited[1] == "b");
+
+  // A channel the primary no longer has is dropped; a watched entry stays without its message
+  CHECK(map.drop("b") && !map.drop("b") && !map.containsKey("b"));
+  CHECK(map.drop("a") && map.containsKey("a") && map.get("a").empty());
+  CHECK(!map.drop("waiting") && !map.drop("missing"));
+}
+
+// ----------------------------------------
+// Time to live
+// ----------------------------------------
+
+static unsigned long now_millis()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000ul + now.tv_nsec / 1000000;
+}
+
+static void test_expiry()
+{
+  HashMap map;
+  vector<unsigned long> woken;
+  unsigned long now = now_millis();
+
+  // A message past its time is gone on the next lookup, and its entry with it
+  map.put("stale", bytes_of("a"), &woken, now - 1);
+  CHECK(map.get("stale").empty() && map.version("stale") == 0);
+  CHECK(!map.containsKey("stale") && map.expired() == 1);
+  CHECK(!map.expire("stale"));
+
+  map.put("fresh", bytes_of("b"), &woken, now + 60000);
+  CHECK(!map.expire("fresh") && map.get("fresh") == bytes_of("b"));
+
+  // A watched entry stays, with a new version telling the watchers the message is gone
+  map.watch("kept", 5);
+  map.put("kept", bytes_of("c"), &woken, now + 50);
+  unsigned long version = map.version("kept");
+  CHECK(woken.size() == 1 && version > 0 && !map.expire("kept"));
+  usleep(100000);
+  CHECK(map.expire("kept") && !map.expire("kept"));
+  CHECK(map.containsKey("kept") && map.get("kept").empty() && map.version("kept") > version);
+  CHECK(map.expired() == 2);
+
+  // A put without a time to live clears the one before
+  map.put("kept", bytes_of("d"), &woken, now + 50);
+  map.put("kept", bytes_of("e"), &woken);
+  usleep(100000);
+  CHECK(!map.expire("kept") && map.get("kept") == bytes_of("e"));
+
+  // Expired messages are not visited
+  map.put("gone", bytes_of("f"), &woken, now - 1);
+  vector<string> visited;
+  map.forEach([&](const string &channel, const vector<unsigned char> &, unsigned long, unsigned long expiresAt, bool) {
+    visited.push_back(channel);
+    CHECK(channel != "fresh" || expiresAt == now + 60000);
+  });
+  sort(visited.begin(), visited.end());
+  CHECK(visited.size() == 2 && visited[0] == "fresh" && visited[1] == "kept");
+  CHECK(map.expired() == 3);
+}
+
+int main()
+{
+  test_parked_waiters();
+  test_watchers();
+  test_versions();
+  test_replica_puts();
+  test_expiry();
+  return report();
+}
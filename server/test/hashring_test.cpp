@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "hashring.h"
+#include "check.h"
+
+// The consistent-hash ring in include/hashring.h that shares channels out
+// over the nodes of a cluster.
+
+#define KEYS 100000
+
+static HashRing make_ring(int nodes, int replicas)
+{
+  HashRing ring;
+  for (int node = 0; node < nodes; node++)
+  {
+    ring.add("localhost:" + to_string(8081 + node), node, replicas);
+  }
+  return ring;
+}
+
+static void test_owners()
+{
+  HashRing empty;
+  CHECK(empty.size() == 0 && empty.owner("anything") == -1);
+
+  // A single point owns everything, on both sides of it
+  HashRing single;
+  single.add("localhost:8081", 3, 1);
+  CHECK(single.size() == 1);
+  for (int i = 0; i < 1000; i++)
+  {
+    CHECK(single.owner("channel" + to_string(i)) == 3);
+  }
+
+  // Every node builds the same ring from the same list, whatever the order it adds them in
+  HashRing forward = make_ring(3, 128);
+  HashRing backward;
+  for (int node = 2; node >= 0; node--)
+  {
+    backward.add("localhost:" + to_string(8081 + node), node, 128);
+  }
+  CHECK(forward.size() == 3 * 128 && backward.size() == 3 * 128);
+  for (int i = 0; i < 1000; i++)
+  {
+    string key = "channel" + to_string(i);
+    CHECK(forward.owner(key) == backward.owner(key));
+    CHECK(forward.owner(key) >= 0 && forward.owner(key) < 3);
+  }
+  CHECK(HashRing::hash("channel1") != HashRing::hash("channel2"));
+}
+
+static void test_spread()
+{
+  // Four nodes of 128 points each get a quarter of the keys, give or take
+  HashRing ring = make_ring(4, 128);
+  vector<int> counts(4, 0);
+  for (int i = 0; i < KEYS; i++)
+  {
+    counts[ring.owner("channel" + to_string(i))]++;
+  }
+  for (int node = 0; node < 4; node++)
+  {
+    CHECK(counts[node] > KEYS * 0.18 && counts[node] < KEYS * 0.32);
+  }
+
+  // A fifth node takes its share from the others and nothing moves between them
+  HashRing grown = make_ring(5, 128);
+  int moved = 0;
+  for (int i = 0; i < KEYS; i++)
+  {
+    string key = "channel" + to_string(i);
+    int before = ring.owner(key);
+    int after = grown.owner(key);
+    if (before != after)
+    {
+      CHECK(after == 4);
+      moved++;
+    }
+  }
+  CHECK(moved > KEYS * 0.12 && moved < KEYS * 0.28);
+}
+
+int main()
+{
+  test_owners();
+  test_spread();
+  return report();
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include "logger.h"
+#include "check.h"
+
+// The asynchronous logger of include/logger.h. Its records are caught by
+// pointing stdout and stderr at files while it writes.
+
+struct Output
+{
+  std::string out;
+  std::string err;
+};
+
+static std::string read_back(int fd)
+{
+  std::string text;
+  char buffer[65536];
+  ssize_t n;
+  lseek(fd, 0, SEEK_SET);
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+  {
+    text.append(buffer, n);
+  }
+  close(fd);
+  return text;
+}
+
+// Run log with stdout and stderr going to files, and return what they got
+template <typename Log>
+static Output capture(Log log)
+{
+  char outPath[] = "/tmp/hmp221-logger-out-XXXXXX";
+  char errPath[] = "/tmp/hmp221-logger-err-XXXXXX";
+  int outFd = mkstemp(outPath);
+  int errFd = mkstemp(errPath);
+  unlink(outPath);
+  unlink(errPath);
+  fflush(stdout);
+  fflush(stderr);
+  int savedOut = dup(STDOUT_FILENO);
+  int savedErr = dup(STDERR_FILENO);
+  dup2(outFd, STDOUT_FILENO);
+  dup2(errFd, STDERR_FILENO);
+  log();
+  dup2(savedOut, STDOUT_FILENO);
+  dup2(savedErr, STDERR_FILENO);
+  close(savedOut);
+  close(savedErr);
+  Output output;
+  output.out = read_back(outFd);
+  output.err = read_back(errFd);
+  return output;
+}
+
+static std::vector<std::string> lines_of(const std::string &text)
+{
+  std::vector<std::string> lines;
+  size_t start = 0;
+  for (size_t end = text.find('\n'); end != std::string::npos; end = text.find('\n', start))
+  {
+    lines.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  return lines;
+}
+
+static void test_levels()
+{
+  // Records logged before the writer runs are kept for it; warnings and
+  // errors go to stderr, the rest to stdout
+  Output output = capture([]() {
+    Logger log;
+    log.log(LOG_LEVEL_INFO, "first %d", 1);
+    log.log(LOG_LEVEL_WARN, "warned %s", "here");
+    log.log(LOG_LEVEL_DEBUG, "second");
+    log.log(LOG_LEVEL_ERROR, "failed");
+    log.start();
+    log.log(LOG_LEVEL_INFO, "third");
+    log.stop();
+  });
+  CHECK(output.out == "first 1\nsecond\nthird\n");
+  CHECK(output.err == "warned here\nfailed\n");
+
+  // Long records are cut to fit a slot, newline included
+  output = capture([]() {
+    Logger log;
+    log.start();
+    log.log(LOG_LEVEL_INFO, "%s", std::string(1000, 'x').c_str());
+    log.log(LOG_LEVEL_INFO, "%s", "");
+  });
+  std::vector<std::string> lines = lines_of(output.out);
+  CHECK(lines.size() == 2 && lines[0] == std::string(LOG_RECORD_SIZE - 2, 'x') && lines[1].empty());
+}
+
+static void test_full_ring()
+{
+  // Records that find the ring full are dropped and counted, not waited for
+  Output output = capture([]() {
+    Logger log;
+    for (int i = 0; i < LOG_RING_SIZE + 50; i++)
+    {
+      log.log(LOG_LEVEL_INFO, "%d", i);
+    }
+    log.start();
+    log.stop();
+  });
+  std::vector<std::string> lines = lines_of(output.out);
+  CHECK(lines.size() == LOG_RING_SIZE);
+  CHECK(!lines.empty() && lines.front() == "0" && lines.back() == std::to_string(LOG_RING_SIZE - 1));
+  CHECK(output.err == "50 log records dropped\n");
+}
+
+static void test_threads()
+{
+  // Every record of every thread is written whole, or counted as dropped,
+  // and the records of one thread keep their order
+  const int threads = 4;
+  const int records = 20000;
+  Output output = capture([&]() {
+    Logger log;
+    log.start();
+    std::vector<std::thread> loggers;
+    for (int t = 0; t < threads; t++)
+    {
+      loggers.push_back(std::thread([&log, t, records]() {
+        for (int i = 0; i < records; i++)
+        {
+          log.log(LOG_LEVEL_INFO, "%d %d", t, i);
+        }
+      }));
+    }
+    for (size_t t = 0; t < loggers.size(); t++)
+    {
+      loggers[t].join();
+    }
+    log.stop();
+  });
+  std::vector<std::string> lines = lines_of(output.out);
+  int last[threads] = {-1, -1, -1, -1};
+  bool ordered = true;
+  for (size_t i = 0; i < lines.size(); i++)
+  {
+    int t = -1;
+    int record = -1;
+    if (sscanf(lines[i].c_str(), "%d %d", &t, &record) != 2 || t < 0 || t >= threads || record <= last[t])
+    {
+      ordered = false;
+      break;
+    }
+    last[t] = record;
+  }
+  CHECK(ordered);
+  unsigned long dropped = 0;
+  std::vector<std::string> errors = lines_of(output.err);
+  for (size_t i = 0; i < errors.size(); i++)
+  {
+    unsigned long count = 0;
+    CHECK(sscanf(errors[i].c_str(), "%lu log records dropped", &count) == 1);
+    dropped += count;
+  }
+  CHECK(lines.size() + dropped == (size_t)threads * records);
+}
+
+int main()
+{
+  test_levels();
+  test_full_ring();
+  test_threads();
+  return report();
+}
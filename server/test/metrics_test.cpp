@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include "metrics.h"
+#include "check.h"
+
+// Latency histograms and the named values of include/metrics.h.
+
+// Whether a reported value is within the histogram's 0.1% of the true one
+static bool close_to(u64 reported, u64 value)
+{
+  u64 difference = reported > value ? reported - value : value - reported;
+  return difference * 1000 <= value;
+}
+
+static void test_histogram()
+{
+  HdrHistogram empty;
+  CHECK(empty.count() == 0 && empty.min() == 0 && empty.max() == 0 && empty.mean() == 0);
+  CHECK(empty.percentile(50) == 0 && empty.percentile(100) == 0);
+
+  // 1..100000 once each: every percentile is that share of the range
+  HdrHistogram histogram;
+  for (u64 value = 1; value <= 100000; value++)
+  {
+    histogram.record(value);
+  }
+  CHECK(histogram.count() == 100000);
+  CHECK(histogram.min() == 1 && histogram.max() == 100000);
+  CHECK(histogram.mean() > 50000 && histogram.mean() < 50001);
+  CHECK(close_to(histogram.percentile(50), 50000));
+  CHECK(close_to(histogram.percentile(99), 99000));
+  CHECK(close_to(histogram.percentile(99.9), 99900));
+  CHECK(histogram.percentile(100) == 100000);
+  CHECK(histogram.percentile(0) == 1);
+
+  // Small values are exact; values past the range are clamped to it
+  HdrHistogram small(1000);
+  small.record(0);
+  small.record(7);
+  small.record(5000);
+  CHECK(small.percentile(34) == 0 && small.percentile(50) == 7);
+  CHECK(small.max() == 1000 && small.percentile(100) == 1000);
+
+  // Percentiles across the whole range, and values far apart
+  HdrHistogram wide;
+  for (u64 value = 1; value < 3600ULL * 1000000; value = value * 3 + 1)
+  {
+    wide.reset();
+    wide.record(value);
+    CHECK(close_to(wide.percentile(50), value) && wide.min() == value);
+  }
+
+  // Merging adds the counts of another histogram
+  HdrHistogram low;
+  HdrHistogram high;
+  for (u64 value = 1; value <= 1000; value++)
+  {
+    low.record(value);
+    high.record(value * 1000);
+  }
+  low.merge(high);
+  CHECK(low.count() == 2000 && low.min() == 1 && low.max() == 1000000);
+  CHECK(close_to(low.percentile(50), 1000));
+  CHECK(close_to(low.percentile(75), 500000));
+  HdrHistogram none;
+  none.merge(empty);
+  CHECK(none.count() == 0 && none.min() == 0);
+}
+
+static void test_latencies()
+{
+  Metrics *metrics = new Metrics();
+  unsigned long start = currentNanos();
+  recordSince(metrics, OP_PUT, start);
+  recordSince(metrics, OP_PUT, start);
+  CHECK(currentNanos() >= start);
+  vector<pair<string, u64>> values;
+  appendLatencies(metrics, &values);
+  CHECK(values.size() == OP_COUNT * 5);
+  bool found = false;
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    if (values[i].first == "put_count")
+    {
+      found = values[i].second == 2;
+    }
+    if (values[i].first == "get_count")
+    {
+      CHECK(values[i].second == 0);
+    }
+  }
+  CHECK(found);
+  delete metrics;
+}
+
+int main()
+{
+  test_histogram();
+  test_latencies();
+  return report();
+}
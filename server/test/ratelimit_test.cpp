@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include "ratelimit.h"
+#include "check.h"
+
+// The token buckets in include/ratelimit.h. Time is passed in, so the
+// tests step a clock of their own.
+
+#define SECOND 1000000000ul
+
+static void test_refill()
+{
+  TokenBucket bucket;
+  bucketInit(&bucket, 100, SECOND);
+
+  // A new bucket is full: a second's worth goes at once, and no more
+  CHECK(bucketReady(&bucket, 100, SECOND));
+  bucketTake(&bucket, 100);
+  CHECK(!bucketReady(&bucket, 1, SECOND));
+
+  // Tokens come back at the rate, never beyond the burst
+  CHECK(!bucketReady(&bucket, 11, SECOND + SECOND / 10));
+  CHECK(bucketReady(&bucket, 10, SECOND + SECOND / 10));
+  CHECK(bucketReady(&bucket, 100, 10 * SECOND));
+  bucketTake(&bucket, 100);
+  CHECK(!bucketReady(&bucket, 1, 10 * SECOND));
+
+  // A clock that goes back does not take tokens away
+  CHECK(!bucketReady(&bucket, 1, 5 * SECOND));
+  CHECK(bucketReady(&bucket, 1, 10 * SECOND + SECOND / 100));
+}
+
+static void test_wait()
+{
+  TokenBucket bucket;
+  bucketInit(&bucket, 1000, 0);
+  CHECK(bucketWait(&bucket, 1000) == 0);
+  bucketTake(&bucket, 1000);
+
+  // Waiting as long as bucketWait says is enough, and not a nanosecond too much
+  unsigned long wait = bucketWait(&bucket, 250);
+  CHECK(wait >= SECOND / 4 && wait <= SECOND / 4 + 1);
+  CHECK(bucketReady(&bucket, 250, wait));
+  CHECK(!bucketReady(&bucket, 251, wait));
+}
+
+static void test_debt()
+{
+  TokenBucket bucket;
+  bucketInit(&bucket, 100, 0);
+
+  // An amount over the burst is let in once the bucket is full and leaves it
+  // in debt, so the next one waits longer
+  CHECK(bucketReady(&bucket, 300, 0));
+  bucketTake(&bucket, 300);
+  CHECK(bucketWait(&bucket, 1) > 2 * SECOND);
+  CHECK(!bucketReady(&bucket, 1, 2 * SECOND));
+  CHECK(bucketReady(&bucket, 1, 2 * SECOND + SECOND / 50));
+
+  // It waits for a full bucket, not for its own size
+  bucketInit(&bucket, 100, 0);
+  bucketTake(&bucket, 50);
+  CHECK(!bucketReady(&bucket, 300, 0));
+  unsigned long wait = bucketWait(&bucket, 300);
+  CHECK(wait >= SECOND / 2 && wait <= SECOND / 2 + 1);
+}
+
+static void test_unlimited()
+{
+  TokenBucket bucket;
+  bucketInit(&bucket, 0, 0);
+  for (int i = 0; i < 1000; i++)
+  {
+    CHECK(bucketReady(&bucket, 1e12, 0));
+    bucketTake(&bucket, 1e12);
+  }
+  CHECK(bucketWait(&bucket, 1e12) == 0 && bucket.tokens == 0);
+}
+
+int main()
+{
+  test_refill();
+  test_wait();
+  test_debt();
+  test_unlimited();
+  return report();
+}
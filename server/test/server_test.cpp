@@ -0,0 +1,1316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "hmp221.hpp"
+#include "hashring.h"
+#include "shmring.h"
+#include "check.h"
+
+// Behaviour of the server binary that only shows on the wire. Every test
+// starts build/bin/release/server on a port of its own, talks to it in
+// frames, and kills it.
+
+#define KEY 42
+#define SERVER_PATH "build/bin/release/server"
+#define CLUSTER_VNODES 128 // Points of each node on the hash ring when --vnodes is not given
+
+struct TestServer
+{
+  pid_t pid;
+  int port;
+};
+
+// A connection to a test server and the decrypted bytes of frames that have
+// not fully arrived yet
+struct TestClient
+{
+  int fd;
+  vec inbound;
+};
+
+static int nextPort = 0;
+
+static int connect_to(int port, int receiveBuffer)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (receiveBuffer > 0)
+  {
+    // Set before connecting, so the window the server sees is small from the start
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+  }
+  int noDelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// A port for a test server, e.g. to name it in the options of another
+static int reserve_port()
+{
+  if (nextPort == 0)
+  {
+    nextPort = 20000 + getpid() % 20000;
+  }
+  return nextPort++;
+}
+
+/**
+ * @brief Start a server with the given options and wait until it accepts connections
+ *
+ * @param port where it listens, a port of its own if 0
+ */
+static TestServer start_server(const std::vector<string> &options, int port = 0)
+{
+  TestServer server;
+  server.port = port != 0 ? port : reserve_port();
+  string hostname = "localhost:" + std::to_string(server.port);
+  std::vector<char *> args;
+  args.push_back((char *)"server");
+  args.push_back((char *)"--hostname");
+  args.push_back((char *)hostname.c_str());
+  for (size_t i = 0; i < options.size(); i++)
+  {
+    args.push_back((char *)options[i].c_str());
+  }
+  args.push_back(NULL);
+  server.pid = fork();
+  if (server.pid == 0)
+  {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    execv(SERVER_PATH, args.data());
+    _exit(127);
+  }
+  for (int attempt = 0; attempt < 500; attempt++)
+  {
+    int fd = connect_to(server.port, 0);
+    if (fd >= 0)
+    {
+      close(fd);
+      return server;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "server on port %d did not start\n", server.port);
+  failures++;
+  return server;
+}
+
+static void stop_server(TestServer &server)
+{
+  kill(server.pid, SIGKILL);
+  waitpid(server.pid, NULL, 0);
+}
+
+static TestClient connect_client(const TestServer &server, int receiveBuffer = 0)
+{
+  TestClient client;
+  client.fd = connect_to(server.port, receiveBuffer);
+  CHECK(client.fd >= 0);
+  return client;
+}
+
+static void send_frame(TestClient &client, vec frame)
+{
+  for (size_t i = 0; i < frame.size(); i++)
+  {
+    frame[i] ^= KEY;
+  }
+  size_t done = 0;
+  while (done < frame.size())
+  {
+    ssize_t n = write(client.fd, frame.data() + done, frame.size() - done);
+    if (n <= 0)
+    {
+      fprintf(stderr, "ERROR writing to test server: %s\n", strerror(errno));
+      failures++;
+      return;
+    }
+    done += n;
+  }
+}
+
+/**
+ * @brief Read the next frame, waiting up to timeoutMillis for it
+ *
+ * @return false when none arrived in time, the server closed the
+ *         connection or sent a malformed frame
+ */
+static bool read_frame(TestClient &client, vec &frame, int timeoutMillis = 2000)
+{
+  while (true)
+  {
+    long length = hmp221::frame_length(client.inbound.data(), client.inbound.size());
+    if (length < 0)
+    {
+      return false;
+    }
+    if (length > 0)
+    {
+      frame.assign(client.inbound.begin(), client.inbound.begin() + length);
+      client.inbound.erase(client.inbound.begin(), client.inbound.begin() + length);
+      return true;
+    }
+    struct pollfd readable = {client.fd, POLLIN, 0};
+    if (poll(&readable, 1, timeoutMillis) <= 0)
+    {
+      return false;
+    }
+    unsigned char buffer[65536];
+    ssize_t n = read(client.fd, buffer, sizeof(buffer));
+    if (n <= 0)
+    {
+      return false;
+    }
+    for (ssize_t i = 0; i < n; i++)
+    {
+      client.inbound.push_back(buffer[i] ^ KEY);
+    }
+  }
+}
+
+// Whether the server closed the connection, after sending anything it still had
+static bool closed_by_server(TestClient &client, int timeoutMillis = 2000)
+{
+  vec frame;
+  while (read_frame(client, frame, timeoutMillis))
+  {
+  }
+  struct pollfd readable = {client.fd, POLLIN, 0};
+  unsigned char byte;
+  return poll(&readable, 1, 0) == 1 && read(client.fd, &byte, 1) == 0;
+}
+
+static void close_client(TestClient &client)
+{
+  close(client.fd);
+}
+
+// A server metric, read with a Stats request
+static u64 stat(const TestServer &server, const string &name)
+{
+  TestClient client = connect_client(server);
+  send_frame(client, hmp221::serialize(Stats()));
+  vec frame;
+  u64 value = ~0ul;
+  if (read_frame(client, frame))
+  {
+    struct Stats stats = hmp221::deserialize_stats(frame);
+    for (size_t i = 0; i < stats.values.size(); i++)
+    {
+      if (stats.values[i].first == name)
+      {
+        value = stats.values[i].second;
+      }
+    }
+  }
+  close_client(client);
+  CHECK(value != ~0ul);
+  return value;
+}
+
+static unsigned long now_millis()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000ul + now.tv_nsec / 1000000;
+}
+
+// A message with nothing but a channel and a payload
+static struct Message make_message(const string &channel, const vec &bytes)
+{
+  struct Message message = {};
+  message.channelName = channel;
+  message.contentBytes = bytes;
+  return message;
+}
+
+// The latest message of a channel, read with a Request on a connection of its
+// own; an empty one when the server closes it, as it does for a channel
+// without a message
+static struct Message request(const TestServer &server, const string &channel)
+{
+  TestClient client = connect_client(server);
+  struct Request requestStruct = {channel};
+  send_frame(client, hmp221::serialize(requestStruct));
+  vec frame;
+  struct Message message = {};
+  if (read_frame(client, frame))
+  {
+    CHECK(hmp221::frame_type(frame) == "Message");
+    message = hmp221::deserialize_message(frame);
+  }
+  else
+  {
+    CHECK(closed_by_server(client));
+  }
+  close_client(client);
+  return message;
+}
+
+// The latest message of a channel with its version, read with a Subscribe for any version
+static struct Message subscribe(const TestServer &server, const string &channel)
+{
+  TestClient client = connect_client(server);
+  struct Subscribe subscribeStruct = {channel, 0, 0};
+  send_frame(client, hmp221::serialize(subscribeStruct));
+  vec frame;
+  struct Message message = {};
+  if (read_frame(client, frame) && hmp221::frame_type(frame) == "Message")
+  {
+    message = hmp221::deserialize_message(frame);
+  }
+  close_client(client);
+  return message;
+}
+
+// Poll a server metric until it has the given value, for up to two seconds
+static bool wait_for_stat(const TestServer &server, const string &name, u64 value)
+{
+  for (int attempt = 0; attempt < 200; attempt++)
+  {
+    if (stat(server, name) == value)
+    {
+      return true;
+    }
+    usleep(10000);
+  }
+  return false;
+}
+
+// Publish count messages of size bytes, then wait until the server has handled them
+static void publish_many(const TestServer &server, const string &channel, int count, size_t size)
+{
+  TestClient publisher = connect_client(server);
+  vec frame = hmp221::serialize(make_message(channel, vec(size, 'x')));
+  for (int i = 0; i < count; i++)
+  {
+    send_frame(publisher, frame);
+  }
+  // Frames of a connection are handled in order, so the reply to this one
+  // comes once every publish is stored and pushed
+  send_frame(publisher, hmp221::serialize(Stats()));
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Stats");
+  close_client(publisher);
+}
+
+// Watch a channel nothing was published on yet. The Pong to the Ping behind
+// the Watch tells that the server has it.
+static void watch_channel(TestClient &watcher, struct Watch watch)
+{
+  send_frame(watcher, hmp221::serialize(watch));
+  struct Ping ping = {1};
+  send_frame(watcher, hmp221::serialize(ping));
+  vec frame;
+  CHECK(read_frame(watcher, frame) && hmp221::frame_type(frame) == "Pong");
+}
+
+// Messages pushed to a watcher until it has been quiet for a while
+static std::vector<struct Message> drain_messages(TestClient &watcher)
+{
+  std::vector<struct Message> messages;
+  vec frame;
+  while (read_frame(watcher, frame, 500))
+  {
+    if (hmp221::frame_type(frame) == "Message")
+    {
+      messages.push_back(hmp221::deserialize_message(frame));
+    }
+  }
+  return messages;
+}
+
+// Versions of the messages of a channel pushed to a watcher, or of every channel when it is empty
+static std::vector<u64> versions_of(const std::vector<struct Message> &messages, const string &channel = "")
+{
+  std::vector<u64> versions;
+  for (size_t i = 0; i < messages.size(); i++)
+  {
+    if (channel.empty() || messages[i].channelName == channel)
+    {
+      versions.push_back(messages[i].version);
+    }
+  }
+  return versions;
+}
+
+static std::vector<u64> drain_versions(TestClient &watcher)
+{
+  return versions_of(drain_messages(watcher));
+}
+
+static bool increasing(const std::vector<u64> &versions)
+{
+  for (size_t i = 1; i < versions.size(); i++)
+  {
+    if (versions[i] <= versions[i - 1])
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// ----------------------------------------
+// Slow consumers
+// ----------------------------------------
+
+static void test_slow_consumers()
+{
+  // A watcher that does not read loses its oldest messages, never the latest
+  std::vector<string> dropOldest = {"--queue-limit", "8"};
+  TestServer server = start_server(dropOldest);
+  TestClient watcher = connect_client(server, 4096);
+  struct Watch watch = {"feed", 0, false};
+  watch_channel(watcher, watch);
+  publish_many(server, "feed", 800, 4000);
+  std::vector<u64> versions = drain_versions(watcher);
+  CHECK(!versions.empty() && versions.size() < 800);
+  CHECK(increasing(versions) && !versions.empty() && versions.back() == 800);
+  CHECK(stat(server, "frames_dropped") > 0);
+  close_client(watcher);
+  stop_server(server);
+
+  // Under the disconnect policy it is closed instead
+  std::vector<string> disconnect = {"--queue-limit", "8", "--slow-consumer", "disconnect"};
+  server = start_server(disconnect);
+  watcher = connect_client(server, 4096);
+  watch_channel(watcher, watch);
+  publish_many(server, "feed", 800, 4000);
+  CHECK(closed_by_server(watcher));
+  CHECK(stat(server, "slow_consumers_disconnected") == 1);
+  close_client(watcher);
+  stop_server(server);
+
+  // Under the conflate policy a newer message overwrites the queued one of its channel
+  std::vector<string> conflate = {"--queue-limit", "8", "--slow-consumer", "conflate"};
+  server = start_server(conflate);
+  watcher = connect_client(server, 4096);
+  watch_channel(watcher, watch);
+  publish_many(server, "feed", 800, 4000);
+  versions = drain_versions(watcher);
+  CHECK(!versions.empty() && versions.size() < 800);
+  CHECK(increasing(versions) && !versions.empty() && versions.back() == 800);
+  CHECK(stat(server, "frames_conflated") > 0 && stat(server, "frames_dropped") == 0);
+  close_client(watcher);
+  stop_server(server);
+}
+
+// ----------------------------------------
+// Conflated watches
+// ----------------------------------------
+
+static void test_conflated_watches()
+{
+  // The queue limit does not matter: a conflated watch holds one slot per channel
+  TestServer server = start_server(std::vector<string>());
+  TestClient watcher = connect_client(server, 4096);
+  struct Watch watchA = {"a", 0, true};
+  struct Watch watchB = {"b", 0, true};
+  watch_channel(watcher, watchA);
+  watch_channel(watcher, watchB);
+  publish_many(server, "a", 400, 4000);
+  publish_many(server, "b", 400, 4000);
+  TestClient publisher = connect_client(server);
+  send_frame(publisher, hmp221::serialize(make_message("a", vec(10, 'A'))));
+  send_frame(publisher, hmp221::serialize(make_message("b", vec(10, 'B'))));
+  close_client(publisher);
+
+  // Each channel skips versions but keeps its order and ends with its latest message
+  std::vector<struct Message> messages = drain_messages(watcher);
+  CHECK(messages.size() < 802);
+  const char *channels[] = {"a", "b"};
+  for (size_t c = 0; c < 2; c++)
+  {
+    std::vector<u64> versions = versions_of(messages, channels[c]);
+    CHECK(!versions.empty() && increasing(versions));
+    for (size_t i = messages.size(); i-- > 0;)
+    {
+      if (messages[i].channelName == channels[c])
+      {
+        CHECK(messages[i].contentBytes == vec(10, channels[c][0] - 'a' + 'A'));
+        break;
+      }
+    }
+  }
+  CHECK(stat(server, "frames_conflated") > 0 && stat(server, "frames_dropped") == 0);
+  close_client(watcher);
+  stop_server(server);
+}
+
+// ----------------------------------------
+// Acknowledged publishing
+// ----------------------------------------
+
+static void test_acks()
+{
+  TestServer server = start_server(std::vector<string>());
+  TestClient publisher = connect_client(server);
+  vec frame;
+
+  struct Message message = make_message("orders", vec(100, 'o'));
+  message.id = 7;
+  send_frame(publisher, hmp221::serialize(message));
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Ack");
+  CHECK(hmp221::deserialize_ack(frame).id == 7);
+
+  // Publishes that arrive in one read are acknowledged at once, with the last id
+  vec burst;
+  for (unsigned int id = 8; id <= 10; id++)
+  {
+    message.id = id;
+    vec one = hmp221::serialize(message);
+    burst.insert(burst.end(), one.begin(), one.end());
+  }
+  send_frame(publisher, burst);
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Ack");
+  CHECK(hmp221::deserialize_ack(frame).id == 10);
+
+  // So are the messages of a batch
+  struct MultiMessage batch = {};
+  for (unsigned int id = 11; id <= 13; id++)
+  {
+    message.id = id;
+    batch.messages.push_back(message);
+  }
+  send_frame(publisher, hmp221::serialize(batch));
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Ack");
+  CHECK(hmp221::deserialize_ack(frame).id == 13);
+
+  // A message without an id is not acknowledged: the next frame is the Stats reply
+  message.id = 0;
+  send_frame(publisher, hmp221::serialize(message));
+  send_frame(publisher, hmp221::serialize(Stats()));
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Stats");
+  close_client(publisher);
+
+  CHECK(stat(server, "acks_sent") == 3);
+  stop_server(server);
+}
+
+// ----------------------------------------
+// Rate limits and admission control
+// ----------------------------------------
+
+static void test_rate_limits()
+{
+  // 100 pings at 50 requests per second: the first 50 at once, the rest over a second
+  std::vector<string> limited = {"--rate-limit", "50"};
+  TestServer server = start_server(limited);
+  TestClient client = connect_client(server);
+  vec pings;
+  for (u32 id = 1; id <= 100; id++)
+  {
+    struct Ping ping = {id};
+    vec one = hmp221::serialize(ping);
+    pings.insert(pings.end(), one.begin(), one.end());
+  }
+  unsigned long start = now_millis();
+  send_frame(client, pings);
+  vec frame;
+  u32 answered = 0;
+  while (answered < 100 && read_frame(client, frame) && hmp221::frame_type(frame) == "Pong" &&
+         hmp221::deserialize_pong(frame).id == answered + 1)
+  {
+    answered++;
+  }
+  CHECK(answered == 100);
+  CHECK(now_millis() - start >= 900);
+  close_client(client);
+  CHECK(stat(server, "throttles") > 0);
+  stop_server(server);
+
+  // Connections beyond the limit are closed at once; a slot that frees up can be taken again
+  std::vector<string> admission = {"--max-connections", "2"};
+  server = start_server(admission);
+  // Until the server sees it closed, the connection start_server probed with counts too
+  usleep(100000);
+  TestClient first = connect_client(server);
+  TestClient second = connect_client(server);
+  TestClient third = connect_client(server);
+  CHECK(closed_by_server(third));
+  close_client(third);
+  send_frame(second, hmp221::serialize(Stats()));
+  CHECK(read_frame(second, frame) && hmp221::frame_type(frame) == "Stats");
+  close_client(first);
+  usleep(100000);
+  CHECK(stat(server, "connections_rejected") == 1);
+  close_client(second);
+  stop_server(server);
+}
+
+// ----------------------------------------
+// Timeouts
+// ----------------------------------------
+
+static void test_timeouts()
+{
+  std::vector<string> options = {"--keepalive", "1", "--idle-timeout", "2", "--message-ttl", "1"};
+  TestServer server = start_server(options);
+
+  // A message goes after its own time to live, or the server's
+  TestClient publisher = connect_client(server);
+  struct Message shortLived = make_message("short", vec(10, 's'));
+  shortLived.ttl = 200;
+  send_frame(publisher, hmp221::serialize(shortLived));
+  send_frame(publisher, hmp221::serialize(make_message("default", vec(10, 'd'))));
+  send_frame(publisher, hmp221::serialize(Stats()));
+  vec frame;
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Stats");
+  close_client(publisher);
+  CHECK(request(server, "short").contentBytes == vec(10, 's'));
+  CHECK(request(server, "default").contentBytes == vec(10, 'd'));
+  usleep(400000);
+  CHECK(request(server, "short").contentBytes.empty());
+  CHECK(request(server, "default").contentBytes == vec(10, 'd'));
+
+  // A quiet connection is pinged after a second and closed after two, unless it answers
+  TestClient silent = connect_client(server);
+  TestClient answering = connect_client(server);
+  unsigned long start = now_millis();
+  int pings = 0;
+  while (now_millis() - start < 3500)
+  {
+    if (read_frame(answering, frame, 3500 - (now_millis() - start)) && hmp221::frame_type(frame) == "Ping")
+    {
+      struct Pong pong = {hmp221::deserialize_ping(frame).id};
+      send_frame(answering, hmp221::serialize(pong));
+      pings++;
+    }
+  }
+  CHECK(pings >= 2);
+  send_frame(answering, hmp221::serialize(Stats()));
+  CHECK(read_frame(answering, frame) && hmp221::frame_type(frame) == "Stats");
+  CHECK(read_frame(silent, frame, 0) && hmp221::frame_type(frame) == "Ping");
+  CHECK(closed_by_server(silent, 0));
+  close_client(silent);
+  close_client(answering);
+
+  CHECK(request(server, "default").contentBytes.empty());
+  CHECK(stat(server, "messages_expired") == 2);
+  CHECK(stat(server, "idle_disconnects") >= 1 && stat(server, "pings_sent") >= 3);
+  stop_server(server);
+}
+
+// ----------------------------------------
+// Cluster
+// ----------------------------------------
+
+static void test_cluster()
+{
+  int ports[] = {reserve_port(), reserve_port()};
+  string names[] = {"localhost:" + std::to_string(ports[0]), "localhost:" + std::to_string(ports[1])};
+  std::vector<string> options = {"--cluster", names[0] + "," + names[1]};
+  TestServer nodes[] = {start_server(options, ports[0]), start_server(options, ports[1])};
+  HashRing ring;
+  ring.add(names[0], 0, CLUSTER_VNODES);
+  ring.add(names[1], 1, CLUSTER_VNODES);
+
+  // Whichever node a channel is published to, every node serves it
+  TestClient publisher = connect_client(nodes[0]);
+  std::vector<int> owned(2, 0);
+  for (int i = 0; i < 20; i++)
+  {
+    string channel = "channel" + std::to_string(i);
+    send_frame(publisher, hmp221::serialize(make_message(channel, vec(i + 1, 'c'))));
+    owned[ring.owner(channel)]++;
+  }
+  send_frame(publisher, hmp221::serialize(Stats()));
+  vec frame;
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Stats");
+  close_client(publisher);
+  CHECK(owned[0] > 0 && owned[1] > 0);
+  for (int i = 0; i < 20; i++)
+  {
+    string channel = "channel" + std::to_string(i);
+    CHECK(request(nodes[1], channel).contentBytes == vec(i + 1, 'c'));
+  }
+  CHECK(stat(nodes[0], "cluster_nodes") == 2);
+  CHECK(stat(nodes[0], "requests_forwarded") > 0 && stat(nodes[1], "requests_forwarded") > 0);
+
+  // A watch on a channel of the other node is redirected there
+  string remote;
+  for (int i = 0; remote.empty(); i++)
+  {
+    if (ring.owner("watched" + std::to_string(i)) == 1)
+    {
+      remote = "watched" + std::to_string(i);
+    }
+  }
+  TestClient watcher = connect_client(nodes[0]);
+  struct Watch watch = {remote, 0, false};
+  send_frame(watcher, hmp221::serialize(watch));
+  CHECK(read_frame(watcher, frame) && hmp221::frame_type(frame) == "Redirect");
+  struct Redirect redirect = hmp221::deserialize_redirect(frame);
+  CHECK(redirect.name == remote && redirect.node == names[1]);
+  close_client(watcher);
+  CHECK(stat(nodes[0], "redirects") == 1);
+
+  // With the owner gone, requests for its channels fail
+  stop_server(nodes[1]);
+  TestClient client = connect_client(nodes[0]);
+  struct Request requestStruct = {remote};
+  send_frame(client, hmp221::serialize(requestStruct));
+  CHECK(closed_by_server(client));
+  close_client(client);
+  CHECK(stat(nodes[0], "link_failures") >= 1);
+  stop_server(nodes[0]);
+}
+
+// ----------------------------------------
+// Replication
+// ----------------------------------------
+
+static bool same_on_both(const TestServer &primary, const TestServer &replica, const string &channel, const vec &bytes)
+{
+  struct Message onPrimary = subscribe(primary, channel);
+  struct Message onReplica = subscribe(replica, channel);
+  return onPrimary.contentBytes == bytes && onReplica.contentBytes == bytes && onPrimary.version != 0 &&
+         onReplica.version == onPrimary.version;
+}
+
+static void test_replication()
+{
+  TestServer primary = start_server(std::vector<string>());
+  TestClient publisher = connect_client(primary);
+  send_frame(publisher, hmp221::serialize(make_message("before", vec(100, 'b'))));
+  send_frame(publisher, hmp221::serialize(make_message("before", vec(100, 'B'))));
+  close_client(publisher);
+
+  // A new replica starts from a snapshot, then follows the change stream
+  std::vector<string> options = {"--replica-of", "localhost:" + std::to_string(primary.port)};
+  TestServer replica = start_server(options);
+  CHECK(wait_for_stat(replica, "replication_connected", 1));
+  CHECK(stat(primary, "replicas") == 1 && stat(primary, "snapshots_sent") == 1);
+  CHECK(stat(replica, "snapshots_applied") == 1);
+  CHECK(same_on_both(primary, replica, "before", vec(100, 'B')));
+
+  publisher = connect_client(primary);
+  send_frame(publisher, hmp221::serialize(make_message("after", vec(100, 'a'))));
+  close_client(publisher);
+  CHECK(wait_for_stat(replica, "replication_applied", stat(primary, "replication_sequence")));
+  CHECK(same_on_both(primary, replica, "after", vec(100, 'a')));
+
+  // A publish to the replica is stored on the primary and comes back
+  publisher = connect_client(replica);
+  struct Message viaReplica = make_message("via-replica", vec(100, 'r'));
+  viaReplica.id = 1;
+  send_frame(publisher, hmp221::serialize(viaReplica));
+  vec frame;
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Ack");
+  close_client(publisher);
+  CHECK(wait_for_stat(replica, "replication_applied", stat(primary, "replication_sequence")));
+  CHECK(same_on_both(primary, replica, "via-replica", vec(100, 'r')));
+
+  // The replica keeps serving what it has while the primary is gone
+  stop_server(primary);
+  CHECK(wait_for_stat(replica, "replication_connected", 0));
+  CHECK(subscribe(replica, "after").contentBytes == vec(100, 'a'));
+  stop_server(replica);
+}
+
+// ----------------------------------------
+// Datagram publishes
+// ----------------------------------------
+
+// Send frames as one datagram to the port of a server
+static void send_datagram(const TestServer &server, const vec &frames)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(server.port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  vec encrypted = frames;
+  for (size_t i = 0; i < encrypted.size(); i++)
+  {
+    encrypted[i] ^= KEY;
+  }
+  CHECK(sendto(fd, encrypted.data(), encrypted.size(), 0, (struct sockaddr *)&address, sizeof(address)) ==
+        (ssize_t)encrypted.size());
+  close(fd);
+}
+
+static vec concatenate(const vec &first, const vec &second)
+{
+  vec both = first;
+  both.insert(both.end(), second.begin(), second.end());
+  return both;
+}
+
+static void test_datagrams()
+{
+  std::vector<string> options = {"--udp"};
+  TestServer server = start_server(options);
+
+  // A message, and a message with a batch behind it, each stored as if a connection sent them
+  send_datagram(server, hmp221::serialize(make_message("sensor", vec(8, '1'))));
+  struct MultiMessage batch = {};
+  batch.messages.push_back(make_message("batch-a", vec(8, 'a')));
+  batch.messages.push_back(make_message("batch-b", vec(8, 'b')));
+  send_datagram(server, concatenate(hmp221::serialize(make_message("first", vec(8, 'f'))), hmp221::serialize(batch)));
+
+  // Packet ids are ignored: there is no connection to send an Ack to
+  struct Message acknowledged = make_message("with-id", vec(8, 'i'));
+  acknowledged.id = 5;
+  send_datagram(server, hmp221::serialize(acknowledged));
+
+  // Anything else drops the datagram whole, including the messages before it
+  struct Request requestStruct = {"sensor"};
+  send_datagram(server,
+                concatenate(hmp221::serialize(make_message("dropped", vec(8, 'd'))), hmp221::serialize(requestStruct)));
+  send_datagram(server, vec(20, 0xff));
+  vec cut = hmp221::serialize(make_message("cut", vec(8, 'c')));
+  cut.pop_back();
+  send_datagram(server, cut);
+
+  CHECK(wait_for_stat(server, "udp_datagrams", 6));
+  CHECK(stat(server, "udp_dropped") == 3);
+  CHECK(request(server, "sensor").contentBytes == vec(8, '1'));
+  CHECK(request(server, "first").contentBytes == vec(8, 'f'));
+  CHECK(request(server, "batch-a").contentBytes == vec(8, 'a'));
+  CHECK(request(server, "batch-b").contentBytes == vec(8, 'b'));
+  CHECK(request(server, "with-id").contentBytes == vec(8, 'i'));
+  CHECK(request(server, "dropped").contentBytes.empty());
+  CHECK(request(server, "cut").contentBytes.empty());
+  CHECK(stat(server, "acks_sent") == 0);
+  stop_server(server);
+}
+
+// ----------------------------------------
+// Local transport
+// ----------------------------------------
+
+static TestClient connect_unix(const string &path)
+{
+  TestClient client;
+  client.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  CHECK(connect(client.fd, (struct sockaddr *)&address, sizeof(address)) == 0);
+  return client;
+}
+
+// The client's side of a pair of rings: the memory, the eventfd the server
+// sleeps on and the one the client would
+struct TestRings
+{
+  void *memory;
+  size_t capacity;
+  int serverDoorbell;
+  int doorbell;
+  ShmRing requests;
+  ShmRing replies;
+};
+
+/**
+ * @brief Send an Attach for rings of capacity bytes with the descriptors they need
+ */
+static TestRings attach_rings(TestClient &client, size_t capacity)
+{
+  TestRings rings;
+  rings.capacity = capacity;
+  size_t size = 2 * (SHM_RING_HEADER + capacity);
+  int memoryFd = memfd_create("hmp221-test", 0);
+  CHECK(memoryFd >= 0 && ftruncate(memoryFd, size) == 0);
+  rings.memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0);
+  CHECK(rings.memory != MAP_FAILED);
+  rings.serverDoorbell = eventfd(0, EFD_NONBLOCK);
+  rings.doorbell = eventfd(0, EFD_NONBLOCK);
+  rings.requests.attach(rings.memory, capacity);
+  rings.replies.attach((unsigned char *)rings.memory + SHM_RING_HEADER + capacity, capacity);
+  rings.requests.reset();
+  rings.replies.reset();
+
+  struct Attach attachStruct = {capacity};
+  vec frame = hmp221::serialize(attachStruct);
+  for (size_t i = 0; i < frame.size(); i++)
+  {
+    frame[i] ^= KEY;
+  }
+  int fds[3] = {memoryFd, rings.serverDoorbell, rings.doorbell};
+  struct iovec iov = {frame.data(), frame.size()};
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  CHECK(sendmsg(client.fd, &message, 0) == (ssize_t)frame.size());
+  close(memoryFd);
+  return rings;
+}
+
+static void detach_rings(TestRings &rings)
+{
+  munmap(rings.memory, 2 * (SHM_RING_HEADER + rings.capacity));
+  close(rings.serverDoorbell);
+  close(rings.doorbell);
+}
+
+// Write a frame to the request ring, ringing the server's doorbell if it sleeps
+static void ring_send(TestRings &rings, vec frame)
+{
+  for (size_t i = 0; i < frame.size(); i++)
+  {
+    frame[i] ^= KEY;
+  }
+  CHECK(rings.requests.write(frame.data(), frame.size()) == (ssize_t)frame.size());
+  if (rings.requests.wakeConsumer())
+  {
+    u64 one = 1;
+    CHECK(write(rings.serverDoorbell, &one, sizeof(one)) == sizeof(one));
+  }
+}
+
+// Read the next frame from the reply ring, waiting up to two seconds for it.
+// A frame larger than the ring comes in pieces, the server writing the next
+// one once its doorbell says there is room.
+static bool ring_read(TestRings &rings, vec &frame)
+{
+  vec inbound;
+  for (int attempt = 0; attempt < 2000; attempt++)
+  {
+    unsigned char buffer[4096];
+    ssize_t n = rings.replies.read(buffer, sizeof(buffer));
+    if (n < 0)
+    {
+      return false;
+    }
+    for (ssize_t i = 0; i < n; i++)
+    {
+      inbound.push_back(buffer[i] ^ KEY);
+    }
+    if (n > 0 && rings.replies.wakeProducer())
+    {
+      u64 one = 1;
+      CHECK(write(rings.serverDoorbell, &one, sizeof(one)) == sizeof(one));
+    }
+    long length = hmp221::frame_length(inbound.data(), inbound.size());
+    if (length > 0)
+    {
+      frame.assign(inbound.begin(), inbound.begin() + length);
+      return true;
+    }
+    if (length < 0)
+    {
+      return false;
+    }
+    usleep(1000);
+  }
+  return false;
+}
+
+static void test_local_transport()
+{
+  string path = "/tmp/hmp221-test-" + std::to_string(getpid()) + ".sock";
+  std::vector<string> options = {"--unix", path};
+  TestServer server = start_server(options);
+
+  // The Unix socket speaks the same frames as TCP
+  TestClient client = connect_unix(path);
+  struct Message message = make_message("local", vec(100, 'l'));
+  message.id = 1;
+  send_frame(client, hmp221::serialize(message));
+  vec frame;
+  CHECK(read_frame(client, frame) && hmp221::frame_type(frame) == "Ack");
+  close_client(client);
+  CHECK(request(server, "local").contentBytes == vec(100, 'l'));
+
+  // Requests and replies go through the rings once they are attached
+  client = connect_unix(path);
+  TestRings rings = attach_rings(client, 4096);
+  CHECK(read_frame(client, frame) && hmp221::frame_type(frame) == "Attach");
+  CHECK(hmp221::deserialize_attach(frame).capacity == 4096);
+  struct Request requestStruct = {"local"};
+  ring_send(rings, hmp221::serialize(requestStruct));
+  CHECK(ring_read(rings, frame) && hmp221::frame_type(frame) == "Message");
+  CHECK(hmp221::deserialize_message(frame).contentBytes == vec(100, 'l'));
+  // A message larger than the ring comes through in pieces
+  publish_many(server, "large", 1, 20000);
+  requestStruct.name = "large";
+  ring_send(rings, hmp221::serialize(requestStruct));
+  CHECK(ring_read(rings, frame) && hmp221::deserialize_message(frame).contentBytes == vec(20000, 'x'));
+
+  // A client that leaves the ring's head behind its tail is closed
+  ((ShmRingHeader *)rings.memory)->head.store(0);
+  ((ShmRingHeader *)rings.memory)->tail.store(100);
+  u64 one = 1;
+  CHECK(write(rings.serverDoorbell, &one, sizeof(one)) == sizeof(one));
+  CHECK(closed_by_server(client));
+  close_client(client);
+  detach_rings(rings);
+
+  // Rings of a size that is not a power of two, or asked for over TCP, are refused
+  client = connect_unix(path);
+  rings = attach_rings(client, 5000);
+  CHECK(closed_by_server(client));
+  close_client(client);
+  detach_rings(rings);
+  client = connect_client(server);
+  struct Attach attachStruct = {4096};
+  send_frame(client, hmp221::serialize(attachStruct));
+  CHECK(closed_by_server(client));
+  close_client(client);
+
+  CHECK(stat(server, "rings_attached") == 1);
+  stop_server(server);
+  unlink(path.c_str());
+}
+
+// ----------------------------------------
+// Handshake
+// ----------------------------------------
+
+// The Welcome a server answers a Hello with
+static struct Welcome hello(TestClient &client, u64 version, u64 capabilities)
+{
+  struct Hello helloStruct = {version, capabilities};
+  send_frame(client, hmp221::serialize(helloStruct));
+  vec frame;
+  struct Welcome welcome = {~0ul, ~0ul};
+  if (read_frame(client, frame) && hmp221::frame_type(frame) == "Welcome")
+  {
+    welcome = hmp221::deserialize_welcome(frame);
+  }
+  return welcome;
+}
+
+static struct Welcome handshake(const TestServer &server, u64 version, u64 capabilities)
+{
+  TestClient client = connect_client(server);
+  struct Welcome welcome = hello(client, version, capabilities);
+  close_client(client);
+  return welcome;
+}
+
+static void test_handshake()
+{
+  TestServer server = start_server(std::vector<string>());
+  const u64 all = HMP221_CAP_COMPACT | HMP221_CAP_COMPRESS | HMP221_CAP_BATCH | HMP221_CAP_PUSH | HMP221_CAP_STREAM |
+                  HMP221_CAP_DELTA;
+
+  // The version both speak and the capabilities both know
+  struct Welcome welcome = handshake(server, HMP221_PROTOCOL_VERSION, ~0ul);
+  CHECK(welcome.version == HMP221_PROTOCOL_VERSION && welcome.capabilities == all);
+  welcome = handshake(server, 99, HMP221_CAP_BATCH | 0x10000);
+  CHECK(welcome.version == HMP221_PROTOCOL_VERSION && welcome.capabilities == HMP221_CAP_BATCH);
+  welcome = handshake(server, HMP221_PROTOCOL_VERSION, 0);
+  CHECK(welcome.version == HMP221_PROTOCOL_VERSION && welcome.capabilities == 0);
+  // Version 0 is the original protocol, which has none
+  welcome = handshake(server, 0, all);
+  CHECK(welcome.version == 0 && welcome.capabilities == 0);
+
+  // The capabilities hold for the rest of the connection
+  TestClient client = connect_client(server);
+  struct Hello hello = {HMP221_PROTOCOL_VERSION, HMP221_CAP_BATCH};
+  send_frame(client, hmp221::serialize(hello));
+  vec frame;
+  CHECK(read_frame(client, frame) && hmp221::frame_type(frame) == "Welcome");
+  struct Ping ping = {3};
+  send_frame(client, hmp221::serialize(ping));
+  CHECK(read_frame(client, frame) && hmp221::frame_type(frame) == "Pong");
+  // and are settled by the first frame: a later Hello closes the connection
+  send_frame(client, hmp221::serialize(hello));
+  CHECK(closed_by_server(client));
+  close_client(client);
+  client = connect_client(server);
+  send_frame(client, hmp221::serialize(ping));
+  CHECK(read_frame(client, frame) && hmp221::frame_type(frame) == "Pong");
+  send_frame(client, hmp221::serialize(hello));
+  CHECK(closed_by_server(client));
+  close_client(client);
+
+  CHECK(stat(server, "handshakes") == 5);
+  stop_server(server);
+}
+
+// ----------------------------------------
+// Streaming
+// ----------------------------------------
+
+static vec pattern_bytes(size_t size)
+{
+  vec bytes(size);
+  for (size_t i = 0; i < size; i++)
+  {
+    bytes[i] = (unsigned char)(i * 131 + i / 7);
+  }
+  return bytes;
+}
+
+// A client that negotiated streaming publishes a message in Chunk frames
+static void publish_stream(TestClient &client, const string &channel, const vec &bytes)
+{
+  for (size_t offset = 0; offset == 0 || offset < bytes.size(); offset += HMP221_CHUNK_SIZE)
+  {
+    size_t length = std::min((size_t)HMP221_CHUNK_SIZE, bytes.size() - offset);
+    struct Chunk chunk = {channel, 0, bytes.size(), offset, vec(bytes.begin() + offset, bytes.begin() + offset + length)};
+    send_frame(client, hmp221::serialize_compact(chunk));
+  }
+}
+
+static void test_streaming()
+{
+  std::vector<string> options = {"--spool-dir", "/tmp"};
+  TestServer server = start_server(options);
+  const u64 streaming = HMP221_CAP_COMPACT | HMP221_CAP_STREAM;
+
+  // A message larger than a frame goes to a spool file
+  TestClient publisher = connect_client(server);
+  CHECK(hello(publisher, HMP221_PROTOCOL_VERSION, streaming).capabilities == streaming);
+  vec large = pattern_bytes(300000);
+  publish_stream(publisher, "large", large);
+  send_frame(publisher, hmp221::serialize(Stats()));
+  vec frame;
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Stats");
+  close_client(publisher);
+  CHECK(stat(server, "spooled_stored") == 1);
+
+  // and is streamed back in pieces to a client that negotiated streaming
+  TestClient fetcher = connect_client(server);
+  hello(fetcher, HMP221_PROTOCOL_VERSION, streaming);
+  struct Request requestStruct = {"large"};
+  send_frame(fetcher, hmp221::serialize(requestStruct));
+  vec assembled;
+  u64 total = 1;
+  while (assembled.size() < total && read_frame(fetcher, frame) && hmp221::frame_type(frame) == "Chunk")
+  {
+    struct Chunk chunk = hmp221::deserialize_chunk(frame);
+    CHECK(chunk.name == "large" && chunk.version > 0 && chunk.offset == assembled.size());
+    total = chunk.total;
+    assembled.insert(assembled.end(), chunk.bytes.begin(), chunk.bytes.end());
+  }
+  CHECK(assembled == large);
+  close_client(fetcher);
+  CHECK(stat(server, "sendfile_bytes") >= large.size());
+
+  // Any other client gets it as one Message
+  CHECK(request(server, "large").contentBytes == large);
+
+  // Pieces are refused without the capability, out of order, or for more than 4 GiB
+  TestClient refused = connect_client(server);
+  hello(refused, HMP221_PROTOCOL_VERSION, HMP221_CAP_COMPACT);
+  publish_stream(refused, "refused", pattern_bytes(100));
+  CHECK(closed_by_server(refused));
+  close_client(refused);
+  struct Chunk first = {"refused", 0, 200000, 0, pattern_bytes(100)};
+  struct Chunk skipped = {"refused", 0, 200000, 200, pattern_bytes(100)};
+  struct Chunk huge = {"refused", 0, 1ul << 33, 0, pattern_bytes(100)};
+  refused = connect_client(server);
+  hello(refused, HMP221_PROTOCOL_VERSION, streaming);
+  send_frame(refused, hmp221::serialize_compact(first));
+  send_frame(refused, hmp221::serialize_compact(skipped));
+  CHECK(closed_by_server(refused));
+  close_client(refused);
+  refused = connect_client(server);
+  hello(refused, HMP221_PROTOCOL_VERSION, streaming);
+  send_frame(refused, hmp221::serialize_compact(huge));
+  CHECK(closed_by_server(refused));
+  close_client(refused);
+  CHECK(request(server, "refused").contentBytes.empty());
+
+  // A message too large to be held in memory can only be streamed; asking for it otherwise closes the connection
+  publisher = connect_client(server);
+  hello(publisher, HMP221_PROTOCOL_VERSION, streaming);
+  publish_stream(publisher, "huge", vec(HMP221_MAX_INFLATED + 1, 'h'));
+  send_frame(publisher, hmp221::serialize(Stats()));
+  CHECK(read_frame(publisher, frame, 10000) && hmp221::frame_type(frame) == "Stats");
+  close_client(publisher);
+  TestClient client = connect_client(server);
+  requestStruct.name = "huge";
+  send_frame(client, hmp221::serialize(requestStruct));
+  CHECK(closed_by_server(client));
+  close_client(client);
+  CHECK(stat(server, "spooled_stored") == 2);
+  stop_server(server);
+}
+
+// ----------------------------------------
+// Fan-out of large messages
+// ----------------------------------------
+
+static void test_fanout()
+{
+  TestServer server = start_server(std::vector<string>());
+  std::vector<TestClient> watchers;
+  struct Watch watch = {"fanout", 0, false};
+  for (int i = 0; i < 4; i++)
+  {
+    watchers.push_back(connect_client(server));
+    watch_channel(watchers[i], watch);
+  }
+
+  // Frames over the zero-copy threshold and under it, all shared by every watcher
+  size_t sizes[] = {100000, 20000, 1000, 120000, 100000};
+  std::vector<vec> payloads;
+  TestClient publisher = connect_client(server);
+  for (int i = 0; i < 5; i++)
+  {
+    payloads.push_back(pattern_bytes(sizes[i]));
+    payloads[i][0] = (unsigned char)i;
+    send_frame(publisher, hmp221::serialize(make_message("fanout", payloads[i])));
+  }
+  send_frame(publisher, hmp221::serialize(Stats()));
+  vec frame;
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Stats");
+  close_client(publisher);
+
+  // Every watcher gets every byte, in order, whether the kernel sent from the shared buffer or copied it
+  for (int w = 0; w < 4; w++)
+  {
+    std::vector<struct Message> messages = drain_messages(watchers[w]);
+    CHECK(messages.size() == 5 && increasing(versions_of(messages)));
+    for (size_t i = 0; i < messages.size() && i < 5; i++)
+    {
+      CHECK(messages[i].contentBytes == payloads[i]);
+    }
+  }
+  // Loopback always copies, which the kernel reports for every connection
+  u64 zerocopyBytes = stat(server, "zerocopy_bytes");
+  CHECK(zerocopyBytes >= 4 * 100000 && stat(server, "zerocopy_copied") >= 4);
+
+  // so they fall back to writev
+  publish_many(server, "fanout", 1, 100000);
+  for (int w = 0; w < 4; w++)
+  {
+    std::vector<struct Message> messages = drain_messages(watchers[w]);
+    CHECK(messages.size() == 1 && messages[0].contentBytes == vec(100000, 'x'));
+    close_client(watchers[w]);
+  }
+  CHECK(stat(server, "zerocopy_bytes") == zerocopyBytes);
+  stop_server(server);
+}
+
+// ----------------------------------------
+// io_uring backend
+// ----------------------------------------
+
+static void test_io_uring()
+{
+  std::vector<string> options = {"--io-uring", "--queue-limit", "8"};
+  TestServer server = start_server(options);
+
+  // Requests, replies and Acks
+  TestClient publisher = connect_client(server);
+  struct Message message = make_message("uring", pattern_bytes(50000));
+  message.id = 9;
+  send_frame(publisher, hmp221::serialize(message));
+  vec frame;
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Ack" && hmp221::deserialize_ack(frame).id == 9);
+  close_client(publisher);
+  CHECK(request(server, "uring").contentBytes == pattern_bytes(50000));
+  CHECK(subscribe(server, "uring").version > 0);
+
+  // Pushes to several watchers, larger than one provided buffer and than what four linked sends hold
+  std::vector<TestClient> watchers;
+  struct Watch watch = {"fanout", 0, false};
+  for (int i = 0; i < 3; i++)
+  {
+    watchers.push_back(connect_client(server));
+    watch_channel(watchers[i], watch);
+  }
+  publisher = connect_client(server);
+  for (int i = 0; i < 6; i++)
+  {
+    vec payload = pattern_bytes(60000);
+    payload[0] = (unsigned char)i;
+    send_frame(publisher, hmp221::serialize(make_message("fanout", payload)));
+  }
+  send_frame(publisher, hmp221::serialize(Stats()));
+  CHECK(read_frame(publisher, frame) && hmp221::frame_type(frame) == "Stats");
+  close_client(publisher);
+  for (int w = 0; w < 3; w++)
+  {
+    std::vector<struct Message> messages = drain_messages(watchers[w]);
+    CHECK(messages.size() == 6 && increasing(versions_of(messages)));
+    for (size_t i = 0; i < messages.size(); i++)
+    {
+      CHECK(messages[i].contentBytes.size() == 60000 && messages[i].contentBytes[0] == i);
+    }
+    close_client(watchers[w]);
+  }
+
+  // A slow watcher still loses its oldest pushes, never the latest, nor
+  // one the ring is sending. A send of the ring waits for all of its bytes,
+  // so fewer publishes than on epoll fill the queue.
+  TestClient slow = connect_client(server, 4096);
+  watch.name = "feed";
+  watch_channel(slow, watch);
+  publish_many(server, "feed", 200, 4000);
+  std::vector<u64> versions = drain_versions(slow);
+  CHECK(!versions.empty() && versions.size() < 200);
+  CHECK(increasing(versions) && !versions.empty() && versions.back() == 200);
+  CHECK(stat(server, "frames_dropped") > 0);
+  close_client(slow);
+
+  // Connections the server closes are closed through the ring too
+  TestClient client = connect_client(server);
+  struct Ping ping = {1};
+  send_frame(client, hmp221::serialize(ping));
+  CHECK(read_frame(client, frame) && hmp221::frame_type(frame) == "Pong");
+  struct Hello late = {HMP221_PROTOCOL_VERSION, 0};
+  send_frame(client, hmp221::serialize(late));
+  CHECK(closed_by_server(client));
+  close_client(client);
+
+  CHECK(stat(server, "uring_enters") > 0 && stat(server, "uring_completions") > 0);
+  stop_server(server);
+}
+
+int main()
+{
+  signal(SIGPIPE, SIG_IGN);
+  test_slow_consumers();
+  test_conflated_watches();
+  test_acks();
+  test_rate_limits();
+  test_timeouts();
+  test_cluster();
+  test_replication();
+  test_datagrams();
+  test_local_transport();
+  test_handshake();
+  test_streaming();
+  test_fanout();
+  test_io_uring();
+  return report();
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "shmring.h"
+#include "check.h"
+
+// The shared-memory ring in include/shmring.h. Both sides are in this
+// process; memory from the heap stands in for the shared mapping.
+
+// Memory for a ring of capacity bytes, aligned like a mapping
+struct RingMemory
+{
+  std::vector<uint64_t> words;
+  ShmRing ring;
+
+  RingMemory(size_t capacity) : words((SHM_RING_HEADER + capacity) / 8)
+  {
+    this->ring.attach(this->words.data(), capacity);
+    this->ring.reset();
+  }
+
+  ShmRingHeader *header() { return (ShmRingHeader *)this->words.data(); }
+};
+
+static void test_wrap()
+{
+  RingMemory memory(64);
+  ShmRing &ring = memory.ring;
+  unsigned char in[100];
+  unsigned char out[100];
+  for (size_t i = 0; i < sizeof(in); i++)
+  {
+    in[i] = (unsigned char)(i * 7 + 1);
+  }
+  CHECK(ring.readable() == 0 && ring.writable() == 64);
+  CHECK(ring.read(out, sizeof(out)) == 0);
+
+  // Only as much as there is room for goes in, and a full ring takes nothing
+  CHECK(ring.write(in, 100) == 64);
+  CHECK(ring.readable() == 64 && ring.writable() == 0);
+  CHECK(ring.write(in, 1) == 0);
+  CHECK(ring.read(out, 40) == 40 && memcmp(out, in, 40) == 0);
+
+  // Writes and reads that cross the end of the ring
+  CHECK(ring.write(in + 64, 36) == 36);
+  CHECK(ring.read(out, 100) == 60 && memcmp(out, in + 40, 60) == 0);
+  CHECK(ring.readable() == 0);
+
+  // Lengths that do not divide the capacity wrap at every offset
+  size_t written = 0;
+  size_t read = 0;
+  for (int round = 0; round < 1000; round++)
+  {
+    unsigned char chunk[23];
+    for (size_t i = 0; i < sizeof(chunk); i++)
+    {
+      chunk[i] = (unsigned char)(written + i);
+    }
+    size_t length = 1 + round % 23;
+    ssize_t n = ring.write(chunk, length);
+    CHECK(n >= 0);
+    written += n;
+    n = ring.read(out, 1 + round % 17);
+    for (ssize_t i = 0; i < n; i++)
+    {
+      CHECK(out[i] == (unsigned char)(read + i));
+    }
+    read += n;
+    CHECK(ring.readable() == written - read && written - read <= 64);
+  }
+
+  // Buffers are written in order and cut where the ring is full
+  RingMemory gathered(64);
+  unsigned char a[30], b[30], c[30];
+  memset(a, 'a', 30);
+  memset(b, 'b', 30);
+  memset(c, 'c', 30);
+  struct iovec iov[] = {{a, 30}, {b, 30}, {c, 30}};
+  CHECK(gathered.ring.write(iov, 3) == 64);
+  CHECK(gathered.ring.read(out, 100) == 64);
+  CHECK(out[0] == 'a' && out[29] == 'a' && out[30] == 'b' && out[59] == 'b' && out[60] == 'c' && out[63] == 'c');
+}
+
+static void test_inconsistent()
+{
+  // The other process may store anything in head and tail; nothing is copied then
+  RingMemory memory(64);
+  ShmRing &ring = memory.ring;
+  unsigned char bytes[64] = {0};
+  CHECK(ring.consistent(0, 0) && ring.consistent(100, 36) && ring.consistent(1000, 1000));
+  CHECK(!ring.consistent(10, 11) && !ring.consistent(101, 36) && !ring.consistent(~0ul, 0));
+
+  uint64_t bad[][2] = {{5, 10}, {200, 100}, {~0ul, 0}, {0, ~0ul}};
+  for (size_t i = 0; i < 4; i++)
+  {
+    memory.header()->head.store(bad[i][0]);
+    memory.header()->tail.store(bad[i][1]);
+    CHECK(ring.read(bytes, sizeof(bytes)) == -1);
+    CHECK(ring.write(bytes, sizeof(bytes)) == -1);
+    CHECK(memory.header()->head.load() == bad[i][0] && memory.header()->tail.load() == bad[i][1]);
+  }
+
+  // Counters far along are fine as long as they agree
+  memory.header()->head.store(~0ul - 10);
+  memory.header()->tail.store(~0ul - 20);
+  CHECK(ring.read(bytes, 4) == 4 && ring.readable() == 6);
+}
+
+static void test_wakeups()
+{
+  RingMemory memory(64);
+  ShmRing &ring = memory.ring;
+  unsigned char bytes[64] = {0};
+
+  // A consumer that finds the ring empty may sleep, and the next write wakes it once
+  CHECK(!ring.wakeConsumer());
+  CHECK(ring.sleep());
+  CHECK(ring.write(bytes, 10) == 10);
+  CHECK(ring.wakeConsumer() && !ring.wakeConsumer());
+  // One that finds bytes must not sleep
+  CHECK(!ring.sleep() && !ring.wakeConsumer());
+
+  // A producer facing a full ring may wait, and the next read wakes it once
+  CHECK(ring.write(bytes, 64) == 54);
+  CHECK(ring.waitForRoom());
+  CHECK(ring.read(bytes, 1) == 1);
+  CHECK(ring.wakeProducer() && !ring.wakeProducer());
+  CHECK(!ring.waitForRoom() && !ring.wakeProducer());
+}
+
+static void test_threads()
+{
+  // A producer and a consumer streaming through a small ring see the same bytes
+  RingMemory memory(4096);
+  ShmRing &ring = memory.ring;
+  const size_t total = 8 << 20;
+  std::thread producer([&ring, total]() {
+    unsigned char chunk[1000];
+    size_t written = 0;
+    while (written < total)
+    {
+      size_t length = 1 + written % 997;
+      if (length > total - written)
+      {
+        length = total - written;
+      }
+      for (size_t i = 0; i < length; i++)
+      {
+        chunk[i] = (unsigned char)((written + i) * 31);
+      }
+      ssize_t n = ring.write(chunk, length);
+      if (n < 0)
+      {
+        return;
+      }
+      written += n;
+      if (n == 0)
+      {
+        std::this_thread::yield();
+      }
+    }
+  });
+  unsigned char out[1500];
+  size_t read = 0;
+  size_t wrong = 0;
+  while (read < total)
+  {
+    ssize_t n = ring.read(out, sizeof(out));
+    if (n < 0)
+    {
+      break;
+    }
+    for (ssize_t i = 0; i < n; i++)
+    {
+      wrong += out[i] != (unsigned char)((read + i) * 31);
+    }
+    read += n;
+    if (n == 0)
+    {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  CHECK(read == total && wrong == 0);
+}
+
+int main()
+{
+  test_wrap();
+  test_inconsistent();
+  test_wakeups();
+  test_threads();
+  return report();
+}
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <vector>
+#include "timerwheel.h"
+#include "check.h"
+
+// The timing wheel in include/timerwheel.h, driven by a clock of its own in
+// milliseconds.
+
+static unsigned long seed = 1;
+
+static unsigned long next_random()
+{
+  seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+  return seed >> 33;
+}
+
+// Every timer expire() hands out up to now, checking that none comes early
+static std::vector<TimerNode *> expire_all(TimerWheel &wheel, unsigned long now)
+{
+  std::vector<TimerNode *> expired;
+  TimerNode *node;
+  while ((node = wheel.expire(now)) != NULL)
+  {
+    CHECK(node->deadline <= now && !TimerWheel::scheduled(node));
+    expired.push_back(node);
+  }
+  return expired;
+}
+
+static void test_nearby()
+{
+  TimerWheel wheel;
+  wheel.start(1000);
+  CHECK(wheel.nextExpiry() == ~0UL && wheel.expire(5000) == NULL);
+
+  TimerNode a, b, c;
+  timerInit(&a, 1, &a);
+  timerInit(&b, 2, &b);
+  timerInit(&c, 3, &c);
+  CHECK(!TimerWheel::scheduled(&a));
+  wheel.schedule(&a, 5010);
+  wheel.schedule(&b, 5005);
+  wheel.schedule(&c, 5005);
+  CHECK(wheel.size() == 3 && wheel.nextExpiry() == 5005);
+  CHECK(wheel.expire(5004) == NULL);
+
+  // Timers of one tick come in the order they were scheduled; cancelling one
+  // while handling another keeps it from being handed out
+  TimerNode *first = wheel.expire(5005);
+  CHECK(first == &b && first->kind == 2 && first->owner == &b);
+  wheel.cancel(&c);
+  wheel.cancel(&c);
+  CHECK(wheel.expire(5005) == NULL && wheel.size() == 1);
+
+  // Scheduling again moves a timer, and a deadline in the past is due at once
+  wheel.schedule(&a, 6000);
+  CHECK(wheel.size() == 1 && wheel.expire(5010) == NULL);
+  wheel.schedule(&a, 10);
+  CHECK(wheel.expire(5011) == &a && wheel.size() == 0);
+}
+
+static void test_levels()
+{
+  // Deadlines on and around every level boundary, from a start that is not aligned to any
+  const unsigned long start = 0xfff0;
+  TimerWheel wheel;
+  wheel.start(start);
+  unsigned long offsets[] = {0, 1, 255, 256, 257, 511, 65535, 65536, 65537, 300000, 16777215, 16777216, 16777300};
+  const size_t n = sizeof(offsets) / sizeof(offsets[0]);
+  TimerNode nodes[n];
+  for (size_t i = 0; i < n; i++)
+  {
+    timerInit(&nodes[i], 0, NULL);
+    wheel.schedule(&nodes[i], start + offsets[i]);
+  }
+  for (size_t i = 0; i < n; i++)
+  {
+    // Nothing before the deadline, the timer on it
+    if (offsets[i] > 0)
+    {
+      CHECK(wheel.nextExpiry() <= start + offsets[i]);
+      CHECK(expire_all(wheel, start + offsets[i] - 1).empty());
+    }
+    std::vector<TimerNode *> expired = expire_all(wheel, start + offsets[i]);
+    CHECK(expired.size() == 1 && expired[0] == &nodes[i]);
+  }
+  CHECK(wheel.size() == 0);
+
+  // A deadline beyond the span of the wheel is kept until it comes
+  TimerNode far;
+  timerInit(&far, 0, NULL);
+  unsigned long now = start + 16777300;
+  wheel.schedule(&far, now + (1ul << 40));
+  CHECK(wheel.nextExpiry() <= now + WHEEL_SLOTS);
+  CHECK(expire_all(wheel, now + 100000).empty());
+  CHECK(wheel.size() == 1 && TimerWheel::scheduled(&far) && far.deadline == now + (1ul << 40));
+}
+
+static void test_random()
+{
+  // Many timers, some moved and some cancelled, with the clock advancing in steps of any size
+  const size_t n = 5000;
+  std::vector<TimerNode> nodes(n);
+  std::vector<bool> cancelled(n, false);
+  std::vector<bool> fired(n, false);
+  TimerWheel wheel;
+  unsigned long now = 123456;
+  wheel.start(now);
+  for (size_t i = 0; i < n; i++)
+  {
+    timerInit(&nodes[i], (int)i, NULL);
+    wheel.schedule(&nodes[i], now + 1 + next_random() % 400000);
+  }
+  for (size_t i = 0; i < n; i += 3)
+  {
+    wheel.schedule(&nodes[i], now + 1 + next_random() % 400000);
+  }
+  for (size_t i = 1; i < n; i += 7)
+  {
+    wheel.cancel(&nodes[i]);
+    cancelled[i] = true;
+  }
+  size_t pending = wheel.size();
+  while (wheel.size() > 0)
+  {
+    unsigned long previous = now;
+    now += next_random() % 2000;
+    std::vector<TimerNode *> expired = expire_all(wheel, now);
+    for (size_t j = 0; j < expired.size(); j++)
+    {
+      int i = expired[j]->kind;
+      CHECK(!cancelled[i] && !fired[i]);
+      // Handed out on the first expire() at or after the deadline, in deadline order
+      CHECK(expired[j]->deadline > previous);
+      CHECK(j == 0 || expired[j]->deadline >= expired[j - 1]->deadline);
+      fired[i] = true;
+      pending--;
+    }
+    CHECK(wheel.nextExpiry() > now);
+  }
+  CHECK(pending == 0);
+}
+
+int main()
+{
+  test_nearby();
+  test_levels();
+  test_random();
+  return report();
+}
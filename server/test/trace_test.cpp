@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include "trace.h"
+#include "check.h"
+
+// The trace ring of include/trace.h and its dump, built with HMP221_TRACE.
+
+#ifndef HMP221_TRACE
+#error "trace_test is built with -DHMP221_TRACE"
+#endif
+
+// Events of a dump, by the "bytes" each one carries, in the order written
+static std::vector<unsigned long> dumped_sizes(bool *wellFormed)
+{
+  char path[] = "/tmp/hmp221-trace-test-XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  traceDump(path);
+  FILE *in = fopen(path, "r");
+  std::string text;
+  char buffer[4096];
+  size_t n;
+  while (in != NULL && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+  {
+    text.append(buffer, n);
+  }
+  if (in != NULL)
+  {
+    fclose(in);
+  }
+  unlink(path);
+  std::string start = "{\"displayTimeUnit\"";
+  *wellFormed = text.compare(0, start.size(), start) == 0 && text.size() >= 3 &&
+                text.compare(text.size() - 3, 3, "]}\n") == 0;
+  std::vector<unsigned long> sizes;
+  for (size_t at = text.find("\"bytes\": "); at != std::string::npos; at = text.find("\"bytes\": ", at + 1))
+  {
+    sizes.push_back(strtoul(text.c_str() + at + 9, NULL, 10));
+  }
+  return sizes;
+}
+
+static void test_ring()
+{
+  bool wellFormed = false;
+  CHECK(dumped_sizes(&wellFormed).empty() && wellFormed);
+
+  for (unsigned long i = 0; i < 10; i++)
+  {
+    TRACE_BEGIN(stage);
+    TRACE_END(stage, TRACE_GET, 1, i);
+  }
+  std::vector<unsigned long> sizes = dumped_sizes(&wellFormed);
+  CHECK(wellFormed && sizes.size() == 10);
+  for (size_t i = 0; i < sizes.size(); i++)
+  {
+    CHECK(sizes[i] == i);
+  }
+
+  // A full ring keeps the latest events, oldest first
+  for (unsigned long i = 10; i < TRACE_RING_SIZE + 100; i++)
+  {
+    TRACE_BEGIN(stage);
+    TRACE_END(stage, TRACE_PUT, 2, i);
+  }
+  sizes = dumped_sizes(&wellFormed);
+  CHECK(wellFormed && sizes.size() == TRACE_RING_SIZE);
+  CHECK(sizes.front() == 100 && sizes.back() == TRACE_RING_SIZE + 99);
+
+  // Every thread records into a ring of its own
+  std::thread other([]() {
+    bool otherWellFormed = false;
+    TRACE_BEGIN(stage);
+    TRACE_END(stage, TRACE_WRITE, 3, 7);
+    std::vector<unsigned long> otherSizes = dumped_sizes(&otherWellFormed);
+    CHECK(otherWellFormed && otherSizes.size() == 1 && otherSizes[0] == 7);
+  });
+  other.join();
+  CHECK(dumped_sizes(&wellFormed).size() == TRACE_RING_SIZE);
+}
+
+int main()
+{
+  test_ring();
+  return report();
+}
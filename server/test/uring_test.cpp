@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include "uring.h"
+#include "check.h"
+
+// The io_uring wrapper in include/uring.h, on socket pairs. A kernel
+// without io_uring or without one of the features the server needs skips
+// these tests, as the server falls back to epoll there.
+
+#define GROUP 1
+
+// Wait for the next completion, up to a second
+static struct io_uring_cqe next_completion(Uring &ring)
+{
+  struct io_uring_cqe cqe;
+  memset(&cqe, 0, sizeof(cqe));
+  cqe.user_data = ~0ull;
+  for (int attempt = 0; attempt < 100 && ring.completion() == NULL; attempt++)
+  {
+    ring.submitAndWait(10);
+  }
+  struct io_uring_cqe *found = ring.completion();
+  if (found != NULL)
+  {
+    cqe = *found;
+    ring.seen();
+  }
+  return cqe;
+}
+
+static uint16_t buffer_id(const struct io_uring_cqe &cqe)
+{
+  return cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+}
+
+static void test_receive(Uring &ring)
+{
+  int pair[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  ring.receiveMultishot(pair[0], GROUP, 42);
+  ring.submitAndWait(0);
+
+  // One completion per read, each in a buffer of the group, and the receive stays armed
+  const char *words[] = {"first", "second", "third"};
+  for (int i = 0; i < 3; i++)
+  {
+    CHECK(write(pair[1], words[i], strlen(words[i])) == (ssize_t)strlen(words[i]));
+    struct io_uring_cqe cqe = next_completion(ring);
+    CHECK(cqe.user_data == 42 && cqe.res == (int)strlen(words[i]));
+    CHECK((cqe.flags & IORING_CQE_F_BUFFER) != 0 && (cqe.flags & IORING_CQE_F_MORE) != 0);
+    if (cqe.res > 0)
+    {
+      CHECK(std::string((char *)ring.buffer(buffer_id(cqe)), cqe.res) == words[i]);
+      ring.recycle(buffer_id(cqe));
+    }
+  }
+
+  // Reads that are not handed back use up the buffers, which ends the receive
+  int received = 0;
+  struct io_uring_cqe cqe;
+  do
+  {
+    CHECK(write(pair[1], "x", 1) == 1);
+    cqe = next_completion(ring);
+    received += cqe.res > 0;
+  } while (cqe.res > 0 && received < 100);
+  CHECK(received == 4 && cqe.user_data == 42 && cqe.res == -ENOBUFS && (cqe.flags & IORING_CQE_F_MORE) == 0);
+  for (uint16_t id = 0; id < 4; id++)
+  {
+    ring.recycle(id);
+  }
+
+  // The end of the stream ends it too
+  ring.receiveMultishot(pair[0], GROUP, 43);
+  cqe = next_completion(ring);
+  CHECK(cqe.user_data == 43 && cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE) != 0);
+  ring.recycle(buffer_id(cqe));
+  close(pair[1]);
+  cqe = next_completion(ring);
+  CHECK(cqe.user_data == 43 && cqe.res == 0 && (cqe.flags & IORING_CQE_F_MORE) == 0);
+  close(pair[0]);
+}
+
+static void test_send(Uring &ring)
+{
+  int pair[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+
+  // Linked sends go out whole and in order
+  std::string parts[] = {"alpha", std::string(100000, 'b'), "gamma"};
+  struct iovec iov[3];
+  struct msghdr messages[3];
+  for (int i = 0; i < 3; i++)
+  {
+    iov[i].iov_base = (void *)parts[i].data();
+    iov[i].iov_len = parts[i].size();
+    memset(&messages[i], 0, sizeof(messages[i]));
+    messages[i].msg_iov = &iov[i];
+    messages[i].msg_iovlen = 1;
+    ring.sendmsg(pair[0], &messages[i], i < 2, 10 + i);
+  }
+  ring.submitAndWait(0);
+  std::string received;
+  char buffer[65536];
+  while (received.size() < 100010)
+  {
+    ssize_t n = read(pair[1], buffer, sizeof(buffer));
+    if (n <= 0)
+    {
+      break;
+    }
+    received.append(buffer, n);
+  }
+  CHECK(received == parts[0] + parts[1] + parts[2]);
+  for (int i = 0; i < 3; i++)
+  {
+    struct io_uring_cqe cqe = next_completion(ring);
+    CHECK(cqe.user_data == (uint64_t)(10 + i) && cqe.res == (int)parts[i].size());
+  }
+
+  // A poll completes once the socket is readable
+  ring.poll(pair[1], POLLIN, false, 20);
+  ring.submitAndWait(0);
+  CHECK(ring.completion() == NULL);
+  CHECK(write(pair[0], "p", 1) == 1);
+  struct io_uring_cqe cqe = next_completion(ring);
+  CHECK(cqe.user_data == 20 && (cqe.res & POLLIN) != 0);
+
+  // A cancelled request completes with ECANCELED
+  ring.poll(pair[0], POLLIN, true, 21);
+  ring.submitAndWait(0);
+  ring.cancel(21, 22);
+  std::vector<struct io_uring_cqe> completions;
+  completions.push_back(next_completion(ring));
+  completions.push_back(next_completion(ring));
+  for (size_t i = 0; i < 2; i++)
+  {
+    CHECK(completions[i].user_data == 21 || completions[i].user_data == 22);
+    CHECK(completions[i].user_data != 21 || completions[i].res == -ECANCELED);
+    CHECK(completions[i].user_data != 22 || completions[i].res == 0);
+  }
+
+  // Shutting a socket down and closing it, linked, is how the server ends a connection
+  ring.shutdown(pair[0], true, 30);
+  ring.close(pair[0], 31);
+  cqe = next_completion(ring);
+  CHECK(cqe.user_data == 30 && cqe.res == 0);
+  cqe = next_completion(ring);
+  CHECK(cqe.user_data == 31 && cqe.res == 0);
+  CHECK(read(pair[1], buffer, 1) == 1 && read(pair[1], buffer, 1) == 0);
+  close(pair[1]);
+}
+
+static void test_full_queue()
+{
+  // More requests than the submission queue holds are submitted as it fills
+  Uring ring;
+  CHECK(ring.setup(4));
+  int pair[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  char bytes[10];
+  struct iovec iov[10];
+  struct msghdr messages[10];
+  for (int i = 0; i < 10; i++)
+  {
+    bytes[i] = (char)('0' + i);
+    iov[i].iov_base = &bytes[i];
+    iov[i].iov_len = 1;
+    memset(&messages[i], 0, sizeof(messages[i]));
+    messages[i].msg_iov = &iov[i];
+    messages[i].msg_iovlen = 1;
+    ring.sendmsg(pair[0], &messages[i], true, i);
+  }
+  ring.submitAndWait(0);
+  int completed = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    completed += next_completion(ring).res == 1;
+  }
+  CHECK(completed == 10);
+  char received[11] = {0};
+  CHECK(read(pair[1], received, 10) == 10 && strcmp(received, "0123456789") == 0);
+  close(pair[0]);
+  close(pair[1]);
+}
+
+int main()
+{
+  Uring ring;
+  if (!ring.setup(64) || !ring.provideBuffers(4, 4096, GROUP))
+  {
+    printf("io_uring is not available (%s), skipped\n", strerror(errno));
+    return report();
+  }
+  test_receive(ring);
+  test_send(ring);
+  test_full_queue();
+  return report();
+}